@@ -2,10 +2,37 @@
 ** This SQLite extension implements functions to perform vector
 ** similarity searches. 
 */
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE // For sched_setaffinity and the CPU_* macros.
+#endif
 #include "sqlite3ext.h"
 SQLITE_EXTENSION_INIT1
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#else
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#endif
+#ifdef __linux__
+#include <dirent.h>
+#include <sys/syscall.h>
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+#endif
 #define USE_AVX 1 // Comment this out if you don't want to use AVX extensions.
 #ifdef USE_AVX
 #include <immintrin.h>
@@ -30,150 +57,69 @@ static void ndvss_version( sqlite3_context* context,
 
 
 //----------------------------------------------------------------------------------------
-// Name: ndvss_convert_str_to_array_d
-// Desc: Converts a list of decimal numbers from a string to an array of doubles.
-// Args: List of decimal numbers TEXT, 
-//       Number of dimensions INTEGER
-// Returns: The double-array as a BLOB.
+// KERNELS.
+// The similarity math works on plain arrays so that it can be shared by the SQL
+// functions and by any code that scores vectors without going through sqlite3_value.
 //----------------------------------------------------------------------------------------
-static void ndvss_convert_str_to_array_d( sqlite3_context* context,
-                                          int argc,
-                                          sqlite3_value** argv ) 
-{
-  if( argc < 2 ) {
-    sqlite3_result_error(context, "2 arguments needs to be given: string to convert, array length.", -1);
-    return;
-  }
-  if( sqlite3_value_type(argv[0]) == SQLITE_NULL ||
-      sqlite3_value_type(argv[1]) == SQLITE_NULL ) {
-    sqlite3_result_error(context, "One of the given arguments is null.", -1);
-    return;
-  }
 
-  int num_dimensions = sqlite3_value_int(argv[1]);
-  if( num_dimensions <= 0 ) {
-    sqlite3_result_error(context, "Number of dimensions is 0.", -1);
-    return;
-  }
-  int allocated_size = sizeof(double)*num_dimensions;
-  double* output = (double*)sqlite3_malloc(allocated_size);
-  if( output == 0 ) {
-    sqlite3_result_error(context, "Out of memory.", -1);
-    return;
-  }
-  char* input = (char*)sqlite3_value_text(argv[0]);
-  char* end = input;
-  double* index = output;
-  int i = 0;
-  while( end != 0 && i < num_dimensions ) {
-    // Skip the JSON-array characters.
-    if (*end == '[' || *end == ']' || *end == ',') {
-      end++;
-      continue;
-    } 
-    *index = strtod(end, &end);
-    ++index;
-    ++i;  
-  }//endwhile processing string
-  sqlite3_result_blob(context, output, allocated_size, sqlite3_free );
+#ifdef USE_AVX
+//----------------------------------------------------------------------------------------
+// Name: ndvss_hsum_pd
+// Desc: Sums the four doubles of an AVX register.
+//       The following is based on code from stack overflow. 
+//       https://stackoverflow.com/questions/49941645/get-sum-of-values-stored-in-m256d-with-sse-avx/49943540#49943540
+// Args: AVX register __m256d
+// Returns: Sum DOUBLE
+//----------------------------------------------------------------------------------------
+static inline double ndvss_hsum_pd( __m256d v )
+{
+  __m128d vlow   = _mm256_castpd256_pd128(v);
+  __m128d vhigh  = _mm256_extractf128_pd(v, 1); 
+          vlow   = _mm_add_pd(vlow, vhigh);
+  __m128d high64 = _mm_unpackhi_pd(vlow, vlow);
+  return _mm_cvtsd_f64(_mm_add_sd(vlow, high64)); 
 }
 
 
 //----------------------------------------------------------------------------------------
-// Name: ndvss_convert_str_to_array_f
-// Desc: Converts a list of decimal numbers from a string to an array of floats.
-// Args: List of decimal numbers TEXT, 
-//       Number of dimensions INTEGER
-// Returns: The float-array as a BLOB.
+// Name: ndvss_hsum_ps
+// Desc: Sums the eight floats of an AVX register.
+// Args: AVX register __m256
+// Returns: Sum FLOAT
 //----------------------------------------------------------------------------------------
-static void ndvss_convert_str_to_array_f( sqlite3_context* context,
-                                          int argc,
-                                          sqlite3_value** argv ) 
+static inline float ndvss_hsum_ps( __m256 v )
 {
-  if( argc < 2 ) {
-    sqlite3_result_error(context, "2 arguments needs to be given: string to convert, array length.", -1);
-    return;
-  }
-  if( sqlite3_value_type(argv[0]) == SQLITE_NULL ||
-      sqlite3_value_type(argv[1]) == SQLITE_NULL ) {
-    sqlite3_result_error(context, "One of the given arguments is null.", -1);
-    return;
-  }
-
-  int num_dimensions = sqlite3_value_int(argv[1]);
-  if( num_dimensions <= 0 ) {
-    sqlite3_result_error(context, "Number of dimensions is 0.", -1);
-    return;
-  }
-  int allocated_size = sizeof(float)*num_dimensions;
-  float* output = (float*)sqlite3_malloc(allocated_size);
-  if( output == 0 ) {
-    sqlite3_result_error(context, "Out of memory.", -1);
-    return;
-  }
-  char* input = (char*)sqlite3_value_text(argv[0]);
-  char* end = input;
-  float* index = output;
-  int i = 0;
-  while( end != 0 && i < num_dimensions ) {
-    // Skip the JSON-array characters.
-    if (*end == '[' || *end == ']' || *end == ',') {
-      end++;
-      continue;
-    } 
-    *index = (float)strtod(end, &end);
-    ++index;
-    ++i;  
-  }//endwhile processing string
-  sqlite3_result_blob(context, output, allocated_size, sqlite3_free );
+  __m128 vlow   = _mm256_castps256_ps128(v);
+  __m128 vhigh  = _mm256_extractf128_ps(v, 1);
+         vlow   = _mm_add_ps(vlow, vhigh);
+  __m128 high64 = _mm_movehl_ps( vlow, vlow );
+  __m128 sum    = _mm_add_ps(vlow, high64);
+         sum    = _mm_add_ss(sum, _mm_shuffle_ps( sum, sum, 0x55));
+  return _mm_cvtss_f32(sum); 
 }
+#endif
 
 
 //----------------------------------------------------------------------------------------
-// Name: ndvss_cosine_similarity_d
-// Desc: Calculates the cosine similarity to a BLOB-converted array of doubles.
-// Args: Searched double array BLOB,
-//       Compared double array (usually a column) BLOB, 
-//       Number of dimensions INTEGER
-// Returns: Similarity as an angle DOUBLE
+// Name: ndvss_cosine_kernel_d
+// Desc: Calculates the cosine similarity between two arrays of doubles.
+// Args: Searched double array,
+//       Compared double array,
+//       Number of dimensions,
+//       Pointer where the similarity is stored.
+// Returns: 1 on success, 0 if either of the vectors has zero length.
 //----------------------------------------------------------------------------------------
-static void ndvss_cosine_similarity_d( sqlite3_context* context,
-                                       int argc,
-                                       sqlite3_value** argv ) 
+static int ndvss_cosine_kernel_d( const double* searched_array,
+                                  const double* column_array,
+                                  int vector_size,
+                                  double* result )
 {
-  if( argc < 2 ) {
-    sqlite3_result_error(context, "2 arguments needs to be given: searched array, column/compared array. Optionally the vector size can be given as the 3rd argument.", -1);
-    return;
-  }
-  if( sqlite3_value_type(argv[0]) == SQLITE_NULL ||
-      sqlite3_value_type(argv[1]) == SQLITE_NULL ) {
-    sqlite3_result_error(context, "One of the given arguments is null.", -1);
-    return;
-  }
-  int arg1_size_bytes = sqlite3_value_bytes(argv[0]);
-  int arg2_size_bytes = sqlite3_value_bytes(argv[1]);
-  if( arg1_size_bytes != arg2_size_bytes ) {
-    sqlite3_result_error(context, "The arrays are not the same length.", -1);
-    return;
-  }
-  int vector_size = -1;
-  if( argc > 2 ) {
-    if( sqlite3_value_type(argv[2]) != SQLITE_NULL ) {
-      vector_size = sqlite3_value_int(argv[2]);
-    }
-  } 
-  if( vector_size < 1 ) {
-    vector_size = arg1_size_bytes / sizeof(double);
-  }
-  
-  const double* searched_array = (const double *)sqlite3_value_blob(argv[0]);
-  const double* column_array = (const double *)sqlite3_value_blob(argv[1]);
   double similarity = 0.0;
   double dividerA = 0.0;
   double dividerB = 0.0;
   int i = 0;
   #ifdef USE_AVX
-  __m256d A, B, AA, BB, AB, mmdividerA = _mm256_setzero_pd(), mmdividerB = _mm256_setzero_pd(), mmsimilarity = _mm256_setzero_pd();
+  __m256d A, B, mmdividerA = _mm256_setzero_pd(), mmdividerB = _mm256_setzero_pd(), mmsimilarity = _mm256_setzero_pd();
   for( ; i + 3 < vector_size; i += 4 ) {
     A = _mm256_loadu_pd(&searched_array[i]);
     B = _mm256_loadu_pd(&column_array[i]);
@@ -184,36 +130,14 @@ static void ndvss_cosine_similarity_d( sqlite3_context* context,
     mmsimilarity = _mm256_fmadd_pd(A, B, mmsimilarity);
     #else
     // No Fused multiply-add support (AVX).
-    AA = _mm256_mul_pd(A, A);
-    BB = _mm256_mul_pd(B, B);
-    AB = _mm256_mul_pd(A, B);
-    mmdividerA = _mm256_add_pd(AA, mmdividerA);
-    mmdividerB = _mm256_add_pd(BB, mmdividerB);
-    mmsimilarity = _mm256_add_pd(AB, mmsimilarity);    
+    mmdividerA = _mm256_add_pd(_mm256_mul_pd(A, A), mmdividerA);
+    mmdividerB = _mm256_add_pd(_mm256_mul_pd(B, B), mmdividerB);
+    mmsimilarity = _mm256_add_pd(_mm256_mul_pd(A, B), mmsimilarity);    
     #endif
   }
-  // The following is based on code from stack overflow. 
-  // https://stackoverflow.com/questions/49941645/get-sum-of-values-stored-in-m256d-with-sse-avx/49943540#49943540
-  __m128d vlow  = _mm256_castpd256_pd128(mmdividerA);
-  __m128d vhigh = _mm256_extractf128_pd(mmdividerA, 1); 
-          vlow  = _mm_add_pd(vlow, vhigh);     
-
-  __m128d high64 = _mm_unpackhi_pd(vlow, vlow);
-  dividerA = _mm_cvtsd_f64(_mm_add_sd(vlow, high64)); 
-
-  vlow  = _mm256_castpd256_pd128(mmdividerB);
-  vhigh = _mm256_extractf128_pd(mmdividerB, 1); 
-  vlow  = _mm_add_pd(vlow, vhigh);     
-
-  high64 = _mm_unpackhi_pd(vlow, vlow);
-  dividerB = _mm_cvtsd_f64(_mm_add_sd(vlow, high64)); 
-
-  vlow  = _mm256_castpd256_pd128(mmsimilarity);
-  vhigh = _mm256_extractf128_pd(mmsimilarity, 1); 
-  vlow  = _mm_add_pd(vlow, vhigh);     
-
-  high64 = _mm_unpackhi_pd(vlow, vlow);
-  similarity = _mm_cvtsd_f64(_mm_add_sd(vlow, high64)); 
+  dividerA = ndvss_hsum_pd(mmdividerA);
+  dividerB = ndvss_hsum_pd(mmdividerB);
+  similarity = ndvss_hsum_pd(mmsimilarity);
   #else
   // Non-AVX implementation.
   for( ; i + 3 < vector_size; i += 4 ) {
@@ -233,7 +157,7 @@ static void ndvss_cosine_similarity_d( sqlite3_context* context,
     similarity += (A*B);
     dividerA += (A*A);
     dividerB += (B*B);
-     A = searched_array[i+3];
+    A = searched_array[i+3];
     B = column_array[i+3];
     similarity += (A*B);
     dividerA += (A*A);
@@ -250,61 +174,34 @@ static void ndvss_cosine_similarity_d( sqlite3_context* context,
   }
 
   if( dividerA == 0.0 || dividerB == 0.0 ) {
-    sqlite3_result_error(context, "Division by zero.", -1);
-    return;
+    return 0;
   }
   double divider = sqrt(dividerA * dividerB);
-  similarity = similarity / divider;
-  sqlite3_result_double(context, similarity);
-  
+  *result = similarity / divider;
+  return 1;
 }
 
 
 //----------------------------------------------------------------------------------------
-// Name: ndvss_cosine_similarity_f
-// Desc: Calculates the cosine similarity to a BLOB-converted array of floats.
-// Args: Searched float array BLOB,
-//       Compared float array (usually a column) BLOB, 
-//       Number of dimensions INTEGER
-// Returns: Similarity as an angle DOUBLE
+// Name: ndvss_cosine_kernel_f
+// Desc: Calculates the cosine similarity between two arrays of floats.
+// Args: Searched float array,
+//       Compared float array,
+//       Number of dimensions,
+//       Pointer where the similarity is stored.
+// Returns: 1 on success, 0 if either of the vectors has zero length.
 //----------------------------------------------------------------------------------------
-static void ndvss_cosine_similarity_f( sqlite3_context* context,
-                                       int argc,
-                                       sqlite3_value** argv ) 
+static int ndvss_cosine_kernel_f( const float* searched_array,
+                                  const float* column_array,
+                                  int vector_size,
+                                  double* result )
 {
-  if( argc < 2 ) {
-    sqlite3_result_error(context, "2 arguments needs to be given: searched array, column/compared array, optionally the array length.", -1);
-    return;
-  }
-  if( sqlite3_value_type(argv[0]) == SQLITE_NULL ||
-      sqlite3_value_type(argv[1]) == SQLITE_NULL ) {
-    sqlite3_result_error(context, "One of the required arguments is null.", -1);
-    return;
-  }
-  int arg1_size_bytes = sqlite3_value_bytes(argv[0]);
-  int arg2_size_bytes = sqlite3_value_bytes(argv[1]);
-  if( arg1_size_bytes != arg2_size_bytes ) {
-    sqlite3_result_error(context, "The arrays are not the same length.", -1);
-    return;
-  }
-  int vector_size = -1;
-  if( argc > 2 ) {
-    if( sqlite3_value_type(argv[2]) != SQLITE_NULL ) {
-      vector_size = sqlite3_value_int(argv[2]);
-    }
-  } 
-  if( vector_size < 1 ) {
-    vector_size = arg1_size_bytes / sizeof(float);
-  }
-
-  const float* searched_array = (const float *)sqlite3_value_blob(argv[0]);
-  const float* column_array = (const float *)sqlite3_value_blob(argv[1]);
   float similarity = 0.0f;
   float dividerA = 0.0f;
   float dividerB = 0.0f;
   int i = 0;
   #ifdef USE_AVX
-  __m256 A, B, AA, BB, AB, mmdividerA = _mm256_setzero_ps(), mmdividerB = _mm256_setzero_ps(), mmsimilarity = _mm256_setzero_ps();
+  __m256 A, B, mmdividerA = _mm256_setzero_ps(), mmdividerB = _mm256_setzero_ps(), mmsimilarity = _mm256_setzero_ps();
   for( ; i + 7 < vector_size; i += 8 ) {
     A = _mm256_loadu_ps(&searched_array[i]);
     B = _mm256_loadu_ps(&column_array[i]);
@@ -315,45 +212,15 @@ static void ndvss_cosine_similarity_f( sqlite3_context* context,
     mmsimilarity = _mm256_fmadd_ps(A, B, mmsimilarity);
     #else
     // No Fused multiply-add support (AVX).
-    AA = _mm256_mul_ps(A, A);
-    BB = _mm256_mul_ps(B, B);
-    AB = _mm256_mul_ps(A, B);
-    mmdividerA = _mm256_add_ps(AA, mmdividerA);
-    mmdividerB = _mm256_add_ps(BB, mmdividerB);
-    mmsimilarity = _mm256_add_ps(AB, mmsimilarity);    
+    mmdividerA = _mm256_add_ps(_mm256_mul_ps(A, A), mmdividerA);
+    mmdividerB = _mm256_add_ps(_mm256_mul_ps(B, B), mmdividerB);
+    mmsimilarity = _mm256_add_ps(_mm256_mul_ps(A, B), mmsimilarity);    
     #endif
   }
-  
-  __m128 vlow   = _mm256_castps256_ps128(mmdividerA);
-  __m128 vhigh  = _mm256_extractf128_ps(mmdividerA, 1);
-         vlow   = _mm_add_ps(vlow, vhigh);
-  __m128 high64 = _mm_movehl_ps( vlow, vlow );
-  __m128 sum    = _mm_add_ps(vlow, high64);
-         sum    = _mm_add_ss(sum, _mm_shuffle_ps( sum, sum, 0x55));
-  dividerA = _mm_cvtss_f32(sum); 
-
-  vlow   = _mm256_castps256_ps128(mmdividerB);
-  vhigh  = _mm256_extractf128_ps(mmdividerB, 1);
-  vlow   = _mm_add_ps(vlow, vhigh);
-  high64 = _mm_movehl_ps( vlow, vlow );
-  sum    = _mm_add_ps(vlow, high64);
-  sum    = _mm_add_ss(sum, _mm_shuffle_ps( sum, sum, 0x55));
-  dividerB = _mm_cvtss_f32(sum); 
-
-  vlow   = _mm256_castps256_ps128(mmsimilarity);
-  vhigh  = _mm256_extractf128_ps(mmsimilarity, 1);
-  vlow   = _mm_add_ps(vlow, vhigh);
-  high64 = _mm_movehl_ps( vlow, vlow );
-  sum    = _mm_add_ps(vlow, high64);
-  sum    = _mm_add_ss(sum, _mm_shuffle_ps( sum, sum, 0x55));
-  similarity = _mm_cvtss_f32(sum); 
-
-
-
+  dividerA = ndvss_hsum_ps(mmdividerA);
+  dividerB = ndvss_hsum_ps(mmdividerB);
+  similarity = ndvss_hsum_ps(mmsimilarity);
   #else
-  //#pragma GCC ivdep
-  /**/ // 
-  //for( ; i + 7 < vector_size; i += 8 ) {
   for( ; i + 3 < vector_size; i += 4 ) {
     float A = searched_array[i];
     float B = column_array[i];
@@ -378,99 +245,40 @@ static void ndvss_cosine_similarity_f( sqlite3_context* context,
     similarity += (A*B);
     dividerA += (A*A);
     dividerB += (B*B);
-/**
-    A = searched_array[i+4];
-    B = column_array[i+4];
-    similarity += (A*B);
-    dividerA += (A*A);
-    dividerB += (B*B);
-
-    A = searched_array[i+5];
-    B = column_array[i+5];
-    similarity += (A*B);
-    dividerA += (A*A);
-    dividerB += (B*B);
-
-    A = searched_array[i+6];
-    B = column_array[i+6];
-    similarity += (A*B);
-    dividerA += (A*A);
-    dividerB += (B*B);
-
-    A = searched_array[i+7];
-    B = column_array[i+7];
-    similarity += (A*B);
-    dividerA += (A*A);
-    dividerB += (B*B);
-    /**/
   }
-  //#pragma GCC ivdep
   #endif
-  /**/
   for(; i < vector_size; ++i ) {
     float A = searched_array[i];
     float B = column_array[i];
     similarity += (A*B);
     dividerA += (A*A);
     dividerB += (B*B);
-
   }
   if( dividerA == 0.0f || dividerB == 0.0f ) {
-    // There'd be a division by zero, so assume no similarity.
-    sqlite3_result_error(context, "Division by zero.", -1); 
-    return;
+    return 0;
   }
   float divider = sqrtf(dividerA * dividerB);
-  similarity = similarity / divider;
-  sqlite3_result_double(context, (double)similarity);
+  *result = (double)(similarity / divider);
+  return 1;
 }
 
 
 //----------------------------------------------------------------------------------------
-// Name: ndvss_euclidean_distance_similarity_d
-// Desc: Calculates the euclidean distance similarity to a BLOB-converted array of doubles.
-// Args: Searched double array BLOB,
-//       Compared double array (usually a column) BLOB, 
-//       Number of dimensions INTEGER
-// Returns: Similarity as a distance DOUBLE
+// Name: ndvss_euclidean_distance_squared_kernel_d
+// Desc: Calculates the squared euclidean distance between two arrays of doubles.
+// Args: Searched double array,
+//       Compared double array,
+//       Number of dimensions.
+// Returns: Squared distance DOUBLE
 //----------------------------------------------------------------------------------------
-static void ndvss_euclidean_distance_similarity_d( sqlite3_context* context,
-                                                   int argc,
-                                                   sqlite3_value** argv ) 
+static double ndvss_euclidean_distance_squared_kernel_d( const double* searched_array,
+                                                        const double* column_array,
+                                                        int vector_size )
 {
-  if( argc < 2 ) {
-    sqlite3_result_error(context, "2 arguments needs to be given: searched array, column/compared array, optionally the array length.", -1);
-    return;
-  }
-  if( sqlite3_value_type(argv[0]) == SQLITE_NULL ||
-      sqlite3_value_type(argv[1]) == SQLITE_NULL ) {
-    sqlite3_result_error(context, "One of the required arguments is null.", -1);
-    return;
-  }
-
-  int arg1_size_bytes = sqlite3_value_bytes(argv[0]);
-  int arg2_size_bytes = sqlite3_value_bytes(argv[1]);
-  if( arg1_size_bytes != arg2_size_bytes ) {
-    sqlite3_result_error(context, "The arrays are not the same length.", -1);
-    return;
-  }
-  int vector_size = -1;
-  if( argc > 2 ) {
-    if( sqlite3_value_type(argv[2]) != SQLITE_NULL ) {
-      vector_size = sqlite3_value_int(argv[2]);
-    }
-  } 
-  if( vector_size < 1 ) {
-    vector_size = arg1_size_bytes / sizeof(double);
-  }
-
-  const double* searched_array = (const double *)sqlite3_value_blob(argv[0]);
-  const double* column_array = (const double *)sqlite3_value_blob(argv[1]);
   double similarity = 0.0;
-  
   int i = 0;
   #ifdef USE_AVX
-  __m256d A, B, AB, ABAB, sumAB = _mm256_setzero_pd();
+  __m256d A, B, AB, sumAB = _mm256_setzero_pd();
   for( ; i + 3 < vector_size; i += 4 ) {
     A = _mm256_loadu_pd(&searched_array[i]);
     B = _mm256_loadu_pd(&column_array[i]);
@@ -480,19 +288,11 @@ static void ndvss_euclidean_distance_similarity_d( sqlite3_context* context,
     sumAB = _mm256_fmadd_pd(AB, AB, sumAB );
     #else
     // No Fused multiply-add support (AVX).
-    ABAB = _mm256_mul_pd(AB, AB);
-    sumAB = _mm256_add_pd(ABAB, sumAB );    
+    sumAB = _mm256_add_pd(_mm256_mul_pd(AB, AB), sumAB );    
     #endif
   }
-  __m128d vlow  = _mm256_castpd256_pd128(sumAB);
-  __m128d vhigh = _mm256_extractf128_pd(sumAB, 1); 
-          vlow  = _mm_add_pd(vlow, vhigh);     
-
-  __m128d high64 = _mm_unpackhi_pd(vlow, vlow);
-  similarity = _mm_cvtsd_f64(_mm_add_sd(vlow, high64)); 
-
+  similarity = ndvss_hsum_pd(sumAB);
   #else
-
   for( ; i + 3 < vector_size; i += 4 ) {
     double AB = (searched_array[i] - column_array[i]);
     similarity += (AB * AB);
@@ -508,57 +308,26 @@ static void ndvss_euclidean_distance_similarity_d( sqlite3_context* context,
     double AB = (searched_array[i] - column_array[i]);
     similarity += (AB * AB);
   }
-  similarity = sqrt(similarity);
-  sqlite3_result_double(context, similarity);
+  return similarity;
 }
 
 
 //----------------------------------------------------------------------------------------
-// Name: ndvss_euclidean_distance_similarity_f
-// Desc: Calculates the euclidean distance similarity to a BLOB-converted array of floats.
-// Args: Searched float array BLOB,
-//       Compared float array (usually a column) BLOB, 
-//       Number of dimensions INTEGER
-// Returns: Similarity as a distance DOUBLE
+// Name: ndvss_euclidean_distance_squared_kernel_f
+// Desc: Calculates the squared euclidean distance between two arrays of floats.
+// Args: Searched float array,
+//       Compared float array,
+//       Number of dimensions.
+// Returns: Squared distance FLOAT
 //----------------------------------------------------------------------------------------
-static void ndvss_euclidean_distance_similarity_f( sqlite3_context* context,
-                                                   int argc,
-                                                   sqlite3_value** argv ) 
+static float ndvss_euclidean_distance_squared_kernel_f( const float* searched_array,
+                                                        const float* column_array,
+                                                        int vector_size )
 {
-  if( argc < 2 ) {
-    // Not enough arguments.
-    sqlite3_result_error(context, "2 arguments needs to be given: searched array, column/compared array, optionally the array length.", -1);
-    return;
-  }
-  if( sqlite3_value_type(argv[0]) == SQLITE_NULL ||
-      sqlite3_value_type(argv[1]) == SQLITE_NULL ) {
-    // Missing one of the required arguments.
-    sqlite3_result_error(context, "One of the given arguments is null.", -1);
-    return;
-  }
-  int arg1_size_bytes = sqlite3_value_bytes(argv[0]);
-  int arg2_size_bytes = sqlite3_value_bytes(argv[1]);
-  if( arg1_size_bytes != arg2_size_bytes ) {
-    sqlite3_result_error(context, "The arrays are not the same length.", -1);
-    return;
-  }
-  int vector_size = -1;
-  if( argc > 2 ) {
-    if( sqlite3_value_type(argv[2]) != SQLITE_NULL ) {
-      vector_size = sqlite3_value_int(argv[2]);
-    }
-  } 
-  if( vector_size < 1 ) {
-    vector_size = arg1_size_bytes / sizeof(float);
-  }
-
-  const float* searched_array = (const float *)sqlite3_value_blob(argv[0]);
-  const float* column_array = (const float *)sqlite3_value_blob(argv[1]);
   float similarity = 0.0f;
-  
   int i = 0; 
   #ifdef USE_AVX
-  __m256 A, B, AB, ABAB, sumAB = _mm256_setzero_ps();
+  __m256 A, B, AB, sumAB = _mm256_setzero_ps();
   for( ; i + 7 < vector_size; i += 8 ) {
     A = _mm256_loadu_ps(&searched_array[i]);
     B = _mm256_loadu_ps(&column_array[i]);
@@ -568,20 +337,11 @@ static void ndvss_euclidean_distance_similarity_f( sqlite3_context* context,
     sumAB = _mm256_fmadd_ps(AB, AB, sumAB );
     #else
     // No fused multiply-add support (AVX).
-    ABAB = _mm256_mul_ps(AB, AB);
-    sumAB = _mm256_add_ps(ABAB, sumAB);
+    sumAB = _mm256_add_ps(_mm256_mul_ps(AB, AB), sumAB);
     #endif
   }
-  __m128 vlow   = _mm256_castps256_ps128(sumAB);
-  __m128 vhigh  = _mm256_extractf128_ps(sumAB, 1);
-         vlow   = _mm_add_ps(vlow, vhigh);
-  __m128 high64 = _mm_movehl_ps( vlow, vlow );
-  __m128 sum    = _mm_add_ps(vlow, high64);
-         sum    = _mm_add_ss(sum, _mm_shuffle_ps( sum, sum, 0x55));
-  similarity = _mm_cvtss_f32(sum);
-
+  similarity = ndvss_hsum_ps(sumAB);
   #else 
-
   for( ; i + 3 < vector_size; i += 4 ) {
     float AB = (searched_array[i] - column_array[i]);
     similarity += (AB * AB);
@@ -597,289 +357,259 @@ static void ndvss_euclidean_distance_similarity_f( sqlite3_context* context,
     float AB = (searched_array[i] - column_array[i]);
     similarity += (AB * AB);
   }
-  similarity = sqrtf(similarity);
-  sqlite3_result_double(context, (double)similarity);
+  return similarity;
 }
 
 
 //----------------------------------------------------------------------------------------
-// Name: ndvss_euclidean_distance_similarity_squared_d
-// Desc: Calculates the euclidean distance similarity to a BLOB-converted array of doubles.
-//       Returns the squared result (i.e. doesn't calculate the square root).
-// Args: Searched double array BLOB,
-//       Compared double array (usually a column) BLOB, 
-//       Number of dimensions INTEGER
-// Returns: Similarity as a squared distance DOUBLE
+// Name: ndvss_dot_product_kernel_d
+// Desc: Calculates the dot product between two arrays of doubles.
+// Args: Searched double array,
+//       Compared double array,
+//       Number of dimensions.
+// Returns: Dot product DOUBLE
 //----------------------------------------------------------------------------------------
-static void ndvss_euclidean_distance_similarity_squared_d( sqlite3_context* context,
-                                                           int argc,
-                                                           sqlite3_value** argv ) 
+static double ndvss_dot_product_kernel_d( const double* searched_array,
+                                          const double* column_array,
+                                          int vector_size )
 {
-  if( argc < 2 ) {
-    // Not enough arguments.
-    sqlite3_result_error(context, "2 arguments needs to be given: searched array, column/compared array, optionally array length.", -1);
-    return;
-  }
-  if( sqlite3_value_type(argv[0]) == SQLITE_NULL ||
-      sqlite3_value_type(argv[1]) == SQLITE_NULL ) {
-    // Missing one of the required arguments.
-    sqlite3_result_error(context, "One of the given arguments is null.", -1);
-    return;
-  }
-  int arg1_size_bytes = sqlite3_value_bytes(argv[0]);
-  int arg2_size_bytes = sqlite3_value_bytes(argv[1]);
-  if( arg1_size_bytes != arg2_size_bytes ) {
-    sqlite3_result_error(context, "The arrays are not the same length.", -1);
-    return;
-  }
-  int vector_size = -1;
-  if( argc > 2 ) {
-    if( sqlite3_value_type(argv[2]) != SQLITE_NULL ) {
-      vector_size = sqlite3_value_int(argv[2]);
-    }
-  } 
-  if( vector_size < 1 ) {
-    vector_size = arg1_size_bytes / sizeof(double);
-  }
-
-  const double* searched_array = (const double *)sqlite3_value_blob(argv[0]);
-  const double* column_array = (const double *)sqlite3_value_blob(argv[1]);
   double similarity = 0.0;
-  
-  //#pragma GCC ivdep
   int i = 0;
   #ifdef USE_AVX
-  __m256d A, B, AB, ABAB, sumAB = _mm256_setzero_pd();
+  __m256d A, B, sumAB = _mm256_setzero_pd();
   for( ; i + 3 < vector_size; i += 4 ) {
     A = _mm256_loadu_pd(&searched_array[i]);
     B = _mm256_loadu_pd(&column_array[i]);
-    AB = _mm256_sub_pd( A, B );
     #ifdef __AVX2__
-    // Fused multiply-add supported (AVX2).
-    sumAB = _mm256_fmadd_pd(AB, AB, sumAB );
+    sumAB = _mm256_fmadd_pd(A, B, sumAB );
     #else 
-    // No fused multiply-add support (AVX).
-    ABAB = _mm256_mul_pd(AB, AB);
-    sumAB = _mm256_add_pd(ABAB, sumAB);
+    sumAB = _mm256_add_pd(_mm256_mul_pd(A, B), sumAB);
     #endif
   }
-  __m128d vlow  = _mm256_castpd256_pd128(sumAB);
-  __m128d vhigh = _mm256_extractf128_pd(sumAB, 1); 
-          vlow  = _mm_add_pd(vlow, vhigh);     
-
-  __m128d high64 = _mm_unpackhi_pd(vlow, vlow);
-  similarity = _mm_cvtsd_f64(_mm_add_sd(vlow, high64)); 
-
+  similarity = ndvss_hsum_pd(sumAB);
   #else
   for( ; i + 3 < vector_size; i += 4 ) {
-    double AB = (searched_array[i] - column_array[i]);
-    similarity += (AB * AB);
-    AB = (searched_array[i+1] - column_array[i+1]);
-    similarity += (AB * AB);
-    AB = (searched_array[i+2] - column_array[i+2]);
-    similarity += (AB * AB);
-    AB = (searched_array[i+3] - column_array[i+3]);
-    similarity += (AB * AB);
+    similarity += ((searched_array[i]) * (column_array[i]));
+    similarity += ((searched_array[i+1]) * (column_array[i+1]));
+    similarity += ((searched_array[i+2]) * (column_array[i+2]));
+    similarity += ((searched_array[i+3]) * (column_array[i+3]));
   }
   #endif
   for( ; i < vector_size; ++i ) {
-    double AB = (searched_array[i] - column_array[i]);
-    similarity += (AB * AB);
+    similarity += ((searched_array[i]) * (column_array[i]));
   }
-  sqlite3_result_double(context, similarity);
+  return similarity;
 }
 
 
 //----------------------------------------------------------------------------------------
-// Name: ndvss_euclidean_distance_similarity_squared_f
-// Desc: Calculates the euclidean distance similarity to a BLOB-converted array of floats.
-//       Returns the squared result (i.e. doesn't calculate the square root).
-// Args: Searched float array BLOB,
-//       Compared float array (usually a column) BLOB, 
-//       Number of dimensions INTEGER
-// Returns: Similarity as a squared distance DOUBLE
+// Name: ndvss_dot_product_kernel_f
+// Desc: Calculates the dot product between two arrays of floats.
+// Args: Searched float array,
+//       Compared float array,
+//       Number of dimensions.
+// Returns: Dot product FLOAT
 //----------------------------------------------------------------------------------------
-static void ndvss_euclidean_distance_similarity_squared_f( sqlite3_context* context,
-                                                           int argc,
-                                                           sqlite3_value** argv ) 
+static float ndvss_dot_product_kernel_f( const float* searched_array,
+                                         const float* column_array,
+                                         int vector_size )
 {
-  if( argc < 2 ) {
-    // Not enough arguments.
-    sqlite3_result_error(context, "2 arguments needs to be given: searched array, column/compared array, optionally the array length.", -1);
-    return;
-  }
-  if( sqlite3_value_type(argv[0]) == SQLITE_NULL ||
-      sqlite3_value_type(argv[1]) == SQLITE_NULL ) {
-    // Missing one of the required arguments.
-    sqlite3_result_error(context, "One of the given arguments is null.", -1);
-    return;
-  }
-  int arg1_size_bytes = sqlite3_value_bytes(argv[0]);
-  int arg2_size_bytes = sqlite3_value_bytes(argv[1]);
-  if( arg1_size_bytes != arg2_size_bytes ) {
-    sqlite3_result_error(context, "The arrays are not the same length.", -1);
-    return;
-  }
-  int vector_size = -1;
-  if( argc > 2 ) {
-    if( sqlite3_value_type(argv[2]) != SQLITE_NULL ) {
-      vector_size = sqlite3_value_int(argv[2]);
-    }
-  } 
-  if( vector_size < 1 ) {
-    vector_size = arg1_size_bytes / sizeof(float);
-  }
-
-  const float* searched_array = (const float *)sqlite3_value_blob(argv[0]);
-  const float* column_array = (const float *)sqlite3_value_blob(argv[1]);
   float similarity = 0.0f;
-  
-  //#pragma GCC ivdep
-  int i = 0; 
+  int i = 0;
   #ifdef USE_AVX
-  __m256 A, B, AB, ABAB, sumAB = _mm256_setzero_ps();
+  __m256 A, B, sumAB = _mm256_setzero_ps();
   for( ; i + 7 < vector_size; i += 8 ) {
     A = _mm256_loadu_ps(&searched_array[i]);
     B = _mm256_loadu_ps(&column_array[i]);
-    AB = _mm256_sub_ps( A, B );
     #ifdef __AVX2__
-    // Fused multiply-add supported (AVX2).
-    sumAB = _mm256_fmadd_ps(AB, AB, sumAB );
+    sumAB = _mm256_fmadd_ps(A, B, sumAB );
     #else 
-    // No fused multiply-add support (AVX).
-    ABAB = _mm256_mul_ps(AB, AB);
-    sumAB = _mm256_add_ps(ABAB, sumAB);
+    sumAB = _mm256_add_ps(_mm256_mul_ps(A, B), sumAB);
     #endif
   }
-  __m128 vlow   = _mm256_castps256_ps128(sumAB);
-  __m128 vhigh  = _mm256_extractf128_ps(sumAB, 1);
-         vlow   = _mm_add_ps(vlow, vhigh);
-  __m128 high64 = _mm_movehl_ps( vlow, vlow );
-  __m128 sum    = _mm_add_ps(vlow, high64);
-         sum    = _mm_add_ss(sum, _mm_shuffle_ps( sum, sum, 0x55));
-  similarity = _mm_cvtss_f32(sum);
-
+  similarity = ndvss_hsum_ps(sumAB);
   #else 
   for( ; i + 3 < vector_size; i += 4 ) {
-    float AB = (searched_array[i] - column_array[i]);
-    similarity += (AB * AB);
-    AB = (searched_array[i+1] - column_array[i+1]);
-    similarity += (AB * AB);
-    AB = (searched_array[i+2] - column_array[i+2]);
-    similarity += (AB * AB);
-    AB = (searched_array[i+3] - column_array[i+3]);
-    similarity += (AB * AB);
+    similarity += ((searched_array[i]) * (column_array[i]));
+    similarity += ((searched_array[i+1]) * (column_array[i+1]));
+    similarity += ((searched_array[i+2]) * (column_array[i+2]));
+    similarity += ((searched_array[i+3]) * (column_array[i+3]));
   }
   #endif
   for( ; i < vector_size; ++i ) {
-    float AB = (searched_array[i] - column_array[i]);
-    similarity += (AB * AB);
+    similarity += ((searched_array[i]) * (column_array[i]));
   }
-  sqlite3_result_double(context, (float)similarity);
+  return similarity;
 }
 
 
 //----------------------------------------------------------------------------------------
-// Name: ndvss_dot_product_similarity_d
-// Desc: Calculates the dot product similarity to a BLOB-converted array of doubles.
-// Args: Searched double array BLOB,
-//       Compared double array (usually a column) BLOB, 
+// Name: ndvss_convert_str_to_array_d
+// Desc: Converts a list of decimal numbers from a string to an array of doubles.
+// Args: List of decimal numbers TEXT, 
 //       Number of dimensions INTEGER
-// Returns: Similarity as a dot product DOUBLE
+// Returns: The double-array as a BLOB.
 //----------------------------------------------------------------------------------------
-static void ndvss_dot_product_similarity_d( sqlite3_context* context,
-                                            int argc,
-                                            sqlite3_value** argv ) 
+static void ndvss_convert_str_to_array_d( sqlite3_context* context,
+                                          int argc,
+                                          sqlite3_value** argv ) 
 {
   if( argc < 2 ) {
-    // Not enough arguments.
-    sqlite3_result_error(context, "2 arguments needs to be given: searched array, column/compared array, optionally the array length.", -1);
+    sqlite3_result_error(context, "2 arguments needs to be given: string to convert, array length.", -1);
     return;
   }
   if( sqlite3_value_type(argv[0]) == SQLITE_NULL ||
       sqlite3_value_type(argv[1]) == SQLITE_NULL ) {
-    // Missing one of the required arguments.
     sqlite3_result_error(context, "One of the given arguments is null.", -1);
     return;
   }
-  int arg1_size_bytes = sqlite3_value_bytes(argv[0]);
-  int arg2_size_bytes = sqlite3_value_bytes(argv[1]);
-  if( arg1_size_bytes != arg2_size_bytes ) {
-    sqlite3_result_error(context, "The arrays are not the same length.", -1);
+
+  int num_dimensions = sqlite3_value_int(argv[1]);
+  if( num_dimensions <= 0 ) {
+    sqlite3_result_error(context, "Number of dimensions is 0.", -1);
     return;
   }
-  int vector_size = -1;
-  if( argc > 2 ) {
-    if( sqlite3_value_type(argv[2]) != SQLITE_NULL ) {
-      vector_size = sqlite3_value_int(argv[2]);
-    }
-  } 
-  if( vector_size < 1 ) {
-    vector_size = arg1_size_bytes / sizeof(double);
+  int allocated_size = sizeof(double)*num_dimensions;
+  double* output = (double*)sqlite3_malloc(allocated_size);
+  if( output == 0 ) {
+    sqlite3_result_error(context, "Out of memory.", -1);
+    return;
   }
-
-  const double* searched_array = (const double *)sqlite3_value_blob(argv[0]);
-  const double* column_array = (const double *)sqlite3_value_blob(argv[1]);
-  double similarity = 0.0;
-  
-  //#pragma GCC ivdep
+  char* input = (char*)sqlite3_value_text(argv[0]);
+  char* end = input;
+  double* index = output;
   int i = 0;
-  #ifdef USE_AVX
-  __m256d A, B, AB, sumAB = _mm256_setzero_pd();
-  for( ; i + 3 < vector_size; i += 4 ) {
-    A = _mm256_loadu_pd(&searched_array[i]);
-    B = _mm256_loadu_pd(&column_array[i]);
-    #ifdef __AVX2__
-    sumAB = _mm256_fmadd_pd(A, B, sumAB );
-    #else 
-    AB = _mm256_mul_pd(A, B);
-    sumAB = _mm256_add_pd(AB, sumAB);
-    #endif
-  }
-  __m128d vlow  = _mm256_castpd256_pd128(sumAB);
-  __m128d vhigh = _mm256_extractf128_pd(sumAB, 1); 
-          vlow  = _mm_add_pd(vlow, vhigh);     
+  while( end != 0 && i < num_dimensions ) {
+    // Skip the JSON-array characters.
+    if (*end == '[' || *end == ']' || *end == ',') {
+      end++;
+      continue;
+    } 
+    *index = strtod(end, &end);
+    ++index;
+    ++i;  
+  }//endwhile processing string
+  sqlite3_result_blob(context, output, allocated_size, sqlite3_free );
+}
 
-  __m128d high64 = _mm_unpackhi_pd(vlow, vlow);
-  similarity = _mm_cvtsd_f64(_mm_add_sd(vlow, high64)); 
 
-  #else
-  for( ; i + 3 < vector_size; i += 4 ) {
-    similarity += ((searched_array[i]) * (column_array[i]));
-    similarity += ((searched_array[i+1]) * (column_array[i+1]));
-    similarity += ((searched_array[i+2]) * (column_array[i+2]));
-    similarity += ((searched_array[i+3]) * (column_array[i+3]));
+//----------------------------------------------------------------------------------------
+// Name: ndvss_convert_str_to_array_f
+// Desc: Converts a list of decimal numbers from a string to an array of floats.
+// Args: List of decimal numbers TEXT, 
+//       Number of dimensions INTEGER
+// Returns: The float-array as a BLOB.
+//----------------------------------------------------------------------------------------
+static void ndvss_convert_str_to_array_f( sqlite3_context* context,
+                                          int argc,
+                                          sqlite3_value** argv ) 
+{
+  if( argc < 2 ) {
+    sqlite3_result_error(context, "2 arguments needs to be given: string to convert, array length.", -1);
+    return;
   }
-  #endif
-  for( ; i < vector_size; ++i ) {
-    similarity += ((searched_array[i]) * (column_array[i]));
+  if( sqlite3_value_type(argv[0]) == SQLITE_NULL ||
+      sqlite3_value_type(argv[1]) == SQLITE_NULL ) {
+    sqlite3_result_error(context, "One of the given arguments is null.", -1);
+    return;
+  }
+
+  int num_dimensions = sqlite3_value_int(argv[1]);
+  if( num_dimensions <= 0 ) {
+    sqlite3_result_error(context, "Number of dimensions is 0.", -1);
+    return;
+  }
+  int allocated_size = sizeof(float)*num_dimensions;
+  float* output = (float*)sqlite3_malloc(allocated_size);
+  if( output == 0 ) {
+    sqlite3_result_error(context, "Out of memory.", -1);
+    return;
   }
+  char* input = (char*)sqlite3_value_text(argv[0]);
+  char* end = input;
+  float* index = output;
+  int i = 0;
+  while( end != 0 && i < num_dimensions ) {
+    // Skip the JSON-array characters.
+    if (*end == '[' || *end == ']' || *end == ',') {
+      end++;
+      continue;
+    } 
+    *index = (float)strtod(end, &end);
+    ++index;
+    ++i;  
+  }//endwhile processing string
+  sqlite3_result_blob(context, output, allocated_size, sqlite3_free );
+}
 
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_cosine_similarity_d
+// Desc: Calculates the cosine similarity to a BLOB-converted array of doubles.
+// Args: Searched double array BLOB,
+//       Compared double array (usually a column) BLOB, 
+//       Number of dimensions INTEGER
+// Returns: Similarity as an angle DOUBLE
+//----------------------------------------------------------------------------------------
+static void ndvss_cosine_similarity_d( sqlite3_context* context,
+                                       int argc,
+                                       sqlite3_value** argv ) 
+{
+  if( argc < 2 ) {
+    sqlite3_result_error(context, "2 arguments needs to be given: searched array, column/compared array. Optionally the vector size can be given as the 3rd argument.", -1);
+    return;
+  }
+  if( sqlite3_value_type(argv[0]) == SQLITE_NULL ||
+      sqlite3_value_type(argv[1]) == SQLITE_NULL ) {
+    sqlite3_result_error(context, "One of the given arguments is null.", -1);
+    return;
+  }
+  int arg1_size_bytes = sqlite3_value_bytes(argv[0]);
+  int arg2_size_bytes = sqlite3_value_bytes(argv[1]);
+  if( arg1_size_bytes != arg2_size_bytes ) {
+    sqlite3_result_error(context, "The arrays are not the same length.", -1);
+    return;
+  }
+  int vector_size = -1;
+  if( argc > 2 ) {
+    if( sqlite3_value_type(argv[2]) != SQLITE_NULL ) {
+      vector_size = sqlite3_value_int(argv[2]);
+    }
+  } 
+  if( vector_size < 1 ) {
+    vector_size = arg1_size_bytes / sizeof(double);
+  }
+  
+  const double* searched_array = (const double *)sqlite3_value_blob(argv[0]);
+  const double* column_array = (const double *)sqlite3_value_blob(argv[1]);
+  double similarity = 0.0;
+  if( !ndvss_cosine_kernel_d(searched_array, column_array, vector_size, &similarity) ) {
+    sqlite3_result_error(context, "Division by zero.", -1);
+    return;
+  }
   sqlite3_result_double(context, similarity);
 }
 
 
 //----------------------------------------------------------------------------------------
-// Name: ndvss_dot_product_similarity_f
-// Desc: Calculates the dot product similarity to a BLOB-converted array of floats.
+// Name: ndvss_cosine_similarity_f
+// Desc: Calculates the cosine similarity to a BLOB-converted array of floats.
 // Args: Searched float array BLOB,
 //       Compared float array (usually a column) BLOB, 
 //       Number of dimensions INTEGER
-// Returns: Similarity as a dot product DOUBLE
+// Returns: Similarity as an angle DOUBLE
 //----------------------------------------------------------------------------------------
-static void ndvss_dot_product_similarity_f( sqlite3_context* context,
-                                            int argc,
-                                            sqlite3_value** argv ) 
+static void ndvss_cosine_similarity_f( sqlite3_context* context,
+                                       int argc,
+                                       sqlite3_value** argv ) 
 {
   if( argc < 2 ) {
-    // Not enough arguments.
-    sqlite3_result_error(context, "2 arguments needs to be given: searched array, column/compared array, array length.", -1);
+    sqlite3_result_error(context, "2 arguments needs to be given: searched array, column/compared array, optionally the array length.", -1);
     return;
   }
   if( sqlite3_value_type(argv[0]) == SQLITE_NULL ||
       sqlite3_value_type(argv[1]) == SQLITE_NULL ) {
-    // Missing one of the required arguments.
-    sqlite3_result_error(context, "One of the given arguments is NULL.", -1);
+    sqlite3_result_error(context, "One of the required arguments is null.", -1);
     return;
   }
   int arg1_size_bytes = sqlite3_value_bytes(argv[0]);
@@ -897,106 +627,355 @@ static void ndvss_dot_product_similarity_f( sqlite3_context* context,
   if( vector_size < 1 ) {
     vector_size = arg1_size_bytes / sizeof(float);
   }
+
   const float* searched_array = (const float *)sqlite3_value_blob(argv[0]);
   const float* column_array = (const float *)sqlite3_value_blob(argv[1]);
-  float similarity = 0.0f;
-  
-  //#pragma GCC ivdep
-  int i = 0;
-  #ifdef USE_AVX
-  __m256 A, B, AB, sumAB = _mm256_setzero_ps();
-  for( ; i + 7 < vector_size; i += 8 ) {
-    A = _mm256_loadu_ps(&searched_array[i]);
-    B = _mm256_loadu_ps(&column_array[i]);
-    #ifdef __AVX2__
-    sumAB = _mm256_fmadd_ps(A, B, sumAB );
-    #else 
-    AB = _mm256_mul_ps(A, B);
-    sumAB = _mm256_add_ps(AB, sumAB);
-    #endif
+  double similarity = 0.0;
+  if( !ndvss_cosine_kernel_f(searched_array, column_array, vector_size, &similarity) ) {
+    // There'd be a division by zero, so assume no similarity.
+    sqlite3_result_error(context, "Division by zero.", -1); 
+    return;
   }
-  __m128 vlow   = _mm256_castps256_ps128(sumAB);
-  __m128 vhigh  = _mm256_extractf128_ps(sumAB, 1);
-         vlow   = _mm_add_ps(vlow, vhigh);
-  __m128 high64 = _mm_movehl_ps( vlow, vlow );
-  __m128 sum    = _mm_add_ps(vlow, high64);
-         sum    = _mm_add_ss(sum, _mm_shuffle_ps( sum, sum, 0x55));
-  similarity = _mm_cvtss_f32(sum);
+  sqlite3_result_double(context, similarity);
+}
 
-  #else 
-  for( ; i + 3 < vector_size; i += 4 ) {
-    similarity += ((searched_array[i]) * (column_array[i]));
-    similarity += ((searched_array[i+1]) * (column_array[i+1]));
-    similarity += ((searched_array[i+2]) * (column_array[i+2]));
-    similarity += ((searched_array[i+3]) * (column_array[i+3]));
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_euclidean_distance_similarity_d
+// Desc: Calculates the euclidean distance similarity to a BLOB-converted array of doubles.
+// Args: Searched double array BLOB,
+//       Compared double array (usually a column) BLOB, 
+//       Number of dimensions INTEGER
+// Returns: Similarity as a distance DOUBLE
+//----------------------------------------------------------------------------------------
+static void ndvss_euclidean_distance_similarity_d( sqlite3_context* context,
+                                                   int argc,
+                                                   sqlite3_value** argv ) 
+{
+  if( argc < 2 ) {
+    sqlite3_result_error(context, "2 arguments needs to be given: searched array, column/compared array, optionally the array length.", -1);
+    return;
   }
-  #endif
-  for( ; i < vector_size; ++i ) {
-    similarity += ((searched_array[i]) * (column_array[i]));
+  if( sqlite3_value_type(argv[0]) == SQLITE_NULL ||
+      sqlite3_value_type(argv[1]) == SQLITE_NULL ) {
+    sqlite3_result_error(context, "One of the required arguments is null.", -1);
+    return;
   }
 
-  sqlite3_result_double(context, (double)similarity);
-}
+  int arg1_size_bytes = sqlite3_value_bytes(argv[0]);
+  int arg2_size_bytes = sqlite3_value_bytes(argv[1]);
+  if( arg1_size_bytes != arg2_size_bytes ) {
+    sqlite3_result_error(context, "The arrays are not the same length.", -1);
+    return;
+  }
+  int vector_size = -1;
+  if( argc > 2 ) {
+    if( sqlite3_value_type(argv[2]) != SQLITE_NULL ) {
+      vector_size = sqlite3_value_int(argv[2]);
+    }
+  } 
+  if( vector_size < 1 ) {
+    vector_size = arg1_size_bytes / sizeof(double);
+  }
 
+  const double* searched_array = (const double *)sqlite3_value_blob(argv[0]);
+  const double* column_array = (const double *)sqlite3_value_blob(argv[1]);
+  double similarity = ndvss_euclidean_distance_squared_kernel_d(searched_array, column_array, vector_size);
+  similarity = sqrt(similarity);
+  sqlite3_result_double(context, similarity);
+}
 
 
 //----------------------------------------------------------------------------------------
-// Name: ndvss_dot_product_similarity_str
-// Desc: Calculates the dot product similarity between two strings containing arrays of
-//       decimal numbers. The first argument (searched array) is cached as a BLOB.
-// Args: Searched array TEXT,
-//       Compared array (usually a column) TEXT, 
+// Name: ndvss_euclidean_distance_similarity_f
+// Desc: Calculates the euclidean distance similarity to a BLOB-converted array of floats.
+// Args: Searched float array BLOB,
+//       Compared float array (usually a column) BLOB, 
 //       Number of dimensions INTEGER
-// Returns: Similarity as a dot product DOUBLE
+// Returns: Similarity as a distance DOUBLE
 //----------------------------------------------------------------------------------------
-static void ndvss_dot_product_similarity_str( sqlite3_context* context,
-                                                    int argc,
-                                                    sqlite3_value** argv ) 
+static void ndvss_euclidean_distance_similarity_f( sqlite3_context* context,
+                                                   int argc,
+                                                   sqlite3_value** argv ) 
 {
-  if( argc < 3 ) {
+  if( argc < 2 ) {
     // Not enough arguments.
-    sqlite3_result_error(context, "3 arguments needs to be given: searched array, column/compared array, array length.", -1);
+    sqlite3_result_error(context, "2 arguments needs to be given: searched array, column/compared array, optionally the array length.", -1);
     return;
   }
   if( sqlite3_value_type(argv[0]) == SQLITE_NULL ||
-      sqlite3_value_type(argv[1]) == SQLITE_NULL ||
-      sqlite3_value_type(argv[2]) == SQLITE_NULL ) {
-    // Missing one of the required argument.
-    sqlite3_result_error(context, "One of the given arguments is NULL.", -1);
+      sqlite3_value_type(argv[1]) == SQLITE_NULL ) {
+    // Missing one of the required arguments.
+    sqlite3_result_error(context, "One of the given arguments is null.", -1);
     return;
   }
-
-  int vector_size = sqlite3_value_int(argv[2]);
-  // Parse through the searched value and save it to aux-data for future
-  // use.
-  void* aux_array = sqlite3_get_auxdata( context, 0 );
-  double* comparison_vector = 0; 
-  if( aux_array == 0 ) {
-    comparison_vector = (double*)sqlite3_malloc(vector_size*sizeof(double));
-    if(comparison_vector == 0 ) {
-      sqlite3_result_error(context, "Out of memory.", -1);
-      return;
-    }
-    char* search_vector = (char*)sqlite3_value_text(argv[0]);
-    char* end = search_vector;
-    double* index = comparison_vector;
-    int i = 0;
-    while( end != 0 && i < vector_size ) {
-      if (*end == '[' || *end == ']' || *end == ',') {
-            // Increment endptr to skip the character
-            end++;
-            continue;
-      } 
-      *index = strtod(end, &end);
-      ++index;
-      ++i;
-    }//endwhile processing searched string
-    sqlite3_set_auxdata(context, 0, comparison_vector, sqlite3_free);
-  } else {
-    comparison_vector = (double *)aux_array;
+  int arg1_size_bytes = sqlite3_value_bytes(argv[0]);
+  int arg2_size_bytes = sqlite3_value_bytes(argv[1]);
+  if( arg1_size_bytes != arg2_size_bytes ) {
+    sqlite3_result_error(context, "The arrays are not the same length.", -1);
+    return;
   }
-
-  // Start parsing through the second argument and calculate the
+  int vector_size = -1;
+  if( argc > 2 ) {
+    if( sqlite3_value_type(argv[2]) != SQLITE_NULL ) {
+      vector_size = sqlite3_value_int(argv[2]);
+    }
+  } 
+  if( vector_size < 1 ) {
+    vector_size = arg1_size_bytes / sizeof(float);
+  }
+
+  const float* searched_array = (const float *)sqlite3_value_blob(argv[0]);
+  const float* column_array = (const float *)sqlite3_value_blob(argv[1]);
+  float similarity = ndvss_euclidean_distance_squared_kernel_f(searched_array, column_array, vector_size);
+  similarity = sqrtf(similarity);
+  sqlite3_result_double(context, (double)similarity);
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_euclidean_distance_similarity_squared_d
+// Desc: Calculates the euclidean distance similarity to a BLOB-converted array of doubles.
+//       Returns the squared result (i.e. doesn't calculate the square root).
+// Args: Searched double array BLOB,
+//       Compared double array (usually a column) BLOB, 
+//       Number of dimensions INTEGER
+// Returns: Similarity as a squared distance DOUBLE
+//----------------------------------------------------------------------------------------
+static void ndvss_euclidean_distance_similarity_squared_d( sqlite3_context* context,
+                                                           int argc,
+                                                           sqlite3_value** argv ) 
+{
+  if( argc < 2 ) {
+    // Not enough arguments.
+    sqlite3_result_error(context, "2 arguments needs to be given: searched array, column/compared array, optionally array length.", -1);
+    return;
+  }
+  if( sqlite3_value_type(argv[0]) == SQLITE_NULL ||
+      sqlite3_value_type(argv[1]) == SQLITE_NULL ) {
+    // Missing one of the required arguments.
+    sqlite3_result_error(context, "One of the given arguments is null.", -1);
+    return;
+  }
+  int arg1_size_bytes = sqlite3_value_bytes(argv[0]);
+  int arg2_size_bytes = sqlite3_value_bytes(argv[1]);
+  if( arg1_size_bytes != arg2_size_bytes ) {
+    sqlite3_result_error(context, "The arrays are not the same length.", -1);
+    return;
+  }
+  int vector_size = -1;
+  if( argc > 2 ) {
+    if( sqlite3_value_type(argv[2]) != SQLITE_NULL ) {
+      vector_size = sqlite3_value_int(argv[2]);
+    }
+  } 
+  if( vector_size < 1 ) {
+    vector_size = arg1_size_bytes / sizeof(double);
+  }
+
+  const double* searched_array = (const double *)sqlite3_value_blob(argv[0]);
+  const double* column_array = (const double *)sqlite3_value_blob(argv[1]);
+  double similarity = ndvss_euclidean_distance_squared_kernel_d(searched_array, column_array, vector_size);
+  sqlite3_result_double(context, similarity);
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_euclidean_distance_similarity_squared_f
+// Desc: Calculates the euclidean distance similarity to a BLOB-converted array of floats.
+//       Returns the squared result (i.e. doesn't calculate the square root).
+// Args: Searched float array BLOB,
+//       Compared float array (usually a column) BLOB, 
+//       Number of dimensions INTEGER
+// Returns: Similarity as a squared distance DOUBLE
+//----------------------------------------------------------------------------------------
+static void ndvss_euclidean_distance_similarity_squared_f( sqlite3_context* context,
+                                                           int argc,
+                                                           sqlite3_value** argv ) 
+{
+  if( argc < 2 ) {
+    // Not enough arguments.
+    sqlite3_result_error(context, "2 arguments needs to be given: searched array, column/compared array, optionally the array length.", -1);
+    return;
+  }
+  if( sqlite3_value_type(argv[0]) == SQLITE_NULL ||
+      sqlite3_value_type(argv[1]) == SQLITE_NULL ) {
+    // Missing one of the required arguments.
+    sqlite3_result_error(context, "One of the given arguments is null.", -1);
+    return;
+  }
+  int arg1_size_bytes = sqlite3_value_bytes(argv[0]);
+  int arg2_size_bytes = sqlite3_value_bytes(argv[1]);
+  if( arg1_size_bytes != arg2_size_bytes ) {
+    sqlite3_result_error(context, "The arrays are not the same length.", -1);
+    return;
+  }
+  int vector_size = -1;
+  if( argc > 2 ) {
+    if( sqlite3_value_type(argv[2]) != SQLITE_NULL ) {
+      vector_size = sqlite3_value_int(argv[2]);
+    }
+  } 
+  if( vector_size < 1 ) {
+    vector_size = arg1_size_bytes / sizeof(float);
+  }
+
+  const float* searched_array = (const float *)sqlite3_value_blob(argv[0]);
+  const float* column_array = (const float *)sqlite3_value_blob(argv[1]);
+  float similarity = ndvss_euclidean_distance_squared_kernel_f(searched_array, column_array, vector_size);
+  sqlite3_result_double(context, (float)similarity);
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_dot_product_similarity_d
+// Desc: Calculates the dot product similarity to a BLOB-converted array of doubles.
+// Args: Searched double array BLOB,
+//       Compared double array (usually a column) BLOB, 
+//       Number of dimensions INTEGER
+// Returns: Similarity as a dot product DOUBLE
+//----------------------------------------------------------------------------------------
+static void ndvss_dot_product_similarity_d( sqlite3_context* context,
+                                            int argc,
+                                            sqlite3_value** argv ) 
+{
+  if( argc < 2 ) {
+    // Not enough arguments.
+    sqlite3_result_error(context, "2 arguments needs to be given: searched array, column/compared array, optionally the array length.", -1);
+    return;
+  }
+  if( sqlite3_value_type(argv[0]) == SQLITE_NULL ||
+      sqlite3_value_type(argv[1]) == SQLITE_NULL ) {
+    // Missing one of the required arguments.
+    sqlite3_result_error(context, "One of the given arguments is null.", -1);
+    return;
+  }
+  int arg1_size_bytes = sqlite3_value_bytes(argv[0]);
+  int arg2_size_bytes = sqlite3_value_bytes(argv[1]);
+  if( arg1_size_bytes != arg2_size_bytes ) {
+    sqlite3_result_error(context, "The arrays are not the same length.", -1);
+    return;
+  }
+  int vector_size = -1;
+  if( argc > 2 ) {
+    if( sqlite3_value_type(argv[2]) != SQLITE_NULL ) {
+      vector_size = sqlite3_value_int(argv[2]);
+    }
+  } 
+  if( vector_size < 1 ) {
+    vector_size = arg1_size_bytes / sizeof(double);
+  }
+
+  const double* searched_array = (const double *)sqlite3_value_blob(argv[0]);
+  const double* column_array = (const double *)sqlite3_value_blob(argv[1]);
+  double similarity = ndvss_dot_product_kernel_d(searched_array, column_array, vector_size);
+  sqlite3_result_double(context, similarity);
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_dot_product_similarity_f
+// Desc: Calculates the dot product similarity to a BLOB-converted array of floats.
+// Args: Searched float array BLOB,
+//       Compared float array (usually a column) BLOB, 
+//       Number of dimensions INTEGER
+// Returns: Similarity as a dot product DOUBLE
+//----------------------------------------------------------------------------------------
+static void ndvss_dot_product_similarity_f( sqlite3_context* context,
+                                            int argc,
+                                            sqlite3_value** argv ) 
+{
+  if( argc < 2 ) {
+    // Not enough arguments.
+    sqlite3_result_error(context, "2 arguments needs to be given: searched array, column/compared array, array length.", -1);
+    return;
+  }
+  if( sqlite3_value_type(argv[0]) == SQLITE_NULL ||
+      sqlite3_value_type(argv[1]) == SQLITE_NULL ) {
+    // Missing one of the required arguments.
+    sqlite3_result_error(context, "One of the given arguments is NULL.", -1);
+    return;
+  }
+  int arg1_size_bytes = sqlite3_value_bytes(argv[0]);
+  int arg2_size_bytes = sqlite3_value_bytes(argv[1]);
+  if( arg1_size_bytes != arg2_size_bytes ) {
+    sqlite3_result_error(context, "The arrays are not the same length.", -1);
+    return;
+  }
+  int vector_size = -1;
+  if( argc > 2 ) {
+    if( sqlite3_value_type(argv[2]) != SQLITE_NULL ) {
+      vector_size = sqlite3_value_int(argv[2]);
+    }
+  } 
+  if( vector_size < 1 ) {
+    vector_size = arg1_size_bytes / sizeof(float);
+  }
+  const float* searched_array = (const float *)sqlite3_value_blob(argv[0]);
+  const float* column_array = (const float *)sqlite3_value_blob(argv[1]);
+  float similarity = ndvss_dot_product_kernel_f(searched_array, column_array, vector_size);
+  sqlite3_result_double(context, (double)similarity);
+}
+
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_dot_product_similarity_str
+// Desc: Calculates the dot product similarity between two strings containing arrays of
+//       decimal numbers. The first argument (searched array) is cached as a BLOB.
+// Args: Searched array TEXT,
+//       Compared array (usually a column) TEXT, 
+//       Number of dimensions INTEGER
+// Returns: Similarity as a dot product DOUBLE
+//----------------------------------------------------------------------------------------
+static void ndvss_dot_product_similarity_str( sqlite3_context* context,
+                                                    int argc,
+                                                    sqlite3_value** argv ) 
+{
+  if( argc < 3 ) {
+    // Not enough arguments.
+    sqlite3_result_error(context, "3 arguments needs to be given: searched array, column/compared array, array length.", -1);
+    return;
+  }
+  if( sqlite3_value_type(argv[0]) == SQLITE_NULL ||
+      sqlite3_value_type(argv[1]) == SQLITE_NULL ||
+      sqlite3_value_type(argv[2]) == SQLITE_NULL ) {
+    // Missing one of the required argument.
+    sqlite3_result_error(context, "One of the given arguments is NULL.", -1);
+    return;
+  }
+
+  int vector_size = sqlite3_value_int(argv[2]);
+  // Parse through the searched value and save it to aux-data for future
+  // use.
+  void* aux_array = sqlite3_get_auxdata( context, 0 );
+  double* comparison_vector = 0; 
+  if( aux_array == 0 ) {
+    comparison_vector = (double*)sqlite3_malloc(vector_size*sizeof(double));
+    if(comparison_vector == 0 ) {
+      sqlite3_result_error(context, "Out of memory.", -1);
+      return;
+    }
+    char* search_vector = (char*)sqlite3_value_text(argv[0]);
+    char* end = search_vector;
+    double* index = comparison_vector;
+    int i = 0;
+    while( end != 0 && i < vector_size ) {
+      if (*end == '[' || *end == ']' || *end == ',') {
+            // Increment endptr to skip the character
+            end++;
+            continue;
+      } 
+      *index = strtod(end, &end);
+      ++index;
+      ++i;
+    }//endwhile processing searched string
+    sqlite3_set_auxdata(context, 0, comparison_vector, sqlite3_free);
+  } else {
+    comparison_vector = (double *)aux_array;
+  }
+
+  // Start parsing through the second argument and calculate the
   // similarity.
   double similarity = 0.0;
   char* rowvalue_input = (char*)sqlite3_value_text(argv[1]);
@@ -1018,6 +997,13664 @@ static void ndvss_dot_product_similarity_str( sqlite3_context* context,
 }
 
 
+//----------------------------------------------------------------------------------------
+// PROGRESSIVE BLOB READS.
+// The *_blob_* functions read the compared vector straight from the table with
+// sqlite3_blob_read in blocks, and stop reading as soon as the partial distance shows
+// that the row can't pass the given limit. The rest of the vector is never fetched
+// from the pager, which saves I/O on databases that are on disk.
+//----------------------------------------------------------------------------------------
+#define NDVSS_BLOB_READ_BLOCK_BYTES 1024 // Bytes read per sqlite3_blob_read call. Must be a multiple of 8.
+
+typedef struct ndvss_blob_reader {
+  sqlite3_blob*  blob;            // Handle that is moved from row to row with sqlite3_blob_reopen.
+  char*          db_name;         // Schema, table and column that the handle is opened on.
+  char*          table_name;
+  char*          column_name;
+  unsigned char* block;           // Read buffer for one block.
+  unsigned char* query;           // Copy of the searched array that the memo and the top-k 
+  int            query_bytes;     // below were computed for.
+  sqlite3_int64  last_rowid;      // Result of the latest row, in case the same row is 
+  int            last_valid;      // evaluated more than once (e.g. both in WHERE and SELECT).
+  int            last_is_null;
+  double         last_distance;
+  int            k;               // Size of the running top-k, 0 if not used.
+  int            heap_count;      
+  double*        heap;            // Max-heap of the k smallest squared distances seen so far.
+} ndvss_blob_reader;
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_blob_reader_free
+// Desc: Closes the blob handle and frees the reader. Used as the aux-data destructor.
+//----------------------------------------------------------------------------------------
+static void ndvss_blob_reader_free( void* p )
+{
+  ndvss_blob_reader* reader = (ndvss_blob_reader*)p;
+  if( reader == 0 ) {
+    return;
+  }
+  if( reader->blob != 0 ) {
+    sqlite3_blob_close(reader->blob);
+  }
+  sqlite3_free(reader->db_name);
+  sqlite3_free(reader->table_name);
+  sqlite3_free(reader->column_name);
+  sqlite3_free(reader->block);
+  sqlite3_free(reader->query);
+  sqlite3_free(reader->heap);
+  sqlite3_free(reader);
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_blob_reader_new
+// Desc: Allocates a reader for the given table and column. The table can be given
+//       either as "table" or as "schema.table".
+// Returns: The reader or 0 if out of memory.
+//----------------------------------------------------------------------------------------
+static ndvss_blob_reader* ndvss_blob_reader_new( const char* table, 
+                                                 const char* column, 
+                                                 int k )
+{
+  ndvss_blob_reader* reader = (ndvss_blob_reader*)sqlite3_malloc(sizeof(ndvss_blob_reader));
+  if( reader == 0 ) {
+    return 0;
+  }
+  memset(reader, 0, sizeof(ndvss_blob_reader));
+  const char* dot = strchr(table, '.');
+  if( dot != 0 ) {
+    reader->db_name = sqlite3_mprintf("%.*s", (int)(dot - table), table);
+    reader->table_name = sqlite3_mprintf("%s", dot + 1);
+  } else {
+    reader->db_name = sqlite3_mprintf("main");
+    reader->table_name = sqlite3_mprintf("%s", table);
+  }
+  reader->column_name = sqlite3_mprintf("%s", column);
+  reader->block = (unsigned char*)sqlite3_malloc(NDVSS_BLOB_READ_BLOCK_BYTES);
+  reader->k = k;
+  if( k > 0 ) {
+    reader->heap = (double*)sqlite3_malloc(sizeof(double) * k);
+  }
+  if( reader->db_name == 0 || reader->table_name == 0 || reader->column_name == 0 ||
+      reader->block == 0 || (k > 0 && reader->heap == 0) ) {
+    ndvss_blob_reader_free(reader);
+    return 0;
+  }
+  return reader;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_blob_reader_push
+// Desc: Adds a squared distance to the running top-k.
+//----------------------------------------------------------------------------------------
+static void ndvss_blob_reader_push( ndvss_blob_reader* reader, double distance )
+{
+  double* heap = reader->heap;
+  int i;
+  if( reader->heap_count < reader->k ) {
+    // Sift up.
+    i = reader->heap_count++;
+    while( i > 0 && heap[(i - 1) / 2] < distance ) {
+      heap[i] = heap[(i - 1) / 2];
+      i = (i - 1) / 2;
+    }
+    heap[i] = distance;
+    return;
+  }
+  if( distance >= heap[0] ) {
+    return;
+  }
+  // Replace the largest and sift down.
+  i = 0;
+  for( ;; ) {
+    int child = 2 * i + 1;
+    if( child >= reader->heap_count ) {
+      break;
+    }
+    if( child + 1 < reader->heap_count && heap[child + 1] > heap[child] ) {
+      ++child;
+    }
+    if( heap[child] <= distance ) {
+      break;
+    }
+    heap[i] = heap[child];
+    i = child;
+  }
+  heap[i] = distance;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_blob_column_is_null
+// Desc: Checks whether the column of the given row is NULL. Called only when a blob 
+//       handle can't be opened on the row, since sqlite3_blob_open fails for NULLs.
+// Returns: 1 if the row exists and its column is NULL, otherwise 0.
+//----------------------------------------------------------------------------------------
+static int ndvss_blob_column_is_null( sqlite3* db, 
+                                      const ndvss_blob_reader* reader, 
+                                      sqlite3_int64 rowid )
+{
+  char* sql = sqlite3_mprintf("SELECT \"%w\" IS NULL FROM \"%w\".\"%w\" WHERE rowid = ?", 
+                              reader->column_name, reader->db_name, reader->table_name);
+  if( sql == 0 ) {
+    return 0;
+  }
+  sqlite3_stmt* stmt = 0;
+  int is_null = 0;
+  if( sqlite3_prepare_v2(db, sql, -1, &stmt, 0) == SQLITE_OK ) {
+    sqlite3_bind_int64(stmt, 1, rowid);
+    if( sqlite3_step(stmt) == SQLITE_ROW ) {
+      is_null = sqlite3_column_int(stmt, 0);
+    }
+  }
+  sqlite3_finalize(stmt);
+  sqlite3_free(sql);
+  return is_null;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_euclidean_distance_similarity_blob
+// Desc: Shared implementation of ndvss_euclidean_distance_similarity_blob_f/_d.
+//       Calculates the euclidean distance block by block and abandons the row as soon as
+//       the partial squared distance exceeds the bound, which is the smaller of the 
+//       squared maximum distance and the k:th best squared distance seen so far. 
+// Args: Searched array BLOB,
+//       Table name TEXT ("table" or "schema.table"),
+//       Column name TEXT,
+//       Rowid of the compared row INTEGER,
+//       Maximum distance DOUBLE (NULL for no limit),
+//       Optionally the number of best results that are kept, k INTEGER
+// Returns: Similarity as a distance DOUBLE, or NULL if the row can't qualify.
+//----------------------------------------------------------------------------------------
+static void ndvss_euclidean_distance_similarity_blob( sqlite3_context* context,
+                                                      int argc,
+                                                      sqlite3_value** argv,
+                                                      int element_size ) 
+{
+  if( argc < 5 ) {
+    sqlite3_result_error(context, "5 arguments needs to be given: searched array, table, column, rowid, maximum distance. Optionally the number of best results (k) can be given as the 6th argument.", -1);
+    return;
+  }
+  if( sqlite3_value_type(argv[0]) == SQLITE_NULL ||
+      sqlite3_value_type(argv[1]) == SQLITE_NULL ||
+      sqlite3_value_type(argv[2]) == SQLITE_NULL ||
+      sqlite3_value_type(argv[3]) == SQLITE_NULL ) {
+    sqlite3_result_error(context, "One of the required arguments is null.", -1);
+    return;
+  }
+  const char* table = (const char*)sqlite3_value_text(argv[1]);
+  const char* column = (const char*)sqlite3_value_text(argv[2]);
+  sqlite3_int64 rowid = sqlite3_value_int64(argv[3]);
+  double bound = HUGE_VAL;
+  if( sqlite3_value_type(argv[4]) != SQLITE_NULL ) {
+    double max_distance = sqlite3_value_double(argv[4]);
+    bound = max_distance * max_distance;
+  }
+  int k = 0;
+  if( argc > 5 && sqlite3_value_type(argv[5]) != SQLITE_NULL ) {
+    k = sqlite3_value_int(argv[5]);
+    if( k < 0 ) {
+      k = 0;
+    }
+  }
+
+  // The reader is kept as aux-data of the table name, so the blob handle is reused 
+  // for as long as the statement runs.
+  ndvss_blob_reader* reader = (ndvss_blob_reader*)sqlite3_get_auxdata(context, 1);
+  if( reader != 0 && ( reader->k != k || strcmp(reader->column_name, column) != 0 ) ) {
+    reader = 0;
+  }
+  if( reader == 0 ) {
+    reader = ndvss_blob_reader_new(table, column, k);
+    if( reader == 0 ) {
+      sqlite3_result_error(context, "Out of memory.", -1);
+      return;
+    }
+    sqlite3_set_auxdata(context, 1, reader, ndvss_blob_reader_free);
+    reader = (ndvss_blob_reader*)sqlite3_get_auxdata(context, 1);
+    if( reader == 0 ) {
+      sqlite3_result_error(context, "Out of memory.", -1);
+      return;
+    }
+  }
+  // The memo and the top-k belong to one searched array. When the array changes from 
+  // row to row (e.g. in a join over several queries) both start over.
+  const unsigned char* searched_array = (const unsigned char*)sqlite3_value_blob(argv[0]);
+  int arg1_size_bytes = sqlite3_value_bytes(argv[0]);
+  if( reader->query == 0 || reader->query_bytes != arg1_size_bytes ||
+      memcmp(reader->query, searched_array, arg1_size_bytes) != 0 ) {
+    unsigned char* query = (unsigned char*)sqlite3_realloc(reader->query, arg1_size_bytes > 0 ? arg1_size_bytes : 1);
+    if( query == 0 ) {
+      sqlite3_result_error_nomem(context);
+      return;
+    }
+    memcpy(query, searched_array, arg1_size_bytes);
+    reader->query = query;
+    reader->query_bytes = arg1_size_bytes;
+    reader->last_valid = 0;
+    reader->heap_count = 0;
+  }
+  if( reader->last_valid && reader->last_rowid == rowid ) {
+    if( reader->last_is_null ) {
+      sqlite3_result_null(context);
+    } else {
+      sqlite3_result_double(context, reader->last_distance);
+    }
+    return;
+  }
+
+  int rc = SQLITE_OK;
+  if( reader->blob != 0 ) {
+    rc = sqlite3_blob_reopen(reader->blob, rowid);
+    if( rc != SQLITE_OK ) {
+      // A failed reopen leaves the handle aborted.
+      sqlite3_blob_close(reader->blob);
+      reader->blob = 0;
+    }
+  } else {
+    rc = sqlite3_blob_open(sqlite3_context_db_handle(context), reader->db_name, 
+                           reader->table_name, reader->column_name, rowid, 0, &reader->blob);
+    if( rc != SQLITE_OK && reader->blob != 0 ) {
+      sqlite3_blob_close(reader->blob);
+      reader->blob = 0;
+    }
+  }
+  if( rc != SQLITE_OK ) {
+    if( rc == SQLITE_ERROR && ndvss_blob_column_is_null(sqlite3_context_db_handle(context), 
+                                                         reader, rowid) ) {
+      // Same as the scalar functions: a row without a vector has no distance.
+      reader->last_valid = 1;
+      reader->last_rowid = rowid;
+      reader->last_is_null = 1;
+      sqlite3_result_null(context);
+      return;
+    }
+    sqlite3_result_error(context, sqlite3_errmsg(sqlite3_context_db_handle(context)), -1);
+    return;
+  }
+
+  int blob_size_bytes = sqlite3_blob_bytes(reader->blob);
+  if( arg1_size_bytes != blob_size_bytes ) {
+    sqlite3_result_error(context, "The arrays are not the same length.", -1);
+    return;
+  }
+  if( reader->k > 0 && reader->heap_count == reader->k && reader->heap[0] < bound ) {
+    bound = reader->heap[0];
+  }
+
+  int vector_bytes = (blob_size_bytes / element_size) * element_size;
+  double similarity = 0.0;
+  int offset = 0;
+  while( offset < vector_bytes ) {
+    int n = vector_bytes - offset;
+    if( n > NDVSS_BLOB_READ_BLOCK_BYTES ) {
+      n = NDVSS_BLOB_READ_BLOCK_BYTES;
+    }
+    rc = sqlite3_blob_read(reader->blob, reader->block, n, offset);
+    if( rc != SQLITE_OK ) {
+      sqlite3_result_error_code(context, rc);
+      return;
+    }
+    if( element_size == sizeof(double) ) {
+      similarity += ndvss_euclidean_distance_squared_kernel_d((const double*)(searched_array + offset), 
+                                                              (const double*)reader->block, 
+                                                              n / (int)sizeof(double));
+    } else {
+      similarity += ndvss_euclidean_distance_squared_kernel_f((const float*)(searched_array + offset), 
+                                                              (const float*)reader->block, 
+                                                              n / (int)sizeof(float));
+    }
+    offset += n;
+    if( similarity > bound ) {
+      break;
+    }
+  }//endwhile reading blocks
+
+  reader->last_valid = 1;
+  reader->last_rowid = rowid;
+  if( similarity > bound ) {
+    reader->last_is_null = 1;
+    sqlite3_result_null(context);
+    return;
+  }
+  if( reader->k > 0 ) {
+    ndvss_blob_reader_push(reader, similarity);
+  }
+  reader->last_is_null = 0;
+  reader->last_distance = sqrt(similarity);
+  sqlite3_result_double(context, reader->last_distance);
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_euclidean_distance_similarity_blob_d
+// Desc: Calculates the euclidean distance similarity to an array of doubles stored in
+//       a table, reading the stored array progressively. See 
+//       ndvss_euclidean_distance_similarity_blob.
+// Args: Searched double array BLOB,
+//       Table name TEXT,
+//       Column name TEXT,
+//       Rowid INTEGER,
+//       Maximum distance DOUBLE (or NULL),
+//       Optionally the number of best results, k INTEGER
+// Returns: Similarity as a distance DOUBLE, or NULL if the row can't qualify.
+//----------------------------------------------------------------------------------------
+static void ndvss_euclidean_distance_similarity_blob_d( sqlite3_context* context,
+                                                        int argc,
+                                                        sqlite3_value** argv ) 
+{
+  ndvss_euclidean_distance_similarity_blob(context, argc, argv, sizeof(double));
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_euclidean_distance_similarity_blob_f
+// Desc: Calculates the euclidean distance similarity to an array of floats stored in
+//       a table, reading the stored array progressively. See 
+//       ndvss_euclidean_distance_similarity_blob.
+// Args: Searched float array BLOB,
+//       Table name TEXT,
+//       Column name TEXT,
+//       Rowid INTEGER,
+//       Maximum distance DOUBLE (or NULL),
+//       Optionally the number of best results, k INTEGER
+// Returns: Similarity as a distance DOUBLE, or NULL if the row can't qualify.
+//----------------------------------------------------------------------------------------
+static void ndvss_euclidean_distance_similarity_blob_f( sqlite3_context* context,
+                                                        int argc,
+                                                        sqlite3_value** argv ) 
+{
+  ndvss_euclidean_distance_similarity_blob(context, argc, argv, sizeof(float));
+}
+
+
+//----------------------------------------------------------------------------------------
+// CONFIGURATION AND STATISTICS.
+// Process-wide settings are changed with ndvss_config() and counters are read with
+// ndvss_stats().
+//----------------------------------------------------------------------------------------
+typedef struct ndvss_config_entry {
+  const char*   name;
+  double        value;
+  double        min_value;
+  double        max_value;
+  int           is_real;       // 0 = the value is an integer.
+} ndvss_config_entry;
+
+// The order of the enum must match the order of ndvss_config_entries.
+enum {
+  NDVSS_CONFIG_PREFETCH_DISTANCE = 0,
+  NDVSS_CONFIG_SCAN_NONTEMPORAL,
+  NDVSS_CONFIG_SCAN_THREADS,
+  NDVSS_CONFIG_NUMA,
+  NDVSS_CONFIG_HUGE_PAGES,
+  NDVSS_CONFIG_IO_URING,
+  NDVSS_CONFIG_DIRECT_IO,
+  NDVSS_CONFIG_IO_DEPTH,
+  NDVSS_CONFIG_VECTOR_CACHE,
+  NDVSS_CONFIG_SHARED_CACHE,
+  NDVSS_CONFIG_RESULT_CACHE_ENTRIES,
+  NDVSS_CONFIG_SEMANTIC_CACHE_EPSILON,
+  NDVSS_CONFIG_PQ_SUBQUANTIZERS,
+  NDVSS_CONFIG_PQ_RERANK,
+  NDVSS_CONFIG_DISKANN_SEARCH_LIST,
+  NDVSS_CONFIG_DISKANN_BEAM_WIDTH,
+  NDVSS_CONFIG_MERGE_THRESHOLD,
+  NDVSS_CONFIG_ESTIMATE_SAMPLE,
+  NDVSS_CONFIG_SEARCH_BUDGET_MS,
+  NDVSS_CONFIG_SEARCH_BUDGET_ROWS,
+  NDVSS_CONFIG_SEARCH_BUDGET_IVF,
+  NDVSS_CONFIG_MEMORY_LIMIT,
+  NDVSS_CONFIG_COUNT
+};
+
+static ndvss_config_entry ndvss_config_entries[NDVSS_CONFIG_COUNT] = {
+  { "prefetch_distance", 4, 0, 64, 0 }, // How many vectors ahead the scan prefetches, 0 = off.
+  { "scan_nontemporal",  0, 0, 1, 0 }, // 1 = prefetch with the non-temporal hint, so a scan 
+                                       // larger than the cache doesn't evict everything else.
+  { "scan_threads",      1, 0, 1024, 0 }, // Threads used by a scan, 0 = one per CPU.
+  { "numa",              1, 0, 1, 0 }, // 1 = spread the vector segments over the NUMA nodes
+                                       // and pin the scan threads to the node they read.
+  { "huge_pages",        1, 0, 1, 0 }, // 1 = back the vector segments with 2 MB pages.
+  { "io_uring",          1, 0, 1, 0 }, // 1 = read flat vector files with io_uring on Linux.
+  { "direct_io",         1, 0, 1, 0 }, // 1 = read flat vector files with O_DIRECT, bypassing
+                                       // the page cache.
+  { "io_depth",          8, 1, 256, 0 }, // Reads of a flat vector file kept in flight.
+  { "vector_cache",      1, 0, 1, 0 }, // 1 = copy the searched column to memory, 0 = stream
+                                       // it from the table on every search.
+  { "shared_cache",      1, 0, 1, 0 }, // 1 = share the copies of the columns of database 
+                                       // files between the connections of the process.
+  { "result_cache_entries", 256, 0, 1000000, 0 }, // Searches whose results are remembered per
+                                       // connection, 0 = off.
+  { "semantic_cache_epsilon", 0, 0, 2, 1 }, // Largest cosine distance between two searched 
+                                       // vectors for which the cached candidates of one are
+                                       // reranked for the other, 0 = off.
+  { "pq_subquantizers",  0, 0, 4096, 0 }, // Sub-vectors of the PQ codes, 0 = one per 2 dimensions.
+  { "pq_rerank",        16, 0, 1000, 0 }, // The PQ search reranks k * pq_rerank candidates with
+                                       // the exact vectors, 0 = return approximate distances.
+  { "diskann_search_list", 64, 1, 100000, 0 }, // Candidate list of a DiskANN search (at least k).
+  { "diskann_beam_width", 4, 1, 64, 0 }, // Nodes of a DiskANN index read together per hop.
+  { "merge_threshold", 10000, 0, 1000000000, 0 }, // Vectors without 'pq' codes after which an
+                                       // ndvss_index table is merged in the background, 0 = off.
+  { "estimate_sample", 1000, 16, 1000000, 0 }, // Vectors sampled from a column to estimate how
+                                       // many rows pass a similarity threshold.
+  { "search_budget_ms", 0, 0, 1e7, 1 }, // Milliseconds after which an exact scan returns
+                                       // the best rows found so far, 0 = no limit.
+  { "search_budget_rows", 0, 0, 1e15, 0 }, // Vectors after which an exact scan returns the
+                                       // best rows found so far, 0 = no limit.
+  { "search_budget_ivf", 1, 0, 1, 0 }, // 1 = with a budget, scan the cached vectors from 
+                                       // the nearest k-means centroid outwards.
+  { "memory_limit",      0, 0, 1e15, 0 }, // Bytes of cached columns and results kept by the
+                                       // process, 0 = no limit. The least recently used
+                                       // columns are dropped first.
+};
+
+#define NDVSS_CONFIG(id) (ndvss_config_entries[(id)].value)
+
+// The counters are updated from several threads, so they are only changed with these.
+#define NDVSS_STAT_ADD(field, value) __atomic_fetch_add(&ndvss_stats_global.field, (sqlite3_int64)(value), __ATOMIC_RELAXED)
+#define NDVSS_STAT_SET(field, value) __atomic_store_n(&ndvss_stats_global.field, (sqlite3_int64)(value), __ATOMIC_RELAXED)
+#define NDVSS_STAT_GET(field)        __atomic_load_n(&ndvss_stats_global.field, __ATOMIC_RELAXED)
+
+typedef struct ndvss_statistics {
+  sqlite3_int64 scans;                 // Number of in-memory scans.
+  sqlite3_int64 scan_rows;             // Vectors scored by the scans.
+  sqlite3_int64 scan_bytes;            // Vector bytes read by the scans.
+  sqlite3_int64 scan_nanoseconds;      // Time spent in the scans.
+  sqlite3_int64 last_scan_rows;
+  sqlite3_int64 last_scan_bytes;
+  sqlite3_int64 last_scan_nanoseconds;
+  sqlite3_int64 last_scan_threads;
+  sqlite3_int64 cache_loads;           // Times a vector set was (re)loaded from its table.
+  sqlite3_int64 shared_cache_hits;     // Times a connection took a set loaded by another.
+  sqlite3_int64 shared_sets;           // Shared vector sets in memory now.
+  sqlite3_int64 huge_page_bytes;       // Vector memory in explicit 2 MB pages (MAP_HUGETLB).
+  sqlite3_int64 transparent_huge_page_bytes; // Vector memory advised to use transparent huge pages.
+  sqlite3_int64 heap_bytes;            // Vector memory from sqlite3_malloc.
+  sqlite3_int64 file_scans;            // Number of flat vector file scans.
+  sqlite3_int64 file_scan_bytes;       // Vector bytes read from flat vector files.
+  sqlite3_int64 file_scan_nanoseconds; // Time spent in the file scans.
+  sqlite3_int64 last_file_scan_io_uring;  // 1 if the last file scan used io_uring.
+  sqlite3_int64 last_file_scan_direct_io; // 1 if the last file scan used O_DIRECT.
+  sqlite3_int64 pipeline_scans;        // Number of streaming scans.
+  sqlite3_int64 pipeline_rows;         // Vectors scored by the streaming scans.
+  sqlite3_int64 pipeline_nanoseconds;  // Time spent in the streaming scans.
+  sqlite3_int64 pipeline_producer_waits; // Times the reading thread found the ring full.
+  sqlite3_int64 pipeline_consumer_waits; // Times a scoring thread found the ring empty.
+  sqlite3_int64 last_pipeline_threads;
+  sqlite3_int64 result_cache_hits;     // Searches answered from the result cache.
+  sqlite3_int64 result_cache_misses;
+  sqlite3_int64 result_cache_evictions;     // Entries dropped to stay under the limit.
+  sqlite3_int64 result_cache_invalidations; // Entries dropped because the data changed.
+  sqlite3_int64 result_cache_entries;  // Entries in the result caches now.
+  sqlite3_int64 result_cache_bytes;    // Memory used by the result caches.
+  sqlite3_int64 semantic_cache_hits;   // Searches answered by reranking a close search.
+  sqlite3_int64 semantic_cache_misses;
+  sqlite3_int64 semantic_cache_stale;  // Close searches dropped because the data changed.
+  sqlite3_int64 pq_builds;             // Times the PQ codes of a vector set were built.
+  sqlite3_int64 pq_build_nanoseconds;
+  sqlite3_int64 pq_scans;
+  sqlite3_int64 pq_scan_vectors;       // Codes scanned by the PQ searches.
+  sqlite3_int64 pq_scan_nanoseconds;
+  sqlite3_int64 pq_code_bytes;         // Memory used by the PQ codes.
+  sqlite3_int64 diskann_builds;
+  sqlite3_int64 diskann_build_nanoseconds;
+  sqlite3_int64 diskann_searches;
+  sqlite3_int64 diskann_hops;          // Rounds of batched node reads.
+  sqlite3_int64 diskann_reads;         // Nodes read from DiskANN index files.
+  sqlite3_int64 diskann_search_nanoseconds;
+  sqlite3_int64 diskann_code_bytes;    // Memory used by the PQ sections of open index files.
+  sqlite3_int64 index_exports;
+  sqlite3_int64 index_attaches;        // Times an index file was mapped.
+  sqlite3_int64 index_attach_nanoseconds;
+  sqlite3_int64 index_mapped_bytes;    // Size of the index files mapped now.
+  sqlite3_int64 shm_publishes;
+  sqlite3_int64 live_commits;          // Transactions applied to ndvss_index tables in memory.
+  sqlite3_int64 live_reloads;
+  sqlite3_int64 live_compactions;
+  sqlite3_int64 live_fallbacks;        // Searches that read the table instead of the memory.
+  sqlite3_int64 live_merges;
+  sqlite3_int64 live_merged_vectors;   // Vectors moved from the delta to the 'pq' codes.
+  sqlite3_int64 score_samples;         // Columns sampled for the estimates.
+  sqlite3_int64 planner_estimates;     // k-NN plans whose row count came from a sample.
+  sqlite3_int64 partial_searches;      // Scans stopped by search_budget_ms or _rows.
+  sqlite3_int64 ivf_builds;            // Inverted lists built for budgeted scans.
+  sqlite3_int64 ivf_build_nanoseconds;
+  sqlite3_int64 interrupted_tasks;     // Searches and builds stopped by an interrupt.
+  sqlite3_int64 vector_cache_bytes;    // Memory of the cached columns, in memory_limit.
+  sqlite3_int64 memory_highwater;      // Most memory of the caches, see ndvss_memory().
+  sqlite3_int64 memory_evictions;      // Cached columns dropped to stay under memory_limit.
+  sqlite3_int64 memory_reloads;        // Columns loaded again after they were dropped.
+  sqlite3_int64 diskann_reranks;       // Candidates of 'int8' DiskANN nodes read from their table.
+  sqlite3_int64 multi_searches;        // Searches of ndvss_knn_multi_f/_d.
+  sqlite3_int64 multi_shards;          // Shards searched by them.
+} ndvss_statistics;
+
+static ndvss_statistics ndvss_stats_global;
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_now
+// Desc: Returns a monotonic time stamp in seconds.
+//----------------------------------------------------------------------------------------
+static double ndvss_now( void )
+{
+#ifdef _WIN32
+  LARGE_INTEGER frequency, counter;
+  QueryPerformanceFrequency(&frequency);
+  QueryPerformanceCounter(&counter);
+  return (double)counter.QuadPart / (double)frequency.QuadPart;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+#endif
+}
+
+
+static void ndvss_memory_enforce( void );
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_config
+// Desc: Reads or changes a process-wide setting of the extension.
+// Args: Name of the setting TEXT,
+//       Optionally the new value INTEGER or REAL
+// Returns: The value of the setting INTEGER or REAL
+//----------------------------------------------------------------------------------------
+static void ndvss_config( sqlite3_context* context,
+                          int argc,
+                          sqlite3_value** argv ) 
+{
+  if( argc < 1 || sqlite3_value_type(argv[0]) == SQLITE_NULL ) {
+    sqlite3_result_error(context, "The name of the setting needs to be given.", -1);
+    return;
+  }
+  const char* name = (const char*)sqlite3_value_text(argv[0]);
+  int i;
+  for( i = 0; i < NDVSS_CONFIG_COUNT; ++i ) {
+    if( sqlite3_stricmp(name, ndvss_config_entries[i].name) == 0 ) {
+      break;
+    }
+  }
+  if( i == NDVSS_CONFIG_COUNT ) {
+    sqlite3_result_error(context, "Unknown setting.", -1);
+    return;
+  }
+  ndvss_config_entry* entry = &ndvss_config_entries[i];
+  if( argc > 1 && sqlite3_value_type(argv[1]) != SQLITE_NULL ) {
+    double value = entry->is_real ? sqlite3_value_double(argv[1]) : (double)sqlite3_value_int64(argv[1]);
+    if( !(value >= entry->min_value && value <= entry->max_value) ) {
+      char* message = entry->is_real 
+        ? sqlite3_mprintf("The value of %s needs to be between %g and %g.", 
+                          entry->name, entry->min_value, entry->max_value)
+        : sqlite3_mprintf("The value of %s needs to be between %lld and %lld.", 
+                          entry->name, (sqlite3_int64)entry->min_value, (sqlite3_int64)entry->max_value);
+      sqlite3_result_error(context, message ? message : "Value out of range.", -1);
+      sqlite3_free(message);
+      return;
+    }
+    entry->value = value;
+    if( i == NDVSS_CONFIG_MEMORY_LIMIT ) {
+      ndvss_memory_enforce();
+    }
+  }
+  if( entry->is_real ) {
+    sqlite3_result_double(context, entry->value);
+  } else {
+    sqlite3_result_int64(context, (sqlite3_int64)entry->value);
+  }
+}
+
+
+static int ndvss_numa_node_count( void );
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_stats
+// Desc: Returns the counters of the extension.
+// Args: None.
+// Returns: The counters as a JSON object TEXT
+//----------------------------------------------------------------------------------------
+static void ndvss_stats( sqlite3_context* context,
+                         int argc,
+                         sqlite3_value** argv ) 
+{
+  sqlite3_int64 scan_bytes = NDVSS_STAT_GET(scan_bytes);
+  sqlite3_int64 scan_nanoseconds = NDVSS_STAT_GET(scan_nanoseconds);
+  sqlite3_int64 last_scan_bytes = NDVSS_STAT_GET(last_scan_bytes);
+  sqlite3_int64 last_scan_nanoseconds = NDVSS_STAT_GET(last_scan_nanoseconds);
+  double gbps = scan_nanoseconds > 0 ? (double)scan_bytes / (double)scan_nanoseconds : 0.0;
+  double last_gbps = last_scan_nanoseconds > 0 ? (double)last_scan_bytes / (double)last_scan_nanoseconds : 0.0;
+  sqlite3_int64 file_scan_bytes = NDVSS_STAT_GET(file_scan_bytes);
+  sqlite3_int64 file_scan_nanoseconds = NDVSS_STAT_GET(file_scan_nanoseconds);
+  double file_gbps = file_scan_nanoseconds > 0 ? (double)file_scan_bytes / (double)file_scan_nanoseconds : 0.0;
+  sqlite3_int64 hits = NDVSS_STAT_GET(result_cache_hits);
+  sqlite3_int64 misses = NDVSS_STAT_GET(result_cache_misses);
+  sqlite3_int64 pq_scan_vectors = NDVSS_STAT_GET(pq_scan_vectors);
+  sqlite3_int64 pq_scan_nanoseconds = NDVSS_STAT_GET(pq_scan_nanoseconds);
+  char* json = sqlite3_mprintf("{\"scans\":%lld,\"scan_rows\":%lld,\"scan_bytes\":%lld,"
+                               "\"scan_seconds\":%.6f,\"scan_gb_per_s\":%.3f,"
+                               "\"last_scan_rows\":%lld,\"last_scan_bytes\":%lld,"
+                               "\"last_scan_seconds\":%.6f,\"last_scan_gb_per_s\":%.3f,"
+                               "\"last_scan_threads\":%lld,\"cache_loads\":%lld,"
+                               "\"shared_cache_hits\":%lld,\"shared_sets\":%lld,"
+                               "\"numa_nodes\":%d,\"huge_page_bytes\":%lld,"
+                               "\"transparent_huge_page_bytes\":%lld,\"heap_bytes\":%lld,"
+                               "\"file_scans\":%lld,\"file_scan_bytes\":%lld,"
+                               "\"file_scan_seconds\":%.6f,\"file_scan_gb_per_s\":%.3f,"
+                               "\"last_file_scan_io_uring\":%lld,\"last_file_scan_direct_io\":%lld,"
+                               "\"pipeline_scans\":%lld,\"pipeline_rows\":%lld,\"pipeline_seconds\":%.6f,"
+                               "\"pipeline_producer_waits\":%lld,\"pipeline_consumer_waits\":%lld,"
+                               "\"last_pipeline_threads\":%lld,"
+                               "\"result_cache_hits\":%lld,\"result_cache_misses\":%lld,"
+                               "\"result_cache_hit_rate\":%.4f,\"result_cache_evictions\":%lld,"
+                               "\"result_cache_invalidations\":%lld,\"result_cache_entries\":%lld,"
+                               "\"result_cache_bytes\":%lld,\"semantic_cache_hits\":%lld,"
+                               "\"semantic_cache_misses\":%lld,\"semantic_cache_stale\":%lld,"
+                               "\"pq_builds\":%lld,\"pq_build_seconds\":%.6f,\"pq_scans\":%lld,"
+                               "\"pq_scan_vectors\":%lld,\"pq_scan_seconds\":%.6f,"
+                               "\"pq_vectors_per_s\":%.0f,\"pq_code_bytes\":%lld,"
+                               "\"diskann_builds\":%lld,\"diskann_build_seconds\":%.6f,"
+                               "\"diskann_searches\":%lld,\"diskann_hops\":%lld,\"diskann_reads\":%lld,"
+                               "\"diskann_search_seconds\":%.6f,\"diskann_code_bytes\":%lld,"
+                               "\"index_exports\":%lld,\"index_attaches\":%lld,"
+                               "\"index_attach_seconds\":%.6f,\"index_mapped_bytes\":%lld,"
+                               "\"shm_publishes\":%lld,\"live_commits\":%lld,\"live_reloads\":%lld,"
+                               "\"live_compactions\":%lld,\"live_fallbacks\":%lld,\"live_merges\":%lld,"
+                               "\"live_merged_vectors\":%lld,\"score_samples\":%lld,\"planner_estimates\":%lld,"
+                               "\"partial_searches\":%lld,\"ivf_builds\":%lld,\"ivf_build_seconds\":%.6f,"
+                               "\"interrupted_tasks\":%lld,\"vector_cache_bytes\":%lld,"
+                               "\"memory_evictions\":%lld,\"memory_reloads\":%lld,"
+                               "\"diskann_reranks\":%lld,\"multi_searches\":%lld,\"multi_shards\":%lld}",
+                               NDVSS_STAT_GET(scans), NDVSS_STAT_GET(scan_rows), scan_bytes,
+                               (double)scan_nanoseconds * 1e-9, gbps,
+                               NDVSS_STAT_GET(last_scan_rows), last_scan_bytes,
+                               (double)last_scan_nanoseconds * 1e-9, last_gbps,
+                               NDVSS_STAT_GET(last_scan_threads), NDVSS_STAT_GET(cache_loads),
+                               NDVSS_STAT_GET(shared_cache_hits), NDVSS_STAT_GET(shared_sets),
+                               ndvss_numa_node_count(), NDVSS_STAT_GET(huge_page_bytes),
+                               NDVSS_STAT_GET(transparent_huge_page_bytes), NDVSS_STAT_GET(heap_bytes),
+                               NDVSS_STAT_GET(file_scans), file_scan_bytes,
+                               (double)file_scan_nanoseconds * 1e-9, file_gbps,
+                               NDVSS_STAT_GET(last_file_scan_io_uring), NDVSS_STAT_GET(last_file_scan_direct_io),
+                               NDVSS_STAT_GET(pipeline_scans), NDVSS_STAT_GET(pipeline_rows),
+                               (double)NDVSS_STAT_GET(pipeline_nanoseconds) * 1e-9,
+                               NDVSS_STAT_GET(pipeline_producer_waits), NDVSS_STAT_GET(pipeline_consumer_waits),
+                               NDVSS_STAT_GET(last_pipeline_threads),
+                               hits, misses, hits + misses > 0 ? (double)hits / (double)(hits + misses) : 0.0,
+                               NDVSS_STAT_GET(result_cache_evictions), NDVSS_STAT_GET(result_cache_invalidations),
+                               NDVSS_STAT_GET(result_cache_entries), NDVSS_STAT_GET(result_cache_bytes),
+                               NDVSS_STAT_GET(semantic_cache_hits), NDVSS_STAT_GET(semantic_cache_misses),
+                               NDVSS_STAT_GET(semantic_cache_stale),
+                               NDVSS_STAT_GET(pq_builds), (double)NDVSS_STAT_GET(pq_build_nanoseconds) * 1e-9,
+                               NDVSS_STAT_GET(pq_scans), pq_scan_vectors, (double)pq_scan_nanoseconds * 1e-9,
+                               pq_scan_nanoseconds > 0 ? (double)pq_scan_vectors * 1e9 / (double)pq_scan_nanoseconds : 0.0,
+                               NDVSS_STAT_GET(pq_code_bytes),
+                               NDVSS_STAT_GET(diskann_builds), (double)NDVSS_STAT_GET(diskann_build_nanoseconds) * 1e-9,
+                               NDVSS_STAT_GET(diskann_searches), NDVSS_STAT_GET(diskann_hops), NDVSS_STAT_GET(diskann_reads),
+                               (double)NDVSS_STAT_GET(diskann_search_nanoseconds) * 1e-9, NDVSS_STAT_GET(diskann_code_bytes),
+                               NDVSS_STAT_GET(index_exports), NDVSS_STAT_GET(index_attaches),
+                               (double)NDVSS_STAT_GET(index_attach_nanoseconds) * 1e-9, NDVSS_STAT_GET(index_mapped_bytes),
+                               NDVSS_STAT_GET(shm_publishes), NDVSS_STAT_GET(live_commits),
+                               NDVSS_STAT_GET(live_reloads), NDVSS_STAT_GET(live_compactions),
+                               NDVSS_STAT_GET(live_fallbacks), NDVSS_STAT_GET(live_merges),
+                               NDVSS_STAT_GET(live_merged_vectors), NDVSS_STAT_GET(score_samples),
+                               NDVSS_STAT_GET(planner_estimates), NDVSS_STAT_GET(partial_searches),
+                               NDVSS_STAT_GET(ivf_builds), (double)NDVSS_STAT_GET(ivf_build_nanoseconds) * 1e-9,
+                               NDVSS_STAT_GET(interrupted_tasks), NDVSS_STAT_GET(vector_cache_bytes),
+                               NDVSS_STAT_GET(memory_evictions), NDVSS_STAT_GET(memory_reloads),
+                               NDVSS_STAT_GET(diskann_reranks), NDVSS_STAT_GET(multi_searches),
+                               NDVSS_STAT_GET(multi_shards));
+  if( json == 0 ) {
+    sqlite3_result_error_nomem(context);
+    return;
+  }
+  sqlite3_result_text(context, json, -1, sqlite3_free);
+}
+
+
+//----------------------------------------------------------------------------------------
+// PLATFORM.
+// Threads, locking, NUMA topology and the memory arena for the vector data.
+//----------------------------------------------------------------------------------------
+#define NDVSS_ALIGNMENT      64                // Vectors start on cache line boundaries.
+#define NDVSS_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define NDVSS_MAX_NUMA_NODES 64
+
+#ifdef _WIN32
+typedef HANDLE ndvss_thread;
+typedef LPTHREAD_START_ROUTINE ndvss_thread_proc;
+#define NDVSS_THREAD_PROC DWORD WINAPI
+#else
+typedef pthread_t ndvss_thread;
+typedef void* (*ndvss_thread_proc)( void* );
+#define NDVSS_THREAD_PROC void*
+#endif
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_thread_start
+// Desc: Starts a thread.
+// Returns: SQLITE_OK or SQLITE_ERROR.
+//----------------------------------------------------------------------------------------
+static int ndvss_thread_start( ndvss_thread* thread, ndvss_thread_proc proc, void* arg )
+{
+#ifdef _WIN32
+  *thread = CreateThread(0, 0, proc, arg, 0, 0);
+  return *thread != 0 ? SQLITE_OK : SQLITE_ERROR;
+#else
+  return pthread_create(thread, 0, proc, arg) == 0 ? SQLITE_OK : SQLITE_ERROR;
+#endif
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_thread_join
+// Desc: Waits for a thread to finish.
+//----------------------------------------------------------------------------------------
+static void ndvss_thread_join( ndvss_thread thread )
+{
+#ifdef _WIN32
+  WaitForSingleObject(thread, INFINITE);
+  CloseHandle(thread);
+#else
+  pthread_join(thread, 0);
+#endif
+}
+
+
+#ifdef _WIN32
+typedef SRWLOCK ndvss_mutex;
+#define NDVSS_MUTEX_INITIALIZER SRWLOCK_INIT
+#else
+typedef pthread_mutex_t ndvss_mutex;
+#define NDVSS_MUTEX_INITIALIZER PTHREAD_MUTEX_INITIALIZER
+#endif
+
+static ndvss_mutex ndvss_global_mutex = NDVSS_MUTEX_INITIALIZER;
+static ndvss_mutex ndvss_build_mutex = NDVSS_MUTEX_INITIALIZER;
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_mutex_lock / ndvss_mutex_trylock / ndvss_mutex_unlock
+// Desc: Locks and unlocks a mutex initialized with NDVSS_MUTEX_INITIALIZER. trylock 
+//       returns 1 if it got the mutex and 0 if it's held.
+//----------------------------------------------------------------------------------------
+static void ndvss_mutex_lock( ndvss_mutex* mutex )
+{
+#ifdef _WIN32
+  AcquireSRWLockExclusive(mutex);
+#else
+  pthread_mutex_lock(mutex);
+#endif
+}
+
+static int ndvss_mutex_trylock( ndvss_mutex* mutex )
+{
+#ifdef _WIN32
+  return TryAcquireSRWLockExclusive(mutex) != 0;
+#else
+  return pthread_mutex_trylock(mutex) == 0;
+#endif
+}
+
+static void ndvss_mutex_unlock( ndvss_mutex* mutex )
+{
+#ifdef _WIN32
+  ReleaseSRWLockExclusive(mutex);
+#else
+  pthread_mutex_unlock(mutex);
+#endif
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_global_lock / ndvss_global_unlock
+// Desc: Protects the process-wide state of the extension. Only held for short moments;
+//       ndvss_build_mutex serializes the slow lazy builds of shared data instead.
+//----------------------------------------------------------------------------------------
+static void ndvss_global_lock( void )
+{
+  ndvss_mutex_lock(&ndvss_global_mutex);
+}
+
+static void ndvss_global_unlock( void )
+{
+  ndvss_mutex_unlock(&ndvss_global_mutex);
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_thread_yield
+// Desc: Gives the rest of the time slice to other threads while spinning.
+//----------------------------------------------------------------------------------------
+static void ndvss_thread_yield( void )
+{
+#ifdef _WIN32
+  SwitchToThread();
+#else
+  sched_yield();
+#endif
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_cpu_count
+// Desc: Returns the number of online CPUs.
+//----------------------------------------------------------------------------------------
+static int ndvss_cpu_count( void )
+{
+#ifdef _WIN32
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return info.dwNumberOfProcessors > 0 ? (int)info.dwNumberOfProcessors : 1;
+#else
+  long count = sysconf(_SC_NPROCESSORS_ONLN);
+  return count > 0 ? (int)count : 1;
+#endif
+}
+
+
+typedef struct ndvss_numa_topology {
+  int       initialized;
+  int       node_count;                      // At least 1.
+#ifdef __linux__
+  int       node_ids[NDVSS_MAX_NUMA_NODES];  // Kernel node numbers, they can have gaps.
+  cpu_set_t cpus[NDVSS_MAX_NUMA_NODES];      // CPUs of each node.
+#endif
+} ndvss_numa_topology;
+
+static ndvss_numa_topology ndvss_numa;
+
+#ifdef __linux__
+//----------------------------------------------------------------------------------------
+// Name: ndvss_numa_parse_cpulist
+// Desc: Parses a list of CPUs like "0-3,8-11" from sysfs.
+//----------------------------------------------------------------------------------------
+static void ndvss_numa_parse_cpulist( const char* list, cpu_set_t* cpus )
+{
+  CPU_ZERO(cpus);
+  const char* p = list;
+  while( *p >= '0' && *p <= '9' ) {
+    char* end = 0;
+    long first = strtol(p, &end, 10);
+    long last = first;
+    if( *end == '-' ) {
+      last = strtol(end + 1, &end, 10);
+    }
+    for( ; first <= last && first < CPU_SETSIZE; ++first ) {
+      CPU_SET((int)first, cpus);
+    }
+    p = (*end == ',') ? end + 1 : end;
+  }
+}
+#endif
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_numa_node_count
+// Desc: Returns the number of NUMA nodes that have CPUs, reading the topology from sysfs
+//       on the first call. Other platforms than Linux are treated as one node.
+//----------------------------------------------------------------------------------------
+static int ndvss_numa_node_count( void )
+{
+  ndvss_global_lock();
+  if( !ndvss_numa.initialized ) {
+    ndvss_numa.initialized = 1;
+    ndvss_numa.node_count = 0;
+#ifdef __linux__
+    DIR* dir = opendir("/sys/devices/system/node");
+    struct dirent* entry;
+    while( dir != 0 && (entry = readdir(dir)) != 0 && ndvss_numa.node_count < NDVSS_MAX_NUMA_NODES ) {
+      if( strncmp(entry->d_name, "node", 4) != 0 || entry->d_name[4] < '0' || entry->d_name[4] > '9' ) {
+        continue;
+      }
+      char path[300];
+      char list[4096];
+      snprintf(path, sizeof(path), "/sys/devices/system/node/%s/cpulist", entry->d_name);
+      FILE* file = fopen(path, "r");
+      if( file == 0 ) {
+        continue;
+      }
+      size_t length = fread(list, 1, sizeof(list) - 1, file);
+      fclose(file);
+      list[length] = 0;
+      int n = ndvss_numa.node_count;
+      ndvss_numa_parse_cpulist(list, &ndvss_numa.cpus[n]);
+      if( CPU_COUNT(&ndvss_numa.cpus[n]) == 0 ) {
+        continue; // Memory-only node.
+      }
+      ndvss_numa.node_ids[n] = atoi(entry->d_name + 4);
+      ++ndvss_numa.node_count;
+    }
+    if( dir != 0 ) {
+      closedir(dir);
+    }
+#endif
+    if( ndvss_numa.node_count < 1 ) {
+      ndvss_numa.node_count = 1;
+    }
+  }
+  int node_count = ndvss_numa.node_count;
+  ndvss_global_unlock();
+  return node_count;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_numa_pin_thread
+// Desc: Pins the calling thread to the CPUs of a node (index from 0 to node count - 1).
+//----------------------------------------------------------------------------------------
+static void ndvss_numa_pin_thread( int node )
+{
+#ifdef __linux__
+  if( node >= 0 && node < ndvss_numa.node_count && ndvss_numa.node_count > 1 ) {
+    sched_setaffinity(0, sizeof(cpu_set_t), &ndvss_numa.cpus[node]);
+  }
+#endif
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_numa_place
+// Desc: Asks the kernel to place untouched memory on a node. Done with the raw mbind 
+//       system call so that libnuma isn't needed. Failing is harmless.
+//----------------------------------------------------------------------------------------
+static void ndvss_numa_place( void* memory, size_t bytes, int node )
+{
+#if defined(__linux__) && defined(SYS_mbind)
+  if( node >= 0 && node < ndvss_numa.node_count && ndvss_numa.node_count > 1 ) {
+    unsigned long mask[1024 / (8 * sizeof(unsigned long))];
+    int id = ndvss_numa.node_ids[node];
+    if( id < 1024 ) {
+      memset(mask, 0, sizeof(mask));
+      mask[id / (8 * sizeof(unsigned long))] |= 1UL << (id % (8 * sizeof(unsigned long)));
+      syscall(SYS_mbind, memory, bytes, 1 /* MPOL_PREFERRED */, mask, sizeof(mask) * 8 + 1, 0);
+    }
+  }
+#endif
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_aligned_malloc
+// Desc: Allocates memory with sqlite3_malloc64, aligned to the given power of two.
+// Returns: The aligned pointer or 0 if out of memory.
+//----------------------------------------------------------------------------------------
+static void* ndvss_aligned_malloc( sqlite3_uint64 bytes, sqlite3_uint64 alignment )
+{
+  unsigned char* raw = (unsigned char*)sqlite3_malloc64(bytes + alignment + sizeof(void*));
+  if( raw == 0 ) {
+    return 0;
+  }
+  sqlite3_uint64 address = (sqlite3_uint64)(size_t)(raw + sizeof(void*));
+  address = (address + alignment - 1) & ~(alignment - 1);
+  unsigned char* aligned = (unsigned char*)(size_t)address;
+  ((void**)aligned)[-1] = raw;
+  return aligned;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_aligned_free
+// Desc: Frees memory allocated with ndvss_aligned_malloc.
+//----------------------------------------------------------------------------------------
+static void ndvss_aligned_free( void* p )
+{
+  if( p != 0 ) {
+    sqlite3_free(((void**)p)[-1]);
+  }
+}
+
+
+enum {
+  NDVSS_ARENA_HEAP = 0,  // ndvss_aligned_malloc.
+  NDVSS_ARENA_MMAP,      // Anonymous mapping.
+  NDVSS_ARENA_THP,       // Anonymous mapping, advised to use transparent huge pages.
+  NDVSS_ARENA_HUGETLB,   // Anonymous mapping of explicit 2 MB pages.
+  NDVSS_ARENA_FILE       // Part of a mapped index file, unmapped with the file.
+};
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_arena_alloc
+// Desc: Allocates memory for vector data. On Linux big blocks are mapped with 2 MB pages
+//       (MAP_HUGETLB, or madvise(MADV_HUGEPAGE) when no huge pages are reserved) to cut 
+//       TLB misses, and placed on the given NUMA node. Elsewhere, and for small blocks,
+//       the memory comes from sqlite3_malloc.
+// Args: Size in bytes, NUMA node (-1 for any), where the kind of memory is stored.
+// Returns: Memory aligned to at least NDVSS_ALIGNMENT bytes, or 0 if out of memory.
+//----------------------------------------------------------------------------------------
+static void* ndvss_arena_alloc( size_t bytes, int node, int* kind )
+{
+#ifdef __linux__
+  if( bytes >= NDVSS_HUGE_PAGE_SIZE ) {
+    size_t rounded = (bytes + NDVSS_HUGE_PAGE_SIZE - 1) & ~((size_t)NDVSS_HUGE_PAGE_SIZE - 1);
+    void* p = MAP_FAILED;
+    if( NDVSS_CONFIG(NDVSS_CONFIG_HUGE_PAGES) ) {
+      p = mmap(0, rounded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+      if( p != MAP_FAILED ) {
+        *kind = NDVSS_ARENA_HUGETLB;
+        NDVSS_STAT_ADD(huge_page_bytes, rounded);
+      }
+    }
+    if( p == MAP_FAILED ) {
+      p = mmap(0, rounded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if( p != MAP_FAILED ) {
+        *kind = NDVSS_ARENA_MMAP;
+        #ifdef MADV_HUGEPAGE
+        if( NDVSS_CONFIG(NDVSS_CONFIG_HUGE_PAGES) && madvise(p, rounded, MADV_HUGEPAGE) == 0 ) {
+          *kind = NDVSS_ARENA_THP;
+          NDVSS_STAT_ADD(transparent_huge_page_bytes, rounded);
+        }
+        #endif
+      }
+    }
+    if( p != MAP_FAILED ) {
+      // Nothing has been touched yet, so the pages still follow the placement.
+      ndvss_numa_place(p, rounded, node);
+      return p;
+    }
+  }
+#endif
+  void* p = ndvss_aligned_malloc(bytes, NDVSS_ALIGNMENT);
+  if( p != 0 ) {
+    *kind = NDVSS_ARENA_HEAP;
+    NDVSS_STAT_ADD(heap_bytes, bytes);
+  }
+  return p;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_arena_free
+// Desc: Frees memory from ndvss_arena_alloc.
+//----------------------------------------------------------------------------------------
+static void ndvss_arena_free( void* p, size_t bytes, int kind )
+{
+  if( p == 0 || kind == NDVSS_ARENA_FILE ) {
+    return;
+  }
+  if( kind == NDVSS_ARENA_HEAP ) {
+    NDVSS_STAT_ADD(heap_bytes, -(sqlite3_int64)bytes);
+    ndvss_aligned_free(p);
+    return;
+  }
+#ifdef __linux__
+  size_t rounded = (bytes + NDVSS_HUGE_PAGE_SIZE - 1) & ~((size_t)NDVSS_HUGE_PAGE_SIZE - 1);
+  if( kind == NDVSS_ARENA_HUGETLB ) {
+    NDVSS_STAT_ADD(huge_page_bytes, -(sqlite3_int64)rounded);
+  } else if( kind == NDVSS_ARENA_THP ) {
+    NDVSS_STAT_ADD(transparent_huge_page_bytes, -(sqlite3_int64)rounded);
+  }
+  munmap(p, rounded);
+#endif
+}
+
+
+#ifndef _WIN32
+//----------------------------------------------------------------------------------------
+// Name: ndvss_map_fd
+// Desc: Maps the whole file of a descriptor, shared with the other processes that map it.
+// Args: Descriptor, 1 to map it for writing, where the size of the mapping is stored.
+// Returns: The page aligned mapping, or 0 if the file is empty or can't be mapped.
+//----------------------------------------------------------------------------------------
+static void* ndvss_map_fd( int fd, int writable, sqlite3_int64* bytes )
+{
+  struct stat st;
+  if( fstat(fd, &st) != 0 || st.st_size <= 0 ) {
+    return 0;
+  }
+  void* p = mmap(0, (size_t)st.st_size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+  if( p == MAP_FAILED ) {
+    return 0;
+  }
+  *bytes = (sqlite3_int64)st.st_size;
+  return p;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_shm_open / ndvss_shm_unlink
+// Desc: Opens or removes a named POSIX shared memory object. On Linux the objects are 
+//       the files of /dev/shm, which is what shm_open uses, so librt isn't needed.
+// Args: Name without the leading slash, open flags and mode.
+// Returns: The descriptor or -1 / 0 on success or -1.
+//----------------------------------------------------------------------------------------
+static int ndvss_shm_open( const char* name, int flags, int mode )
+{
+  char path[300];
+#ifdef __linux__
+  snprintf(path, sizeof(path), "/dev/shm/%s", name);
+  return open(path, flags | O_CLOEXEC, mode);
+#else
+  snprintf(path, sizeof(path), "/%s", name);
+  return shm_open(path, flags, mode);
+#endif
+}
+
+static int ndvss_shm_unlink( const char* name )
+{
+  char path[300];
+#ifdef __linux__
+  snprintf(path, sizeof(path), "/dev/shm/%s", name);
+  return unlink(path);
+#else
+  snprintf(path, sizeof(path), "/%s", name);
+  return shm_unlink(path);
+#endif
+}
+#endif
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_map_file
+// Desc: Maps a whole file read-only to memory. The pages are read from the page cache
+//       when they are first touched, so nothing is read here.
+// Args: Path, where the size of the mapping is stored.
+// Returns: The page aligned mapping, or 0 if the file can't be opened or mapped.
+//----------------------------------------------------------------------------------------
+static void* ndvss_map_file( const char* path, sqlite3_int64* bytes )
+{
+  void* p = 0;
+#ifdef _WIN32
+  HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, 0, OPEN_EXISTING, 
+                            FILE_ATTRIBUTE_NORMAL, 0);
+  if( file == INVALID_HANDLE_VALUE ) {
+    return 0;
+  }
+  LARGE_INTEGER size;
+  if( GetFileSizeEx(file, &size) && size.QuadPart > 0 ) {
+    HANDLE mapping = CreateFileMappingA(file, 0, PAGE_READONLY, 0, 0, 0);
+    if( mapping != 0 ) {
+      p = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+      // The view keeps the mapping alive.
+      CloseHandle(mapping);
+      *bytes = (sqlite3_int64)size.QuadPart;
+    }
+  }
+  CloseHandle(file);
+#else
+  int fd = open(path, O_RDONLY);
+  if( fd < 0 ) {
+    return 0;
+  }
+  p = ndvss_map_fd(fd, 0, bytes);
+  close(fd);
+#endif
+  return p;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_unmap_file
+// Desc: Unmaps a file mapped with ndvss_map_file.
+//----------------------------------------------------------------------------------------
+static void ndvss_unmap_file( void* p, sqlite3_int64 bytes )
+{
+  if( p == 0 ) {
+    return;
+  }
+#ifdef _WIN32
+  UnmapViewOfFile(p);
+#else
+  munmap(p, (size_t)bytes);
+#endif
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_file_identity
+// Desc: Reads the size and modification time of a file. The time is read with the 
+//       resolution of the file system (nanoseconds, or 100 ns on Windows), since two 
+//       writes of the same size within a second are common.
+// Returns: 1 on success, 0 if the file can't be found.
+//----------------------------------------------------------------------------------------
+static int ndvss_file_identity( const char* path, sqlite3_int64* size, sqlite3_int64* mtime )
+{
+#ifdef _WIN32
+  WIN32_FILE_ATTRIBUTE_DATA data;
+  if( !GetFileAttributesExA(path, GetFileExInfoStandard, &data) ) {
+    return 0;
+  }
+  *size = ((sqlite3_int64)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+  *mtime = ((sqlite3_int64)data.ftLastWriteTime.dwHighDateTime << 32) | data.ftLastWriteTime.dwLowDateTime;
+#else
+  struct stat st;
+  if( stat(path, &st) != 0 ) {
+    return 0;
+  }
+  *size = (sqlite3_int64)st.st_size;
+#if defined(__APPLE__)
+  *mtime = (sqlite3_int64)st.st_mtimespec.tv_sec * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+  *mtime = (sqlite3_int64)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+#endif
+  return 1;
+}
+
+
+//----------------------------------------------------------------------------------------
+// CANCELLATION AND PROGRESS.
+// The statements that run long loops inside the extension (searches, k-means, graph
+// builds) register a task for the time they run. The loops check the task between
+// blocks of work, so that sqlite3_interrupt() or ndvss_cancel() stops them and their
+// worker threads, and count the work done, which ndvss_progress() reports.
+//----------------------------------------------------------------------------------------
+#define NDVSS_TASK_TARGET_BYTES 128
+
+typedef struct ndvss_task ndvss_task;
+struct ndvss_task {
+  sqlite3_int64   id;
+  sqlite3*        db;                               // Checked for sqlite3_interrupt(), 0 = none.
+  const char*     operation;                        // Static name, e.g. "knn".
+  const char*     phase;                            // Static name of the current loop, e.g. "scan".
+  char            target[NDVSS_TASK_TARGET_BYTES];  // Table or file, truncated.
+  sqlite3_int64   done;                             // Work of the phase done so far.
+  sqlite3_int64   total;                            // Work of the phase, 0 = unknown.
+  double          start;
+  int             interrupted;                      // Set once, then every check fails.
+  int             scan_threads;                     // Threads a scan of the task may use, 0 = scan_threads.
+  ndvss_task*     outer;                            // Task of the thread this one is nested in.
+  ndvss_task*     previous;
+  ndvss_task*     next;
+};
+
+static ndvss_mutex ndvss_task_mutex = NDVSS_MUTEX_INITIALIZER;
+static ndvss_task* ndvss_tasks = 0;                 // Running tasks, protected by ndvss_task_mutex.
+static sqlite3_int64 ndvss_task_next_id = 0;
+static __thread ndvss_task* ndvss_task_of_thread = 0;
+static int ndvss_interrupt_check = 0;               // 1 if the SQLite library has sqlite3_is_interrupted.
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_task_begin
+// Desc: Registers the task of a statement and makes it the task of the calling thread,
+//       which the loops it calls find with ndvss_task_current.
+// Args: Task (usually on the stack), connection, static name of the operation, table
+//       or file it works on (0 if none).
+//----------------------------------------------------------------------------------------
+static void ndvss_task_begin( ndvss_task* task, sqlite3* db, const char* operation, const char* target )
+{
+  memset(task, 0, sizeof(ndvss_task));
+  task->db = db;
+  task->operation = operation;
+  task->phase = operation;
+  task->start = ndvss_now();
+  if( target != 0 ) {
+    sqlite3_snprintf(NDVSS_TASK_TARGET_BYTES, task->target, "%s", target);
+  }
+  task->outer = ndvss_task_of_thread;
+  ndvss_task_of_thread = task;
+  ndvss_mutex_lock(&ndvss_task_mutex);
+  task->id = ++ndvss_task_next_id;
+  task->next = ndvss_tasks;
+  if( ndvss_tasks != 0 ) {
+    ndvss_tasks->previous = task;
+  }
+  ndvss_tasks = task;
+  ndvss_mutex_unlock(&ndvss_task_mutex);
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_task_end
+// Desc: Unregisters a task and restores the task of the calling thread.
+//----------------------------------------------------------------------------------------
+static void ndvss_task_end( ndvss_task* task )
+{
+  ndvss_mutex_lock(&ndvss_task_mutex);
+  if( task->previous != 0 ) {
+    task->previous->next = task->next;
+  } else {
+    ndvss_tasks = task->next;
+  }
+  if( task->next != 0 ) {
+    task->next->previous = task->previous;
+  }
+  ndvss_mutex_unlock(&ndvss_task_mutex);
+  ndvss_task_of_thread = task->outer;
+  if( task->interrupted ) {
+    NDVSS_STAT_ADD(interrupted_tasks, 1);
+  }
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_task_current
+// Returns: The task of the calling thread, 0 if none. Worker threads get the task from
+//          the thread that started them.
+//----------------------------------------------------------------------------------------
+static ndvss_task* ndvss_task_current( void )
+{
+  return ndvss_task_of_thread;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_task_phase
+// Desc: Starts the next loop of a task: its progress starts from 0 of total.
+//----------------------------------------------------------------------------------------
+static void ndvss_task_phase( ndvss_task* task, const char* phase, sqlite3_int64 total )
+{
+  if( task == 0 ) {
+    return;
+  }
+  __atomic_store_n(&task->phase, phase, __ATOMIC_RELAXED);
+  __atomic_store_n(&task->total, total, __ATOMIC_RELAXED);
+  __atomic_store_n(&task->done, 0, __ATOMIC_RELAXED);
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_task_interrupted
+// Desc: Checks whether a task was interrupted with sqlite3_interrupt() on its connection
+//       or with ndvss_cancel(). Can be called from any thread of the task.
+// Returns: 1 if the task needs to stop.
+//----------------------------------------------------------------------------------------
+static int ndvss_task_interrupted( ndvss_task* task )
+{
+  if( task == 0 ) {
+    return 0;
+  }
+  if( __atomic_load_n(&task->interrupted, __ATOMIC_RELAXED) ) {
+    return 1;
+  }
+#if SQLITE_VERSION_NUMBER >= 3041000
+  if( ndvss_interrupt_check && task->db != 0 && sqlite3_is_interrupted(task->db) ) {
+    __atomic_store_n(&task->interrupted, 1, __ATOMIC_RELAXED);
+    return 1;
+  }
+#endif
+  return 0;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_task_advance
+// Desc: Counts work done in the current phase of a task and checks it for interrupts.
+//       Called between blocks of work, not for every vector.
+// Returns: 1 if the task needs to stop.
+//----------------------------------------------------------------------------------------
+static int ndvss_task_advance( ndvss_task* task, sqlite3_int64 done )
+{
+  if( task == 0 ) {
+    return 0;
+  }
+  __atomic_fetch_add(&task->done, done, __ATOMIC_RELAXED);
+  return ndvss_task_interrupted(task);
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_json_escape
+// Desc: Copies a string in to a buffer of at least 2 * strlen + 1 bytes, escaped for a
+//       JSON string.
+//----------------------------------------------------------------------------------------
+static void ndvss_json_escape( char* target, const char* source )
+{
+  for( ; *source != 0; ++source ) {
+    if( *source == '"' || *source == '\\' ) {
+      *target++ = '\\';
+      *target++ = *source;
+    } else {
+      *target++ = (unsigned char)*source < 0x20 ? ' ' : *source;
+    }
+  }
+  *target = 0;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_progress
+// Desc: Lists the tasks running in the process, for example to find a slow search from
+//       another connection.
+// Args: None.
+// Returns: JSON array TEXT of {"id", "operation", "target", "phase", "done", "total",
+//          "fraction", "seconds", "interrupted"}, the newest first. fraction is null
+//          while the total of the phase is unknown.
+//----------------------------------------------------------------------------------------
+static void ndvss_progress( sqlite3_context* context,
+                            int argc,
+                            sqlite3_value** argv )
+{
+  char target[2 * NDVSS_TASK_TARGET_BYTES];
+  double now = ndvss_now();
+  char* json = sqlite3_mprintf("[");
+  ndvss_mutex_lock(&ndvss_task_mutex);
+  ndvss_task* task;
+  for( task = ndvss_tasks; task != 0 && json != 0; task = task->next ) {
+    sqlite3_int64 done = __atomic_load_n(&task->done, __ATOMIC_RELAXED);
+    sqlite3_int64 total = __atomic_load_n(&task->total, __ATOMIC_RELAXED);
+    char fraction[32];
+    if( total > 0 ) {
+      sqlite3_snprintf(sizeof(fraction), fraction, "%.4f", done < total ? (double)done / (double)total : 1.0);
+    } else {
+      sqlite3_snprintf(sizeof(fraction), fraction, "null");
+    }
+    ndvss_json_escape(target, task->target);
+    json = sqlite3_mprintf("%z%s{\"id\":%lld,\"operation\":\"%s\",\"target\":\"%s\",\"phase\":\"%s\","
+                           "\"done\":%lld,\"total\":%lld,\"fraction\":%s,\"seconds\":%.3f,\"interrupted\":%d}",
+                           json, task == ndvss_tasks ? "" : ",", task->id, task->operation, target,
+                           __atomic_load_n(&task->phase, __ATOMIC_RELAXED), done, total, fraction,
+                           now - task->start, __atomic_load_n(&task->interrupted, __ATOMIC_RELAXED));
+  }
+  ndvss_mutex_unlock(&ndvss_task_mutex);
+  json = json != 0 ? sqlite3_mprintf("%z]", json) : 0;
+  if( json == 0 ) {
+    sqlite3_result_error_nomem(context);
+    return;
+  }
+  sqlite3_result_text(context, json, -1, sqlite3_free);
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_cancel
+// Desc: Stops a running task, like sqlite3_interrupt() does for its connection, but
+//       from any connection of the process. The statement of the task fails with
+//       SQLITE_INTERRUPT at the next block of work.
+// Args: Id of the task from ndvss_progress() INTEGER
+// Returns: 1 if the task was found, 0 if it had already finished INTEGER
+//----------------------------------------------------------------------------------------
+static void ndvss_cancel( sqlite3_context* context,
+                          int argc,
+                          sqlite3_value** argv )
+{
+  if( argc < 1 || sqlite3_value_type(argv[0]) == SQLITE_NULL ) {
+    sqlite3_result_error(context, "The id of the task needs to be given.", -1);
+    return;
+  }
+  sqlite3_int64 id = sqlite3_value_int64(argv[0]);
+  int found = 0;
+  ndvss_mutex_lock(&ndvss_task_mutex);
+  ndvss_task* task;
+  for( task = ndvss_tasks; task != 0; task = task->next ) {
+    if( task->id == id ) {
+      __atomic_store_n(&task->interrupted, 1, __ATOMIC_RELAXED);
+      found = 1;
+      break;
+    }
+  }
+  ndvss_mutex_unlock(&ndvss_task_mutex);
+  sqlite3_result_int(context, found);
+}
+
+
+//----------------------------------------------------------------------------------------
+// TOP-K.
+// Keeps the k best (smallest) distances and their rowids in a max-heap. Metrics where
+// a bigger value is better (cosine, dot product) are stored negated.
+//----------------------------------------------------------------------------------------
+typedef struct ndvss_topk {
+  int            k;
+  int            count;
+  double*        distances;
+  sqlite3_int64* rowids;
+  int            partial;      // 1 if a search budget stopped the search early.
+} ndvss_topk;
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_topk_init
+// Desc: Allocates room for k results.
+// Returns: SQLITE_OK or SQLITE_NOMEM.
+//----------------------------------------------------------------------------------------
+static int ndvss_topk_init( ndvss_topk* topk, int k )
+{
+  topk->k = k;
+  topk->count = 0;
+  topk->partial = 0;
+  topk->distances = (double*)sqlite3_malloc64(sizeof(double) * (sqlite3_uint64)(k > 0 ? k : 1));
+  topk->rowids = (sqlite3_int64*)sqlite3_malloc64(sizeof(sqlite3_int64) * (sqlite3_uint64)(k > 0 ? k : 1));
+  if( topk->distances == 0 || topk->rowids == 0 ) {
+    sqlite3_free(topk->distances);
+    sqlite3_free(topk->rowids);
+    topk->distances = 0;
+    topk->rowids = 0;
+    return SQLITE_NOMEM;
+  }
+  return SQLITE_OK;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_topk_fit
+// Desc: Lowers the room of an empty top-k to the number of rows that are searched, so 
+//       that a k bigger than the table doesn't keep (or hand to the scan threads) room
+//       for results that can't exist.
+// Returns: SQLITE_OK or SQLITE_NOMEM.
+//----------------------------------------------------------------------------------------
+static int ndvss_topk_fit( ndvss_topk* topk, sqlite3_int64 rows )
+{
+  if( topk->count > 0 || rows >= topk->k ) {
+    return SQLITE_OK;
+  }
+  int k = rows > 0 ? (int)rows : 1;
+  sqlite3_free(topk->distances);
+  sqlite3_free(topk->rowids);
+  int partial = topk->partial;
+  int rc = ndvss_topk_init(topk, k);
+  topk->partial = partial;
+  return rc;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_topk_free
+// Desc: Frees the arrays of the top-k.
+//----------------------------------------------------------------------------------------
+static void ndvss_topk_free( ndvss_topk* topk )
+{
+  sqlite3_free(topk->distances);
+  sqlite3_free(topk->rowids);
+  topk->distances = 0;
+  topk->rowids = 0;
+  topk->count = 0;
+  topk->partial = 0;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_topk_bound
+// Desc: Returns the distance a result needs to beat to get in to the top-k.
+//----------------------------------------------------------------------------------------
+static inline double ndvss_topk_bound( const ndvss_topk* topk )
+{
+  return topk->count < topk->k ? HUGE_VAL : topk->distances[0];
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_topk_push
+// Desc: Offers a result to the top-k.
+//----------------------------------------------------------------------------------------
+static void ndvss_topk_push( ndvss_topk* topk, double distance, sqlite3_int64 rowid )
+{
+  double* d = topk->distances;
+  sqlite3_int64* r = topk->rowids;
+  int i;
+  if( topk->k <= 0 ) {
+    return;
+  }
+  if( topk->count < topk->k ) {
+    // Sift up.
+    i = topk->count++;
+    while( i > 0 && d[(i - 1) / 2] < distance ) {
+      d[i] = d[(i - 1) / 2];
+      r[i] = r[(i - 1) / 2];
+      i = (i - 1) / 2;
+    }
+    d[i] = distance;
+    r[i] = rowid;
+    return;
+  }
+  if( distance >= d[0] ) {
+    return;
+  }
+  // Replace the worst and sift down.
+  i = 0;
+  for( ;; ) {
+    int child = 2 * i + 1;
+    if( child >= topk->count ) {
+      break;
+    }
+    if( child + 1 < topk->count && d[child + 1] > d[child] ) {
+      ++child;
+    }
+    if( d[child] <= distance ) {
+      break;
+    }
+    d[i] = d[child];
+    r[i] = r[child];
+    i = child;
+  }
+  d[i] = distance;
+  r[i] = rowid;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_topk_sort
+// Desc: Turns the heap into a list sorted from the best to the worst result.
+//----------------------------------------------------------------------------------------
+static void ndvss_topk_sort( ndvss_topk* topk )
+{
+  int n = topk->count;
+  double* d = topk->distances;
+  sqlite3_int64* r = topk->rowids;
+  // Heap sort: move the worst to the end one by one.
+  while( n > 1 ) {
+    double last_d = d[n - 1];
+    sqlite3_int64 last_r = r[n - 1];
+    d[n - 1] = d[0];
+    r[n - 1] = r[0];
+    --n;
+    int i = 0;
+    for( ;; ) {
+      int child = 2 * i + 1;
+      if( child >= n ) {
+        break;
+      }
+      if( child + 1 < n && d[child + 1] > d[child] ) {
+        ++child;
+      }
+      if( d[child] <= last_d ) {
+        break;
+      }
+      d[i] = d[child];
+      r[i] = r[child];
+      i = child;
+    }
+    d[i] = last_d;
+    r[i] = last_r;
+  }
+}
+
+
+//----------------------------------------------------------------------------------------
+// METRICS.
+//----------------------------------------------------------------------------------------
+enum {
+  NDVSS_METRIC_COSINE = 0,
+  NDVSS_METRIC_EUCLIDEAN,
+  NDVSS_METRIC_EUCLIDEAN_SQUARED,
+  NDVSS_METRIC_DOT_PRODUCT
+};
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_metric_from_name
+// Desc: Maps the name of a similarity metric to its NDVSS_METRIC_* value.
+// Returns: The metric or -1 if the name is unknown.
+//----------------------------------------------------------------------------------------
+static int ndvss_metric_from_name( const char* name )
+{
+  if( name == 0 || sqlite3_stricmp(name, "cosine") == 0 ) {
+    return NDVSS_METRIC_COSINE;
+  }
+  if( sqlite3_stricmp(name, "euclidean") == 0 || sqlite3_stricmp(name, "euclidean_distance") == 0 ) {
+    return NDVSS_METRIC_EUCLIDEAN;
+  }
+  if( sqlite3_stricmp(name, "euclidean_squared") == 0 || sqlite3_stricmp(name, "euclidean_distance_squared") == 0 ) {
+    return NDVSS_METRIC_EUCLIDEAN_SQUARED;
+  }
+  if( sqlite3_stricmp(name, "dot_product") == 0 || sqlite3_stricmp(name, "dot") == 0 ) {
+    return NDVSS_METRIC_DOT_PRODUCT;
+  }
+  return -1;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_metric_distance
+// Desc: Scores two vectors so that a smaller value is always better.
+// Args: Metric, element size (4 = float, 8 = double), the vectors, number of dimensions
+//       and a pointer where the distance is stored.
+// Returns: 1 on success, 0 if the vectors can't be compared (zero length in cosine).
+//----------------------------------------------------------------------------------------
+static inline int ndvss_metric_distance( int metric,
+                                         int element_size,
+                                         const void* searched_array,
+                                         const void* column_array,
+                                         int vector_size,
+                                         double* distance )
+{
+  double similarity = 0.0;
+  if( element_size == sizeof(double) ) {
+    const double* a = (const double*)searched_array;
+    const double* b = (const double*)column_array;
+    switch( metric ) {
+      case NDVSS_METRIC_COSINE:
+        if( !ndvss_cosine_kernel_d(a, b, vector_size, &similarity) ) {
+          return 0;
+        }
+        *distance = -similarity;
+        return 1;
+      case NDVSS_METRIC_DOT_PRODUCT:
+        *distance = -ndvss_dot_product_kernel_d(a, b, vector_size);
+        return 1;
+      default:
+        *distance = ndvss_euclidean_distance_squared_kernel_d(a, b, vector_size);
+        return 1;
+    }
+  }
+  const float* a = (const float*)searched_array;
+  const float* b = (const float*)column_array;
+  switch( metric ) {
+    case NDVSS_METRIC_COSINE:
+      if( !ndvss_cosine_kernel_f(a, b, vector_size, &similarity) ) {
+        return 0;
+      }
+      *distance = -similarity;
+      return 1;
+    case NDVSS_METRIC_DOT_PRODUCT:
+      *distance = -(double)ndvss_dot_product_kernel_f(a, b, vector_size);
+      return 1;
+    default:
+      *distance = (double)ndvss_euclidean_distance_squared_kernel_f(a, b, vector_size);
+      return 1;
+  }
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_metric_similarity
+// Desc: Converts a distance from ndvss_metric_distance back to the value the matching 
+//       ndvss_*_similarity_* function would return.
+//----------------------------------------------------------------------------------------
+static inline double ndvss_metric_similarity( int metric, double distance )
+{
+  switch( metric ) {
+    case NDVSS_METRIC_COSINE:
+    case NDVSS_METRIC_DOT_PRODUCT:
+      return -distance;
+    case NDVSS_METRIC_EUCLIDEAN:
+      return sqrt(distance);
+    default:
+      return distance;
+  }
+}
+
+
+//----------------------------------------------------------------------------------------
+// VECTOR CACHE.
+// A vector set is a copy of one BLOB column of a table in flat arrays, so that the
+// k-NN functions can score the vectors without going through the VDBE row by row.
+// The vectors are stored in segments that are allocated from the arena. With NUMA the
+// segments are spread over the nodes round-robin, and a scan thread reads the segments
+// of its own node. The sets are cached per connection and reloaded when the table might
+// have changed.
+// With shared_cache on, the sets of database files are also shared by all the 
+// connections of the process, so that a server with a connection per thread keeps one
+// copy. A shared set is immutable once loaded (its PQ codes are built once under 
+// ndvss_build_mutex) and reference counted: a reload publishes a new set in place of 
+// the old one, and the old one is freed when the last connection that still uses it
+// moves on, so the searches never wait for each other. A connection that hasn't 
+// checked a set before takes it if the database and WAL files have the same size and
+// modification time as when it was loaded; after that the connection's own snapshot 
+// (PRAGMA data_version and total changes) decides, as for the private sets.
+// With memory_limit above 0, the sets of all the connections and the result caches 
+// share one budget. The sets are kept in one least recently used list, and while the 
+// total is over the limit the sets at its end that no search is using are evicted:
+// their vectors, PQ codes and inverted lists are freed, and the next search of the
+// column loads it again. A search pins its set from ndvss_vector_set_get to
+// ndvss_vector_set_unpin. A whole set is evicted, not single segments, because a scan
+// reads all of them.
+//----------------------------------------------------------------------------------------
+#define NDVSS_SEGMENT_BYTES         (32 * 1024 * 1024) // Size of a full segment.
+#define NDVSS_FIRST_SEGMENT_VECTORS 256                // Segments double in size until full.
+
+typedef struct ndvss_segment {
+  unsigned char* vectors;
+  sqlite3_int64  first;          // Index of the first vector of the segment in the set.
+  int            count;
+  int            capacity;
+  int            node;           // NUMA node of the memory, -1 if not placed.
+  int            arena_kind;
+  size_t         bytes;
+  unsigned char* deleted;        // Bitmap of the deleted vectors, 0 if there are none.
+} ndvss_segment;
+
+typedef struct ndvss_file_state {
+  sqlite3_int64 size;
+  sqlite3_int64 mtime;
+  sqlite3_int64 wal_size;          // 0 if there is no WAL file.
+  sqlite3_int64 wal_mtime;
+} ndvss_file_state;
+
+typedef struct ndvss_vector_set ndvss_vector_set;
+typedef struct ndvss_set_ref ndvss_set_ref;
+typedef struct ndvss_result_entry ndvss_result_entry;
+typedef struct ndvss_pq ndvss_pq;
+typedef struct ndvss_diskann ndvss_diskann;
+typedef struct ndvss_live_table ndvss_live_table;
+typedef struct ndvss_group_keys ndvss_group_keys;
+typedef struct ndvss_score_sample ndvss_score_sample;
+typedef struct ndvss_ivf ndvss_ivf;
+struct ndvss_vector_set {
+  char*             db_name;
+  char*             table_name;
+  char*             column_name;
+  int               element_size;   // 4 for floats, 8 for doubles.
+  int               dimensions;
+  int               vector_bytes;   // dimensions * element_size.
+  int               stride;         // Bytes between vectors, a multiple of NDVSS_ALIGNMENT.
+  sqlite3_int64     count;
+  sqlite3_int64     rowid_capacity;
+  sqlite3_int64*    rowids;
+  int               segment_count;
+  int               segment_capacity;
+  ndvss_segment*    segments;
+  sqlite3_int64     data_version;   // PRAGMA data_version when loaded.
+  sqlite3_int64     total_changes;  // sqlite3_total_changes64 when loaded.
+  ndvss_pq*         pq;             // Product quantization codes, built on first use.
+  ndvss_group_keys* group_keys;     // Group keys read by ndvss_topk_per_group_f/_d.
+  ndvss_ivf*        ivf;            // Scan order of budgeted searches, built on first use.
+  void*             mapping;        // Index file the set lives in, or 0 if loaded from a table.
+  sqlite3_int64     mapping_bytes;
+  char*             file_name;      // Database file of a shared set, 0 for a private set.
+  ndvss_file_state  file_state;     // The database files when the shared set was loaded.
+  int               ref_count;      // Connections that use the shared set.
+  int               registered;     // In ndvss_shared_sets, where other connections find it.
+  ndvss_vector_set* shared_next;
+  ndvss_vector_set* next;
+  // The memory budget, protected by the global lock.
+  sqlite3_int64     memory_bytes;   // Counted in vector_cache_bytes.
+  int               pins;           // Searches using the set now, it isn't evicted while > 0.
+  int               cached;         // In the LRU list.
+  int               evicted;        // Only the names are left, the column is loaded again.
+  ndvss_vector_set* lru_previous;   // Toward the most recently used set.
+  ndvss_vector_set* lru_next;
+};
+
+// The group key of every vector of a set, INTEGER values of another column of the rows.
+struct ndvss_group_keys {
+  char*             column_name;
+  sqlite3_int64*    groups;         // NDVSS_GROUP_NONE for NULL.
+  ndvss_group_keys* next;
+};
+
+// A connection's use of a vector set.
+struct ndvss_set_ref {
+  char*             db_name;        // Schema name on this connection.
+  ndvss_vector_set* set;            // Holds a reference.
+  sqlite3_int64     data_version;   // Snapshot of this connection when the set was checked.
+  sqlite3_int64     total_changes;
+  int               autocommit;     // 0 if loaded in a transaction, which may roll back.
+  ndvss_set_ref*    next;
+};
+
+typedef struct ndvss_connection {
+  sqlite3*          db;
+  int               ref_count;      // Number of modules that share this state.
+  ndvss_set_ref*    vector_sets;
+  ndvss_result_entry** result_buckets; // Hash table of the result cache.
+  ndvss_result_entry*  result_lru_head;  // Most recently used result.
+  ndvss_result_entry*  result_lru_tail;
+  int                  result_count;
+  ndvss_diskann*       diskann_indexes; // Open DiskANN index files.
+  ndvss_vector_set*    index_files;     // Attached index files.
+  ndvss_live_table*    live_tables;     // Connected ndvss_index tables.
+  ndvss_score_sample*  score_samples;   // Samples of the columns, for the estimates.
+} ndvss_connection;
+
+
+static void ndvss_result_cache_clear( ndvss_connection* connection );
+
+
+static void ndvss_score_sample_clear( ndvss_connection* connection );
+
+
+// Shared vector sets, protected by the global lock.
+static ndvss_vector_set* ndvss_shared_sets = 0;
+
+
+// Sets loaded from tables, the most recently used first, protected by the global lock.
+static ndvss_vector_set* ndvss_lru_head = 0;
+static ndvss_vector_set* ndvss_lru_tail = 0;
+
+
+static void ndvss_pq_free( ndvss_pq* pq );
+
+
+static sqlite3_int64 ndvss_pq_memory( const ndvss_pq* pq );
+
+
+static void ndvss_ivf_free( ndvss_ivf* ivf );
+
+
+static sqlite3_int64 ndvss_ivf_memory( const ndvss_ivf* ivf );
+
+
+static void ndvss_diskann_free_list( ndvss_diskann* index );
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_vector_set_drop
+// Desc: Frees the vectors of a set and what was built from them, but not the set.
+//----------------------------------------------------------------------------------------
+static void ndvss_vector_set_drop( ndvss_vector_set* set )
+{
+  int i;
+  for( i = 0; set->segments != 0 && i < set->segment_count; ++i ) {
+    ndvss_arena_free(set->segments[i].vectors, set->segments[i].bytes, set->segments[i].arena_kind);
+    sqlite3_free(set->segments[i].deleted);
+  }
+  sqlite3_free(set->segments);
+  set->segments = 0;
+  ndvss_pq_free(set->pq);
+  set->pq = 0;
+  ndvss_ivf_free(set->ivf);
+  set->ivf = 0;
+  while( set->group_keys != 0 ) {
+    ndvss_group_keys* keys = set->group_keys;
+    set->group_keys = keys->next;
+    sqlite3_free(keys->column_name);
+    sqlite3_free(keys->groups);
+    sqlite3_free(keys);
+  }
+  if( set->mapping == 0 ) {
+    sqlite3_free(set->rowids);
+  }
+  set->rowids = 0;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_vector_set_free
+// Desc: Frees a vector set.
+//----------------------------------------------------------------------------------------
+static void ndvss_vector_set_free( ndvss_vector_set* set )
+{
+  if( set == 0 ) {
+    return;
+  }
+  ndvss_vector_set_drop(set);
+  sqlite3_free(set->db_name);
+  sqlite3_free(set->table_name);
+  sqlite3_free(set->column_name);
+  sqlite3_free(set->file_name);
+  if( set->mapping != 0 ) {
+    NDVSS_STAT_ADD(index_mapped_bytes, -set->mapping_bytes);
+    ndvss_unmap_file(set->mapping, set->mapping_bytes);
+  }
+  sqlite3_free(set);
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_vector_set_add_segment
+// Desc: Adds an empty segment to the end of the set. 
+// Returns: SQLITE_OK or SQLITE_NOMEM.
+//----------------------------------------------------------------------------------------
+static int ndvss_vector_set_add_segment( ndvss_vector_set* set )
+{
+  if( set->segment_count == set->segment_capacity ) {
+    int capacity = set->segment_capacity < 16 ? 16 : set->segment_capacity * 2;
+    ndvss_segment* segments = (ndvss_segment*)sqlite3_realloc64(set->segments, sizeof(ndvss_segment) * (sqlite3_uint64)capacity);
+    if( segments == 0 ) {
+      return SQLITE_NOMEM;
+    }
+    set->segments = segments;
+    set->segment_capacity = capacity;
+  }
+  int full_capacity = NDVSS_SEGMENT_BYTES / set->stride;
+  if( full_capacity < 1 ) {
+    full_capacity = 1;
+  }
+  int capacity = NDVSS_FIRST_SEGMENT_VECTORS;
+  int i;
+  for( i = 0; i < set->segment_count && capacity < full_capacity; ++i ) {
+    capacity *= 2;
+  }
+  if( capacity > full_capacity ) {
+    capacity = full_capacity;
+  }
+  int node = -1;
+  if( NDVSS_CONFIG(NDVSS_CONFIG_NUMA) && ndvss_numa_node_count() > 1 ) {
+    node = set->segment_count % ndvss_numa_node_count();
+  }
+  ndvss_segment* segment = &set->segments[set->segment_count];
+  memset(segment, 0, sizeof(ndvss_segment));
+  segment->bytes = (size_t)set->stride * (size_t)capacity;
+  segment->vectors = (unsigned char*)ndvss_arena_alloc(segment->bytes, node, &segment->arena_kind);
+  if( segment->vectors == 0 ) {
+    return SQLITE_NOMEM;
+  }
+  segment->first = set->count;
+  segment->capacity = capacity;
+  segment->node = node;
+  ++set->segment_count;
+  return SQLITE_OK;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_vector_set_append
+// Desc: Adds a vector to the end of the set.
+// Returns: SQLITE_OK or SQLITE_NOMEM.
+//----------------------------------------------------------------------------------------
+static int ndvss_vector_set_append( ndvss_vector_set* set, sqlite3_int64 rowid, const void* vector )
+{
+  if( set->count == set->rowid_capacity ) {
+    sqlite3_int64 capacity = set->rowid_capacity < 1024 ? 1024 : set->rowid_capacity * 2;
+    sqlite3_int64* rowids = (sqlite3_int64*)sqlite3_realloc64(set->rowids, sizeof(sqlite3_int64) * (sqlite3_uint64)capacity);
+    if( rowids == 0 ) {
+      return SQLITE_NOMEM;
+    }
+    set->rowids = rowids;
+    set->rowid_capacity = capacity;
+  }
+  if( set->segment_count == 0 || 
+      set->segments[set->segment_count - 1].count == set->segments[set->segment_count - 1].capacity ) {
+    int rc = ndvss_vector_set_add_segment(set);
+    if( rc != SQLITE_OK ) {
+      return rc;
+    }
+  }
+  ndvss_segment* segment = &set->segments[set->segment_count - 1];
+  unsigned char* destination = segment->vectors + (size_t)set->stride * (size_t)segment->count;
+  memcpy(destination, vector, (size_t)set->vector_bytes);
+  memset(destination + set->vector_bytes, 0, (size_t)(set->stride - set->vector_bytes));
+  ++segment->count;
+  set->rowids[set->count] = rowid;
+  ++set->count;
+  return SQLITE_OK;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_table_snapshot
+// Desc: Reads the values used to notice that a table might have changed since it was
+//       loaded: PRAGMA data_version covers the other connections and the total number
+//       of changes covers this one.
+// Returns: SQLITE_OK or an error code.
+//----------------------------------------------------------------------------------------
+static int ndvss_table_snapshot( sqlite3* db, 
+                                 const char* db_name, 
+                                 sqlite3_int64* data_version, 
+                                 sqlite3_int64* total_changes )
+{
+  sqlite3_stmt* stmt = 0;
+  char* sql = sqlite3_mprintf("PRAGMA \"%w\".data_version", db_name);
+  if( sql == 0 ) {
+    return SQLITE_NOMEM;
+  }
+  int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+  sqlite3_free(sql);
+  if( rc != SQLITE_OK ) {
+    return rc;
+  }
+  *data_version = 0;
+  if( sqlite3_step(stmt) == SQLITE_ROW ) {
+    *data_version = sqlite3_column_int64(stmt, 0);
+  }
+  rc = sqlite3_finalize(stmt);
+  *total_changes = sqlite3_total_changes64(db);
+  return rc;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_vector_select_sql
+// Desc: Builds the query that reads the non-NULL vectors of a column with their rowids.
+//       The column is qualified with the table so that a misspelled name is an error
+//       and not a string literal.
+// Returns: The SQL allocated with sqlite3_mprintf, or 0 if out of memory.
+//----------------------------------------------------------------------------------------
+static char* ndvss_vector_select_sql( const char* db_name, const char* table_name, const char* column_name )
+{
+  return sqlite3_mprintf("SELECT rowid, v.\"%w\" FROM \"%w\".\"%w\" AS v WHERE v.\"%w\" IS NOT NULL", 
+                         column_name, db_name, table_name, column_name);
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_column_check
+// Desc: Checks that a table or view has a column, so that the error of a misspelled 
+//       name has only the name as it was given. A missing table isn't reported here, 
+//       the query on it reports it.
+// Returns: SQLITE_OK or an error code, with the message in error_message.
+//----------------------------------------------------------------------------------------
+static int ndvss_column_check( sqlite3* db,
+                               const char* db_name,
+                               const char* table_name,
+                               const char* column_name,
+                               char** error_message )
+{
+  sqlite3_stmt* stmt = 0;
+  int rc = sqlite3_prepare_v2(db, "SELECT count(*), count(CASE WHEN name = ?3 COLLATE NOCASE THEN 1 END) "
+                                  "FROM pragma_table_xinfo(?2, ?1)", -1, &stmt, 0);
+  if( rc != SQLITE_OK ) {
+    // Without the pragma (or with an unknown schema), the query reports the column itself.
+    sqlite3_finalize(stmt);
+    return rc == SQLITE_NOMEM ? rc : SQLITE_OK;
+  }
+  sqlite3_bind_text(stmt, 1, db_name, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, 2, table_name, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, 3, column_name, -1, SQLITE_STATIC);
+  int missing = sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_int(stmt, 0) > 0 && sqlite3_column_int(stmt, 1) == 0;
+  sqlite3_finalize(stmt);
+  if( missing ) {
+    *error_message = sqlite3_mprintf("no such column: %s", column_name);
+    return SQLITE_ERROR;
+  }
+  return SQLITE_OK;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_vector_select_prepare
+// Desc: Prepares the query of ndvss_vector_select_sql, checking the column first.
+// Returns: SQLITE_OK or an error code, with the message in error_message.
+//----------------------------------------------------------------------------------------
+static int ndvss_vector_select_prepare( sqlite3* db,
+                                        const char* db_name,
+                                        const char* table_name,
+                                        const char* column_name,
+                                        sqlite3_stmt** stmt,
+                                        char** error_message )
+{
+  int rc = ndvss_column_check(db, db_name, table_name, column_name, error_message);
+  if( rc != SQLITE_OK ) {
+    return rc;
+  }
+  char* sql = ndvss_vector_select_sql(db_name, table_name, column_name);
+  if( sql == 0 ) {
+    return SQLITE_NOMEM;
+  }
+  rc = sqlite3_prepare_v2(db, sql, -1, stmt, 0);
+  sqlite3_free(sql);
+  if( rc != SQLITE_OK ) {
+    *error_message = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+  }
+  return rc;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_vector_set_load
+// Desc: Reads all the non-NULL vectors of a column into a new vector set.
+// Args: Database, schema, table and column names, element size, expected size of a
+//       vector in bytes, where the set is stored and where an error message is stored.
+// Returns: SQLITE_OK or an error code.
+//----------------------------------------------------------------------------------------
+static int ndvss_vector_set_load( sqlite3* db,
+                                  const char* db_name,
+                                  const char* table_name,
+                                  const char* column_name,
+                                  int element_size,
+                                  int vector_bytes,
+                                  ndvss_vector_set** result,
+                                  char** error_message )
+{
+  *result = 0;
+  ndvss_vector_set* set = (ndvss_vector_set*)sqlite3_malloc(sizeof(ndvss_vector_set));
+  if( set == 0 ) {
+    return SQLITE_NOMEM;
+  }
+  memset(set, 0, sizeof(ndvss_vector_set));
+  set->db_name = sqlite3_mprintf("%s", db_name);
+  set->table_name = sqlite3_mprintf("%s", table_name);
+  set->column_name = sqlite3_mprintf("%s", column_name);
+  set->element_size = element_size;
+  set->dimensions = vector_bytes / element_size;
+  set->vector_bytes = vector_bytes;
+  set->stride = (vector_bytes + NDVSS_ALIGNMENT - 1) & ~(NDVSS_ALIGNMENT - 1);
+  if( set->db_name == 0 || set->table_name == 0 || set->column_name == 0 ) {
+    ndvss_vector_set_free(set);
+    return SQLITE_NOMEM;
+  }
+  int rc = ndvss_table_snapshot(db, db_name, &set->data_version, &set->total_changes);
+  if( rc != SQLITE_OK ) {
+    *error_message = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+    ndvss_vector_set_free(set);
+    return rc;
+  }
+
+  sqlite3_stmt* stmt = 0;
+  rc = ndvss_vector_select_prepare(db, db_name, table_name, column_name, &stmt, error_message);
+  if( rc != SQLITE_OK ) {
+    ndvss_vector_set_free(set);
+    return rc;
+  }
+  while( (rc = sqlite3_step(stmt)) == SQLITE_ROW ) {
+    const void* vector = sqlite3_column_blob(stmt, 1);
+    int bytes = sqlite3_column_bytes(stmt, 1);
+    if( bytes != vector_bytes ) {
+      *error_message = sqlite3_mprintf("The arrays are not the same length (rowid %lld).", 
+                                       sqlite3_column_int64(stmt, 0));
+      rc = SQLITE_ERROR;
+      break;
+    }
+    rc = ndvss_vector_set_append(set, sqlite3_column_int64(stmt, 0), vector);
+    if( rc != SQLITE_OK ) {
+      break;
+    }
+  }//endwhile reading rows
+  if( rc == SQLITE_DONE ) {
+    rc = SQLITE_OK;
+  } else if( rc != SQLITE_OK && *error_message == 0 && rc != SQLITE_NOMEM ) {
+    *error_message = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+  }
+  sqlite3_finalize(stmt);
+  if( rc != SQLITE_OK ) {
+    ndvss_vector_set_free(set);
+    return rc;
+  }
+  NDVSS_STAT_ADD(cache_loads, 1);
+  *result = set;
+  return SQLITE_OK;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_vector_set_memory
+// Desc: Adds up the memory of a set: the vectors, the rowids and what was built from 
+//       them so far. The set needs to be pinned or not shared yet.
+//----------------------------------------------------------------------------------------
+static sqlite3_int64 ndvss_vector_set_memory( const ndvss_vector_set* set )
+{
+  sqlite3_int64 bytes = (sqlite3_int64)sizeof(ndvss_vector_set) + 
+                        (sqlite3_int64)sizeof(sqlite3_int64) * set->rowid_capacity +
+                        (sqlite3_int64)sizeof(ndvss_segment) * set->segment_capacity;
+  int i;
+  for( i = 0; i < set->segment_count; ++i ) {
+    bytes += (sqlite3_int64)set->segments[i].bytes;
+  }
+  bytes += ndvss_pq_memory(__atomic_load_n(&set->pq, __ATOMIC_ACQUIRE));
+  bytes += ndvss_ivf_memory(__atomic_load_n(&set->ivf, __ATOMIC_ACQUIRE));
+  const ndvss_group_keys* keys;
+  for( keys = __atomic_load_n(&set->group_keys, __ATOMIC_ACQUIRE); keys != 0; keys = keys->next ) {
+    bytes += (sqlite3_int64)sizeof(sqlite3_int64) * set->count;
+  }
+  return bytes;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_memory_used
+// Desc: Returns the memory counted in memory_limit.
+//----------------------------------------------------------------------------------------
+static sqlite3_int64 ndvss_memory_used( void )
+{
+  return NDVSS_STAT_GET(vector_cache_bytes) + NDVSS_STAT_GET(result_cache_bytes);
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_memory_note
+// Desc: Raises the high-water mark of the caches to the current use.
+//----------------------------------------------------------------------------------------
+static void ndvss_memory_note( void )
+{
+  sqlite3_int64 used = ndvss_memory_used();
+  sqlite3_int64 highwater = NDVSS_STAT_GET(memory_highwater);
+  while( used > highwater && 
+         !__atomic_compare_exchange_n(&ndvss_stats_global.memory_highwater, &highwater, used, 1, 
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED) ) {
+  }
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_vector_set_uncache
+// Desc: Takes a set out of the LRU list and its memory out of the budget. Called with
+//       the global lock.
+//----------------------------------------------------------------------------------------
+static void ndvss_vector_set_uncache( ndvss_vector_set* set )
+{
+  if( !set->cached ) {
+    return;
+  }
+  if( set->lru_previous != 0 ) {
+    set->lru_previous->lru_next = set->lru_next;
+  } else {
+    ndvss_lru_head = set->lru_next;
+  }
+  if( set->lru_next != 0 ) {
+    set->lru_next->lru_previous = set->lru_previous;
+  } else {
+    ndvss_lru_tail = set->lru_previous;
+  }
+  set->lru_previous = set->lru_next = 0;
+  set->cached = 0;
+  NDVSS_STAT_ADD(vector_cache_bytes, -set->memory_bytes);
+  set->memory_bytes = 0;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_vector_set_pin_locked
+// Desc: Keeps a set in memory for a search and makes it the most recently used one.
+//       Called with the global lock.
+// Returns: 1, or 0 if the set was evicted.
+//----------------------------------------------------------------------------------------
+static int ndvss_vector_set_pin_locked( ndvss_vector_set* set )
+{
+  if( set->evicted ) {
+    return 0;
+  }
+  ++set->pins;
+  if( set->cached && set == ndvss_lru_head ) {
+    return 1;
+  }
+  sqlite3_int64 bytes = set->cached ? set->memory_bytes : ndvss_vector_set_memory(set);
+  ndvss_vector_set_uncache(set);
+  set->memory_bytes = bytes;
+  set->cached = 1;
+  NDVSS_STAT_ADD(vector_cache_bytes, bytes);
+  set->lru_next = ndvss_lru_head;
+  if( ndvss_lru_head != 0 ) {
+    ndvss_lru_head->lru_previous = set;
+  } else {
+    ndvss_lru_tail = set;
+  }
+  ndvss_lru_head = set;
+  return 1;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_vector_set_pin
+// Desc: See ndvss_vector_set_pin_locked.
+//----------------------------------------------------------------------------------------
+static int ndvss_vector_set_pin( ndvss_vector_set* set )
+{
+  ndvss_global_lock();
+  int pinned = ndvss_vector_set_pin_locked(set);
+  ndvss_global_unlock();
+  if( pinned ) {
+    ndvss_memory_note();
+  }
+  return pinned;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_memory_enforce
+// Desc: Evicts the least recently used sets that no search is using, until the caches
+//       are under memory_limit or every set left is in use. The result caches are
+//       trimmed by their connections, see ndvss_result_cache_put.
+//----------------------------------------------------------------------------------------
+static void ndvss_memory_enforce( void )
+{
+  for( ;; ) {
+    sqlite3_int64 limit = (sqlite3_int64)NDVSS_CONFIG(NDVSS_CONFIG_MEMORY_LIMIT);
+    if( limit <= 0 || ndvss_memory_used() <= limit ) {
+      return;
+    }
+    ndvss_vector_set dropped;
+    int shared = 0;
+    ndvss_global_lock();
+    ndvss_vector_set* victim = ndvss_lru_tail;
+    while( victim != 0 && victim->pins > 0 ) {
+      victim = victim->lru_previous;
+    }
+    if( victim != 0 ) {
+      ndvss_vector_set_uncache(victim);
+      victim->evicted = 1;
+      if( victim->registered ) {
+        ndvss_vector_set** link = &ndvss_shared_sets;
+        while( *link != victim ) {
+          link = &(*link)->shared_next;
+        }
+        *link = victim->shared_next;
+        __atomic_store_n(&victim->registered, 0, __ATOMIC_RELAXED);
+      }
+      shared = victim->file_name != 0;
+      // The connections that still refer to the set keep its names and sizes, and 
+      // don't touch the rest without pinning it.
+      dropped = *victim;
+      victim->segments = 0;
+      victim->rowids = 0;
+      victim->pq = 0;
+      victim->ivf = 0;
+      victim->group_keys = 0;
+    }
+    ndvss_global_unlock();
+    if( victim == 0 ) {
+      return;
+    }
+    if( shared ) {
+      NDVSS_STAT_ADD(shared_sets, -1);
+    }
+    ndvss_vector_set_drop(&dropped);
+    NDVSS_STAT_ADD(memory_evictions, 1);
+  }
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_vector_set_unpin
+// Desc: Ends the use of a set from ndvss_vector_set_get. The set may have grown during
+//       the search (PQ codes, inverted lists, group keys), so it is measured again and
+//       the budget enforced.
+//----------------------------------------------------------------------------------------
+static void ndvss_vector_set_unpin( ndvss_vector_set* set )
+{
+  if( set == 0 ) {
+    return;
+  }
+  sqlite3_int64 bytes = ndvss_vector_set_memory(set);
+  ndvss_global_lock();
+  --set->pins;
+  NDVSS_STAT_ADD(vector_cache_bytes, bytes - set->memory_bytes);
+  set->memory_bytes = bytes;
+  ndvss_global_unlock();
+  ndvss_memory_note();
+  ndvss_memory_enforce();
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_memory
+// Desc: Reports the memory of the caches against memory_limit, as sqlite3_status64()
+//       and sqlite3_soft_heap_limit64() do for the memory of SQLite.
+// Args: Optionally 1 to reset the high-water mark to the current use INTEGER
+// Returns: JSON object TEXT {"limit", "used", "highwater", "vector_cache_bytes",
+//          "result_cache_bytes", "evictions", "reloads", "sqlite_memory_used",
+//          "sqlite_soft_heap_limit", "sets"}, with sets the cached columns from the 
+//          most recently used: {"schema", "table", "column", "bytes", "pins", "shared"}.
+//          limit is 0 without a limit. highwater is the mark before a reset.
+//----------------------------------------------------------------------------------------
+static void ndvss_memory( sqlite3_context* context,
+                          int argc,
+                          sqlite3_value** argv )
+{
+  ndvss_memory_note();
+  sqlite3_int64 used = ndvss_memory_used();
+  sqlite3_int64 highwater = NDVSS_STAT_GET(memory_highwater);
+  if( argc > 0 && sqlite3_value_int(argv[0]) != 0 ) {
+    NDVSS_STAT_SET(memory_highwater, used);
+  }
+  char* json = sqlite3_mprintf("{\"limit\":%lld,\"used\":%lld,\"highwater\":%lld,\"vector_cache_bytes\":%lld,"
+                               "\"result_cache_bytes\":%lld,\"evictions\":%lld,\"reloads\":%lld,"
+                               "\"sqlite_memory_used\":%lld,\"sqlite_soft_heap_limit\":%lld,\"sets\":[",
+                               (sqlite3_int64)NDVSS_CONFIG(NDVSS_CONFIG_MEMORY_LIMIT), used, highwater,
+                               NDVSS_STAT_GET(vector_cache_bytes), NDVSS_STAT_GET(result_cache_bytes),
+                               NDVSS_STAT_GET(memory_evictions), NDVSS_STAT_GET(memory_reloads),
+                               sqlite3_memory_used(), sqlite3_soft_heap_limit64(-1));
+  ndvss_global_lock();
+  ndvss_vector_set* set;
+  for( set = ndvss_lru_head; set != 0 && json != 0; set = set->lru_next ) {
+    size_t length = strlen(set->db_name) + strlen(set->table_name) + strlen(set->column_name);
+    char* schema = (char*)sqlite3_malloc64(2 * length + 3);
+    if( schema == 0 ) {
+      sqlite3_free(json);
+      json = 0;
+      break;
+    }
+    ndvss_json_escape(schema, set->db_name);
+    char* table = schema + strlen(schema) + 1;
+    ndvss_json_escape(table, set->table_name);
+    char* column = table + strlen(table) + 1;
+    ndvss_json_escape(column, set->column_name);
+    json = sqlite3_mprintf("%z%s{\"schema\":\"%s\",\"table\":\"%s\",\"column\":\"%s\",\"bytes\":%lld,"
+                           "\"pins\":%d,\"shared\":%d}",
+                           json, set == ndvss_lru_head ? "" : ",", schema, table, column, 
+                           set->memory_bytes, set->pins, set->file_name != 0);
+    sqlite3_free(schema);
+  }
+  ndvss_global_unlock();
+  json = json != 0 ? sqlite3_mprintf("%z]}", json) : 0;
+  if( json == 0 ) {
+    sqlite3_result_error_nomem(context);
+    return;
+  }
+  sqlite3_result_text(context, json, -1, sqlite3_free);
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_vector_set_release
+// Desc: Drops a connection's reference to a vector set. A private set is freed, a shared
+//       one with its last reference.
+//----------------------------------------------------------------------------------------
+static void ndvss_vector_set_release( ndvss_vector_set* set )
+{
+  if( set == 0 ) {
+    return;
+  }
+  ndvss_global_lock();
+  if( set->file_name == 0 ) {
+    ndvss_vector_set_uncache(set);
+    ndvss_global_unlock();
+    ndvss_vector_set_free(set);
+    return;
+  }
+  int last = --set->ref_count == 0;
+  int counted = !set->evicted;
+  if( last && set->registered ) {
+    ndvss_vector_set** link = &ndvss_shared_sets;
+    while( *link != set ) {
+      link = &(*link)->shared_next;
+    }
+    *link = set->shared_next;
+  }
+  if( last ) {
+    ndvss_vector_set_uncache(set);
+  }
+  ndvss_global_unlock();
+  if( last ) {
+    if( counted ) {
+      NDVSS_STAT_ADD(shared_sets, -1);
+    }
+    ndvss_vector_set_free(set);
+  }
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_db_file_state
+// Desc: Reads the size and modification time of a database file and its WAL file.
+// Returns: The name of the file, or 0 for an in-memory or temporary database.
+//----------------------------------------------------------------------------------------
+static const char* ndvss_db_file_state( sqlite3* db, const char* db_name, ndvss_file_state* state )
+{
+  memset(state, 0, sizeof(ndvss_file_state));
+  const char* file_name = sqlite3_db_filename(db, db_name);
+  if( file_name == 0 || file_name[0] == 0 || !ndvss_file_identity(file_name, &state->size, &state->mtime) ) {
+    return 0;
+  }
+  char* wal_name = sqlite3_mprintf("%s-wal", file_name);
+  if( wal_name == 0 ) {
+    return 0;
+  }
+  ndvss_file_identity(wal_name, &state->wal_size, &state->wal_mtime);
+  sqlite3_free(wal_name);
+  return file_name;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_shared_set_find
+// Desc: Finds the published set of a column of a database file, if it was loaded from
+//       files in the given state.
+// Returns: The set with a new reference, pinned, or 0.
+//----------------------------------------------------------------------------------------
+static ndvss_vector_set* ndvss_shared_set_find( const char* file_name,
+                                                const ndvss_file_state* state,
+                                                const char* table_name,
+                                                const char* column_name,
+                                                int element_size,
+                                                int vector_bytes )
+{
+  ndvss_vector_set* found = 0;
+  ndvss_global_lock();
+  ndvss_vector_set* set;
+  for( set = ndvss_shared_sets; set != 0; set = set->shared_next ) {
+    if( set->element_size == element_size &&
+        strcmp(set->file_name, file_name) == 0 &&
+        sqlite3_stricmp(set->table_name, table_name) == 0 &&
+        sqlite3_stricmp(set->column_name, column_name) == 0 ) {
+      if( memcmp(&set->file_state, state, sizeof(ndvss_file_state)) == 0 &&
+          (set->count == 0 || set->vector_bytes == vector_bytes) && ndvss_vector_set_pin_locked(set) ) {
+        ++set->ref_count;
+        found = set;
+      }
+      break;
+    }
+  }
+  ndvss_global_unlock();
+  return found;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_shared_set_publish
+// Desc: Makes a newly loaded set the one other connections find for its column. The set
+//       it replaces stays alive for the connections that still use it.
+//----------------------------------------------------------------------------------------
+static void ndvss_shared_set_publish( ndvss_vector_set* set )
+{
+  ndvss_global_lock();
+  ndvss_vector_set** link = &ndvss_shared_sets;
+  while( *link != 0 ) {
+    ndvss_vector_set* old = *link;
+    if( old->element_size == set->element_size &&
+        strcmp(old->file_name, set->file_name) == 0 &&
+        sqlite3_stricmp(old->table_name, set->table_name) == 0 &&
+        sqlite3_stricmp(old->column_name, set->column_name) == 0 ) {
+      *link = old->shared_next;
+      // Read without the lock by the connections that use the old set.
+      __atomic_store_n(&old->registered, 0, __ATOMIC_RELAXED);
+      break;
+    }
+    link = &old->shared_next;
+  }
+  set->registered = 1;
+  set->shared_next = ndvss_shared_sets;
+  ndvss_shared_sets = set;
+  ndvss_global_unlock();
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_vector_set_get
+// Desc: Returns the cached vector set of a column, loading it if it isn't cached yet,
+//       if it was evicted or if the table might have changed since it was loaded. The
+//       set is pinned: it stays valid until ndvss_vector_set_unpin, and the next call 
+//       for the same column on the connection needs to come after that.
+// Returns: SQLITE_OK or an error code.
+//----------------------------------------------------------------------------------------
+static int ndvss_vector_set_get( ndvss_connection* connection,
+                                 const char* db_name,
+                                 const char* table_name,
+                                 const char* column_name,
+                                 int element_size,
+                                 int vector_bytes,
+                                 ndvss_vector_set** result,
+                                 char** error_message )
+{
+  sqlite3* db = connection->db;
+  sqlite3_int64 data_version = 0, total_changes = 0;
+  int rc = ndvss_table_snapshot(db, db_name, &data_version, &total_changes);
+  if( rc != SQLITE_OK ) {
+    *error_message = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+    return rc;
+  }
+  ndvss_set_ref* ref;
+  for( ref = connection->vector_sets; ref != 0; ref = ref->next ) {
+    if( ref->set->element_size == element_size &&
+        sqlite3_stricmp(ref->db_name, db_name) == 0 &&
+        sqlite3_stricmp(ref->set->table_name, table_name) == 0 &&
+        sqlite3_stricmp(ref->set->column_name, column_name) == 0 ) {
+      break;
+    }
+  }
+  // A transaction of this connection may have changes that the files don't have yet.
+  // A set loaded in a transaction isn't used again: neither data_version nor the total
+  // changes go back when the transaction or a savepoint of it rolls back.
+  int autocommit = sqlite3_get_autocommit(db);
+  ndvss_file_state state;
+  if( ref != 0 && ref->data_version == data_version && ref->total_changes == total_changes &&
+      ref->autocommit && (ref->set->count == 0 || ref->set->vector_bytes == vector_bytes) ) {
+    ndvss_vector_set* set = ref->set;
+    if( set->file_name != 0 && !__atomic_load_n(&set->registered, __ATOMIC_RELAXED) && autocommit && ndvss_db_file_state(db, db_name, &state) != 0 ) {
+      // Another connection has reloaded the column. Nothing has changed for this one, 
+      // so the new copy has the same data, and moving to it lets the old one go.
+      ndvss_vector_set* newer = ndvss_shared_set_find(set->file_name, &state, table_name, column_name, 
+                                                      element_size, vector_bytes);
+      if( newer != 0 ) {
+        ndvss_vector_set_release(set);
+        ref->set = newer;
+        *result = newer;
+        return SQLITE_OK;
+      }
+    }
+    if( ndvss_vector_set_pin(set) ) {
+      *result = set;
+      return SQLITE_OK;
+    }
+    NDVSS_STAT_ADD(memory_reloads, 1);
+  }
+
+  ndvss_vector_set* set = 0;
+  const char* file_name = 0;
+  if( NDVSS_CONFIG(NDVSS_CONFIG_SHARED_CACHE) && autocommit ) {
+    file_name = ndvss_db_file_state(db, db_name, &state);
+  }
+  if( file_name != 0 ) {
+    set = ndvss_shared_set_find(file_name, &state, table_name, column_name, element_size, vector_bytes);
+    if( set != 0 && ref != 0 && set == ref->set ) {
+      // This connection has seen the set go stale, whatever the files say.
+      ndvss_vector_set_unpin(set);
+      ndvss_vector_set_release(set);
+      set = 0;
+    }
+    if( set != 0 ) {
+      NDVSS_STAT_ADD(shared_cache_hits, 1);
+    }
+  }
+  if( set == 0 ) {
+    rc = ndvss_vector_set_load(db, db_name, table_name, column_name, element_size, vector_bytes, &set, error_message);
+    if( rc != SQLITE_OK ) {
+      return rc;
+    }
+    if( file_name != 0 ) {
+      set->file_name = sqlite3_mprintf("%s", file_name);
+      if( set->file_name == 0 ) {
+        ndvss_vector_set_free(set);
+        return SQLITE_NOMEM;
+      }
+      // The state from before the load: a commit during the load makes it look stale.
+      set->file_state = state;
+      set->ref_count = 1;
+      NDVSS_STAT_ADD(shared_sets, 1);
+      // Pinned before other connections can find it, so that they can't evict it.
+      ndvss_vector_set_pin(set);
+      ndvss_shared_set_publish(set);
+    } else {
+      ndvss_vector_set_pin(set);
+    }
+    ndvss_memory_enforce();
+  }
+  if( ref == 0 ) {
+    ref = (ndvss_set_ref*)sqlite3_malloc(sizeof(ndvss_set_ref));
+    char* ref_db_name = sqlite3_mprintf("%s", db_name);
+    if( ref == 0 || ref_db_name == 0 ) {
+      sqlite3_free(ref);
+      sqlite3_free(ref_db_name);
+      ndvss_vector_set_unpin(set);
+      ndvss_vector_set_release(set);
+      return SQLITE_NOMEM;
+    }
+    ref->db_name = ref_db_name;
+    ref->next = connection->vector_sets;
+    connection->vector_sets = ref;
+  } else {
+    ndvss_vector_set_release(ref->set);
+  }
+  ref->set = set;
+  ref->data_version = data_version;
+  ref->total_changes = total_changes;
+  ref->autocommit = autocommit;
+  *result = set;
+  return SQLITE_OK;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_connection_release
+// Desc: Drops a reference to the connection state, freeing it with the last one.
+//----------------------------------------------------------------------------------------
+static void ndvss_connection_release( void* p )
+{
+  ndvss_connection* connection = (ndvss_connection*)p;
+  if( connection == 0 || --connection->ref_count > 0 ) {
+    return;
+  }
+  while( connection->vector_sets != 0 ) {
+    ndvss_set_ref* next = connection->vector_sets->next;
+    ndvss_vector_set_release(connection->vector_sets->set);
+    sqlite3_free(connection->vector_sets->db_name);
+    sqlite3_free(connection->vector_sets);
+    connection->vector_sets = next;
+  }
+  while( connection->index_files != 0 ) {
+    ndvss_vector_set* next = connection->index_files->next;
+    ndvss_vector_set_free(connection->index_files);
+    connection->index_files = next;
+  }
+  ndvss_score_sample_clear(connection);
+  ndvss_result_cache_clear(connection);
+  ndvss_diskann_free_list(connection->diskann_indexes);
+  sqlite3_free(connection);
+}
+
+
+//----------------------------------------------------------------------------------------
+// RESULT CACHE.
+// The k-NN functions remember the results of the last result_cache_entries searches of
+// every connection. A search is answered from the cache when the searched vector, 
+// table, column and metric are the same, the cached k is at least as big, and the 
+// database hasn't changed since (the same PRAGMA data_version and total changes check
+// as the vector cache). The entries are found through a hash table and evicted in least
+// recently used order, also when the caches are over memory_limit.
+// With semantic_cache_epsilon above 0, a search that isn't in the cache can also reuse
+// the candidates of a cached search whose vector is close enough.
+//----------------------------------------------------------------------------------------
+#define NDVSS_RESULT_CACHE_BUCKETS 1024
+
+struct ndvss_result_entry {
+  sqlite3_uint64      hash;
+  char*               table;           // As given to the k-NN function.
+  char*               column;
+  int                 element_size;
+  int                 metric;
+  int                 method;          // NDVSS_KNN_METHOD_*.
+  sqlite3_uint64      settings;        // See ndvss_result_cache_settings.
+  int                 query_bytes;
+  void*               query;
+  sqlite3_int64       data_version;
+  sqlite3_int64       total_changes;
+  int                 autocommit;      // 0 if put in a transaction, which may roll back.
+  ndvss_topk          results;         // Sorted from the best to the worst.
+  sqlite3_int64       bytes;           // Memory used by the entry.
+  ndvss_result_entry* bucket_next;
+  ndvss_result_entry* lru_prev;        // Towards the most recently used.
+  ndvss_result_entry* lru_next;
+};
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_result_cache_settings
+// Desc: Packs the settings that change the results of the approximate methods, so that
+//       a search after ndvss_config has changed one of them isn't answered from memory.
+//----------------------------------------------------------------------------------------
+static sqlite3_uint64 ndvss_result_cache_settings( void )
+{
+  sqlite3_uint64 settings = (sqlite3_uint64)NDVSS_CONFIG(NDVSS_CONFIG_PQ_SUBQUANTIZERS);
+  settings = settings * 1001 + (sqlite3_uint64)NDVSS_CONFIG(NDVSS_CONFIG_PQ_RERANK);
+  settings = settings * 100001 + (sqlite3_uint64)NDVSS_CONFIG(NDVSS_CONFIG_DISKANN_SEARCH_LIST);
+  settings = settings * 2 + (sqlite3_uint64)NDVSS_CONFIG(NDVSS_CONFIG_SEARCH_BUDGET_IVF);
+  return settings;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_result_cache_hash
+// Desc: FNV-1a hash of the searched vector and the source of the search. The names
+//       are hashed in lower case, as they are compared without case.
+//----------------------------------------------------------------------------------------
+static sqlite3_uint64 ndvss_result_cache_hash( const char* table,
+                                               const char* column,
+                                               int element_size,
+                                               int metric,
+                                               int method,
+                                               sqlite3_uint64 settings,
+                                               const void* query,
+                                               int query_bytes )
+{
+  sqlite3_uint64 hash = 14695981039346656037ULL;
+  const unsigned char* p = (const unsigned char*)query;
+  int i;
+  for( i = 0; i < query_bytes; ++i ) {
+    hash = (hash ^ p[i]) * 1099511628211ULL;
+  }
+  for( p = (const unsigned char*)table; *p != 0; ++p ) {
+    hash = (hash ^ (sqlite3_uint64)(*p >= 'A' && *p <= 'Z' ? *p + 32 : *p)) * 1099511628211ULL;
+  }
+  for( p = (const unsigned char*)column; *p != 0; ++p ) {
+    hash = (hash ^ (sqlite3_uint64)(*p >= 'A' && *p <= 'Z' ? *p + 32 : *p)) * 1099511628211ULL;
+  }
+  hash = (hash ^ (sqlite3_uint64)element_size) * 1099511628211ULL;
+  hash = (hash ^ (sqlite3_uint64)metric) * 1099511628211ULL;
+  hash = (hash ^ (sqlite3_uint64)method) * 1099511628211ULL;
+  hash = (hash ^ settings) * 1099511628211ULL;
+  return hash;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_result_cache_remove
+// Desc: Unlinks an entry from the hash table and the LRU list and frees it.
+//----------------------------------------------------------------------------------------
+static void ndvss_result_cache_remove( ndvss_connection* connection, ndvss_result_entry* entry )
+{
+  ndvss_result_entry** link = &connection->result_buckets[entry->hash % NDVSS_RESULT_CACHE_BUCKETS];
+  while( *link != entry ) {
+    link = &(*link)->bucket_next;
+  }
+  *link = entry->bucket_next;
+  if( entry->lru_prev != 0 ) {
+    entry->lru_prev->lru_next = entry->lru_next;
+  } else {
+    connection->result_lru_head = entry->lru_next;
+  }
+  if( entry->lru_next != 0 ) {
+    entry->lru_next->lru_prev = entry->lru_prev;
+  } else {
+    connection->result_lru_tail = entry->lru_prev;
+  }
+  --connection->result_count;
+  NDVSS_STAT_ADD(result_cache_entries, -1);
+  NDVSS_STAT_ADD(result_cache_bytes, -entry->bytes);
+  sqlite3_free(entry->table);
+  sqlite3_free(entry->column);
+  sqlite3_free(entry->query);
+  ndvss_topk_free(&entry->results);
+  sqlite3_free(entry);
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_result_cache_clear
+// Desc: Frees all the cached results of a connection.
+//----------------------------------------------------------------------------------------
+static void ndvss_result_cache_clear( ndvss_connection* connection )
+{
+  while( connection->result_lru_head != 0 ) {
+    ndvss_result_cache_remove(connection, connection->result_lru_head);
+  }
+  sqlite3_free(connection->result_buckets);
+  connection->result_buckets = 0;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_result_cache_find
+// Desc: Looks for an entry with the same searched vector and source.
+// Returns: The entry or 0.
+//----------------------------------------------------------------------------------------
+static ndvss_result_entry* ndvss_result_cache_find( ndvss_connection* connection,
+                                                    sqlite3_uint64 hash,
+                                                    const char* table,
+                                                    const char* column,
+                                                    int element_size,
+                                                    int metric,
+                                                    int method,
+                                                    sqlite3_uint64 settings,
+                                                    const void* query,
+                                                    int query_bytes )
+{
+  if( connection->result_buckets == 0 ) {
+    return 0;
+  }
+  ndvss_result_entry* entry = connection->result_buckets[hash % NDVSS_RESULT_CACHE_BUCKETS];
+  for( ; entry != 0; entry = entry->bucket_next ) {
+    if( entry->hash == hash && entry->element_size == element_size && entry->metric == metric && entry->method == method &&
+        entry->settings == settings && entry->query_bytes == query_bytes && memcmp(entry->query, query, (size_t)query_bytes) == 0 &&
+        sqlite3_stricmp(entry->table, table) == 0 && sqlite3_stricmp(entry->column, column) == 0 ) {
+      return entry;
+    }
+  }
+  return 0;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_result_cache_get
+// Desc: Copies the cached results of a search to a top-k, if there are any that are
+//       still valid. Stale entries are dropped.
+// Args: Connection state, key of the search, k, the current data version and total 
+//       changes of the database, sqlite3_get_autocommit() of the connection, the top-k 
+//       that receives the sorted results.
+// Returns: SQLITE_OK on a hit, SQLITE_NOTFOUND on a miss, SQLITE_NOMEM.
+//----------------------------------------------------------------------------------------
+static int ndvss_result_cache_get( ndvss_connection* connection,
+                                   sqlite3_uint64 hash,
+                                   const char* table,
+                                   const char* column,
+                                   int element_size,
+                                   int metric,
+                                   int method,
+                                   sqlite3_uint64 settings,
+                                   const void* query,
+                                   int query_bytes,
+                                   int k,
+                                   sqlite3_int64 data_version,
+                                   sqlite3_int64 total_changes,
+                                   int autocommit,
+                                   ndvss_topk* results )
+{
+  ndvss_result_entry* entry = ndvss_result_cache_find(connection, hash, table, column, element_size, 
+                                                      metric, method, settings, query, query_bytes);
+  // A rollback doesn't change the data version or the total changes, so an entry put in
+  // a transaction can't tell whether its rows were rolled back.
+  if( entry != 0 && (entry->data_version != data_version || entry->total_changes != total_changes || 
+                     (!entry->autocommit && autocommit)) ) {
+    ndvss_result_cache_remove(connection, entry);
+    NDVSS_STAT_ADD(result_cache_invalidations, 1);
+    entry = 0;
+  }
+  if( entry == 0 || entry->results.k < k ) {
+    NDVSS_STAT_ADD(result_cache_misses, 1);
+    return SQLITE_NOTFOUND;
+  }
+  if( ndvss_topk_init(results, k) != SQLITE_OK ) {
+    return SQLITE_NOMEM;
+  }
+  // The first k of a longer sorted list are the best k.
+  results->count = entry->results.count < k ? entry->results.count : k;
+  memcpy(results->distances, entry->results.distances, sizeof(double) * (size_t)results->count);
+  memcpy(results->rowids, entry->results.rowids, sizeof(sqlite3_int64) * (size_t)results->count);
+  if( entry != connection->result_lru_head ) {
+    // Move to the front of the LRU list.
+    entry->lru_prev->lru_next = entry->lru_next;
+    if( entry->lru_next != 0 ) {
+      entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+      connection->result_lru_tail = entry->lru_prev;
+    }
+    entry->lru_prev = 0;
+    entry->lru_next = connection->result_lru_head;
+    connection->result_lru_head->lru_prev = entry;
+    connection->result_lru_head = entry;
+  }
+  NDVSS_STAT_ADD(result_cache_hits, 1);
+  return SQLITE_OK;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_result_cache_put
+// Desc: Stores the sorted results of a search, replacing an older entry of the same
+//       search and evicting the least recently used entries over the limit. The results
+//       of a search in a transaction aren't stored, as they may be rolled back.
+// Returns: SQLITE_OK or SQLITE_NOMEM.
+//----------------------------------------------------------------------------------------
+static int ndvss_result_cache_put( ndvss_connection* connection,
+                                   sqlite3_uint64 hash,
+                                   const char* table,
+                                   const char* column,
+                                   int element_size,
+                                   int metric,
+                                   int method,
+                                   sqlite3_uint64 settings,
+                                   const void* query,
+                                   int query_bytes,
+                                   sqlite3_int64 data_version,
+                                   sqlite3_int64 total_changes,
+                                   int autocommit,
+                                   const ndvss_topk* results )
+{
+  sqlite3_int64 limit = (sqlite3_int64)NDVSS_CONFIG(NDVSS_CONFIG_RESULT_CACHE_ENTRIES);
+  if( limit <= 0 || !autocommit ) {
+    return SQLITE_OK;
+  }
+  if( connection->result_buckets == 0 ) {
+    connection->result_buckets = (ndvss_result_entry**)sqlite3_malloc(sizeof(ndvss_result_entry*) * NDVSS_RESULT_CACHE_BUCKETS);
+    if( connection->result_buckets == 0 ) {
+      return SQLITE_NOMEM;
+    }
+    memset(connection->result_buckets, 0, sizeof(ndvss_result_entry*) * NDVSS_RESULT_CACHE_BUCKETS);
+  }
+  ndvss_result_entry* old = ndvss_result_cache_find(connection, hash, table, column, element_size, 
+                                                    metric, method, settings, query, query_bytes);
+  if( old != 0 ) {
+    ndvss_result_cache_remove(connection, old);
+  }
+  ndvss_result_entry* entry = (ndvss_result_entry*)sqlite3_malloc(sizeof(ndvss_result_entry));
+  if( entry == 0 ) {
+    return SQLITE_NOMEM;
+  }
+  memset(entry, 0, sizeof(ndvss_result_entry));
+  entry->hash = hash;
+  entry->table = sqlite3_mprintf("%s", table);
+  entry->column = sqlite3_mprintf("%s", column);
+  entry->element_size = element_size;
+  entry->metric = metric;
+  entry->method = method;
+  entry->settings = settings;
+  entry->query_bytes = query_bytes;
+  entry->query = sqlite3_malloc(query_bytes);
+  entry->data_version = data_version;
+  entry->total_changes = total_changes;
+  entry->autocommit = autocommit;
+  if( entry->table == 0 || entry->column == 0 || entry->query == 0 ||
+      ndvss_topk_init(&entry->results, results->k) != SQLITE_OK ) {
+    sqlite3_free(entry->table);
+    sqlite3_free(entry->column);
+    sqlite3_free(entry->query);
+    sqlite3_free(entry);
+    return SQLITE_NOMEM;
+  }
+  memcpy(entry->query, query, (size_t)query_bytes);
+  entry->results.count = results->count;
+  memcpy(entry->results.distances, results->distances, sizeof(double) * (size_t)results->count);
+  memcpy(entry->results.rowids, results->rowids, sizeof(sqlite3_int64) * (size_t)results->count);
+  entry->bytes = (sqlite3_int64)sizeof(ndvss_result_entry) + query_bytes + 
+                 (sqlite3_int64)(sizeof(double) + sizeof(sqlite3_int64)) * results->k;
+
+  ndvss_result_entry** bucket = &connection->result_buckets[hash % NDVSS_RESULT_CACHE_BUCKETS];
+  entry->bucket_next = *bucket;
+  *bucket = entry;
+  entry->lru_next = connection->result_lru_head;
+  if( connection->result_lru_head != 0 ) {
+    connection->result_lru_head->lru_prev = entry;
+  } else {
+    connection->result_lru_tail = entry;
+  }
+  connection->result_lru_head = entry;
+  ++connection->result_count;
+  NDVSS_STAT_ADD(result_cache_entries, 1);
+  NDVSS_STAT_ADD(result_cache_bytes, entry->bytes);
+
+  while( connection->result_count > limit ) {
+    ndvss_result_cache_remove(connection, connection->result_lru_tail);
+    NDVSS_STAT_ADD(result_cache_evictions, 1);
+  }
+  // Over memory_limit, the sets that no search is using go first, then the results.
+  ndvss_memory_note();
+  ndvss_memory_enforce();
+  sqlite3_int64 memory_limit = (sqlite3_int64)NDVSS_CONFIG(NDVSS_CONFIG_MEMORY_LIMIT);
+  while( memory_limit > 0 && connection->result_count > 1 && ndvss_memory_used() > memory_limit ) {
+    ndvss_result_cache_remove(connection, connection->result_lru_tail);
+    NDVSS_STAT_ADD(result_cache_evictions, 1);
+  }
+  return SQLITE_OK;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_semantic_cache_get
+// Desc: Looks for a cached search of the same source whose searched vector is within 
+//       semantic_cache_epsilon (cosine distance) of the given one. The candidates of the
+//       closest such search are read from the table and reranked against the new 
+//       vector. The recent searched vectors are few, so they are simply compared one by
+//       one.
+// Args: Connection state, schema, table and column names, key of the search as in
+//       ndvss_result_cache_get, k, data version, total changes and autocommit, the 
+//       top-k that receives the sorted results.
+// Returns: SQLITE_OK on a hit, SQLITE_NOTFOUND on a miss or an error code.
+//----------------------------------------------------------------------------------------
+static int ndvss_semantic_cache_get( ndvss_connection* connection,
+                                     const char* db_name,
+                                     const char* table_name,
+                                     const char* table,
+                                     const char* column,
+                                     int element_size,
+                                     int metric,
+                                     int method,
+                                     sqlite3_uint64 settings,
+                                     const void* query,
+                                     int query_bytes,
+                                     int k,
+                                     sqlite3_int64 data_version,
+                                     sqlite3_int64 total_changes,
+                                     int autocommit,
+                                     ndvss_topk* results )
+{
+  double epsilon = NDVSS_CONFIG(NDVSS_CONFIG_SEMANTIC_CACHE_EPSILON);
+  int dimensions = query_bytes / element_size;
+  ndvss_result_entry* best = 0;
+  double best_similarity = 1.0 - epsilon;
+  ndvss_result_entry* entry = connection->result_lru_head;
+  while( entry != 0 ) {
+    ndvss_result_entry* next = entry->lru_next;
+    if( entry->element_size == element_size && entry->metric == metric && entry->method == method &&
+        entry->settings == settings && entry->query_bytes == query_bytes &&
+        sqlite3_stricmp(entry->table, table) == 0 && sqlite3_stricmp(entry->column, column) == 0 ) {
+      // Stale the same way as in ndvss_result_cache_get, also across a rollback.
+      if( entry->data_version != data_version || entry->total_changes != total_changes || 
+          (!entry->autocommit && autocommit) ) {
+        ndvss_result_cache_remove(connection, entry);
+        NDVSS_STAT_ADD(semantic_cache_stale, 1);
+      } else if( entry->results.k >= k ) {
+        double similarity = 0.0;
+        int ok = element_size == sizeof(double)
+          ? ndvss_cosine_kernel_d((const double*)query, (const double*)entry->query, dimensions, &similarity)
+          : ndvss_cosine_kernel_f((const float*)query, (const float*)entry->query, dimensions, &similarity);
+        if( ok && similarity >= best_similarity ) {
+          best = entry;
+          best_similarity = similarity;
+        }
+      }
+    }
+    entry = next;
+  }//endwhile entries
+  if( best == 0 ) {
+    NDVSS_STAT_ADD(semantic_cache_misses, 1);
+    return SQLITE_NOTFOUND;
+  }
+
+  // Rerank the candidates with the vectors read from the table.
+  int rc = ndvss_topk_init(results, k);
+  void* vector = rc == SQLITE_OK ? ndvss_aligned_malloc((sqlite3_uint64)query_bytes, NDVSS_ALIGNMENT) : 0;
+  if( vector == 0 ) {
+    return SQLITE_NOMEM;
+  }
+  sqlite3_blob* blob = 0;
+  int i;
+  for( i = 0; i < best->results.count && rc == SQLITE_OK; ++i ) {
+    sqlite3_int64 rowid = best->results.rowids[i];
+    rc = blob == 0 ? sqlite3_blob_open(connection->db, db_name, table_name, column, rowid, 0, &blob)
+                   : sqlite3_blob_reopen(blob, rowid);
+    if( rc == SQLITE_OK && sqlite3_blob_bytes(blob) != query_bytes ) {
+      rc = SQLITE_ERROR;
+    }
+    if( rc == SQLITE_OK ) {
+      rc = sqlite3_blob_read(blob, vector, query_bytes, 0);
+    }
+    double distance;
+    if( rc == SQLITE_OK && ndvss_metric_distance(metric, element_size, query, vector, dimensions, &distance) &&
+        distance < ndvss_topk_bound(results) ) {
+      ndvss_topk_push(results, distance, rowid);
+    }
+  }//endfor candidates
+  sqlite3_blob_close(blob);
+  ndvss_aligned_free(vector);
+  if( rc != SQLITE_OK ) {
+    // Not worth an error, the caller scans instead.
+    ndvss_topk_free(results);
+    NDVSS_STAT_ADD(semantic_cache_misses, 1);
+    return rc == SQLITE_NOMEM ? SQLITE_NOMEM : SQLITE_NOTFOUND;
+  }
+  ndvss_topk_sort(results);
+  NDVSS_STAT_ADD(semantic_cache_hits, 1);
+  return SQLITE_OK;
+}
+
+
+//----------------------------------------------------------------------------------------
+// SCORE SAMPLES.
+// A reservoir sample of estimate_sample vectors of a column estimates how many rows a 
+// similarity threshold lets through: the fraction of the sample that passes, times the
+// rows of the column. For a searched vector that isn't known yet, e.g. a parameter of
+// a statement that is being planned, the quantiles of the distances between the sampled
+// vectors stand in for it. The samples are kept per connection and taken again when
+// ndvss_estimate_count_f/_d finds the table changed; the k-NN functions only use the
+// sample that is there when a statement is planned.
+//----------------------------------------------------------------------------------------
+#define NDVSS_SAMPLE_QUANTILES   256
+#define NDVSS_SAMPLE_PROBES      64      // Sampled vectors compared to the rest for the quantiles.
+#define NDVSS_METRIC_COUNT       4
+
+struct ndvss_score_sample {
+  char*               db_name;
+  char*               table_name;
+  char*               column_name;
+  int                 element_size;
+  int                 vector_bytes;
+  int                 stride;         // Bytes between vectors, a multiple of NDVSS_ALIGNMENT.
+  int                 count;          // Vectors in the sample.
+  sqlite3_int64       rows;           // Vectors in the column when it was sampled.
+  sqlite3_int64       data_version;
+  sqlite3_int64       total_changes;
+  unsigned char*      vectors;
+  double*             quantiles[NDVSS_METRIC_COUNT]; // NDVSS_SAMPLE_QUANTILES + 1 distances
+                                      // between sampled vectors, 0 until first needed.
+  ndvss_score_sample* next;
+};
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_score_sample_free
+//----------------------------------------------------------------------------------------
+static void ndvss_score_sample_free( ndvss_score_sample* sample )
+{
+  if( sample == 0 ) {
+    return;
+  }
+  int i;
+  for( i = 0; i < NDVSS_METRIC_COUNT; ++i ) {
+    sqlite3_free(sample->quantiles[i]);
+  }
+  sqlite3_free(sample->db_name);
+  sqlite3_free(sample->table_name);
+  sqlite3_free(sample->column_name);
+  ndvss_aligned_free(sample->vectors);
+  sqlite3_free(sample);
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_score_sample_clear
+// Desc: Frees the samples of a connection.
+//----------------------------------------------------------------------------------------
+static void ndvss_score_sample_clear( ndvss_connection* connection )
+{
+  while( connection->score_samples != 0 ) {
+    ndvss_score_sample* next = connection->score_samples->next;
+    ndvss_score_sample_free(connection->score_samples);
+    connection->score_samples = next;
+  }
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_score_sample_find
+// Desc: Finds the sample of a column, without checking if the table has changed.
+// Returns: The sample or 0.
+//----------------------------------------------------------------------------------------
+static ndvss_score_sample* ndvss_score_sample_find( ndvss_connection* connection,
+                                                    const char* db_name,
+                                                    const char* table_name,
+                                                    const char* column_name,
+                                                    int element_size )
+{
+  ndvss_score_sample* sample;
+  for( sample = connection->score_samples; sample != 0; sample = sample->next ) {
+    if( sample->element_size == element_size &&
+        sqlite3_stricmp(sample->db_name, db_name) == 0 &&
+        sqlite3_stricmp(sample->table_name, table_name) == 0 &&
+        sqlite3_stricmp(sample->column_name, column_name) == 0 ) {
+      return sample;
+    }
+  }
+  return 0;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_score_sample_get
+// Desc: Returns the sample of a column, taking it if there is none or the table has 
+//       changed since.
+// Args: Connection, schema, table and column names, element size, where the sample is
+//       stored and where an error message is stored.
+// Returns: SQLite result code.
+//----------------------------------------------------------------------------------------
+static int ndvss_score_sample_get( ndvss_connection* connection,
+                                   const char* db_name,
+                                   const char* table_name,
+                                   const char* column_name,
+                                   int element_size,
+                                   ndvss_score_sample** result,
+                                   char** error_message )
+{
+  sqlite3* db = connection->db;
+  sqlite3_int64 data_version = 0, total_changes = 0;
+  int rc = ndvss_table_snapshot(db, db_name, &data_version, &total_changes);
+  if( rc != SQLITE_OK ) {
+    *error_message = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+    return rc;
+  }
+  ndvss_score_sample* old = ndvss_score_sample_find(connection, db_name, table_name, column_name, element_size);
+  if( old != 0 && old->data_version == data_version && old->total_changes == total_changes ) {
+    *result = old;
+    return SQLITE_OK;
+  }
+  int capacity = (int)NDVSS_CONFIG(NDVSS_CONFIG_ESTIMATE_SAMPLE);
+  ndvss_score_sample* sample = (ndvss_score_sample*)sqlite3_malloc(sizeof(ndvss_score_sample));
+  if( sample == 0 ) {
+    return SQLITE_NOMEM;
+  }
+  memset(sample, 0, sizeof(ndvss_score_sample));
+  sample->db_name = sqlite3_mprintf("%s", db_name);
+  sample->table_name = sqlite3_mprintf("%s", table_name);
+  sample->column_name = sqlite3_mprintf("%s", column_name);
+  sample->element_size = element_size;
+  sample->data_version = data_version;
+  sample->total_changes = total_changes;
+  if( sample->db_name == 0 || sample->table_name == 0 || sample->column_name == 0 ) {
+    rc = SQLITE_NOMEM;
+  }
+  sqlite3_stmt* stmt = 0;
+  if( rc == SQLITE_OK ) {
+    rc = ndvss_vector_select_prepare(db, db_name, table_name, column_name, &stmt, error_message);
+  }
+
+  // Reservoir sample of the column.
+  sqlite3_uint64 random_state = 0x9E3779B97F4A7C15ULL;
+  int step = SQLITE_DONE;
+  while( rc == SQLITE_OK && (step = sqlite3_step(stmt)) == SQLITE_ROW ) {
+    int bytes = sqlite3_column_bytes(stmt, 1);
+    if( sample->vectors == 0 ) {
+      if( bytes < element_size ) {
+        *error_message = sqlite3_mprintf("The arrays are empty.");
+        rc = SQLITE_ERROR;
+        break;
+      }
+      sample->vector_bytes = bytes;
+      sample->stride = (bytes + NDVSS_ALIGNMENT - 1) & ~(NDVSS_ALIGNMENT - 1);
+      sample->vectors = (unsigned char*)ndvss_aligned_malloc((sqlite3_uint64)sample->stride * (sqlite3_uint64)capacity, 
+                                                             NDVSS_ALIGNMENT);
+      if( sample->vectors == 0 ) {
+        rc = SQLITE_NOMEM;
+        break;
+      }
+    }
+    if( bytes != sample->vector_bytes ) {
+      *error_message = sqlite3_mprintf("The arrays are not the same length.");
+      rc = SQLITE_ERROR;
+      break;
+    }
+    sqlite3_int64 slot = sample->rows++;
+    if( slot >= capacity ) {
+      random_state = random_state * 6364136223846793005ULL + 1442695040888963407ULL;
+      slot = (sqlite3_int64)((random_state >> 11) % (sqlite3_uint64)sample->rows);
+      if( slot >= capacity ) {
+        continue;
+      }
+    } else {
+      ++sample->count;
+    }
+    memcpy(sample->vectors + (size_t)sample->stride * (size_t)slot, sqlite3_column_blob(stmt, 1), (size_t)bytes);
+  }//endwhile reading rows
+  if( rc == SQLITE_OK && step != SQLITE_DONE ) {
+    *error_message = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+    rc = SQLITE_ERROR;
+  }
+  sqlite3_finalize(stmt);
+  if( rc != SQLITE_OK ) {
+    ndvss_score_sample_free(sample);
+    return rc;
+  }
+  if( old != 0 ) {
+    ndvss_score_sample** link = &connection->score_samples;
+    while( *link != old ) {
+      link = &(*link)->next;
+    }
+    *link = old->next;
+    ndvss_score_sample_free(old);
+  }
+  sample->next = connection->score_samples;
+  connection->score_samples = sample;
+  NDVSS_STAT_ADD(score_samples, 1);
+  *result = sample;
+  return SQLITE_OK;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_metric_distance_limit
+// Desc: Converts a similarity threshold to the largest distance that passes it. With 
+//       cosine and dot product the rows at least as similar pass, with the euclidean
+//       metrics, whose similarity is a distance, the rows at most as far.
+//----------------------------------------------------------------------------------------
+static double ndvss_metric_distance_limit( int metric, double threshold )
+{
+  switch( metric ) {
+    case NDVSS_METRIC_COSINE:
+    case NDVSS_METRIC_DOT_PRODUCT:
+      return -threshold;
+    case NDVSS_METRIC_EUCLIDEAN:
+      return threshold < 0.0 ? -1.0 : threshold * threshold;
+    default:
+      return threshold;
+  }
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_compare_doubles
+// Desc: qsort comparator of doubles, smallest first.
+//----------------------------------------------------------------------------------------
+static int ndvss_compare_doubles( const void* a, const void* b )
+{
+  double x = *(const double*)a;
+  double y = *(const double*)b;
+  return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_score_sample_estimate
+// Desc: Estimates how many rows of the column pass a similarity threshold.
+// Args: Sample, metric, searched vector of the size of the sampled ones, or 0 if it 
+//       isn't known, and the similarity threshold.
+// Returns: The estimate, or -1 if out of memory.
+//----------------------------------------------------------------------------------------
+static double ndvss_score_sample_estimate( ndvss_score_sample* sample,
+                                           int metric,
+                                           const void* searched_array,
+                                           double threshold )
+{
+  if( sample->count == 0 ) {
+    return 0.0;
+  }
+  double limit = ndvss_metric_distance_limit(metric, threshold);
+  int dimensions = sample->vector_bytes / sample->element_size;
+  int i;
+  if( searched_array != 0 ) {
+    int passed = 0;
+    for( i = 0; i < sample->count; ++i ) {
+      double distance;
+      if( ndvss_metric_distance(metric, sample->element_size, searched_array, 
+                                sample->vectors + (size_t)sample->stride * (size_t)i, dimensions, &distance) &&
+          distance <= limit ) {
+        ++passed;
+      }
+    }
+    return (double)sample->rows * passed / sample->count;
+  }
+  if( sample->quantiles[metric] == 0 ) {
+    int probes = sample->count < NDVSS_SAMPLE_PROBES ? sample->count : NDVSS_SAMPLE_PROBES;
+    sqlite3_int64 pair_count = 0;
+    double* distances = (double*)sqlite3_malloc64(sizeof(double) * (sqlite3_uint64)probes * (sqlite3_uint64)sample->count);
+    double* quantiles = (double*)sqlite3_malloc64(sizeof(double) * (NDVSS_SAMPLE_QUANTILES + 1));
+    if( distances == 0 || quantiles == 0 ) {
+      sqlite3_free(distances);
+      sqlite3_free(quantiles);
+      return -1.0;
+    }
+    int j;
+    for( i = 0; i < probes; ++i ) {
+      const unsigned char* probe = sample->vectors + (size_t)sample->stride * (size_t)i;
+      for( j = 0; j < sample->count; ++j ) {
+        double distance;
+        if( j != i && ndvss_metric_distance(metric, sample->element_size, probe, 
+                                            sample->vectors + (size_t)sample->stride * (size_t)j, dimensions, &distance) ) {
+          distances[pair_count++] = distance;
+        }
+      }
+    }
+    qsort(distances, (size_t)pair_count, sizeof(double), ndvss_compare_doubles);
+    for( i = 0; i <= NDVSS_SAMPLE_QUANTILES; ++i ) {
+      quantiles[i] = pair_count > 0 ? distances[(pair_count - 1) * i / NDVSS_SAMPLE_QUANTILES] : 0.0;
+    }
+    sqlite3_free(distances);
+    sample->quantiles[metric] = quantiles;
+  }
+  // Fraction of the pairs within the limit, interpolated between the quantiles.
+  const double* quantiles = sample->quantiles[metric];
+  double fraction;
+  if( limit < quantiles[0] ) {
+    fraction = 0.0;
+  } else if( limit >= quantiles[NDVSS_SAMPLE_QUANTILES] ) {
+    fraction = 1.0;
+  } else {
+    i = 0;
+    while( quantiles[i + 1] <= limit ) {
+      ++i;
+    }
+    double width = quantiles[i + 1] - quantiles[i];
+    fraction = (i + (width > 0.0 ? (limit - quantiles[i]) / width : 0.0)) / NDVSS_SAMPLE_QUANTILES;
+  }
+  return (double)sample->rows * fraction;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_estimate_count
+// Desc: Shared implementation of ndvss_estimate_count_f/_d. Estimates how many rows of
+//       a column are at least as similar to the searched vector as the threshold (at 
+//       most as far, for the euclidean metrics). With a NULL searched vector the 
+//       estimate is for a typical vector of the column.
+//----------------------------------------------------------------------------------------
+static void ndvss_estimate_count( sqlite3_context* context,
+                                  int argc,
+                                  sqlite3_value** argv,
+                                  int element_size )
+{
+  if( argc < 4 || sqlite3_value_type(argv[1]) == SQLITE_NULL || sqlite3_value_type(argv[2]) == SQLITE_NULL ||
+      sqlite3_value_type(argv[3]) == SQLITE_NULL ) {
+    sqlite3_result_error(context, "One of the required arguments is null.", -1);
+    return;
+  }
+  const char* metric_name = argc > 4 ? (const char*)sqlite3_value_text(argv[4]) : 0;
+  int metric = ndvss_metric_from_name(metric_name);
+  if( metric < 0 ) {
+    sqlite3_result_error(context, "Unknown metric. Use cosine, euclidean, euclidean_squared or dot_product.", -1);
+    return;
+  }
+  ndvss_connection* connection = (ndvss_connection*)sqlite3_user_data(context);
+  const char* table = (const char*)sqlite3_value_text(argv[1]);
+  const char* column = (const char*)sqlite3_value_text(argv[2]);
+  double threshold = sqlite3_value_double(argv[3]);
+  const char* dot = strchr(table, '.');
+  char* db_name = dot != 0 ? sqlite3_mprintf("%.*s", (int)(dot - table), table) : sqlite3_mprintf("main");
+  if( db_name == 0 ) {
+    sqlite3_result_error_nomem(context);
+    return;
+  }
+  ndvss_score_sample* sample = 0;
+  char* error_message = 0;
+  int rc = ndvss_score_sample_get(connection, db_name, dot != 0 ? dot + 1 : table, column, element_size, 
+                                  &sample, &error_message);
+  sqlite3_free(db_name);
+  if( rc != SQLITE_OK ) {
+    sqlite3_result_error(context, error_message != 0 ? error_message : sqlite3_errstr(rc), -1);
+    sqlite3_free(error_message);
+    return;
+  }
+  void* searched_array = 0;
+  if( sqlite3_value_type(argv[0]) != SQLITE_NULL ) {
+    if( sample->count > 0 && sqlite3_value_bytes(argv[0]) != sample->vector_bytes ) {
+      sqlite3_result_error(context, "The arrays are not the same length.", -1);
+      return;
+    }
+    if( sqlite3_value_bytes(argv[0]) < element_size ) {
+      sqlite3_result_error(context, "The searched array is empty.", -1);
+      return;
+    }
+    // Aligned like the sampled vectors.
+    searched_array = ndvss_aligned_malloc((sqlite3_uint64)sqlite3_value_bytes(argv[0]), NDVSS_ALIGNMENT);
+    if( searched_array == 0 ) {
+      sqlite3_result_error_nomem(context);
+      return;
+    }
+    memcpy(searched_array, sqlite3_value_blob(argv[0]), (size_t)sqlite3_value_bytes(argv[0]));
+  }
+  double estimate = ndvss_score_sample_estimate(sample, metric, searched_array, threshold);
+  ndvss_aligned_free(searched_array);
+  if( estimate < 0.0 ) {
+    sqlite3_result_error_nomem(context);
+    return;
+  }
+  sqlite3_result_int64(context, (sqlite3_int64)(estimate + 0.5));
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_estimate_count_d
+//----------------------------------------------------------------------------------------
+static void ndvss_estimate_count_d( sqlite3_context* context,
+                                    int argc,
+                                    sqlite3_value** argv ) 
+{
+  ndvss_estimate_count(context, argc, argv, sizeof(double));
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_estimate_count_f
+//----------------------------------------------------------------------------------------
+static void ndvss_estimate_count_f( sqlite3_context* context,
+                                    int argc,
+                                    sqlite3_value** argv ) 
+{
+  ndvss_estimate_count(context, argc, argv, sizeof(float));
+}
+
+
+//----------------------------------------------------------------------------------------
+// SCAN.
+// A scan is split into work items of at most NDVSS_SCAN_ITEM_BYTES. The items are
+// grouped by the NUMA node of their segment and each thread first takes the items of
+// its own node, then helps with the rest. Every thread keeps its own top-k and they are
+// merged at the end.
+// With search_budget_ms or search_budget_rows the threads stop taking items when the 
+// budget is spent and the top-k is flagged as partial. If the set has inverted lists 
+// (see IVF SCAN ORDER) the items are then cut from the lists instead, nearest list first,
+// so that the vectors seen before the budget runs out are the likely ones.
+//----------------------------------------------------------------------------------------
+#define NDVSS_SCAN_ITEM_BYTES (4 * 1024 * 1024)
+
+typedef struct ndvss_scan_item {
+  int           segment;    // -1 = the range is in the positions of the inverted lists.
+  sqlite3_int64 first;      // Range of vectors inside the segment.
+  sqlite3_int64 last;
+} ndvss_scan_item;
+
+struct ndvss_ivf {
+  int             list_count;
+  int             dimensions;
+  int             centroid_stride;  // Floats between centroids.
+  float*          centroids;
+  sqlite3_int64*  list_first;       // List l is positions[list_first[l], list_first[l+1]).
+  sqlite3_int64*  positions;        // Indexes of the vectors in the set, ascending in each list.
+};
+
+typedef struct ndvss_ivf_order {
+  double distance;                  // From the searched vector to the centroid.
+  int    list;
+} ndvss_ivf_order;
+
+typedef struct ndvss_scan_shared {
+  const ndvss_vector_set* set;
+  int                     metric;
+  const void*             searched_array;
+  ndvss_scan_item*        items;                                  // Sorted by node.
+  const sqlite3_int64*    positions;                              // Of the inverted lists, if the items use them.
+  double                  deadline;                               // ndvss_now() when the budget runs out, 0 = none.
+  sqlite3_int64           row_budget;                             // 0 = none.
+  sqlite3_int64           rows_claimed;                           // Vectors taken by the threads so far.
+  int                     stopped;                                // Set when the budget ran out.
+  ndvss_task*             task;                                   // Of the statement, 0 = none.
+  int                     node_count;
+  int                     node_first[NDVSS_MAX_NUMA_NODES + 1];   // Items of node n are [node_first[n], node_first[n+1]).
+  int                     node_cursor[NDVSS_MAX_NUMA_NODES];      // Next free item of each node.
+} ndvss_scan_shared;
+
+typedef struct ndvss_scan_worker {
+  ndvss_scan_shared* shared;
+  int                node;      // Home node of the worker.
+  int                pin;       // 1 = pin the thread to the CPUs of the home node.
+  ndvss_topk         topk;
+  ndvss_thread       thread;
+  int                started;
+} ndvss_scan_worker;
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_prefetch_vector
+// Desc: Prefetches every cache line of a vector.
+//----------------------------------------------------------------------------------------
+static inline void ndvss_prefetch_vector( const unsigned char* vector, int bytes, int nontemporal )
+{
+  #ifdef USE_AVX
+  int offset;
+  if( nontemporal ) {
+    for( offset = 0; offset < bytes; offset += NDVSS_ALIGNMENT ) {
+      _mm_prefetch((const char*)(vector + offset), _MM_HINT_NTA);
+    }
+  } else {
+    for( offset = 0; offset < bytes; offset += NDVSS_ALIGNMENT ) {
+      _mm_prefetch((const char*)(vector + offset), _MM_HINT_T0);
+    }
+  }
+  #endif
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_scan_vectors
+// Desc: Scores the vectors [first, last) of a segment against the searched vector and
+//       offers them to the top-k. The vectors a few rows ahead are prefetched so that
+//       the kernels don't wait for memory.
+// Args: Vector set, segment, first and last index in the segment, metric, searched
+//       vector, top-k.
+//----------------------------------------------------------------------------------------
+static void ndvss_scan_vectors( const ndvss_vector_set* set,
+                                const ndvss_segment* segment,
+                                int first,
+                                int last,
+                                int metric,
+                                const void* searched_array,
+                                ndvss_topk* topk )
+{
+  const int stride = set->stride;
+  const int dimensions = set->dimensions;
+  const int element_size = set->element_size;
+  const int prefetch_distance = (int)NDVSS_CONFIG(NDVSS_CONFIG_PREFETCH_DISTANCE);
+  const int nontemporal = (int)NDVSS_CONFIG(NDVSS_CONFIG_SCAN_NONTEMPORAL);
+  const sqlite3_int64* rowids = set->rowids + segment->first;
+  const unsigned char* deleted = segment->deleted;
+  const unsigned char* vector = segment->vectors + (size_t)stride * (size_t)first;
+  int i;
+
+  // Warm up the prefetch window.
+  for( i = first; i < first + prefetch_distance && i < last; ++i ) {
+    ndvss_prefetch_vector(segment->vectors + (size_t)stride * (size_t)i, set->vector_bytes, nontemporal);
+  }
+  for( i = first; i < last; ++i, vector += stride ) {
+    if( prefetch_distance > 0 && i + prefetch_distance < last ) {
+      ndvss_prefetch_vector(vector + (size_t)stride * (size_t)prefetch_distance, set->vector_bytes, nontemporal);
+    }
+    double distance;
+    if( ndvss_metric_distance(metric, element_size, searched_array, vector, dimensions, &distance) &&
+        distance < ndvss_topk_bound(topk) && (deleted == 0 || !(deleted[i >> 3] & (1 << (i & 7)))) ) {
+      ndvss_topk_push(topk, distance, rowids[i]);
+    }
+  }//endfor vectors
+}
+
+
+static int ndvss_vector_set_segment( const ndvss_vector_set* set, sqlite3_int64 index );
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_scan_positions
+// Desc: Scores the vectors of a set at the given ascending positions, like 
+//       ndvss_scan_vectors does for a range of a segment.
+// Args: Vector set, positions and their count, metric, searched vector, top-k.
+//----------------------------------------------------------------------------------------
+static void ndvss_scan_positions( const ndvss_vector_set* set,
+                                  const sqlite3_int64* positions,
+                                  sqlite3_int64 count,
+                                  int metric,
+                                  const void* searched_array,
+                                  ndvss_topk* topk )
+{
+  if( count <= 0 ) {
+    return;
+  }
+  const int prefetch_distance = (int)NDVSS_CONFIG(NDVSS_CONFIG_PREFETCH_DISTANCE);
+  const int nontemporal = (int)NDVSS_CONFIG(NDVSS_CONFIG_SCAN_NONTEMPORAL);
+  int s = ndvss_vector_set_segment(set, positions[0]);
+  const ndvss_segment* segment = &set->segments[s];
+  sqlite3_int64 i;
+  for( i = 0; i < count; ++i ) {
+    while( positions[i] >= segment->first + segment->count ) {
+      segment = &set->segments[++s];
+    }
+    int index = (int)(positions[i] - segment->first);
+    const unsigned char* vector = segment->vectors + (size_t)set->stride * (size_t)index;
+    if( prefetch_distance > 0 && i + prefetch_distance < count && 
+        positions[i + prefetch_distance] < segment->first + segment->count ) {
+      ndvss_prefetch_vector(segment->vectors + (size_t)set->stride * (size_t)(positions[i + prefetch_distance] - segment->first),
+                            set->vector_bytes, nontemporal);
+    }
+    double distance;
+    if( ndvss_metric_distance(metric, set->element_size, searched_array, vector, set->dimensions, &distance) &&
+        distance < ndvss_topk_bound(topk) && 
+        (segment->deleted == 0 || !(segment->deleted[index >> 3] & (1 << (index & 7)))) ) {
+      ndvss_topk_push(topk, distance, set->rowids[positions[i]]);
+    }
+  }//endfor positions
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_scan_worker_run
+// Desc: Thread function of a scan worker: takes work items until there are none left,
+//       the search budget is spent or the task is interrupted.
+//----------------------------------------------------------------------------------------
+static NDVSS_THREAD_PROC ndvss_scan_worker_run( void* arg )
+{
+  ndvss_scan_worker* worker = (ndvss_scan_worker*)arg;
+  ndvss_scan_shared* shared = worker->shared;
+  if( worker->pin ) {
+    ndvss_numa_pin_thread(worker->node);
+  }
+  int n;
+  for( n = 0; n < shared->node_count; ++n ) {
+    int node = (worker->node + n) % shared->node_count;
+    int available = shared->node_first[node + 1] - shared->node_first[node];
+    for( ;; ) {
+      int i = __atomic_fetch_add(&shared->node_cursor[node], 1, __ATOMIC_RELAXED);
+      if( i >= available ) {
+        break;
+      }
+      const ndvss_scan_item* item = &shared->items[shared->node_first[node] + i];
+      sqlite3_int64 last = item->last;
+      if( ndvss_task_interrupted(shared->task) ) {
+        return 0;
+      }
+      if( __atomic_load_n(&shared->stopped, __ATOMIC_RELAXED) || 
+          (shared->deadline > 0.0 && ndvss_now() >= shared->deadline) ) {
+        __atomic_store_n(&shared->stopped, 1, __ATOMIC_RELAXED);
+        return 0;
+      }
+      if( shared->row_budget > 0 ) {
+        sqlite3_int64 claimed = __atomic_fetch_add(&shared->rows_claimed, last - item->first, __ATOMIC_RELAXED);
+        if( claimed + (last - item->first) > shared->row_budget ) {
+          __atomic_store_n(&shared->stopped, 1, __ATOMIC_RELAXED);
+          last = claimed < shared->row_budget ? item->first + (shared->row_budget - claimed) : item->first;
+        }
+      }
+      if( item->segment < 0 ) {
+        ndvss_scan_positions(shared->set, shared->positions + item->first, last - item->first,
+                             shared->metric, shared->searched_array, &worker->topk);
+      } else {
+        ndvss_scan_vectors(shared->set, &shared->set->segments[item->segment], (int)item->first, (int)last,
+                           shared->metric, shared->searched_array, &worker->topk);
+      }
+      ndvss_task_advance(shared->task, last - item->first);
+    }
+  }//endfor nodes
+  return 0;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_scan_budgeted
+// Returns: 1 if search_budget_ms or search_budget_rows is set.
+//----------------------------------------------------------------------------------------
+static int ndvss_scan_budgeted( void )
+{
+  return NDVSS_CONFIG(NDVSS_CONFIG_SEARCH_BUDGET_MS) > 0 || NDVSS_CONFIG(NDVSS_CONFIG_SEARCH_BUDGET_ROWS) > 0;
+}
+
+
+static void ndvss_to_float( float* target, const void* vector, int dimensions, int element_size );
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_ivf_order_compare
+// Desc: qsort comparator of the lists, nearest centroid first.
+//----------------------------------------------------------------------------------------
+static int ndvss_ivf_order_compare( const void* a, const void* b )
+{
+  const ndvss_ivf_order* x = (const ndvss_ivf_order*)a;
+  const ndvss_ivf_order* y = (const ndvss_ivf_order*)b;
+  if( x->distance != y->distance ) {
+    return x->distance < y->distance ? -1 : 1;
+  }
+  return x->list - y->list;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_scan_ivf_items
+// Desc: Cuts the inverted lists of a set in to work items, the list with the centroid 
+//       nearest to the searched vector first.
+// Args: Set, its inverted lists, metric, searched vector, vectors per item, where the
+//       items and their count are stored.
+// Returns: SQLITE_OK or SQLITE_NOMEM.
+//----------------------------------------------------------------------------------------
+static int ndvss_scan_ivf_items( const ndvss_vector_set* set,
+                                 const ndvss_ivf* ivf,
+                                 int metric,
+                                 const void* searched_array,
+                                 int vectors_per_item,
+                                 ndvss_scan_item** result,
+                                 int* result_count )
+{
+  ndvss_ivf_order* order = (ndvss_ivf_order*)sqlite3_malloc64(sizeof(ndvss_ivf_order) * (sqlite3_uint64)ivf->list_count);
+  float* query = (float*)sqlite3_malloc64(sizeof(float) * (sqlite3_uint64)ivf->dimensions);
+  int item_count = 0;
+  int l;
+  for( l = 0; l < ivf->list_count; ++l ) {
+    sqlite3_int64 size = ivf->list_first[l + 1] - ivf->list_first[l];
+    item_count += (int)((size + vectors_per_item - 1) / vectors_per_item);
+  }
+  ndvss_scan_item* items = (ndvss_scan_item*)sqlite3_malloc64(sizeof(ndvss_scan_item) * (sqlite3_uint64)(item_count > 0 ? item_count : 1));
+  if( order == 0 || query == 0 || items == 0 ) {
+    sqlite3_free(order);
+    sqlite3_free(query);
+    sqlite3_free(items);
+    return SQLITE_NOMEM;
+  }
+  ndvss_to_float(query, searched_array, ivf->dimensions, set->element_size);
+  for( l = 0; l < ivf->list_count; ++l ) {
+    double distance;
+    if( !ndvss_metric_distance(metric, sizeof(float), query, ivf->centroids + (size_t)ivf->centroid_stride * (size_t)l,
+                               ivf->dimensions, &distance) ) {
+      distance = HUGE_VAL;
+    }
+    order[l].distance = distance;
+    order[l].list = l;
+  }
+  qsort(order, (size_t)ivf->list_count, sizeof(ndvss_ivf_order), ndvss_ivf_order_compare);
+  int n = 0;
+  for( l = 0; l < ivf->list_count; ++l ) {
+    sqlite3_int64 first;
+    sqlite3_int64 end = ivf->list_first[order[l].list + 1];
+    for( first = ivf->list_first[order[l].list]; first < end; first += vectors_per_item ) {
+      items[n].segment = -1;
+      items[n].first = first;
+      items[n].last = first + vectors_per_item < end ? first + vectors_per_item : end;
+      ++n;
+    }
+  }
+  sqlite3_free(order);
+  sqlite3_free(query);
+  *result = items;
+  *result_count = n;
+  return SQLITE_OK;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_scan
+// Desc: Finds the k best vectors of a set and updates the scan statistics. Uses up to
+//       scan_threads threads. The calling thread takes part in the scan but is never
+//       pinned, as it belongs to the application.
+// Returns: SQLITE_OK, SQLITE_INTERRUPT or an error code.
+//----------------------------------------------------------------------------------------
+static int ndvss_scan( const ndvss_vector_set* set,
+                       int metric,
+                       const void* searched_array,
+                       ndvss_topk* topk )
+{
+  double start = ndvss_now();
+  int i, s;
+  ndvss_scan_shared shared;
+  memset(&shared, 0, sizeof(shared));
+  shared.set = set;
+  shared.metric = metric;
+  shared.searched_array = searched_array;
+  shared.node_count = 1;
+  shared.task = ndvss_task_current();
+  ndvss_task_phase(shared.task, "scan", set->count);
+  const ndvss_ivf* ivf = 0;
+  if( ndvss_scan_budgeted() ) {
+    double budget_ms = NDVSS_CONFIG(NDVSS_CONFIG_SEARCH_BUDGET_MS);
+    shared.deadline = budget_ms > 0 ? start + budget_ms * 1e-3 : 0.0;
+    shared.row_budget = (sqlite3_int64)NDVSS_CONFIG(NDVSS_CONFIG_SEARCH_BUDGET_ROWS);
+    if( NDVSS_CONFIG(NDVSS_CONFIG_SEARCH_BUDGET_IVF) ) {
+      ivf = __atomic_load_n(&set->ivf, __ATOMIC_ACQUIRE);
+    }
+  }
+
+  // Split the segments, or the inverted lists, in to work items and group them by node.
+  int items_per_segment_max = NDVSS_SCAN_ITEM_BYTES / set->stride;
+  if( items_per_segment_max < 1 ) {
+    items_per_segment_max = 1;
+  }
+  int item_count = 0;
+  if( ivf != 0 ) {
+    int rc = ndvss_scan_ivf_items(set, ivf, metric, searched_array, items_per_segment_max, &shared.items, &item_count);
+    if( rc != SQLITE_OK ) {
+      return rc;
+    }
+    shared.positions = ivf->positions;
+    shared.node_first[1] = item_count;
+  } else {
+    for( s = 0; s < set->segment_count; ++s ) {
+      item_count += (set->segments[s].count + items_per_segment_max - 1) / items_per_segment_max;
+    }
+    for( s = 0; s < set->segment_count; ++s ) {
+      if( set->segments[s].node >= shared.node_count ) {
+        shared.node_count = set->segments[s].node + 1;
+      }
+    }
+    shared.items = (ndvss_scan_item*)sqlite3_malloc64(sizeof(ndvss_scan_item) * (sqlite3_uint64)(item_count > 0 ? item_count : 1));
+    if( shared.items == 0 ) {
+      return SQLITE_NOMEM;
+    }
+    for( s = 0; s < set->segment_count; ++s ) {
+      int node = set->segments[s].node < 0 ? 0 : set->segments[s].node;
+      shared.node_first[node + 1] += (set->segments[s].count + items_per_segment_max - 1) / items_per_segment_max;
+    }
+    for( i = 0; i < shared.node_count; ++i ) {
+      shared.node_first[i + 1] += shared.node_first[i];
+      shared.node_cursor[i] = shared.node_first[i]; // Used as the fill position for now.
+    }
+    for( s = 0; s < set->segment_count; ++s ) {
+      int node = set->segments[s].node < 0 ? 0 : set->segments[s].node;
+      int first;
+      for( first = 0; first < set->segments[s].count; first += items_per_segment_max ) {
+        ndvss_scan_item* item = &shared.items[shared.node_cursor[node]++];
+        item->segment = s;
+        item->first = first;
+        item->last = first + items_per_segment_max < set->segments[s].count ? first + items_per_segment_max : set->segments[s].count;
+      }
+    }
+    for( i = 0; i < shared.node_count; ++i ) {
+      shared.node_cursor[i] = 0;
+    }
+  }
+
+  int thread_count = (int)NDVSS_CONFIG(NDVSS_CONFIG_SCAN_THREADS);
+  if( thread_count == 0 ) {
+    thread_count = ndvss_cpu_count();
+  }
+  if( shared.task != 0 && shared.task->scan_threads > 0 && thread_count > shared.task->scan_threads ) {
+    thread_count = shared.task->scan_threads;
+  }
+  if( thread_count > item_count ) {
+    thread_count = item_count;
+  }
+  int rc = SQLITE_OK;
+  if( thread_count <= 1 ) {
+    ndvss_scan_worker worker;
+    memset(&worker, 0, sizeof(worker));
+    worker.shared = &shared;
+    worker.topk = *topk;
+    ndvss_scan_worker_run(&worker);
+    *topk = worker.topk;
+    thread_count = 1;
+  } else {
+    ndvss_scan_worker* workers = (ndvss_scan_worker*)sqlite3_malloc64(sizeof(ndvss_scan_worker) * (sqlite3_uint64)thread_count);
+    if( workers == 0 ) {
+      sqlite3_free(shared.items);
+      return SQLITE_NOMEM;
+    }
+    memset(workers, 0, sizeof(ndvss_scan_worker) * (size_t)thread_count);
+    for( i = 0; i < thread_count && rc == SQLITE_OK; ++i ) {
+      workers[i].shared = &shared;
+      workers[i].node = i % shared.node_count;
+      workers[i].pin = (i > 0 && shared.node_count > 1);
+      rc = ndvss_topk_init(&workers[i].topk, topk->k);
+    }
+    // Worker 0 runs on the calling thread. If a thread can't be started, the others 
+    // simply take its share of the items.
+    for( i = 1; i < thread_count && rc == SQLITE_OK; ++i ) {
+      workers[i].started = ndvss_thread_start(&workers[i].thread, ndvss_scan_worker_run, &workers[i]) == SQLITE_OK;
+    }
+    if( rc == SQLITE_OK ) {
+      ndvss_scan_worker_run(&workers[0]);
+    }
+    for( i = 1; i < thread_count; ++i ) {
+      if( workers[i].started ) {
+        ndvss_thread_join(workers[i].thread);
+      }
+    }
+    for( i = 0; i < thread_count; ++i ) {
+      int j;
+      for( j = 0; j < workers[i].topk.count; ++j ) {
+        ndvss_topk_push(topk, workers[i].topk.distances[j], workers[i].topk.rowids[j]);
+      }
+      ndvss_topk_free(&workers[i].topk);
+    }
+    sqlite3_free(workers);
+  }
+  sqlite3_free(shared.items);
+  if( rc == SQLITE_OK && ndvss_task_interrupted(shared.task) ) {
+    return SQLITE_INTERRUPT;
+  }
+  // A scan stopped by the row budget counts the rows it was allowed.
+  sqlite3_int64 rows = set->count;
+  if( shared.stopped ) {
+    topk->partial = 1;
+    NDVSS_STAT_ADD(partial_searches, 1);
+    if( shared.row_budget > 0 && shared.row_budget < rows ) {
+      rows = shared.row_budget;
+    }
+  }
+
+  sqlite3_int64 nanoseconds = (sqlite3_int64)((ndvss_now() - start) * 1e9);
+  NDVSS_STAT_SET(last_scan_rows, rows);
+  NDVSS_STAT_SET(last_scan_bytes, rows * (sqlite3_int64)set->vector_bytes);
+  NDVSS_STAT_SET(last_scan_nanoseconds, nanoseconds);
+  NDVSS_STAT_SET(last_scan_threads, thread_count);
+  NDVSS_STAT_ADD(scans, 1);
+  NDVSS_STAT_ADD(scan_rows, rows);
+  NDVSS_STAT_ADD(scan_bytes, rows * (sqlite3_int64)set->vector_bytes);
+  NDVSS_STAT_ADD(scan_nanoseconds, nanoseconds);
+  return rc;
+}
+
+
+//----------------------------------------------------------------------------------------
+// PRODUCT QUANTIZATION.
+// The 'pq' method of the k-NN functions searches a compressed copy of a cached vector
+// set. The dimensions are split in to M sub-vectors and each sub-vector is replaced by
+// the 4-bit index of the nearest of its 16 centroids. The codes of 32 vectors are 
+// stored together, two sub-quantizers per 32 bytes, so that the distances of a block 
+// are looked up from tables of 8-bit distances kept in a register (_mm256_shuffle_epi8)
+// and summed with 16-bit saturating adds. The best k * pq_rerank candidates are then
+// reranked with the exact vectors.
+// The codebooks are trained with k-means the first time the method is used on a set,
+// and they are dropped with the set when its table changes. If ndvss_opq_train_f/_d 
+// has learned a rotation for the column, the vectors are rotated before encoding.
+//
+// Code layout of a block: for each pair of sub-quantizers (m, m + 1), 16 bytes for m 
+// and 16 bytes for m + 1. Byte j holds the code of vector j in the low nibble and the 
+// code of vector j + 16 in the high nibble.
+//----------------------------------------------------------------------------------------
+#define NDVSS_PQ_CENTROIDS        16
+#define NDVSS_PQ_BLOCK_VECTORS    32
+#define NDVSS_PQ_TRAINING_VECTORS 16384  // Sample used to train the codebooks.
+#define NDVSS_PQ_ITERATIONS       16     // k-means iterations.
+#define NDVSS_PQ_CHECK_BLOCKS     1024   // Blocks scanned between interrupt checks.
+#define NDVSS_PQ_CHECK_VECTORS    4096   // Vectors encoded between interrupt checks.
+
+struct ndvss_pq {
+  int            dimensions;
+  int            subquantizers;          // M.
+  int            pairs;                  // (M + 1) / 2, a missing last one has zero codes.
+  int*           sub_first;              // Sub-vector m is the dimensions [sub_first[m], sub_first[m+1]).
+  float*         centroids;              // Centroid c of m at centroids[16 * sub_first[m] + c * size of m].
+  sqlite3_int64  count;
+  sqlite3_int64  block_count;
+  unsigned char* codes;                  // block_count * pairs * 32 bytes.
+  float*         rotation;               // OPQ rotation applied before encoding, or 0.
+  int            mapped;                 // The arrays are in a mapped index file.
+};
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_pq_free
+//----------------------------------------------------------------------------------------
+static void ndvss_pq_free( ndvss_pq* pq )
+{
+  if( pq == 0 ) {
+    return;
+  }
+  if( pq->mapped ) {
+    sqlite3_free(pq);
+    return;
+  }
+  if( pq->codes != 0 ) {
+    NDVSS_STAT_ADD(pq_code_bytes, -(pq->block_count * pq->pairs * 32));
+  }
+  sqlite3_free(pq->sub_first);
+  sqlite3_free(pq->centroids);
+  sqlite3_free(pq->rotation);
+  ndvss_aligned_free(pq->codes);
+  sqlite3_free(pq);
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_pq_memory
+// Desc: Returns the memory of PQ codes and codebooks, 0 for those of an index file.
+//----------------------------------------------------------------------------------------
+static sqlite3_int64 ndvss_pq_memory( const ndvss_pq* pq )
+{
+  if( pq == 0 || pq->mapped ) {
+    return 0;
+  }
+  sqlite3_int64 bytes = (sqlite3_int64)sizeof(ndvss_pq) + pq->block_count * pq->pairs * 32 +
+                        (sqlite3_int64)sizeof(float) * NDVSS_PQ_CENTROIDS * pq->dimensions;
+  if( pq->rotation != 0 ) {
+    bytes += (sqlite3_int64)sizeof(float) * pq->dimensions * pq->dimensions;
+  }
+  return bytes;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_to_float
+// Desc: Copies a vector of floats or doubles to an array of floats.
+//----------------------------------------------------------------------------------------
+static void ndvss_to_float( float* target, const void* vector, int dimensions, int element_size )
+{
+  int i;
+  if( element_size == sizeof(double) ) {
+    for( i = 0; i < dimensions; ++i ) {
+      target[i] = (float)((const double*)vector)[i];
+    }
+  } else {
+    memcpy(target, vector, sizeof(float) * (size_t)dimensions);
+  }
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_pq_nearest
+// Desc: Finds the nearest of the 16 centroids of a sub-quantizer.
+//----------------------------------------------------------------------------------------
+static int ndvss_pq_nearest( const float* centroids, const float* sub_vector, int size )
+{
+  int best = 0;
+  float best_distance = 0.0f;
+  int c, j;
+  for( c = 0; c < NDVSS_PQ_CENTROIDS; ++c ) {
+    const float* centroid = centroids + c * size;
+    float distance = 0.0f;
+    for( j = 0; j < size; ++j ) {
+      float d = sub_vector[j] - centroid[j];
+      distance += d * d;
+    }
+    if( c == 0 || distance < best_distance ) {
+      best = c;
+      best_distance = distance;
+    }
+  }
+  return best;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_pq_kmeans
+// Desc: Trains the 16 centroids of one sub-quantizer with Lloyd's algorithm. The first
+//       centroids are spread over the sample and empty clusters are restarted from a 
+//       sample vector.
+// Args: Training vectors (full vectors, n of them), dimensions, first dimension and 
+//       size of the sub-vector, where the centroids are stored, work memory for 
+//       n assignments, number of iterations, 1 = pick the first centroids, 0 = continue
+//       from the given ones. Every iteration counts 1 for the progress of the task.
+// Returns: SQLITE_OK or SQLITE_INTERRUPT.
+//----------------------------------------------------------------------------------------
+static int ndvss_pq_kmeans( const float* train, 
+                             int n, 
+                             int dimensions, 
+                             int first, 
+                             int size, 
+                             float* centroids,
+                             int* assignment,
+                             int iterations,
+                             int initialize )
+{
+  double sums[NDVSS_PQ_CENTROIDS * 64];
+  double* sum = size <= 64 ? sums : (double*)sqlite3_malloc64(sizeof(double) * NDVSS_PQ_CENTROIDS * (sqlite3_uint64)size);
+  int counts[NDVSS_PQ_CENTROIDS];
+  int c, i, j, iteration;
+  for( c = 0; c < NDVSS_PQ_CENTROIDS && initialize; ++c ) {
+    memcpy(centroids + c * size, train + (size_t)((sqlite3_int64)c * n / NDVSS_PQ_CENTROIDS) * dimensions + first, sizeof(float) * (size_t)size);
+  }
+  if( sum == 0 ) {
+    return SQLITE_OK; // Out of memory: keep the initial centroids.
+  }
+  ndvss_task* task = ndvss_task_current();
+  int rc = SQLITE_OK;
+  for( iteration = 0; iteration < iterations && rc == SQLITE_OK; ++iteration ) {
+    memset(sum, 0, sizeof(double) * NDVSS_PQ_CENTROIDS * (size_t)size);
+    memset(counts, 0, sizeof(counts));
+    for( i = 0; i < n; ++i ) {
+      const float* sub_vector = train + (size_t)i * dimensions + first;
+      c = ndvss_pq_nearest(centroids, sub_vector, size);
+      assignment[i] = c;
+      ++counts[c];
+      for( j = 0; j < size; ++j ) {
+        sum[c * size + j] += sub_vector[j];
+      }
+    }
+    for( c = 0; c < NDVSS_PQ_CENTROIDS; ++c ) {
+      if( counts[c] == 0 ) {
+        int restart = (int)(((sqlite3_int64)iteration * 7919 + c * 104729) % n);
+        memcpy(centroids + c * size, train + (size_t)restart * dimensions + first, sizeof(float) * (size_t)size);
+        continue;
+      }
+      for( j = 0; j < size; ++j ) {
+        centroids[c * size + j] = (float)(sum[c * size + j] / counts[c]);
+      }
+    }
+    if( ndvss_task_advance(task, 1) ) {
+      rc = SQLITE_INTERRUPT;
+    }
+  }//endfor iterations
+  if( sum != sums ) {
+    sqlite3_free(sum);
+  }
+  return rc;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_vector_set_segment
+// Desc: Returns the index of the segment that holds a vector of a set.
+//----------------------------------------------------------------------------------------
+static int ndvss_vector_set_segment( const ndvss_vector_set* set, sqlite3_int64 index )
+{
+  int low = 0, high = set->segment_count - 1;
+  while( low < high ) {
+    int middle = (low + high + 1) / 2;
+    if( set->segments[middle].first <= index ) {
+      low = middle;
+    } else {
+      high = middle - 1;
+    }
+  }
+  return low;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_vector_set_vector
+// Desc: Returns a vector of a set by its index.
+//----------------------------------------------------------------------------------------
+static const unsigned char* ndvss_vector_set_vector( const ndvss_vector_set* set, sqlite3_int64 index )
+{
+  const ndvss_segment* segment = &set->segments[ndvss_vector_set_segment(set, index)];
+  return segment->vectors + (size_t)(index - segment->first) * (size_t)set->stride;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_vector_set_deleted
+// Desc: Returns 1 if a vector of a set is marked deleted.
+//----------------------------------------------------------------------------------------
+static int ndvss_vector_set_deleted( const ndvss_vector_set* set, sqlite3_int64 index )
+{
+  const ndvss_segment* segment = &set->segments[ndvss_vector_set_segment(set, index)];
+  int i = (int)(index - segment->first);
+  return segment->deleted != 0 && (segment->deleted[i >> 3] & (1 << (i & 7))) != 0;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_axpy
+// Desc: Adds a scaled vector to another: target += a * vector.
+// Args: Scale, vector, target, dimensions.
+//----------------------------------------------------------------------------------------
+static void ndvss_axpy( float a, const float* vector, float* target, int dimensions )
+{
+  int j = 0;
+  #ifdef USE_AVX
+  __m256 broadcast = _mm256_set1_ps(a);
+  for( ; j + 8 <= dimensions; j += 8 ) {
+    #ifdef __AVX2__
+    _mm256_storeu_ps(target + j, _mm256_fmadd_ps(broadcast, _mm256_loadu_ps(vector + j), _mm256_loadu_ps(target + j)));
+    #else
+    _mm256_storeu_ps(target + j, _mm256_add_ps(_mm256_mul_ps(broadcast, _mm256_loadu_ps(vector + j)), _mm256_loadu_ps(target + j)));
+    #endif
+  }
+  #endif
+  for( ; j < dimensions; ++j ) {
+    target[j] += a * vector[j];
+  }
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_rotate
+// Desc: Multiplies a row vector with a square matrix: target = vector * rotation.
+// Args: Rotation (row-major, dimensions x dimensions), vector, target, dimensions.
+//----------------------------------------------------------------------------------------
+static void ndvss_rotate( const float* rotation, const float* vector, float* target, int dimensions )
+{
+  int i;
+  memset(target, 0, sizeof(float) * (size_t)dimensions);
+  for( i = 0; i < dimensions; ++i ) {
+    ndvss_axpy(vector[i], rotation + (size_t)i * dimensions, target, dimensions);
+  }
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_opq_load
+// Desc: Reads the OPQ rotation of a column from the ndvss_opq table of its schema, if
+//       ndvss_opq_train_f/_d has made one.
+// Args: Database, vector set, where the rotation (sqlite3_malloc, 0 if there is none)
+//       and the number of sub-quantizers it was trained for are stored.
+// Returns: SQLITE_OK or SQLITE_NOMEM.
+//----------------------------------------------------------------------------------------
+static int ndvss_opq_load( sqlite3* db, const ndvss_vector_set* set, float** rotation, int* subquantizers )
+{
+  *rotation = 0;
+  *subquantizers = 0;
+  char* sql = sqlite3_mprintf("SELECT subquantizers, rotation FROM \"%w\".ndvss_opq "
+                              "WHERE table_name = %Q COLLATE NOCASE AND column_name = %Q COLLATE NOCASE", 
+                              set->db_name, set->table_name, set->column_name);
+  if( sql == 0 ) {
+    return SQLITE_NOMEM;
+  }
+  sqlite3_stmt* stmt = 0;
+  int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+  sqlite3_free(sql);
+  if( rc != SQLITE_OK ) {
+    return SQLITE_OK; // No rotations in this schema.
+  }
+  size_t bytes = sizeof(float) * (size_t)set->dimensions * (size_t)set->dimensions;
+  rc = SQLITE_OK;
+  if( sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_bytes(stmt, 1) == (int)bytes ) {
+    *rotation = (float*)sqlite3_malloc64(bytes);
+    if( *rotation == 0 ) {
+      rc = SQLITE_NOMEM;
+    } else {
+      memcpy(*rotation, sqlite3_column_blob(stmt, 1), bytes);
+      *subquantizers = sqlite3_column_int(stmt, 0);
+    }
+  }
+  sqlite3_finalize(stmt);
+  return rc;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_pq_encode
+// Desc: Encodes vector v of a set in to the codes of a PQ. The codes must be zeroed.
+// Args: PQ, set, index of the vector, scratch memory for 2 * dimensions floats.
+//----------------------------------------------------------------------------------------
+static void ndvss_pq_encode( ndvss_pq* pq, const ndvss_vector_set* set, sqlite3_int64 v, float* scratch )
+{
+  int dimensions = pq->dimensions;
+  ndvss_to_float(scratch, ndvss_vector_set_vector(set, v), dimensions, set->element_size);
+  if( pq->rotation != 0 ) {
+    ndvss_rotate(pq->rotation, scratch, scratch + dimensions, dimensions);
+    memcpy(scratch, scratch + dimensions, sizeof(float) * (size_t)dimensions);
+  }
+  unsigned char* block = pq->codes + (size_t)(v / NDVSS_PQ_BLOCK_VECTORS) * pq->pairs * 32;
+  int j = (int)(v % NDVSS_PQ_BLOCK_VECTORS);
+  int m;
+  for( m = 0; m < pq->subquantizers; ++m ) {
+    int size = pq->sub_first[m + 1] - pq->sub_first[m];
+    int code = ndvss_pq_nearest(pq->centroids + NDVSS_PQ_CENTROIDS * pq->sub_first[m], scratch + pq->sub_first[m], size);
+    unsigned char* byte = block + (m / 2) * 32 + (m % 2) * 16 + (j % 16);
+    *byte |= (unsigned char)(j < 16 ? code : code << 4);
+  }
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_pq_train
+// Desc: Trains the codebooks of a vector set and encodes its vectors. 
+// Args: Set, OPQ rotation (taken over, 0 if none), sub-quantizers of the rotation,
+//       where the PQ is stored.
+// Returns: SQLITE_OK, SQLITE_NOMEM or SQLITE_INTERRUPT.
+//----------------------------------------------------------------------------------------
+static int ndvss_pq_train( const ndvss_vector_set* set, float* rotation, int rotation_subquantizers, ndvss_pq** result )
+{
+  double start = ndvss_now();
+  int dimensions = set->dimensions;
+  int m_count = rotation != 0 ? rotation_subquantizers : (int)NDVSS_CONFIG(NDVSS_CONFIG_PQ_SUBQUANTIZERS);
+  if( m_count == 0 ) {
+    m_count = dimensions / 2;
+  }
+  if( m_count < 1 ) {
+    m_count = 1;
+  }
+  if( m_count > dimensions ) {
+    m_count = dimensions;
+  }
+  ndvss_pq* pq = (ndvss_pq*)sqlite3_malloc(sizeof(ndvss_pq));
+  if( pq == 0 ) {
+    sqlite3_free(rotation);
+    return SQLITE_NOMEM;
+  }
+  memset(pq, 0, sizeof(ndvss_pq));
+  pq->rotation = rotation;
+  pq->dimensions = dimensions;
+  pq->subquantizers = m_count;
+  pq->pairs = (m_count + 1) / 2;
+  pq->count = set->count;
+  pq->block_count = (set->count + NDVSS_PQ_BLOCK_VECTORS - 1) / NDVSS_PQ_BLOCK_VECTORS;
+  pq->sub_first = (int*)sqlite3_malloc(sizeof(int) * (m_count + 1));
+  pq->centroids = (float*)sqlite3_malloc64(sizeof(float) * NDVSS_PQ_CENTROIDS * (sqlite3_uint64)dimensions);
+  pq->codes = (unsigned char*)ndvss_aligned_malloc((sqlite3_uint64)(pq->block_count > 0 ? pq->block_count : 1) * pq->pairs * 32, 
+                                                   NDVSS_ALIGNMENT);
+  int n = set->count < NDVSS_PQ_TRAINING_VECTORS ? (int)set->count : NDVSS_PQ_TRAINING_VECTORS;
+  float* train = (float*)sqlite3_malloc64(sizeof(float) * (sqlite3_uint64)(n > 2 ? n : 2) * (sqlite3_uint64)dimensions);
+  int* assignment = (int*)sqlite3_malloc64(sizeof(int) * (sqlite3_uint64)(n > 0 ? n : 1));
+  float* rotated = (float*)sqlite3_malloc64(sizeof(float) * (sqlite3_uint64)dimensions);
+  if( pq->sub_first == 0 || pq->centroids == 0 || pq->codes == 0 || train == 0 || assignment == 0 || rotated == 0 ) {
+    sqlite3_free(train);
+    sqlite3_free(assignment);
+    sqlite3_free(rotated);
+    ndvss_pq_free(pq);
+    return SQLITE_NOMEM;
+  }
+  NDVSS_STAT_ADD(pq_code_bytes, pq->block_count * pq->pairs * 32);
+  memset(pq->codes, 0, (size_t)(pq->block_count > 0 ? pq->block_count : 1) * pq->pairs * 32);
+  int m, i;
+  for( m = 0; m <= m_count; ++m ) {
+    pq->sub_first[m] = (int)((sqlite3_int64)m * dimensions / m_count);
+  }
+  // The training sample is spread evenly over the set.
+  for( i = 0; i < n; ++i ) {
+    sqlite3_int64 index = (sqlite3_int64)i * set->count / n;
+    ndvss_to_float(train + (size_t)i * dimensions, ndvss_vector_set_vector(set, index), dimensions, set->element_size);
+    if( rotation != 0 ) {
+      ndvss_rotate(rotation, train + (size_t)i * dimensions, rotated, dimensions);
+      memcpy(train + (size_t)i * dimensions, rotated, sizeof(float) * (size_t)dimensions);
+    }
+  }
+  ndvss_task* task = ndvss_task_current();
+  ndvss_task_phase(task, "pq_train", (sqlite3_int64)m_count * NDVSS_PQ_ITERATIONS);
+  int rc = SQLITE_OK;
+  if( n > 0 ) {
+    for( m = 0; m < m_count && rc == SQLITE_OK; ++m ) {
+      rc = ndvss_pq_kmeans(train, n, dimensions, pq->sub_first[m], pq->sub_first[m + 1] - pq->sub_first[m],
+                           pq->centroids + NDVSS_PQ_CENTROIDS * pq->sub_first[m], assignment, NDVSS_PQ_ITERATIONS, 1);
+    }
+  }
+  sqlite3_free(assignment);
+  sqlite3_free(rotated);
+
+  // Encode, reusing the start of the training memory.
+  ndvss_task_phase(task, "pq_encode", set->count);
+  sqlite3_int64 v;
+  for( v = 0; v < set->count && rc == SQLITE_OK; ++v ) {
+    ndvss_pq_encode(pq, set, v, train);
+    if( (v + 1) % NDVSS_PQ_CHECK_VECTORS == 0 && ndvss_task_advance(task, NDVSS_PQ_CHECK_VECTORS) ) {
+      rc = SQLITE_INTERRUPT;
+    }
+  }
+  sqlite3_free(train);
+  if( rc != SQLITE_OK ) {
+    ndvss_pq_free(pq);
+    return rc;
+  }
+  *result = pq;
+  NDVSS_STAT_ADD(pq_builds, 1);
+  NDVSS_STAT_ADD(pq_build_nanoseconds, (sqlite3_int64)((ndvss_now() - start) * 1e9));
+  return SQLITE_OK;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_pq_extend
+// Desc: Copies the codes of a PQ and encodes the vectors that were added to its set 
+//       after them with the same codebooks.
+// Returns: SQLITE_OK or SQLITE_NOMEM.
+//----------------------------------------------------------------------------------------
+static int ndvss_pq_extend( const ndvss_pq* old, const ndvss_vector_set* set, ndvss_pq** result )
+{
+  ndvss_pq* pq = (ndvss_pq*)sqlite3_malloc(sizeof(ndvss_pq));
+  if( pq == 0 ) {
+    return SQLITE_NOMEM;
+  }
+  memset(pq, 0, sizeof(ndvss_pq));
+  int dimensions = old->dimensions;
+  pq->dimensions = dimensions;
+  pq->subquantizers = old->subquantizers;
+  pq->pairs = old->pairs;
+  pq->count = set->count;
+  pq->block_count = (set->count + NDVSS_PQ_BLOCK_VECTORS - 1) / NDVSS_PQ_BLOCK_VECTORS;
+  pq->sub_first = (int*)sqlite3_malloc(sizeof(int) * (old->subquantizers + 1));
+  pq->centroids = (float*)sqlite3_malloc64(sizeof(float) * NDVSS_PQ_CENTROIDS * (sqlite3_uint64)dimensions);
+  pq->rotation = old->rotation != 0 ? (float*)sqlite3_malloc64(sizeof(float) * (sqlite3_uint64)dimensions * dimensions) : 0;
+  size_t code_bytes = (size_t)(pq->block_count > 0 ? pq->block_count : 1) * pq->pairs * 32;
+  pq->codes = (unsigned char*)ndvss_aligned_malloc(code_bytes, NDVSS_ALIGNMENT);
+  float* scratch = (float*)sqlite3_malloc64(sizeof(float) * (sqlite3_uint64)dimensions * 2);
+  if( pq->sub_first == 0 || pq->centroids == 0 || (old->rotation != 0 && pq->rotation == 0) || pq->codes == 0 || scratch == 0 ) {
+    sqlite3_free(scratch);
+    ndvss_pq_free(pq);
+    return SQLITE_NOMEM;
+  }
+  NDVSS_STAT_ADD(pq_code_bytes, pq->block_count * pq->pairs * 32);
+  memcpy(pq->sub_first, old->sub_first, sizeof(int) * (size_t)(old->subquantizers + 1));
+  memcpy(pq->centroids, old->centroids, sizeof(float) * NDVSS_PQ_CENTROIDS * (size_t)dimensions);
+  if( old->rotation != 0 ) {
+    memcpy(pq->rotation, old->rotation, sizeof(float) * (size_t)dimensions * dimensions);
+  }
+  // The last old block may be partly filled, its empty places are zero.
+  size_t old_bytes = (size_t)old->block_count * old->pairs * 32;
+  memcpy(pq->codes, old->codes, old_bytes);
+  memset(pq->codes + old_bytes, 0, code_bytes - old_bytes);
+  sqlite3_int64 v;
+  for( v = old->count; v < set->count; ++v ) {
+    ndvss_pq_encode(pq, set, v, scratch);
+  }
+  sqlite3_free(scratch);
+  *result = pq;
+  return SQLITE_OK;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_pq_build
+// Desc: Trains the codebooks of a vector set and encodes its vectors. If the column 
+//       has an OPQ rotation, the vectors are rotated first and the number of 
+//       sub-quantizers of the rotation is used.
+// Returns: SQLITE_OK or SQLITE_NOMEM.
+//----------------------------------------------------------------------------------------
+static int ndvss_pq_build( sqlite3* db, ndvss_vector_set* set )
+{
+  float* rotation = 0;
+  int rotation_subquantizers = 0;
+  if( ndvss_opq_load(db, set, &rotation, &rotation_subquantizers) != SQLITE_OK ) {
+    return SQLITE_NOMEM;
+  }
+  ndvss_pq* pq = 0;
+  int rc = ndvss_pq_train(set, rotation, rotation_subquantizers, &pq);
+  if( rc == SQLITE_OK ) {
+    // Other connections may read the pointer of a shared set without the lock.
+    __atomic_store_n(&set->pq, pq, __ATOMIC_RELEASE);
+  }
+  return rc;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_pq_ensure
+// Desc: Builds the PQ codes of a set if it doesn't have them yet. A shared set can be
+//       searched from several connections at once, so only one of them builds.
+// Returns: SQLITE_OK, SQLITE_NOMEM or SQLITE_INTERRUPT.
+//----------------------------------------------------------------------------------------
+static int ndvss_pq_ensure( sqlite3* db, ndvss_vector_set* set )
+{
+  if( __atomic_load_n(&set->pq, __ATOMIC_ACQUIRE) != 0 ) {
+    return SQLITE_OK;
+  }
+  int rc = SQLITE_OK;
+  ndvss_mutex_lock(&ndvss_build_mutex);
+  if( set->pq == 0 ) {
+    rc = ndvss_pq_build(db, set);
+  }
+  ndvss_mutex_unlock(&ndvss_build_mutex);
+  return rc;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_pq_lookup_tables
+// Desc: Computes the distances from the sub-vectors of the searched vector to every 
+//       centroid and quantizes them to 8 bits, laid out like the codes of a block.
+// Args: PQ, searched vector as floats, metric, where the 8-bit tables (pairs * 32
+//       bytes) are stored, where the scale and the offset are stored: the distance is
+//       about sum / scale + offset.
+// Returns: SQLITE_OK or SQLITE_NOMEM.
+//----------------------------------------------------------------------------------------
+static int ndvss_pq_lookup_tables( const ndvss_pq* pq, 
+                                   const float* query, 
+                                   int metric, 
+                                   unsigned char* tables,
+                                   double* scale,
+                                   double* offset )
+{
+  float* distances = (float*)sqlite3_malloc64(sizeof(float) * NDVSS_PQ_CENTROIDS * (sqlite3_uint64)pq->subquantizers);
+  float* minimums = (float*)sqlite3_malloc64(sizeof(float) * (sqlite3_uint64)pq->subquantizers);
+  if( distances == 0 || minimums == 0 ) {
+    sqlite3_free(distances);
+    sqlite3_free(minimums);
+    return SQLITE_NOMEM;
+  }
+  int squared_l2 = metric == NDVSS_METRIC_EUCLIDEAN || metric == NDVSS_METRIC_EUCLIDEAN_SQUARED;
+  double max_range = 0.0;
+  int m, c, j;
+  *offset = 0.0;
+  for( m = 0; m < pq->subquantizers; ++m ) {
+    int first = pq->sub_first[m];
+    int size = pq->sub_first[m + 1] - first;
+    const float* centroids = pq->centroids + NDVSS_PQ_CENTROIDS * first;
+    float* row = distances + m * NDVSS_PQ_CENTROIDS;
+    float maximum = 0.0f;
+    for( c = 0; c < NDVSS_PQ_CENTROIDS; ++c ) {
+      float distance = 0.0f;
+      for( j = 0; j < size; ++j ) {
+        if( squared_l2 ) {
+          float d = query[first + j] - centroids[c * size + j];
+          distance += d * d;
+        } else {
+          distance -= query[first + j] * centroids[c * size + j];
+        }
+      }
+      row[c] = distance;
+      if( c == 0 || distance < minimums[m] ) {
+        minimums[m] = distance;
+      }
+      if( c == 0 || distance > maximum ) {
+        maximum = distance;
+      }
+    }
+    *offset += minimums[m];
+    if( maximum - minimums[m] > max_range ) {
+      max_range = maximum - minimums[m];
+    }
+  }//endfor sub-quantizers
+  // One scale for all the tables, so that the 8-bit values can be summed.
+  *scale = max_range > 0.0 ? 255.0 / max_range : 1.0;
+  memset(tables, 0, (size_t)pq->pairs * 32);
+  for( m = 0; m < pq->subquantizers; ++m ) {
+    unsigned char* table = tables + (m / 2) * 32 + (m % 2) * 16;
+    for( c = 0; c < NDVSS_PQ_CENTROIDS; ++c ) {
+      double q = floor(((double)distances[m * NDVSS_PQ_CENTROIDS + c] - minimums[m]) * *scale + 0.5);
+      table[c] = (unsigned char)(q > 255.0 ? 255.0 : q);
+    }
+  }
+  sqlite3_free(distances);
+  sqlite3_free(minimums);
+  return SQLITE_OK;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_pq_scan_block
+// Desc: Computes the 16-bit approximate distances of the 32 vectors of a block.
+//----------------------------------------------------------------------------------------
+static inline void ndvss_pq_scan_block( const unsigned char* block, 
+                                        const unsigned char* tables, 
+                                        int pairs, 
+                                        unsigned short* sums )
+{
+  #ifdef __AVX2__
+  const __m256i low_mask = _mm256_set1_epi8(0x0F);
+  __m256i sum_low = _mm256_setzero_si256();   // Vectors 0-15.
+  __m256i sum_high = _mm256_setzero_si256();  // Vectors 16-31.
+  int p;
+  for( p = 0; p < pairs; ++p ) {
+    __m256i codes = _mm256_load_si256((const __m256i*)(block + p * 32));
+    __m256i table = _mm256_loadu_si256((const __m256i*)(tables + p * 32));
+    __m256i low = _mm256_shuffle_epi8(table, _mm256_and_si256(codes, low_mask));
+    __m256i high = _mm256_shuffle_epi8(table, _mm256_and_si256(_mm256_srli_epi16(codes, 4), low_mask));
+    // Lane 0 has the distances of sub-quantizer m, lane 1 those of m + 1.
+    sum_low = _mm256_adds_epu16(sum_low, _mm256_cvtepu8_epi16(_mm256_castsi256_si128(low)));
+    sum_low = _mm256_adds_epu16(sum_low, _mm256_cvtepu8_epi16(_mm256_extracti128_si256(low, 1)));
+    sum_high = _mm256_adds_epu16(sum_high, _mm256_cvtepu8_epi16(_mm256_castsi256_si128(high)));
+    sum_high = _mm256_adds_epu16(sum_high, _mm256_cvtepu8_epi16(_mm256_extracti128_si256(high, 1)));
+  }
+  _mm256_storeu_si256((__m256i*)sums, sum_low);
+  _mm256_storeu_si256((__m256i*)(sums + 16), sum_high);
+  #else
+  int p, j, half;
+  unsigned int total[NDVSS_PQ_BLOCK_VECTORS];
+  memset(total, 0, sizeof(total));
+  for( p = 0; p < pairs; ++p ) {
+    for( half = 0; half < 2; ++half ) {
+      const unsigned char* codes = block + p * 32 + half * 16;
+      const unsigned char* table = tables + p * 32 + half * 16;
+      for( j = 0; j < 16; ++j ) {
+        total[j] += table[codes[j] & 0x0F];
+        total[j + 16] += table[codes[j] >> 4];
+        // Saturate like the 16-bit adds of the AVX2 path.
+        if( total[j] > 65535 ) total[j] = 65535;
+        if( total[j + 16] > 65535 ) total[j + 16] = 65535;
+      }
+    }
+  }
+  for( j = 0; j < NDVSS_PQ_BLOCK_VECTORS; ++j ) {
+    sums[j] = (unsigned short)total[j];
+  }
+  #endif
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_pq_scan
+// Desc: Finds the k best vectors of a set that has PQ codes with the 4-bit fast scan.
+//       The best k * pq_rerank candidates are reranked with the exact vectors; with 
+//       pq_rerank 0 the approximate distances are returned. Vectors added to the set
+//       after the codes were built are scanned exactly, deleted ones are skipped.
+// Returns: SQLITE_OK, SQLITE_NOMEM or SQLITE_INTERRUPT.
+//----------------------------------------------------------------------------------------
+static int ndvss_pq_scan( const ndvss_vector_set* set,
+                          int metric,
+                          const void* searched_array,
+                          ndvss_topk* topk )
+{
+  int rc = SQLITE_OK;
+  double start = ndvss_now();
+  const ndvss_pq* pq = set->pq;
+  int rerank = (int)NDVSS_CONFIG(NDVSS_CONFIG_PQ_RERANK);
+  sqlite3_int64 candidate_count = rerank > 0 ? (sqlite3_int64)topk->k * rerank : topk->k;
+  if( candidate_count > pq->count ) {
+    candidate_count = pq->count > 0 ? pq->count : 1;
+  }
+  int has_deleted = 0;
+  int s;
+  for( s = 0; s < set->segment_count; ++s ) {
+    has_deleted |= set->segments[s].deleted != 0;
+  }
+  ndvss_topk candidates;
+  float* query = (float*)sqlite3_malloc64(sizeof(float) * (sqlite3_uint64)set->dimensions * 2);
+  unsigned char* tables = (unsigned char*)ndvss_aligned_malloc((sqlite3_uint64)pq->pairs * 32, NDVSS_ALIGNMENT);
+  if( query == 0 || tables == 0 || ndvss_topk_init(&candidates, (int)candidate_count) != SQLITE_OK ) {
+    sqlite3_free(query);
+    ndvss_aligned_free(tables);
+    return SQLITE_NOMEM;
+  }
+  ndvss_to_float(query, searched_array, set->dimensions, set->element_size);
+  if( metric == NDVSS_METRIC_COSINE ) {
+    // The inner product with the normalized vector orders like the cosine when the 
+    // stored vectors have the same length.
+    double norm = 0.0;
+    int j;
+    for( j = 0; j < set->dimensions; ++j ) {
+      norm += (double)query[j] * query[j];
+    }
+    norm = norm > 0.0 ? 1.0 / sqrt(norm) : 0.0;
+    for( j = 0; j < set->dimensions; ++j ) {
+      query[j] = (float)(query[j] * norm);
+    }
+  }
+  if( pq->rotation != 0 ) {
+    // The rotation keeps distances and inner products, so only the query is rotated.
+    ndvss_rotate(pq->rotation, query, query + set->dimensions, set->dimensions);
+    memcpy(query, query + set->dimensions, sizeof(float) * (size_t)set->dimensions);
+  }
+  double scale, offset;
+  if( ndvss_pq_lookup_tables(pq, query, metric, tables, &scale, &offset) != SQLITE_OK ) {
+    ndvss_topk_free(&candidates);
+    sqlite3_free(query);
+    ndvss_aligned_free(tables);
+    return SQLITE_NOMEM;
+  }
+
+  ndvss_task* task = ndvss_task_current();
+  ndvss_task_phase(task, "pq_scan", pq->count);
+  unsigned short sums[NDVSS_PQ_BLOCK_VECTORS];
+  sqlite3_int64 b;
+  for( b = 0; b < pq->block_count; ++b ) {
+    if( b % NDVSS_PQ_CHECK_BLOCKS == 0 && ndvss_task_advance(task, b > 0 ? NDVSS_PQ_CHECK_BLOCKS * NDVSS_PQ_BLOCK_VECTORS : 0) ) {
+      ndvss_topk_free(&candidates);
+      sqlite3_free(query);
+      ndvss_aligned_free(tables);
+      return SQLITE_INTERRUPT;
+    }
+    ndvss_pq_scan_block(pq->codes + (size_t)b * pq->pairs * 32, tables, pq->pairs, sums);
+    double bound = ndvss_topk_bound(&candidates);
+    sqlite3_int64 base = b * NDVSS_PQ_BLOCK_VECTORS;
+    int last = pq->count - base < NDVSS_PQ_BLOCK_VECTORS ? (int)(pq->count - base) : NDVSS_PQ_BLOCK_VECTORS;
+    int j;
+    for( j = 0; j < last; ++j ) {
+      if( sums[j] < bound && (!has_deleted || !ndvss_vector_set_deleted(set, base + j)) ) {
+        ndvss_topk_push(&candidates, sums[j], base + j);
+        bound = ndvss_topk_bound(&candidates);
+      }
+    }
+  }//endfor blocks
+
+  int i;
+  for( i = 0; i < candidates.count; ++i ) {
+    sqlite3_int64 index = candidates.rowids[i];
+    double distance;
+    if( rerank > 0 ) {
+      if( !ndvss_metric_distance(metric, set->element_size, searched_array, ndvss_vector_set_vector(set, index),
+                                 set->dimensions, &distance) ) {
+        continue;
+      }
+    } else {
+      distance = candidates.distances[i] / scale + offset;
+    }
+    if( distance < ndvss_topk_bound(topk) ) {
+      ndvss_topk_push(topk, distance, set->rowids[index]);
+    }
+  }
+  ndvss_topk_free(&candidates);
+  sqlite3_free(query);
+  ndvss_aligned_free(tables);
+
+  // The vectors without codes.
+  for( s = 0; s < set->segment_count; ++s ) {
+    const ndvss_segment* segment = &set->segments[s];
+    if( segment->first + segment->count > pq->count ) {
+      int first = segment->first < pq->count ? (int)(pq->count - segment->first) : 0;
+      ndvss_scan_vectors(set, segment, first, segment->count, metric, searched_array, topk);
+    }
+  }
+  NDVSS_STAT_ADD(pq_scans, 1);
+  NDVSS_STAT_ADD(pq_scan_vectors, pq->count);
+  NDVSS_STAT_ADD(pq_scan_nanoseconds, (sqlite3_int64)((ndvss_now() - start) * 1e9));
+  return rc;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_pq_search
+// Desc: Finds the k best vectors of a set with the 4-bit PQ fast scan, building the
+//       codes first if needed.
+// Returns: SQLITE_OK or an error code.
+//----------------------------------------------------------------------------------------
+static int ndvss_pq_search( sqlite3* db,
+                            ndvss_vector_set* set,
+                            int metric,
+                            const void* searched_array,
+                            ndvss_topk* topk )
+{
+  int rc = ndvss_pq_ensure(db, set);
+  if( rc != SQLITE_OK ) {
+    return rc;
+  }
+  return ndvss_pq_scan(set, metric, searched_array, topk);
+}
+
+
+//----------------------------------------------------------------------------------------
+// OPQ.
+// ndvss_opq_train_f/_d learn an orthogonal rotation that spreads the variance of a 
+// column evenly over the PQ sub-vectors, which lowers the quantization error at the same
+// code size. Training alternates between fitting the codebooks to the rotated sample
+// and solving the orthogonal Procrustes problem between the sample and its 
+// reconstruction, R = U * V^T from the SVD of X^T * Y. The rotation is stored in the
+// ndvss_opq table of the schema and the 'pq' method picks it up the next time it builds
+// the codes of the column.
+//----------------------------------------------------------------------------------------
+#define NDVSS_OPQ_ITERATIONS        8    // Default number of rotation updates.
+#define NDVSS_OPQ_KMEANS_ITERATIONS 4    // k-means iterations per rotation update.
+#define NDVSS_SVD_SWEEPS            30   // Upper limit for the Jacobi sweeps.
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_svd_jacobi
+// Desc: One-sided Jacobi SVD of a square matrix. The matrix is given transposed (its 
+//       columns as rows) and the columns are rotated until they are orthogonal. Then 
+//       they are U * S and the rotations applied are V.
+// Args: A^T (n x n, row-major, overwritten with (U * S)^T), where V^T is stored, n.
+//----------------------------------------------------------------------------------------
+static void ndvss_svd_jacobi( double* columns, double* v_columns, int n )
+{
+  int i, p, q, sweep;
+  memset(v_columns, 0, sizeof(double) * (size_t)n * (size_t)n);
+  for( i = 0; i < n; ++i ) {
+    v_columns[(size_t)i * n + i] = 1.0;
+  }
+  for( sweep = 0; sweep < NDVSS_SVD_SWEEPS; ++sweep ) {
+    int rotated = 0;
+    for( p = 0; p < n - 1; ++p ) {
+      double* a_p = columns + (size_t)p * n;
+      for( q = p + 1; q < n; ++q ) {
+        double* a_q = columns + (size_t)q * n;
+        double alpha = 0.0, beta = 0.0, gamma = 0.0;
+        for( i = 0; i < n; ++i ) {
+          alpha += a_p[i] * a_p[i];
+          beta += a_q[i] * a_q[i];
+          gamma += a_p[i] * a_q[i];
+        }
+        if( fabs(gamma) <= 1e-12 * sqrt(alpha * beta) || gamma == 0.0 ) {
+          continue;
+        }
+        rotated = 1;
+        double zeta = (beta - alpha) / (2.0 * gamma);
+        double t = (zeta >= 0.0 ? 1.0 : -1.0) / (fabs(zeta) + sqrt(1.0 + zeta * zeta));
+        double c = 1.0 / sqrt(1.0 + t * t);
+        double s = c * t;
+        double* v_p = v_columns + (size_t)p * n;
+        double* v_q = v_columns + (size_t)q * n;
+        for( i = 0; i < n; ++i ) {
+          double x = a_p[i], y = a_q[i];
+          a_p[i] = c * x - s * y;
+          a_q[i] = s * x + c * y;
+          x = v_p[i];
+          y = v_q[i];
+          v_p[i] = c * x - s * y;
+          v_q[i] = s * x + c * y;
+        }
+      }
+    }
+    if( !rotated ) {
+      break;
+    }
+  }//endfor sweeps
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_opq_procrustes
+// Desc: Finds the orthogonal R that minimizes |X * R - Y| from M = X^T * Y.
+// Args: M (n x n, row-major), where R is stored (row-major floats), n.
+// Returns: SQLITE_OK or SQLITE_NOMEM.
+//----------------------------------------------------------------------------------------
+static int ndvss_opq_procrustes( const double* m, float* rotation, int n )
+{
+  double* u = (double*)sqlite3_malloc64(sizeof(double) * (sqlite3_uint64)n * (sqlite3_uint64)n);
+  double* v = (double*)sqlite3_malloc64(sizeof(double) * (sqlite3_uint64)n * (sqlite3_uint64)n);
+  if( u == 0 || v == 0 ) {
+    sqlite3_free(u);
+    sqlite3_free(v);
+    return SQLITE_NOMEM;
+  }
+  int i, j, p;
+  for( i = 0; i < n; ++i ) {
+    for( j = 0; j < n; ++j ) {
+      u[(size_t)j * n + i] = m[(size_t)i * n + j];
+    }
+  }
+  ndvss_svd_jacobi(u, v, n);
+  // Normalize the columns of U * S. Columns of zero singular values are completed to
+  // an orthonormal basis with Gram-Schmidt.
+  for( p = 0; p < n; ++p ) {
+    double* u_p = u + (size_t)p * n;
+    double norm = 0.0;
+    for( i = 0; i < n; ++i ) {
+      norm += u_p[i] * u_p[i];
+    }
+    norm = sqrt(norm);
+    if( norm > 1e-9 ) {
+      for( i = 0; i < n; ++i ) {
+        u_p[i] /= norm;
+      }
+      continue;
+    }
+    int e;
+    for( e = 0; e < n; ++e ) {
+      memset(u_p, 0, sizeof(double) * (size_t)n);
+      u_p[(p + e) % n] = 1.0;
+      int r;
+      for( r = 0; r < n; ++r ) {
+        if( r == p ) {
+          continue;
+        }
+        const double* u_r = u + (size_t)r * n;
+        double dot = 0.0, r_norm = 0.0;
+        for( i = 0; i < n; ++i ) {
+          dot += u_p[i] * u_r[i];
+          r_norm += u_r[i] * u_r[i];
+        }
+        if( r_norm > 0.5 ) { // Only the columns that are already unit length.
+          for( i = 0; i < n; ++i ) {
+            u_p[i] -= dot * u_r[i];
+          }
+        }
+      }
+      norm = 0.0;
+      for( i = 0; i < n; ++i ) {
+        norm += u_p[i] * u_p[i];
+      }
+      norm = sqrt(norm);
+      if( norm > 1e-6 ) {
+        for( i = 0; i < n; ++i ) {
+          u_p[i] /= norm;
+        }
+        break;
+      }
+    }
+  }//endfor columns
+  for( i = 0; i < n; ++i ) {
+    for( j = 0; j < n; ++j ) {
+      double sum = 0.0;
+      for( p = 0; p < n; ++p ) {
+        sum += u[(size_t)p * n + i] * v[(size_t)p * n + j];
+      }
+      rotation[(size_t)i * n + j] = (float)sum;
+    }
+  }
+  sqlite3_free(u);
+  sqlite3_free(v);
+  return SQLITE_OK;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_opq_train
+// Desc: Shared implementation of ndvss_opq_train_f/_d. Learns the OPQ rotation of a 
+//       column from a sample of its vectors and stores it in the ndvss_opq table.
+// Args: Table name TEXT ("table" or "schema.table"),
+//       Column name TEXT,
+//       Optionally the number of sub-quantizers INTEGER (default pq_subquantizers),
+//       Optionally the number of iterations INTEGER (default 8)
+// Returns: The result of the training as a JSON object TEXT: the mean squared 
+//          quantization error of the sample without and with the rotation.
+//----------------------------------------------------------------------------------------
+static void ndvss_opq_train( sqlite3_context* context,
+                             int argc,
+                             sqlite3_value** argv,
+                             int element_size ) 
+{
+  if( argc < 2 || sqlite3_value_type(argv[0]) == SQLITE_NULL || sqlite3_value_type(argv[1]) == SQLITE_NULL ) {
+    sqlite3_result_error(context, "The table and the column need to be given.", -1);
+    return;
+  }
+  sqlite3* db = sqlite3_context_db_handle(context);
+  const char* table = (const char*)sqlite3_value_text(argv[0]);
+  const char* column = (const char*)sqlite3_value_text(argv[1]);
+  int m_count = argc > 2 && sqlite3_value_type(argv[2]) != SQLITE_NULL ? sqlite3_value_int(argv[2]) 
+                                                                         : (int)NDVSS_CONFIG(NDVSS_CONFIG_PQ_SUBQUANTIZERS);
+  int iterations = argc > 3 && sqlite3_value_type(argv[3]) != SQLITE_NULL ? sqlite3_value_int(argv[3]) : NDVSS_OPQ_ITERATIONS;
+  if( m_count < 0 || iterations < 1 ) {
+    sqlite3_result_error(context, "The number of sub-quantizers and iterations can't be negative.", -1);
+    return;
+  }
+  const char* dot = strchr(table, '.');
+  char* db_name = dot != 0 ? sqlite3_mprintf("%.*s", (int)(dot - table), table) : sqlite3_mprintf("main");
+  const char* table_name = dot != 0 ? dot + 1 : table;
+  sqlite3_stmt* stmt = 0;
+  if( db_name == 0 ) {
+    sqlite3_result_error_nomem(context);
+    return;
+  }
+  char* message = 0;
+  int rc = ndvss_vector_select_prepare(db, db_name, table_name, column, &stmt, &message);
+  if( rc != SQLITE_OK ) {
+    sqlite3_free(db_name);
+    if( message != 0 ) {
+      sqlite3_result_error(context, message, -1);
+      sqlite3_free(message);
+    } else {
+      sqlite3_result_error_nomem(context);
+    }
+    return;
+  }
+  ndvss_task task;
+  ndvss_task_begin(&task, db, "opq_train", table);
+
+  // Reservoir sample of the column.
+  const char* error = 0;
+  int error_code = SQLITE_ERROR;
+  int dimensions = 0;
+  int n = 0;
+  float* sample = 0;
+  sqlite3_int64 seen = 0;
+  sqlite3_uint64 random_state = 0x9E3779B97F4A7C15ULL;
+  while( error == 0 && (rc = sqlite3_step(stmt)) == SQLITE_ROW ) {
+    int bytes = sqlite3_column_bytes(stmt, 1);
+    if( dimensions == 0 ) {
+      dimensions = bytes / element_size;
+      if( dimensions < 1 ) {
+        error = "The arrays are empty.";
+        break;
+      }
+      sample = (float*)sqlite3_malloc64(sizeof(float) * (sqlite3_uint64)dimensions * NDVSS_PQ_TRAINING_VECTORS);
+      if( sample == 0 ) {
+        error = "Out of memory.";
+        break;
+      }
+    }
+    if( bytes != dimensions * element_size ) {
+      error = "The arrays are not the same length.";
+      break;
+    }
+    sqlite3_int64 slot = seen++;
+    if( slot >= NDVSS_PQ_TRAINING_VECTORS ) {
+      random_state = random_state * 6364136223846793005ULL + 1442695040888963407ULL;
+      slot = (sqlite3_int64)((random_state >> 11) % (sqlite3_uint64)seen);
+      if( slot >= NDVSS_PQ_TRAINING_VECTORS ) {
+        continue;
+      }
+    } else {
+      ++n;
+    }
+    ndvss_to_float(sample + (size_t)slot * dimensions, sqlite3_column_blob(stmt, 1), dimensions, element_size);
+  }//endwhile reading rows
+  if( error == 0 && rc != SQLITE_DONE ) {
+    // An interrupted read must not train on part of the column.
+    error = sqlite3_errmsg(db);
+    error_code = rc;
+  }
+  sqlite3_finalize(stmt);
+  if( error == 0 && n < NDVSS_PQ_CENTROIDS ) {
+    error = "At least 16 vectors are needed to train the rotation.";
+  }
+  if( m_count == 0 ) {
+    m_count = dimensions / 2;
+  }
+  if( m_count < 1 ) {
+    m_count = 1;
+  }
+  if( m_count > dimensions ) {
+    m_count = dimensions;
+  }
+
+  size_t matrix = (size_t)dimensions * (size_t)dimensions;
+  float* rotation = 0;
+  float* best_rotation = 0;
+  float* rotated = 0;
+  float* reconstruction = 0;
+  float* accumulated = 0;
+  float* centroids = 0;
+  int* sub_first = 0;
+  int* assignment = 0;
+  double* m = 0;
+  if( error == 0 ) {
+    rotation = (float*)sqlite3_malloc64(sizeof(float) * matrix);
+    best_rotation = (float*)sqlite3_malloc64(sizeof(float) * matrix);
+    rotated = (float*)sqlite3_malloc64(sizeof(float) * (size_t)n * (size_t)dimensions);
+    reconstruction = (float*)sqlite3_malloc64(sizeof(float) * (size_t)dimensions);
+    accumulated = (float*)sqlite3_malloc64(sizeof(float) * matrix);
+    centroids = (float*)sqlite3_malloc64(sizeof(float) * NDVSS_PQ_CENTROIDS * (size_t)dimensions);
+    sub_first = (int*)sqlite3_malloc(sizeof(int) * (m_count + 1));
+    assignment = (int*)sqlite3_malloc64(sizeof(int) * (size_t)n);
+    m = (double*)sqlite3_malloc64(sizeof(double) * matrix);
+    if( rotation == 0 || best_rotation == 0 || rotated == 0 || reconstruction == 0 || accumulated == 0 || centroids == 0 || 
+        sub_first == 0 || assignment == 0 || m == 0 ) {
+      error = "Out of memory.";
+    }
+  }
+  double first_distortion = 0.0, best_distortion = 0.0;
+  int iteration = 0, s, i, j, q;
+  if( error == 0 ) {
+    for( q = 0; q <= m_count; ++q ) {
+      sub_first[q] = (int)((sqlite3_int64)q * dimensions / m_count);
+    }
+    memset(rotation, 0, sizeof(float) * matrix);
+    for( i = 0; i < dimensions; ++i ) {
+      rotation[(size_t)i * dimensions + i] = 1.0f;
+    }
+    ndvss_task_phase(&task, "opq_train", (sqlite3_int64)m_count * (NDVSS_PQ_ITERATIONS + iterations * NDVSS_OPQ_KMEANS_ITERATIONS));
+    // One more round than rotation updates, to measure the last rotation.
+    for( iteration = 0; iteration <= iterations && error == 0; ++iteration ) {
+      for( s = 0; s < n; ++s ) {
+        ndvss_rotate(rotation, sample + (size_t)s * dimensions, rotated + (size_t)s * dimensions, dimensions);
+      }
+      for( q = 0; q < m_count && error == 0; ++q ) {
+        if( ndvss_pq_kmeans(rotated, n, dimensions, sub_first[q], sub_first[q + 1] - sub_first[q], 
+                            centroids + NDVSS_PQ_CENTROIDS * sub_first[q], assignment, 
+                            iteration == 0 ? NDVSS_PQ_ITERATIONS : NDVSS_OPQ_KMEANS_ITERATIONS, iteration == 0) != SQLITE_OK ) {
+          error = sqlite3_errstr(SQLITE_INTERRUPT);
+          error_code = SQLITE_INTERRUPT;
+        }
+      }
+      if( error != 0 ) {
+        break;
+      }
+      // Reconstruct the sample and accumulate M = X^T * Y.
+      double distortion = 0.0;
+      memset(accumulated, 0, sizeof(float) * matrix);
+      for( s = 0; s < n; ++s ) {
+        const float* x = rotated + (size_t)s * dimensions;
+        for( q = 0; q < m_count; ++q ) {
+          int size = sub_first[q + 1] - sub_first[q];
+          const float* codebook = centroids + NDVSS_PQ_CENTROIDS * sub_first[q];
+          int code = ndvss_pq_nearest(codebook, x + sub_first[q], size);
+          memcpy(reconstruction + sub_first[q], codebook + code * size, sizeof(float) * (size_t)size);
+        }
+        for( j = 0; j < dimensions; ++j ) {
+          double d = (double)x[j] - reconstruction[j];
+          distortion += d * d;
+        }
+        const float* original = sample + (size_t)s * dimensions;
+        for( i = 0; i < dimensions; ++i ) {
+          ndvss_axpy(original[i], reconstruction, accumulated + (size_t)i * dimensions, dimensions);
+        }
+      }//endfor samples
+      distortion /= n;
+      if( iteration == 0 ) {
+        first_distortion = distortion;
+      }
+      if( iteration == 0 || distortion < best_distortion ) {
+        best_distortion = distortion;
+        memcpy(best_rotation, rotation, sizeof(float) * matrix);
+      }
+      if( iteration == iterations ) {
+        break;
+      }
+      for( j = 0; j < (int)matrix; ++j ) {
+        m[j] = (double)accumulated[j];
+      }
+      if( ndvss_opq_procrustes(m, rotation, dimensions) != SQLITE_OK ) {
+        error = "Out of memory.";
+      }
+    }//endfor iterations
+  }
+  if( error == 0 ) {
+    char* sql = sqlite3_mprintf("CREATE TABLE IF NOT EXISTS \"%w\".ndvss_opq("
+                          "table_name TEXT NOT NULL COLLATE NOCASE, column_name TEXT NOT NULL COLLATE NOCASE, "
+                          "dimensions INTEGER NOT NULL, subquantizers INTEGER NOT NULL, rotation BLOB NOT NULL, "
+                          "PRIMARY KEY(table_name, column_name))", db_name);
+    rc = sql != 0 ? sqlite3_exec(db, sql, 0, 0, 0) : SQLITE_NOMEM;
+    sqlite3_free(sql);
+    if( rc == SQLITE_OK ) {
+      sql = sqlite3_mprintf("INSERT OR REPLACE INTO \"%w\".ndvss_opq VALUES(?, ?, ?, ?, ?)", db_name);
+      rc = sql != 0 ? sqlite3_prepare_v2(db, sql, -1, &stmt, 0) : SQLITE_NOMEM;
+      sqlite3_free(sql);
+    }
+    if( rc == SQLITE_OK ) {
+      sqlite3_bind_text(stmt, 1, table_name, -1, SQLITE_TRANSIENT);
+      sqlite3_bind_text(stmt, 2, column, -1, SQLITE_TRANSIENT);
+      sqlite3_bind_int(stmt, 3, dimensions);
+      sqlite3_bind_int(stmt, 4, m_count);
+      sqlite3_bind_blob(stmt, 5, best_rotation, (int)(sizeof(float) * matrix), SQLITE_TRANSIENT);
+      rc = sqlite3_step(stmt) == SQLITE_DONE ? SQLITE_OK : SQLITE_ERROR;
+      if( sqlite3_finalize(stmt) != SQLITE_OK ) {
+        rc = SQLITE_ERROR;
+      }
+    }
+    if( rc != SQLITE_OK ) {
+      error = sqlite3_errmsg(db);
+    }
+  }
+  if( error != 0 ) {
+    sqlite3_result_error(context, error, -1);
+    if( error_code != SQLITE_ERROR ) {
+      sqlite3_result_error_code(context, error_code);
+    }
+  } else {
+    char* json = sqlite3_mprintf("{\"vectors\":%d,\"dimensions\":%d,\"subquantizers\":%d,\"iterations\":%d,"
+                                 "\"distortion_pq\":%.9g,\"distortion_opq\":%.9g}",
+                                 n, dimensions, m_count, iterations, first_distortion, best_distortion);
+    if( json == 0 ) {
+      sqlite3_result_error_nomem(context);
+    } else {
+      sqlite3_result_text(context, json, -1, sqlite3_free);
+    }
+  }
+  sqlite3_free(db_name);
+  sqlite3_free(sample);
+  sqlite3_free(rotation);
+  sqlite3_free(best_rotation);
+  sqlite3_free(rotated);
+  sqlite3_free(reconstruction);
+  sqlite3_free(accumulated);
+  sqlite3_free(centroids);
+  sqlite3_free(sub_first);
+  sqlite3_free(assignment);
+  sqlite3_free(m);
+  ndvss_task_end(&task);
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_opq_train_d
+// Desc: Learns the OPQ rotation of a column of double-arrays. See ndvss_opq_train.
+//----------------------------------------------------------------------------------------
+static void ndvss_opq_train_d( sqlite3_context* context,
+                               int argc,
+                               sqlite3_value** argv ) 
+{
+  ndvss_opq_train(context, argc, argv, sizeof(double));
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_opq_train_f
+// Desc: Learns the OPQ rotation of a column of float-arrays. See ndvss_opq_train.
+//----------------------------------------------------------------------------------------
+static void ndvss_opq_train_f( sqlite3_context* context,
+                               int argc,
+                               sqlite3_value** argv ) 
+{
+  ndvss_opq_train(context, argc, argv, sizeof(float));
+}
+
+
+//----------------------------------------------------------------------------------------
+// IVF SCAN ORDER.
+// A cached set searched with a budget is split in to inverted lists: the vectors are
+// grouped by the nearest of about sqrt(count) / 4 k-means centroids, trained on a 
+// sample. A budgeted scan then reads the lists from the centroid nearest to the 
+// searched vector outwards, so that a scan stopped early has still seen the vectors
+// most likely to be in the results. The lists are built on the first budgeted search
+// of a set, like the 'pq' codes, and dropped with the set.
+//----------------------------------------------------------------------------------------
+#define NDVSS_IVF_MIN_VECTORS      1024   // Smaller sets are scanned in table order.
+#define NDVSS_IVF_MAX_LISTS        256
+#define NDVSS_IVF_TRAINING_VECTORS 8192
+#define NDVSS_IVF_ITERATIONS       8
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_ivf_free
+//----------------------------------------------------------------------------------------
+static void ndvss_ivf_free( ndvss_ivf* ivf )
+{
+  if( ivf == 0 ) {
+    return;
+  }
+  ndvss_aligned_free(ivf->centroids);
+  sqlite3_free(ivf->list_first);
+  sqlite3_free(ivf->positions);
+  sqlite3_free(ivf);
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_ivf_memory
+// Desc: Returns the memory of inverted lists.
+//----------------------------------------------------------------------------------------
+static sqlite3_int64 ndvss_ivf_memory( const ndvss_ivf* ivf )
+{
+  if( ivf == 0 ) {
+    return 0;
+  }
+  return (sqlite3_int64)sizeof(ndvss_ivf) + 
+         (sqlite3_int64)sizeof(float) * ivf->list_count * ivf->centroid_stride +
+         (sqlite3_int64)sizeof(sqlite3_int64) * (ivf->list_count + 1 + ivf->list_first[ivf->list_count]);
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_ivf_nearest
+// Desc: Finds the centroid nearest to a vector of floats.
+//----------------------------------------------------------------------------------------
+static int ndvss_ivf_nearest( const ndvss_ivf* ivf, const float* vector )
+{
+  int best = 0;
+  float best_distance = HUGE_VALF;
+  int l;
+  for( l = 0; l < ivf->list_count; ++l ) {
+    float distance = ndvss_euclidean_distance_squared_kernel_f(vector, ivf->centroids + (size_t)ivf->centroid_stride * (size_t)l, 
+                                                              ivf->dimensions);
+    if( distance < best_distance ) {
+      best_distance = distance;
+      best = l;
+    }
+  }
+  return best;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_ivf_train
+// Desc: Trains the centroids of inverted lists with Lloyd's algorithm. The first 
+//       centroids are spread over the sample and an empty list keeps its centroid.
+// Args: Lists with the centroids allocated, sample of full vectors, their number, work 
+//       memory for the sums of the lists (dimensions * list_count) and their sizes. 
+//       Every iteration counts 1 for the progress of the task.
+// Returns: SQLITE_OK or SQLITE_INTERRUPT.
+//----------------------------------------------------------------------------------------
+static int ndvss_ivf_train( ndvss_ivf* ivf, const float* sample, int sample_count, double* sums, int* sizes )
+{
+  int dimensions = ivf->dimensions;
+  int list_count = ivf->list_count;
+  int i, l, d;
+  for( l = 0; l < list_count; ++l ) {
+    memcpy(ivf->centroids + (size_t)ivf->centroid_stride * (size_t)l, 
+           sample + (size_t)dimensions * (size_t)((sqlite3_int64)l * sample_count / list_count), sizeof(float) * (size_t)dimensions);
+  }
+  ndvss_task* task = ndvss_task_current();
+  ndvss_task_phase(task, "ivf_train", NDVSS_IVF_ITERATIONS);
+  int rc = SQLITE_OK;
+  int iteration;
+  for( iteration = 0; iteration < NDVSS_IVF_ITERATIONS && rc == SQLITE_OK; ++iteration ) {
+    memset(sums, 0, sizeof(double) * (size_t)dimensions * (size_t)list_count);
+    memset(sizes, 0, sizeof(int) * (size_t)list_count);
+    for( i = 0; i < sample_count; ++i ) {
+      const float* x = sample + (size_t)dimensions * (size_t)i;
+      l = ndvss_ivf_nearest(ivf, x);
+      ++sizes[l];
+      for( d = 0; d < dimensions; ++d ) {
+        sums[(size_t)dimensions * (size_t)l + d] += x[d];
+      }
+    }
+    for( l = 0; l < list_count; ++l ) {
+      if( sizes[l] == 0 ) {
+        continue;
+      }
+      for( d = 0; d < dimensions; ++d ) {
+        ivf->centroids[(size_t)ivf->centroid_stride * (size_t)l + d] = (float)(sums[(size_t)dimensions * (size_t)l + d] / sizes[l]);
+      }
+    }
+    if( ndvss_task_advance(task, 1) ) {
+      rc = SQLITE_INTERRUPT;
+    }
+  }//endfor iterations
+  return rc;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_ivf_build
+// Desc: Trains the centroids on an evenly spread sample of the set and sorts every
+//       vector in to the list of its nearest centroid.
+// Args: Vector set and where the lists are stored.
+// Returns: SQLITE_OK, SQLITE_NOMEM or SQLITE_INTERRUPT.
+//----------------------------------------------------------------------------------------
+static int ndvss_ivf_build( const ndvss_vector_set* set, ndvss_ivf** result )
+{
+  double start = ndvss_now();
+  int dimensions = set->dimensions;
+  int list_count = (int)(sqrt((double)set->count) / 4);
+  if( list_count > NDVSS_IVF_MAX_LISTS ) {
+    list_count = NDVSS_IVF_MAX_LISTS;
+  }
+  if( list_count < 2 ) {
+    list_count = 2;
+  }
+  int sample_count = set->count < NDVSS_IVF_TRAINING_VECTORS ? (int)set->count : NDVSS_IVF_TRAINING_VECTORS;
+  ndvss_ivf* ivf = (ndvss_ivf*)sqlite3_malloc(sizeof(ndvss_ivf));
+  if( ivf == 0 ) {
+    return SQLITE_NOMEM;
+  }
+  memset(ivf, 0, sizeof(ndvss_ivf));
+  ivf->list_count = list_count;
+  ivf->dimensions = dimensions;
+  ivf->centroid_stride = (dimensions + 15) & ~15;
+  ivf->centroids = (float*)ndvss_aligned_malloc(sizeof(float) * (sqlite3_uint64)ivf->centroid_stride * (sqlite3_uint64)list_count, 
+                                                NDVSS_ALIGNMENT);
+  ivf->list_first = (sqlite3_int64*)sqlite3_malloc64(sizeof(sqlite3_int64) * (sqlite3_uint64)(list_count + 1));
+  ivf->positions = (sqlite3_int64*)sqlite3_malloc64(sizeof(sqlite3_int64) * (sqlite3_uint64)set->count);
+  float* sample = (float*)sqlite3_malloc64(sizeof(float) * (sqlite3_uint64)dimensions * (sqlite3_uint64)sample_count);
+  double* sums = (double*)sqlite3_malloc64(sizeof(double) * (sqlite3_uint64)dimensions * (sqlite3_uint64)list_count);
+  int* sizes = (int*)sqlite3_malloc64(sizeof(int) * (sqlite3_uint64)list_count);
+  int* lists = (int*)sqlite3_malloc64(sizeof(int) * (sqlite3_uint64)set->count);
+  float* vector = (float*)sqlite3_malloc64(sizeof(float) * (sqlite3_uint64)dimensions);
+  if( ivf->centroids == 0 || ivf->list_first == 0 || ivf->positions == 0 || sample == 0 || 
+      sums == 0 || sizes == 0 || lists == 0 || vector == 0 ) {
+    ndvss_ivf_free(ivf);
+    sqlite3_free(sample);
+    sqlite3_free(sums);
+    sqlite3_free(sizes);
+    sqlite3_free(lists);
+    sqlite3_free(vector);
+    return SQLITE_NOMEM;
+  }
+  memset(ivf->centroids, 0, sizeof(float) * (size_t)ivf->centroid_stride * (size_t)list_count);
+
+  // Every count / sample_count:th vector.
+  int s, i, l;
+  for( i = 0; i < sample_count; ++i ) {
+    sqlite3_int64 index = (sqlite3_int64)((double)i * (double)set->count / (double)sample_count);
+    const ndvss_segment* segment = &set->segments[ndvss_vector_set_segment(set, index)];
+    ndvss_to_float(sample + (size_t)dimensions * (size_t)i, 
+                   segment->vectors + (size_t)set->stride * (size_t)(index - segment->first), dimensions, set->element_size);
+  }
+  ndvss_task* task = ndvss_task_current();
+  int rc = ndvss_ivf_train(ivf, sample, sample_count, sums, sizes);
+
+  // Sort the vectors in to the lists, counting first.
+  ndvss_task_phase(task, "ivf_assign", set->count);
+  memset(ivf->list_first, 0, sizeof(sqlite3_int64) * (size_t)(list_count + 1));
+  sqlite3_int64 index = 0;
+  for( s = 0; s < set->segment_count && rc == SQLITE_OK; ++s ) {
+    const ndvss_segment* segment = &set->segments[s];
+    for( i = 0; i < segment->count; ++i, ++index ) {
+      ndvss_to_float(vector, segment->vectors + (size_t)set->stride * (size_t)i, dimensions, set->element_size);
+      lists[index] = ndvss_ivf_nearest(ivf, vector);
+      ++ivf->list_first[lists[index] + 1];
+    }
+    if( ndvss_task_advance(task, segment->count) ) {
+      rc = SQLITE_INTERRUPT;
+    }
+  }
+  if( rc != SQLITE_OK ) {
+    ndvss_ivf_free(ivf);
+    sqlite3_free(sample);
+    sqlite3_free(sums);
+    sqlite3_free(sizes);
+    sqlite3_free(lists);
+    sqlite3_free(vector);
+    return rc;
+  }
+  for( l = 0; l < list_count; ++l ) {
+    ivf->list_first[l + 1] += ivf->list_first[l];
+  }
+  for( l = 0; l < list_count; ++l ) {
+    sizes[l] = 0;
+  }
+  for( index = 0; index < set->count; ++index ) {
+    l = lists[index];
+    ivf->positions[ivf->list_first[l] + sizes[l]++] = index;
+  }
+  sqlite3_free(sample);
+  sqlite3_free(sums);
+  sqlite3_free(sizes);
+  sqlite3_free(lists);
+  sqlite3_free(vector);
+  *result = ivf;
+  NDVSS_STAT_ADD(ivf_builds, 1);
+  NDVSS_STAT_ADD(ivf_build_nanoseconds, (sqlite3_int64)((ndvss_now() - start) * 1e9));
+  return SQLITE_OK;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_ivf_ensure
+// Desc: Builds the inverted lists of a set if a budgeted scan will use them. Only for
+//       sets that don't change in place: not the snapshots of ndvss_index tables.
+// Returns: SQLITE_OK, SQLITE_NOMEM or SQLITE_INTERRUPT.
+//----------------------------------------------------------------------------------------
+static int ndvss_ivf_ensure( ndvss_vector_set* set )
+{
+  if( !ndvss_scan_budgeted() || !NDVSS_CONFIG(NDVSS_CONFIG_SEARCH_BUDGET_IVF) || set->count < NDVSS_IVF_MIN_VECTORS ||
+      __atomic_load_n(&set->ivf, __ATOMIC_ACQUIRE) != 0 ) {
+    return SQLITE_OK;
+  }
+  int rc = SQLITE_OK;
+  ndvss_mutex_lock(&ndvss_build_mutex);
+  if( set->ivf == 0 ) {
+    ndvss_ivf* ivf = 0;
+    rc = ndvss_ivf_build(set, &ivf);
+    if( rc == SQLITE_OK ) {
+      __atomic_store_n(&set->ivf, ivf, __ATOMIC_RELEASE);
+    }
+  }
+  ndvss_mutex_unlock(&ndvss_build_mutex);
+  return rc;
+}
+
+
+//----------------------------------------------------------------------------------------
+// CLUSTERED COPIES.
+// ndvss_reorder_f/_d copy a column to a companion table in the order of the k-means 
+// clusters of its vectors, trained like the IVF lists, so that the rows of a cluster 
+// are next to each other in the file. The table <table>_<column>_reordered has new
+// rowids from 1 in cluster order and the rowid of the source row; the table
+// <table>_<column>_clusters maps every cluster to its centroid and its range of rowids.
+// Reading a cluster is then a range scan of consecutive pages instead of reads all
+// over the file. The source table is not changed, so the copy has to be made again
+// after the column changes.
+//----------------------------------------------------------------------------------------
+#define NDVSS_REORDER_MAX_CLUSTERS 65536
+
+typedef struct ndvss_reorder_row {
+  int           cluster;
+  sqlite3_int64 rowid;
+} ndvss_reorder_row;
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_reorder_row_compare
+// Desc: Orders the rows by cluster and by rowid in a cluster.
+//----------------------------------------------------------------------------------------
+static int ndvss_reorder_row_compare( const void* a, const void* b )
+{
+  const ndvss_reorder_row* x = (const ndvss_reorder_row*)a;
+  const ndvss_reorder_row* y = (const ndvss_reorder_row*)b;
+  if( x->cluster != y->cluster ) {
+    return x->cluster < y->cluster ? -1 : 1;
+  }
+  return x->rowid < y->rowid ? -1 : (x->rowid > y->rowid ? 1 : 0);
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_reorder_write
+// Desc: Writes the companion tables of ndvss_reorder in a savepoint, so that they are
+//       replaced whole or not at all.
+// Args: Database, schema, table and column names, element size, the centroids, the rows
+//       sorted by cluster and their number.
+// Returns: SQLITE_OK or an error code. The message is in sqlite3_errmsg unless the code
+//          is SQLITE_NOMEM or SQLITE_INTERRUPT.
+//----------------------------------------------------------------------------------------
+static int ndvss_reorder_write( sqlite3* db,
+                                const char* db_name,
+                                const char* table_name,
+                                const char* column,
+                                int element_size,
+                                const ndvss_ivf* clusters,
+                                const ndvss_reorder_row* rows,
+                                sqlite3_int64 n )
+{
+  int rc = sqlite3_exec(db, "SAVEPOINT ndvss_reorder", 0, 0, 0);
+  if( rc != SQLITE_OK ) {
+    return rc;
+  }
+  char* sql = sqlite3_mprintf("DROP TABLE IF EXISTS \"%w\".\"%w_%w_reordered\";"
+                              "DROP TABLE IF EXISTS \"%w\".\"%w_%w_clusters\";"
+                              "CREATE TABLE \"%w\".\"%w_%w_reordered\"(rowid INTEGER PRIMARY KEY, "
+                              "source_rowid INTEGER NOT NULL, vector BLOB NOT NULL);"
+                              "CREATE TABLE \"%w\".\"%w_%w_clusters\"(cluster INTEGER PRIMARY KEY, "
+                              "first_rowid INTEGER NOT NULL, last_rowid INTEGER NOT NULL, count INTEGER NOT NULL, "
+                              "centroid BLOB NOT NULL);",
+                              db_name, table_name, column, db_name, table_name, column, 
+                              db_name, table_name, column, db_name, table_name, column);
+  rc = sql != 0 ? sqlite3_exec(db, sql, 0, 0, 0) : SQLITE_NOMEM;
+  sqlite3_free(sql);
+
+  // The vectors are copied by SQLite, without a round trip through memory here.
+  sqlite3_stmt* insert = 0;
+  if( rc == SQLITE_OK ) {
+    sql = sqlite3_mprintf("INSERT INTO \"%w\".\"%w_%w_reordered\" SELECT ?1, v.rowid, v.\"%w\" "
+                          "FROM \"%w\".\"%w\" AS v WHERE v.rowid = ?2", 
+                          db_name, table_name, column, column, db_name, table_name);
+    rc = sql != 0 ? sqlite3_prepare_v2(db, sql, -1, &insert, 0) : SQLITE_NOMEM;
+    sqlite3_free(sql);
+  }
+  ndvss_task* task = ndvss_task_current();
+  ndvss_task_phase(task, "reorder_write", n);
+  sqlite3_int64 i;
+  for( i = 0; i < n && rc == SQLITE_OK; ++i ) {
+    sqlite3_bind_int64(insert, 1, i + 1);
+    sqlite3_bind_int64(insert, 2, rows[i].rowid);
+    sqlite3_step(insert);
+    rc = sqlite3_reset(insert);
+    if( rc == SQLITE_OK && (i & 1023) == 1023 && ndvss_task_advance(task, 1024) ) {
+      rc = SQLITE_INTERRUPT;
+    }
+  }
+  sqlite3_finalize(insert);
+
+  // One row per cluster that got vectors.
+  sqlite3_stmt* stmt = 0;
+  if( rc == SQLITE_OK ) {
+    sql = sqlite3_mprintf("INSERT INTO \"%w\".\"%w_%w_clusters\" VALUES(?, ?, ?, ?, ?)", db_name, table_name, column);
+    rc = sql != 0 ? sqlite3_prepare_v2(db, sql, -1, &stmt, 0) : SQLITE_NOMEM;
+    sqlite3_free(sql);
+  }
+  void* centroid = rc == SQLITE_OK ? sqlite3_malloc64((sqlite3_uint64)element_size * (sqlite3_uint64)clusters->dimensions) : 0;
+  if( rc == SQLITE_OK && centroid == 0 ) {
+    rc = SQLITE_NOMEM;
+  }
+  sqlite3_int64 first = 0;
+  while( first < n && rc == SQLITE_OK ) {
+    sqlite3_int64 last = first;
+    while( last + 1 < n && rows[last + 1].cluster == rows[first].cluster ) {
+      ++last;
+    }
+    const float* c = clusters->centroids + (size_t)clusters->centroid_stride * (size_t)rows[first].cluster;
+    int d;
+    for( d = 0; d < clusters->dimensions; ++d ) {
+      if( element_size == sizeof(double) ) {
+        ((double*)centroid)[d] = c[d];
+      } else {
+        ((float*)centroid)[d] = c[d];
+      }
+    }
+    sqlite3_bind_int(stmt, 1, rows[first].cluster);
+    sqlite3_bind_int64(stmt, 2, first + 1);
+    sqlite3_bind_int64(stmt, 3, last + 1);
+    sqlite3_bind_int64(stmt, 4, last - first + 1);
+    sqlite3_bind_blob(stmt, 5, centroid, element_size * clusters->dimensions, SQLITE_STATIC);
+    rc = sqlite3_step(stmt) == SQLITE_DONE ? SQLITE_OK : SQLITE_ERROR;
+    sqlite3_reset(stmt);
+    first = last + 1;
+  }
+  sqlite3_finalize(stmt);
+  sqlite3_free(centroid);
+  if( rc == SQLITE_OK ) {
+    rc = sqlite3_exec(db, "RELEASE ndvss_reorder", 0, 0, 0);
+  } else {
+    sqlite3_exec(db, "ROLLBACK TO ndvss_reorder; RELEASE ndvss_reorder", 0, 0, 0);
+  }
+  return rc;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_reorder
+// Desc: Shared implementation of ndvss_reorder_f/_d. Clusters the vectors of a column
+//       and copies them to the companion tables in cluster order.
+// Args: Table name TEXT ("table" or "schema.table"),
+//       Column name TEXT,
+//       Optionally the number of clusters INTEGER (default about sqrt(rows) / 4)
+// Returns: The result as a JSON object TEXT: the number of vectors and clusters.
+//----------------------------------------------------------------------------------------
+static void ndvss_reorder( sqlite3_context* context,
+                           int argc,
+                           sqlite3_value** argv,
+                           int element_size ) 
+{
+  if( argc < 2 || sqlite3_value_type(argv[0]) == SQLITE_NULL || sqlite3_value_type(argv[1]) == SQLITE_NULL ) {
+    sqlite3_result_error(context, "The table and the column need to be given.", -1);
+    return;
+  }
+  sqlite3* db = sqlite3_context_db_handle(context);
+  const char* table = (const char*)sqlite3_value_text(argv[0]);
+  const char* column = (const char*)sqlite3_value_text(argv[1]);
+  sqlite3_int64 cluster_count = argc > 2 && sqlite3_value_type(argv[2]) != SQLITE_NULL ? sqlite3_value_int64(argv[2]) : 0;
+  if( cluster_count < 0 || cluster_count > NDVSS_REORDER_MAX_CLUSTERS ) {
+    sqlite3_result_error(context, "The number of clusters can be from 1 to 65536, or 0 for the default.", -1);
+    return;
+  }
+  const char* dot = strchr(table, '.');
+  char* db_name = dot != 0 ? sqlite3_mprintf("%.*s", (int)(dot - table), table) : sqlite3_mprintf("main");
+  const char* table_name = dot != 0 ? dot + 1 : table;
+  sqlite3_stmt* stmt = 0;
+  if( db_name == 0 ) {
+    sqlite3_result_error_nomem(context);
+    return;
+  }
+  char* message = 0;
+  int rc = ndvss_vector_select_prepare(db, db_name, table_name, column, &stmt, &message);
+  if( rc != SQLITE_OK ) {
+    sqlite3_free(db_name);
+    if( message != 0 ) {
+      sqlite3_result_error(context, message, -1);
+      sqlite3_free(message);
+    } else {
+      sqlite3_result_error_nomem(context);
+    }
+    return;
+  }
+  ndvss_task task;
+  ndvss_task_begin(&task, db, "reorder", table);
+
+  // Reservoir sample for the training, and the rowids.
+  const char* error = 0;
+  int error_code = SQLITE_ERROR;
+  int dimensions = 0;
+  int sample_count = 0;
+  float* sample = 0;
+  ndvss_reorder_row* rows = 0;
+  sqlite3_int64 n = 0, capacity = 0;
+  sqlite3_uint64 random_state = 0x9E3779B97F4A7C15ULL;
+  ndvss_task_phase(&task, "reorder_read", 0);
+  while( error == 0 && (rc = sqlite3_step(stmt)) == SQLITE_ROW ) {
+    int bytes = sqlite3_column_bytes(stmt, 1);
+    if( dimensions == 0 ) {
+      dimensions = bytes / element_size;
+      if( dimensions < 1 ) {
+        error = "The arrays are empty.";
+        break;
+      }
+      sample = (float*)sqlite3_malloc64(sizeof(float) * (sqlite3_uint64)dimensions * NDVSS_IVF_TRAINING_VECTORS);
+      if( sample == 0 ) {
+        error = "Out of memory.";
+        break;
+      }
+    }
+    if( bytes != dimensions * element_size ) {
+      error = "The arrays are not the same length.";
+      break;
+    }
+    if( n == capacity ) {
+      capacity = capacity == 0 ? 4096 : capacity * 2;
+      ndvss_reorder_row* grown = (ndvss_reorder_row*)sqlite3_realloc64(rows, sizeof(ndvss_reorder_row) * (sqlite3_uint64)capacity);
+      if( grown == 0 ) {
+        error = "Out of memory.";
+        break;
+      }
+      rows = grown;
+    }
+    rows[n].rowid = sqlite3_column_int64(stmt, 0);
+    rows[n].cluster = 0;
+    sqlite3_int64 slot = n++;
+    if( slot >= NDVSS_IVF_TRAINING_VECTORS ) {
+      random_state = random_state * 6364136223846793005ULL + 1442695040888963407ULL;
+      slot = (sqlite3_int64)((random_state >> 11) % (sqlite3_uint64)n);
+      if( slot >= NDVSS_IVF_TRAINING_VECTORS ) {
+        continue;
+      }
+    } else {
+      ++sample_count;
+    }
+    ndvss_to_float(sample + (size_t)slot * dimensions, sqlite3_column_blob(stmt, 1), dimensions, element_size);
+  }//endwhile reading rows
+  if( error == 0 && rc != SQLITE_DONE ) {
+    error = sqlite3_errmsg(db);
+    error_code = rc;
+  }
+  if( error == 0 && n == 0 ) {
+    error = "The column has no vectors.";
+  }
+  if( cluster_count == 0 ) {
+    cluster_count = (sqlite3_int64)(sqrt((double)n) / 4);
+    if( cluster_count > NDVSS_IVF_MAX_LISTS ) {
+      cluster_count = NDVSS_IVF_MAX_LISTS;
+    }
+  }
+  if( cluster_count < 1 ) {
+    cluster_count = 1;
+  }
+  if( cluster_count > sample_count ) {
+    cluster_count = sample_count;
+  }
+
+  // Train the centroids and assign every row to its nearest one.
+  ndvss_ivf clusters;
+  memset(&clusters, 0, sizeof(clusters));
+  clusters.list_count = (int)cluster_count;
+  clusters.dimensions = dimensions;
+  clusters.centroid_stride = (dimensions + 15) & ~15;
+  double* sums = 0;
+  int* sizes = 0;
+  float* vector = 0;
+  if( error == 0 ) {
+    clusters.centroids = (float*)ndvss_aligned_malloc(sizeof(float) * (sqlite3_uint64)clusters.centroid_stride * 
+                                                      (sqlite3_uint64)cluster_count, NDVSS_ALIGNMENT);
+    sums = (double*)sqlite3_malloc64(sizeof(double) * (sqlite3_uint64)dimensions * (sqlite3_uint64)cluster_count);
+    sizes = (int*)sqlite3_malloc64(sizeof(int) * (sqlite3_uint64)cluster_count);
+    vector = (float*)sqlite3_malloc64(sizeof(float) * (sqlite3_uint64)dimensions);
+    if( clusters.centroids == 0 || sums == 0 || sizes == 0 || vector == 0 ) {
+      error = "Out of memory.";
+    } else {
+      memset(clusters.centroids, 0, sizeof(float) * (size_t)clusters.centroid_stride * (size_t)cluster_count);
+    }
+  }
+  if( error == 0 && ndvss_ivf_train(&clusters, sample, sample_count, sums, sizes) != SQLITE_OK ) {
+    error = sqlite3_errstr(SQLITE_INTERRUPT);
+    error_code = SQLITE_INTERRUPT;
+  }
+  if( error == 0 ) {
+    ndvss_task_phase(&task, "reorder_assign", n);
+    sqlite3_reset(stmt);
+    sqlite3_int64 i = 0;
+    while( (rc = sqlite3_step(stmt)) == SQLITE_ROW && i < n ) {
+      if( sqlite3_column_bytes(stmt, 1) != dimensions * element_size || sqlite3_column_int64(stmt, 0) != rows[i].rowid ) {
+        error = "The table changed while it was read.";
+        break;
+      }
+      ndvss_to_float(vector, sqlite3_column_blob(stmt, 1), dimensions, element_size);
+      rows[i].cluster = ndvss_ivf_nearest(&clusters, vector);
+      ++i;
+      if( (i & 1023) == 0 && ndvss_task_advance(&task, 1024) ) {
+        error = sqlite3_errstr(SQLITE_INTERRUPT);
+        error_code = SQLITE_INTERRUPT;
+        break;
+      }
+    }
+    if( error == 0 && (rc != SQLITE_DONE || i != n) ) {
+      error = rc == SQLITE_DONE || rc == SQLITE_ROW ? "The table changed while it was read." : sqlite3_errmsg(db);
+      error_code = rc == SQLITE_DONE || rc == SQLITE_ROW ? SQLITE_ERROR : rc;
+    }
+  }
+  sqlite3_finalize(stmt);
+
+  int used = 0;
+  if( error == 0 ) {
+    qsort(rows, (size_t)n, sizeof(ndvss_reorder_row), ndvss_reorder_row_compare);
+    rc = ndvss_reorder_write(db, db_name, table_name, column, element_size, &clusters, rows, n);
+    if( rc == SQLITE_NOMEM || rc == SQLITE_INTERRUPT ) {
+      error = sqlite3_errstr(rc);
+      error_code = rc;
+    } else if( rc != SQLITE_OK ) {
+      error = sqlite3_errmsg(db);
+      error_code = rc;
+    }
+    sqlite3_int64 i;
+    for( i = 0; i < n; ++i ) {
+      used += i == 0 || rows[i].cluster != rows[i - 1].cluster;
+    }
+  }
+  if( error != 0 ) {
+    sqlite3_result_error(context, error, -1);
+    if( error_code != SQLITE_ERROR ) {
+      sqlite3_result_error_code(context, error_code);
+    }
+  } else {
+    char* json = sqlite3_mprintf("{\"vectors\":%lld,\"dimensions\":%d,\"clusters\":%d}", n, dimensions, used);
+    if( json == 0 ) {
+      sqlite3_result_error_nomem(context);
+    } else {
+      sqlite3_result_text(context, json, -1, sqlite3_free);
+    }
+  }
+  sqlite3_free(db_name);
+  sqlite3_free(sample);
+  sqlite3_free(rows);
+  ndvss_aligned_free(clusters.centroids);
+  sqlite3_free(sums);
+  sqlite3_free(sizes);
+  sqlite3_free(vector);
+  ndvss_task_end(&task);
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_reorder_d
+// Desc: Copies a column of double-arrays in cluster order. See ndvss_reorder.
+//----------------------------------------------------------------------------------------
+static void ndvss_reorder_d( sqlite3_context* context,
+                             int argc,
+                             sqlite3_value** argv ) 
+{
+  ndvss_reorder(context, argc, argv, sizeof(double));
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_reorder_f
+// Desc: Copies a column of float-arrays in cluster order. See ndvss_reorder.
+//----------------------------------------------------------------------------------------
+static void ndvss_reorder_f( sqlite3_context* context,
+                             int argc,
+                             sqlite3_value** argv ) 
+{
+  ndvss_reorder(context, argc, argv, sizeof(float));
+}
+
+
+//----------------------------------------------------------------------------------------
+// FLAT VECTOR FILES.
+// Vector sets that don't fit in memory can be exported to a flat file next to the 
+// database with ndvss_flat_export_f/_d, and searched with the k-NN functions by giving
+// 'file:<path>' as the table. The file is read in chunks through a queue of 
+// outstanding reads, so that the disk keeps working while the vectors of the previous
+// chunks are scored. On Linux the reads are O_DIRECT reads through io_uring; elsewhere,
+// or if io_uring isn't available, pread with kernel read-ahead is used.
+//
+// File layout (little-endian):
+//   0                  ndvss_flat_header, padded to NDVSS_IO_ALIGNMENT bytes
+//   data_offset        count vectors of vector_bytes each, packed
+//   rowid_offset       count rowids as 64-bit integers, aligned to NDVSS_IO_ALIGNMENT
+//----------------------------------------------------------------------------------------
+#define NDVSS_FLAT_MAGIC       "NDVSSVEC"
+#define NDVSS_FLAT_VERSION     1
+#define NDVSS_IO_ALIGNMENT     4096                // O_DIRECT needs aligned buffers, offsets and sizes.
+#define NDVSS_IO_CHUNK_BYTES   (1024 * 1024)       // Approximate size of one read.
+
+typedef struct ndvss_flat_header {
+  char          magic[8];
+  unsigned int  version;
+  unsigned int  element_size;
+  unsigned int  dimensions;
+  unsigned int  reserved;
+  sqlite3_int64 count;
+  sqlite3_int64 data_offset;
+  sqlite3_int64 rowid_offset;
+} ndvss_flat_header;
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+#define NDVSS_HAVE_IO_URING 1
+#endif
+#endif
+
+#ifdef NDVSS_HAVE_IO_URING
+//----------------------------------------------------------------------------------------
+// A minimal io_uring on top of the raw system calls, so that liburing isn't needed.
+//----------------------------------------------------------------------------------------
+typedef struct ndvss_uring {
+  int                  fd;
+  unsigned*            sq_head;
+  unsigned*            sq_tail;
+  unsigned*            sq_mask;
+  unsigned*            sq_array;
+  unsigned*            cq_head;
+  unsigned*            cq_tail;
+  unsigned*            cq_mask;
+  struct io_uring_sqe* sqes;
+  struct io_uring_cqe* cqes;
+  void*                sq_ring;
+  void*                cq_ring;
+  size_t               sq_ring_bytes;
+  size_t               cq_ring_bytes;
+  size_t               sqes_bytes;
+  unsigned             pending;           // Prepared but not yet submitted.
+} ndvss_uring;
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_uring_close
+//----------------------------------------------------------------------------------------
+static void ndvss_uring_close( ndvss_uring* ring )
+{
+  if( ring->sqes != 0 ) {
+    munmap(ring->sqes, ring->sqes_bytes);
+  }
+  if( ring->cq_ring != 0 && ring->cq_ring != ring->sq_ring ) {
+    munmap(ring->cq_ring, ring->cq_ring_bytes);
+  }
+  if( ring->sq_ring != 0 ) {
+    munmap(ring->sq_ring, ring->sq_ring_bytes);
+  }
+  if( ring->fd >= 0 ) {
+    close(ring->fd);
+  }
+  memset(ring, 0, sizeof(ndvss_uring));
+  ring->fd = -1;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_uring_open
+// Desc: Sets up a ring with room for the given number of requests.
+// Returns: SQLITE_OK or SQLITE_ERROR if io_uring isn't available.
+//----------------------------------------------------------------------------------------
+static int ndvss_uring_open( ndvss_uring* ring, unsigned entries )
+{
+  struct io_uring_params params;
+  memset(ring, 0, sizeof(ndvss_uring));
+  memset(&params, 0, sizeof(params));
+  ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+  if( ring->fd < 0 ) {
+    ring->fd = -1;
+    return SQLITE_ERROR;
+  }
+  ring->sq_ring_bytes = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cq_ring_bytes = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if( params.features & IORING_FEAT_SINGLE_MMAP ) {
+    if( ring->cq_ring_bytes > ring->sq_ring_bytes ) {
+      ring->sq_ring_bytes = ring->cq_ring_bytes;
+    }
+    ring->cq_ring_bytes = ring->sq_ring_bytes;
+  }
+  ring->sq_ring = mmap(0, ring->sq_ring_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, 
+                       ring->fd, IORING_OFF_SQ_RING);
+  if( ring->sq_ring == MAP_FAILED ) {
+    ring->sq_ring = 0;
+    ndvss_uring_close(ring);
+    return SQLITE_ERROR;
+  }
+  if( params.features & IORING_FEAT_SINGLE_MMAP ) {
+    ring->cq_ring = ring->sq_ring;
+  } else {
+    ring->cq_ring = mmap(0, ring->cq_ring_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, 
+                         ring->fd, IORING_OFF_CQ_RING);
+    if( ring->cq_ring == MAP_FAILED ) {
+      ring->cq_ring = 0;
+      ndvss_uring_close(ring);
+      return SQLITE_ERROR;
+    }
+  }
+  ring->sqes_bytes = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = (struct io_uring_sqe*)mmap(0, ring->sqes_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, 
+                                          ring->fd, IORING_OFF_SQES);
+  if( ring->sqes == MAP_FAILED ) {
+    ring->sqes = 0;
+    ndvss_uring_close(ring);
+    return SQLITE_ERROR;
+  }
+  unsigned char* sq = (unsigned char*)ring->sq_ring;
+  unsigned char* cq = (unsigned char*)ring->cq_ring;
+  ring->sq_head = (unsigned*)(sq + params.sq_off.head);
+  ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+  ring->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+  ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+  ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+  ring->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+  return SQLITE_OK;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_uring_prepare_read
+// Desc: Queues a read. It is handed to the kernel by the next ndvss_uring_wait.
+//----------------------------------------------------------------------------------------
+static void ndvss_uring_prepare_read( ndvss_uring* ring, int fd, void* buffer, unsigned bytes, 
+                                      sqlite3_int64 offset, sqlite3_uint64 user_data )
+{
+  unsigned tail = *ring->sq_tail;
+  unsigned index = tail & *ring->sq_mask;
+  struct io_uring_sqe* sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = fd;
+  sqe->addr = (sqlite3_uint64)(size_t)buffer;
+  sqe->len = bytes;
+  sqe->off = (sqlite3_uint64)offset;
+  sqe->user_data = user_data;
+  ring->sq_array[index] = index;
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ++ring->pending;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_uring_wait
+// Desc: Submits the queued reads and waits for one completion.
+// Returns: SQLITE_OK and the completion, or SQLITE_IOERR.
+//----------------------------------------------------------------------------------------
+static int ndvss_uring_wait( ndvss_uring* ring, sqlite3_uint64* user_data, int* result )
+{
+  for( ;; ) {
+    unsigned head = *ring->cq_head;
+    if( head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE) ) {
+      struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cq_mask];
+      *user_data = cqe->user_data;
+      *result = cqe->res;
+      __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+      return SQLITE_OK;
+    }
+    int rc = (int)syscall(__NR_io_uring_enter, ring->fd, ring->pending, 1, IORING_ENTER_GETEVENTS, 0, 0);
+    if( rc < 0 ) {
+      if( errno == EINTR ) {
+        continue;
+      }
+      return SQLITE_IOERR;
+    }
+    ring->pending -= (unsigned)rc < ring->pending ? (unsigned)rc : ring->pending;
+  }
+}
+#endif
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_file_read_at
+// Desc: Reads the given number of bytes from an offset of a file, retrying short reads.
+// Returns: Number of bytes read (less only at the end of the file), or -1 on error.
+//----------------------------------------------------------------------------------------
+static sqlite3_int64 ndvss_file_read_at( int fd, void* buffer, sqlite3_int64 bytes, sqlite3_int64 offset )
+{
+  sqlite3_int64 done = 0;
+  while( done < bytes ) {
+#ifdef _WIN32
+    OVERLAPPED overlapped;
+    DWORD read_bytes = 0;
+    memset(&overlapped, 0, sizeof(overlapped));
+    overlapped.Offset = (DWORD)((offset + done) & 0xFFFFFFFF);
+    overlapped.OffsetHigh = (DWORD)((offset + done) >> 32);
+    DWORD request = (bytes - done) > 0x40000000 ? 0x40000000 : (DWORD)(bytes - done);
+    if( !ReadFile((HANDLE)_get_osfhandle(fd), (char*)buffer + done, request, &read_bytes, &overlapped) ) {
+      return GetLastError() == ERROR_HANDLE_EOF ? done : -1;
+    }
+    sqlite3_int64 n = read_bytes;
+#else
+    ssize_t n = pread(fd, (char*)buffer + done, (size_t)(bytes - done), (off_t)(offset + done));
+    if( n < 0 && errno == EINTR ) {
+      continue;
+    }
+#endif
+    if( n < 0 ) {
+      return -1;
+    }
+    if( n == 0 ) {
+      break;
+    }
+    done += n;
+  }
+  return done;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_resolve_path
+// Desc: Relative paths are taken relative to the directory of the main database file,
+//       so that the flat file can live next to the database.
+// Returns: The path allocated with sqlite3_malloc, or 0 if out of memory.
+//----------------------------------------------------------------------------------------
+static char* ndvss_resolve_path( sqlite3* db, const char* path )
+{
+  int is_absolute = path[0] == '/' || path[0] == '\\' || (path[0] != 0 && path[1] == ':');
+  const char* db_file = sqlite3_db_filename(db, "main");
+  if( is_absolute || db_file == 0 || db_file[0] == 0 ) {
+    return sqlite3_mprintf("%s", path);
+  }
+  const char* slash = strrchr(db_file, '/');
+  const char* backslash = strrchr(db_file, '\\');
+  if( backslash > slash ) {
+    slash = backslash;
+  }
+  if( slash == 0 ) {
+    return sqlite3_mprintf("%s", path);
+  }
+  return sqlite3_mprintf("%.*s%s", (int)(slash - db_file + 1), db_file, path);
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_flat_export
+// Desc: Shared implementation of ndvss_flat_export_f/_d. Writes the non-NULL vectors of
+//       a column and their rowids to a flat file.
+// Args: Table name TEXT ("table" or "schema.table"),
+//       Column name TEXT,
+//       Path of the file TEXT (relative to the database file)
+// Returns: Number of vectors written INTEGER
+//----------------------------------------------------------------------------------------
+static void ndvss_flat_export( sqlite3_context* context,
+                              int argc,
+                              sqlite3_value** argv,
+                              int element_size ) 
+{
+  if( argc < 3 ) {
+    sqlite3_result_error(context, "3 arguments needs to be given: table, column, file path.", -1);
+    return;
+  }
+  if( sqlite3_value_type(argv[0]) == SQLITE_NULL ||
+      sqlite3_value_type(argv[1]) == SQLITE_NULL ||
+      sqlite3_value_type(argv[2]) == SQLITE_NULL ) {
+    sqlite3_result_error(context, "One of the given arguments is null.", -1);
+    return;
+  }
+  sqlite3* db = sqlite3_context_db_handle(context);
+  const char* table = (const char*)sqlite3_value_text(argv[0]);
+  const char* column = (const char*)sqlite3_value_text(argv[1]);
+  const char* dot = strchr(table, '.');
+  char* db_name = dot != 0 ? sqlite3_mprintf("%.*s", (int)(dot - table), table) : sqlite3_mprintf("main");
+  char* path = ndvss_resolve_path(db, (const char*)sqlite3_value_text(argv[2]));
+  if( db_name == 0 || path == 0 ) {
+    sqlite3_free(db_name);
+    sqlite3_free(path);
+    sqlite3_result_error_nomem(context);
+    return;
+  }
+  sqlite3_stmt* stmt = 0;
+  char* message = 0;
+  int rc = ndvss_vector_select_prepare(db, db_name, dot != 0 ? dot + 1 : table, column, &stmt, &message);
+  sqlite3_free(db_name);
+  if( rc != SQLITE_OK ) {
+    sqlite3_free(path);
+    if( message != 0 ) {
+      sqlite3_result_error(context, message, -1);
+      sqlite3_free(message);
+    } else {
+      sqlite3_result_error_nomem(context);
+    }
+    return;
+  }
+  FILE* file = fopen(path, "wb");
+  if( file == 0 ) {
+    message = sqlite3_mprintf("Can't open %s for writing.", path);
+    sqlite3_result_error(context, message ? message : "Can't open the file for writing.", -1);
+    sqlite3_free(message);
+    sqlite3_free(path);
+    sqlite3_finalize(stmt);
+    return;
+  }
+  sqlite3_free(path);
+
+  ndvss_flat_header header;
+  unsigned char padding[NDVSS_IO_ALIGNMENT];
+  memset(&header, 0, sizeof(header));
+  memset(padding, 0, sizeof(padding));
+  memcpy(header.magic, NDVSS_FLAT_MAGIC, 8);
+  header.version = NDVSS_FLAT_VERSION;
+  header.element_size = (unsigned int)element_size;
+  header.data_offset = NDVSS_IO_ALIGNMENT;
+  int ok = fwrite(padding, 1, NDVSS_IO_ALIGNMENT, file) == NDVSS_IO_ALIGNMENT;
+
+  sqlite3_int64* rowids = 0;
+  sqlite3_int64 capacity = 0;
+  const char* error = 0;
+  int vector_bytes = -1;
+  while( ok && (rc = sqlite3_step(stmt)) == SQLITE_ROW ) {
+    int bytes = sqlite3_column_bytes(stmt, 1);
+    if( vector_bytes < 0 ) {
+      vector_bytes = bytes;
+      if( vector_bytes < element_size ) {
+        error = "The arrays are empty.";
+        break;
+      }
+    } else if( bytes != vector_bytes ) {
+      error = "The arrays are not the same length.";
+      break;
+    }
+    if( header.count == capacity ) {
+      capacity = capacity < 1024 ? 1024 : capacity * 2;
+      sqlite3_int64* grown = (sqlite3_int64*)sqlite3_realloc64(rowids, sizeof(sqlite3_int64) * (sqlite3_uint64)capacity);
+      if( grown == 0 ) {
+        error = "Out of memory.";
+        break;
+      }
+      rowids = grown;
+    }
+    rowids[header.count++] = sqlite3_column_int64(stmt, 0);
+    ok = fwrite(sqlite3_column_blob(stmt, 1), 1, (size_t)bytes, file) == (size_t)bytes;
+  }//endwhile writing vectors
+  if( error == 0 && ok && rc != SQLITE_DONE ) {
+    error = sqlite3_errmsg(db);
+  }
+  if( error == 0 && ok ) {
+    header.dimensions = vector_bytes > 0 ? (unsigned int)(vector_bytes / element_size) : 0;
+    sqlite3_int64 end = header.data_offset + header.count * (sqlite3_int64)(vector_bytes > 0 ? vector_bytes : 0);
+    header.rowid_offset = (end + NDVSS_IO_ALIGNMENT - 1) & ~(sqlite3_int64)(NDVSS_IO_ALIGNMENT - 1);
+    ok = fwrite(padding, 1, (size_t)(header.rowid_offset - end), file) == (size_t)(header.rowid_offset - end);
+    if( ok && header.count > 0 ) {
+      ok = fwrite(rowids, sizeof(sqlite3_int64), (size_t)header.count, file) == (size_t)header.count;
+    }
+    if( ok ) {
+      // Pad the end as well, so that every O_DIRECT read stays inside the file.
+      sqlite3_int64 rowid_end = header.rowid_offset + header.count * (sqlite3_int64)sizeof(sqlite3_int64);
+      sqlite3_int64 file_end = (rowid_end + NDVSS_IO_ALIGNMENT - 1) & ~(sqlite3_int64)(NDVSS_IO_ALIGNMENT - 1);
+      ok = fwrite(padding, 1, (size_t)(file_end - rowid_end), file) == (size_t)(file_end - rowid_end);
+    }
+    ok = ok && fseek(file, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, file) == 1;
+  }
+  if( fclose(file) != 0 ) {
+    ok = 0;
+  }
+  sqlite3_free(rowids);
+  if( error != 0 ) {
+    sqlite3_result_error(context, error, -1);
+  } else if( !ok ) {
+    sqlite3_result_error(context, "Writing the file failed.", -1);
+  } else {
+    sqlite3_result_int64(context, header.count);
+  }
+  sqlite3_finalize(stmt);
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_flat_export_d
+// Desc: Writes a column of double-arrays to a flat file. See ndvss_flat_export.
+//----------------------------------------------------------------------------------------
+static void ndvss_flat_export_d( sqlite3_context* context,
+                                 int argc,
+                                 sqlite3_value** argv ) 
+{
+  ndvss_flat_export(context, argc, argv, sizeof(double));
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_flat_export_f
+// Desc: Writes a column of float-arrays to a flat file. See ndvss_flat_export.
+//----------------------------------------------------------------------------------------
+static void ndvss_flat_export_f( sqlite3_context* context,
+                                 int argc,
+                                 sqlite3_value** argv ) 
+{
+  ndvss_flat_export(context, argc, argv, sizeof(float));
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_flat_score_chunk
+// Desc: Scores the vectors of one chunk that has been read to memory.
+//----------------------------------------------------------------------------------------
+static void ndvss_flat_score_chunk( const unsigned char* vectors,
+                                    sqlite3_int64 first,
+                                    int count,
+                                    const ndvss_flat_header* header,
+                                    const sqlite3_int64* rowids,
+                                    int metric,
+                                    const void* searched_array,
+                                    ndvss_topk* topk )
+{
+  int vector_bytes = (int)(header->dimensions * header->element_size);
+  int i;
+  for( i = 0; i < count; ++i ) {
+    double distance;
+    if( ndvss_metric_distance(metric, (int)header->element_size, searched_array, vectors + (size_t)i * (size_t)vector_bytes, 
+                              (int)header->dimensions, &distance) &&
+        distance < ndvss_topk_bound(topk) ) {
+      ndvss_topk_push(topk, distance, rowids[first + i]);
+    }
+  }
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_flat_scan
+// Desc: Finds the k best vectors of a flat file. io_depth chunks are kept in flight:
+//       while a chunk is scored, the following ones are being read.
+// Args: Database (for resolving the path), path, element size, metric, searched vector
+//       and its size in bytes, top-k, where an error message is stored.
+// Returns: SQLITE_OK or an error code.
+//----------------------------------------------------------------------------------------
+static int ndvss_flat_scan( sqlite3* db,
+                            const char* file_path,
+                            int element_size,
+                            int metric,
+                            const void* searched_array,
+                            int vector_bytes,
+                            ndvss_topk* topk,
+                            char** error_message )
+{
+  char* path = ndvss_resolve_path(db, file_path);
+  if( path == 0 ) {
+    return SQLITE_NOMEM;
+  }
+  int direct = 0;
+  int fd = -1;
+#if defined(__linux__) && defined(O_DIRECT)
+  if( NDVSS_CONFIG(NDVSS_CONFIG_DIRECT_IO) ) {
+    fd = open(path, O_RDONLY | O_DIRECT);
+    direct = fd >= 0;
+  }
+#endif
+  if( fd < 0 ) {
+#ifdef _WIN32
+    fd = _open(path, _O_RDONLY | _O_BINARY);
+#else
+    fd = open(path, O_RDONLY);
+#endif
+  }
+  if( fd < 0 ) {
+    *error_message = sqlite3_mprintf("Can't open %s.", path);
+    sqlite3_free(path);
+    return SQLITE_CANTOPEN;
+  }
+  sqlite3_free(path);
+
+  double start = ndvss_now();
+  int rc = SQLITE_OK;
+  int depth = (int)NDVSS_CONFIG(NDVSS_CONFIG_IO_DEPTH);
+  ndvss_task* task = ndvss_task_current();
+  ndvss_flat_header* header = 0;
+  sqlite3_int64* rowids = 0;
+  unsigned char* buffers = 0;
+  int used_io_uring = 0;
+
+  header = (ndvss_flat_header*)ndvss_aligned_malloc(NDVSS_IO_ALIGNMENT, NDVSS_IO_ALIGNMENT);
+  if( header == 0 ) {
+    rc = SQLITE_NOMEM;
+  } else if( ndvss_file_read_at(fd, header, NDVSS_IO_ALIGNMENT, 0) < (sqlite3_int64)sizeof(ndvss_flat_header) ||
+             memcmp(header->magic, NDVSS_FLAT_MAGIC, 8) != 0 || header->version != NDVSS_FLAT_VERSION ) {
+    *error_message = sqlite3_mprintf("Not a flat vector file.");
+    rc = SQLITE_ERROR;
+  } else if( (int)header->element_size != element_size ) {
+    *error_message = sqlite3_mprintf("The file contains %s.", header->element_size == sizeof(double) ? "doubles" : "floats");
+    rc = SQLITE_ERROR;
+  } else if( header->count > 0 && (int)(header->dimensions * header->element_size) != vector_bytes ) {
+    *error_message = sqlite3_mprintf("The arrays are not the same length.");
+    rc = SQLITE_ERROR;
+  }
+
+  // The rowids are kept in memory, 8 bytes per vector.
+  sqlite3_int64 rowid_bytes = 0;
+  if( rc == SQLITE_OK && header->count > 0 ) {
+    rowid_bytes = (header->count * (sqlite3_int64)sizeof(sqlite3_int64) + NDVSS_IO_ALIGNMENT - 1) & ~(sqlite3_int64)(NDVSS_IO_ALIGNMENT - 1);
+    rowids = (sqlite3_int64*)ndvss_aligned_malloc((sqlite3_uint64)rowid_bytes, NDVSS_IO_ALIGNMENT);
+    if( rowids == 0 ) {
+      rc = SQLITE_NOMEM;
+    } else if( ndvss_file_read_at(fd, rowids, rowid_bytes, header->rowid_offset) < header->count * (sqlite3_int64)sizeof(sqlite3_int64) ) {
+      *error_message = sqlite3_mprintf("The flat vector file is truncated.");
+      rc = SQLITE_IOERR;
+    }
+  }
+
+  // A chunk holds a whole number of vectors and is a multiple of NDVSS_IO_ALIGNMENT bytes.
+  int chunk_vectors = 0;
+  sqlite3_int64 chunk_bytes = 0;
+  sqlite3_int64 chunk_count = 0;
+  if( rc == SQLITE_OK && header->count > 0 ) {
+    int a = vector_bytes, b = NDVSS_IO_ALIGNMENT;
+    while( b != 0 ) {
+      int t = a % b;
+      a = b;
+      b = t;
+    }
+    int step = NDVSS_IO_ALIGNMENT / a; // Smallest vector count that fills whole blocks.
+    chunk_vectors = step * (int)((NDVSS_IO_CHUNK_BYTES / vector_bytes + step - 1) / step);
+    if( chunk_vectors < step ) {
+      chunk_vectors = step;
+    }
+    chunk_bytes = (sqlite3_int64)chunk_vectors * vector_bytes;
+    chunk_count = (header->count + chunk_vectors - 1) / chunk_vectors;
+    if( depth > chunk_count ) {
+      depth = (int)chunk_count;
+    }
+    buffers = (unsigned char*)ndvss_aligned_malloc((sqlite3_uint64)chunk_bytes * (sqlite3_uint64)depth, NDVSS_IO_ALIGNMENT);
+    if( buffers == 0 ) {
+      rc = SQLITE_NOMEM;
+    }
+    ndvss_task_phase(task, "file_scan", header->count);
+  }
+
+  if( rc == SQLITE_OK && header->count > 0 ) {
+    sqlite3_int64 chunk;
+#ifdef NDVSS_HAVE_IO_URING
+    ndvss_uring ring;
+    if( NDVSS_CONFIG(NDVSS_CONFIG_IO_URING) && ndvss_uring_open(&ring, (unsigned)depth) == SQLITE_OK ) {
+      used_io_uring = 1;
+      int inflight = 0;
+      // Reads that ended up in a slot. Completions can arrive in any order.
+      int* ready = (int*)sqlite3_malloc64(sizeof(int) * (sqlite3_uint64)depth);
+      if( ready == 0 ) {
+        rc = SQLITE_NOMEM;
+      } else {
+        for( chunk = 0; chunk < depth; ++chunk ) {
+          ready[chunk] = -2;
+          ++inflight;
+          ndvss_uring_prepare_read(&ring, fd, buffers + chunk * chunk_bytes, (unsigned)chunk_bytes,
+                                   header->data_offset + chunk * chunk_bytes, (sqlite3_uint64)chunk);
+        }
+        for( chunk = 0; chunk < chunk_count && rc == SQLITE_OK; ++chunk ) {
+          int slot = (int)(chunk % depth);
+          sqlite3_int64 first = chunk * chunk_vectors;
+          int count = (int)(header->count - first < chunk_vectors ? header->count - first : chunk_vectors);
+          sqlite3_int64 needed = (sqlite3_int64)count * vector_bytes;
+          while( ready[slot] == -2 && rc == SQLITE_OK ) {
+            sqlite3_uint64 user_data;
+            int result;
+            rc = ndvss_uring_wait(&ring, &user_data, &result);
+            if( rc == SQLITE_OK ) {
+              ready[user_data % (sqlite3_uint64)depth] = result;
+              --inflight;
+            }
+          }
+          if( rc != SQLITE_OK ) {
+            break;
+          }
+          unsigned char* buffer = buffers + slot * chunk_bytes;
+          if( ready[slot] < needed ) {
+            // Short or failed read, finish it synchronously.
+            sqlite3_int64 done = ready[slot] > 0 ? ready[slot] & ~(NDVSS_IO_ALIGNMENT - 1) : 0;
+            sqlite3_int64 rest = (chunk_bytes - done);
+            if( ndvss_file_read_at(fd, buffer + done, rest, header->data_offset + chunk * chunk_bytes + done) < needed - done ) {
+              *error_message = sqlite3_mprintf("Reading the flat vector file failed.");
+              rc = SQLITE_IOERR;
+              break;
+            }
+          }
+          ndvss_flat_score_chunk(buffer, first, count, header, rowids, metric, searched_array, topk);
+          ready[slot] = -2;
+          if( ndvss_task_advance(task, count) ) {
+            rc = SQLITE_INTERRUPT;
+            break;
+          }
+          if( chunk + depth < chunk_count ) {
+            ++inflight;
+            ndvss_uring_prepare_read(&ring, fd, buffer, (unsigned)chunk_bytes,
+                                     header->data_offset + (chunk + depth) * chunk_bytes, (sqlite3_uint64)(chunk + depth));
+          }
+        }//endfor chunks
+        // Let the reads that are still in flight finish before the buffers are freed.
+        while( inflight > 0 ) {
+          sqlite3_uint64 user_data;
+          int result;
+          if( ndvss_uring_wait(&ring, &user_data, &result) != SQLITE_OK ) {
+            break;
+          }
+          --inflight;
+        }
+        sqlite3_free(ready);
+      }
+      ndvss_uring_close(&ring);
+    } else
+#endif
+    {
+      // pread with the kernel reading ahead the next io_depth chunks.
+#if defined(POSIX_FADV_SEQUENTIAL) && !defined(_WIN32)
+      if( !direct ) {
+        posix_fadvise(fd, header->data_offset, header->count * (sqlite3_int64)vector_bytes, POSIX_FADV_SEQUENTIAL);
+      }
+#endif
+      for( chunk = 0; chunk < chunk_count; ++chunk ) {
+        sqlite3_int64 first = chunk * chunk_vectors;
+        int count = (int)(header->count - first < chunk_vectors ? header->count - first : chunk_vectors);
+#if defined(POSIX_FADV_WILLNEED) && !defined(_WIN32)
+        if( !direct && chunk + depth < chunk_count ) {
+          posix_fadvise(fd, header->data_offset + (chunk + depth) * chunk_bytes, chunk_bytes, POSIX_FADV_WILLNEED);
+        }
+#endif
+        // O_DIRECT reads need whole blocks.
+        sqlite3_int64 request = direct ? chunk_bytes : (sqlite3_int64)count * vector_bytes;
+        if( ndvss_file_read_at(fd, buffers, request, header->data_offset + chunk * chunk_bytes) < (sqlite3_int64)count * vector_bytes ) {
+          *error_message = sqlite3_mprintf("Reading the flat vector file failed.");
+          rc = SQLITE_IOERR;
+          break;
+        }
+        ndvss_flat_score_chunk(buffers, first, count, header, rowids, metric, searched_array, topk);
+        if( ndvss_task_advance(task, count) ) {
+          rc = SQLITE_INTERRUPT;
+          break;
+        }
+      }//endfor chunks
+    }
+  }
+
+  if( rc == SQLITE_OK && header != 0 ) {
+    sqlite3_int64 nanoseconds = (sqlite3_int64)((ndvss_now() - start) * 1e9);
+    NDVSS_STAT_ADD(file_scans, 1);
+    NDVSS_STAT_ADD(file_scan_bytes, header->count * (sqlite3_int64)vector_bytes);
+    NDVSS_STAT_ADD(file_scan_nanoseconds, nanoseconds);
+    NDVSS_STAT_SET(last_file_scan_io_uring, used_io_uring);
+    NDVSS_STAT_SET(last_file_scan_direct_io, direct);
+  }
+  ndvss_aligned_free(buffers);
+  ndvss_aligned_free(rowids);
+  ndvss_aligned_free(header);
+#ifdef _WIN32
+  _close(fd);
+#else
+  close(fd);
+#endif
+  return rc;
+}
+
+
+//----------------------------------------------------------------------------------------
+// DISKANN.
+// A Vamana graph index for vector sets that don't fit in memory. ndvss_diskann_build_f/_d
+// builds the graph of a column and writes it to a file next to the database: every 
+// node holds its full vector, its rowid and its neighbour list, and the nodes are packed
+// in to 4 KB sectors, so that one aligned read fetches a node. Only the 4-bit PQ codes
+// of the vectors (M / 2 bytes each) are kept in memory. A search walks the graph from 
+// the medoid: the diskann_beam_width closest nodes of the candidate list that haven't 
+// been visited yet are read together (one io_uring submission), their neighbours are 
+// ranked by the PQ distance, and the vectors that come with the nodes give the exact 
+// distances of the results. The 'diskann' method of the k-NN functions searches the 
+// file given as 'file:<path>'.
+// The neighbour lists are sorted and bit-packed with only the bits a node index of the
+// graph needs (20 for a million nodes instead of 32), so that more nodes fit in a 
+// sector and the file is smaller. The width is the same for every node, because the
+// nodes have fixed-size slots and a variable-length code would need the space of its
+// worst case anyway.
+// Built with the 'int8' storage, a node holds the vector scalar-quantized to one byte
+// per dimension instead of the full vector, which makes a node of 768 floats 4 times 
+// smaller. The distances met on the walk are then approximate: the best k * pq_rerank
+// candidates are reranked with the vectors read from the column the index was built 
+// from, whose name is kept in the file. With pq_rerank 0 the approximate distances are
+// returned and the table isn't read.
+//
+// File layout (little-endian):
+//   0            ndvss_diskann_header, then source_bytes of "schema\0table\0column\0",
+//                padded to NDVSS_IO_ALIGNMENT bytes
+//   node_offset  the nodes, nodes_per_sector per sector or sectors_per_node sectors 
+//                each. A node is its vector (as stored, or one code byte per dimension
+//                with the 'int8' storage), rowid (64 bits), number of neighbours 
+//                (32 bits) and degree neighbour indexes of neighbor_bits bits each, in
+//                ascending order, as a little-endian bit stream (version 1: 32 bits
+//                each, in any order).
+//   pq_offset    sub_first (M + 1 32-bit integers), 16 centroids per sub-quantizer 
+//                (floats) and count codes of (M + 1) / 2 bytes, the even sub-quantizer
+//                in the low nibble. With the 'int8' storage the quantizer follows on a
+//                4-byte boundary: the minimum and the step of every dimension (floats).
+//----------------------------------------------------------------------------------------
+#define NDVSS_DISKANN_MAGIC      "NDVSSANN"
+#define NDVSS_DISKANN_VERSION    3
+#define NDVSS_DISKANN_FULL       0    // The nodes hold the vectors as stored.
+#define NDVSS_DISKANN_INT8       1    // The nodes hold 8-bit codes of the vectors.
+#define NDVSS_DISKANN_DEGREE     32   // Default number of neighbours of a node (R).
+#define NDVSS_DISKANN_BUILD_LIST 96   // Candidate list of the searches during the build (L).
+#define NDVSS_DISKANN_ALPHA      1.2  // Pruning factor of the second build pass.
+#define NDVSS_DISKANN_MAX_BEAM   64   // Largest diskann_beam_width.
+#define NDVSS_DISKANN_CHECK_NODES 256 // Nodes inserted between interrupt checks.
+
+typedef struct ndvss_diskann_header {
+  char          magic[8];
+  unsigned int  version;
+  unsigned int  element_size;
+  unsigned int  dimensions;
+  unsigned int  metric;            // NDVSS_METRIC_EUCLIDEAN or NDVSS_METRIC_COSINE.
+  unsigned int  degree;
+  unsigned int  node_bytes;
+  unsigned int  nodes_per_sector;  // 0 if a node takes several sectors.
+  unsigned int  sectors_per_node;
+  unsigned int  subquantizers;
+  unsigned int  neighbor_bits;     // Bits of a neighbour index, 0 in version 1 (32).
+  sqlite3_int64 count;
+  sqlite3_int64 medoid;
+  sqlite3_int64 node_offset;
+  sqlite3_int64 pq_offset;
+  unsigned int  storage;           // NDVSS_DISKANN_FULL or NDVSS_DISKANN_INT8, 0 before version 3.
+  unsigned int  source_bytes;      // Bytes of the names of the column after the header.
+} ndvss_diskann_header;
+
+struct ndvss_diskann {
+  char*                path;
+  int                  fd;
+  int                  direct;         // 1 if the file was opened with O_DIRECT.
+  sqlite3_int64        file_size;      // With file_mtime tells if the file was rebuilt.
+  sqlite3_int64        file_mtime;
+  ndvss_diskann_header header;
+  int                  read_bytes;     // Bytes read per node, whole sectors.
+  int                  neighbor_bits;  // 32 for version 1.
+  int                  neighbor_bytes; // Bytes of the packed neighbour list of a node.
+  int                  code_bytes;     // Bytes of PQ codes per vector.
+  int                  node_vector_bytes; // Bytes of the vector of a node.
+  unsigned char*       pq_section;     // The PQ section of the file.
+  const int*           sub_first;
+  const float*         centroids;
+  const unsigned char* codes;
+  const float*         minimums;       // The quantizer of the 'int8' storage.
+  const float*         steps;
+  sqlite3_int64        pq_bytes;
+  char*                source;         // The schema, table and column the index was built from.
+  const char*          source_table;
+  const char*          source_column;
+#ifdef NDVSS_HAVE_IO_URING
+  ndvss_uring          ring;           // Opened on the first search.
+  int                  has_ring;
+#endif
+  ndvss_diskann*       next;
+};
+
+// Candidate list of a graph search, sorted by distance.
+typedef struct ndvss_diskann_list {
+  int            capacity;
+  int            count;
+  unsigned int*  nodes;
+  float*         distances;
+  unsigned char* expanded;
+} ndvss_diskann_list;
+
+// Open addressing set of the nodes a search has seen. A slot holds node + 1.
+typedef struct ndvss_node_set {
+  unsigned int*  slots;
+  int            capacity;          // A power of two.
+  int            count;
+} ndvss_node_set;
+
+typedef struct ndvss_diskann_pool_item {
+  float          distance;
+  unsigned int   node;
+} ndvss_diskann_pool_item;
+
+// State of the graph construction, all in memory.
+typedef struct ndvss_diskann_builder {
+  int                      dimensions;
+  unsigned int             count;
+  int                      degree;
+  const float*             vectors;       // count * dimensions floats.
+  unsigned int*            neighbors;     // count * degree.
+  unsigned int*            neighbor_counts;
+  unsigned int*            marks;         // marks[node] == generation: seen by the current search.
+  unsigned int             generation;
+  ndvss_diskann_list       list;
+  ndvss_diskann_pool_item* pool;
+  int                      pool_count;
+  int                      pool_capacity;
+  unsigned char*           pruned;        // pool_capacity flags.
+} ndvss_diskann_builder;
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_diskann_list_init
+// Returns: SQLITE_OK or SQLITE_NOMEM.
+//----------------------------------------------------------------------------------------
+static int ndvss_diskann_list_init( ndvss_diskann_list* list, int capacity )
+{
+  list->capacity = capacity;
+  list->count = 0;
+  list->nodes = (unsigned int*)sqlite3_malloc64(sizeof(unsigned int) * (sqlite3_uint64)capacity);
+  list->distances = (float*)sqlite3_malloc64(sizeof(float) * (sqlite3_uint64)capacity);
+  list->expanded = (unsigned char*)sqlite3_malloc64((sqlite3_uint64)capacity);
+  if( list->nodes == 0 || list->distances == 0 || list->expanded == 0 ) {
+    sqlite3_free(list->nodes);
+    sqlite3_free(list->distances);
+    sqlite3_free(list->expanded);
+    memset(list, 0, sizeof(ndvss_diskann_list));
+    return SQLITE_NOMEM;
+  }
+  return SQLITE_OK;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_diskann_list_free
+//----------------------------------------------------------------------------------------
+static void ndvss_diskann_list_free( ndvss_diskann_list* list )
+{
+  sqlite3_free(list->nodes);
+  sqlite3_free(list->distances);
+  sqlite3_free(list->expanded);
+  memset(list, 0, sizeof(ndvss_diskann_list));
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_diskann_list_insert
+// Desc: Inserts a node in distance order. The farthest node drops out of a full list.
+//----------------------------------------------------------------------------------------
+static void ndvss_diskann_list_insert( ndvss_diskann_list* list, unsigned int node, float distance )
+{
+  if( list->count == list->capacity ) {
+    if( distance >= list->distances[list->count - 1] ) {
+      return;
+    }
+    --list->count;
+  }
+  int i = list->count;
+  while( i > 0 && list->distances[i - 1] > distance ) {
+    list->nodes[i] = list->nodes[i - 1];
+    list->distances[i] = list->distances[i - 1];
+    list->expanded[i] = list->expanded[i - 1];
+    --i;
+  }
+  list->nodes[i] = node;
+  list->distances[i] = distance;
+  list->expanded[i] = 0;
+  ++list->count;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_node_set_insert
+// Desc: Adds a node to the set, growing it when it gets half full.
+// Returns: 1 if the node is new, 0 if it was in the set already, -1 if out of memory.
+//----------------------------------------------------------------------------------------
+static int ndvss_node_set_insert( ndvss_node_set* set, unsigned int node )
+{
+  if( (set->count + 1) * 2 > set->capacity ) {
+    int capacity = set->capacity > 0 ? set->capacity * 2 : 1024;
+    unsigned int* slots = (unsigned int*)sqlite3_malloc64(sizeof(unsigned int) * (sqlite3_uint64)capacity);
+    if( slots == 0 ) {
+      return -1;
+    }
+    memset(slots, 0, sizeof(unsigned int) * (size_t)capacity);
+    int i;
+    for( i = 0; i < set->capacity; ++i ) {
+      if( set->slots[i] != 0 ) {
+        unsigned int j = (set->slots[i] * 2654435761u) & (unsigned int)(capacity - 1);
+        while( slots[j] != 0 ) {
+          j = (j + 1) & (unsigned int)(capacity - 1);
+        }
+        slots[j] = set->slots[i];
+      }
+    }
+    sqlite3_free(set->slots);
+    set->slots = slots;
+    set->capacity = capacity;
+  }
+  unsigned int key = node + 1;
+  unsigned int j = (key * 2654435761u) & (unsigned int)(set->capacity - 1);
+  while( set->slots[j] != 0 ) {
+    if( set->slots[j] == key ) {
+      return 0;
+    }
+    j = (j + 1) & (unsigned int)(set->capacity - 1);
+  }
+  set->slots[j] = key;
+  ++set->count;
+  return 1;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_neighbor_bits
+// Desc: Returns the bits of a packed neighbour index in a graph of count nodes.
+//----------------------------------------------------------------------------------------
+static unsigned int ndvss_neighbor_bits( sqlite3_int64 count )
+{
+  unsigned int bits = 1;
+  while( bits < 32 && ((sqlite3_int64)1 << bits) < count ) {
+    ++bits;
+  }
+  return bits;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_neighbors_pack
+// Desc: Writes node indexes as a little-endian bit stream of bits bits each, in to
+//       (count * bits + 7) / 8 bytes.
+//----------------------------------------------------------------------------------------
+static void ndvss_neighbors_pack( unsigned char* target, const unsigned int* neighbors, unsigned int count, unsigned int bits )
+{
+  sqlite3_uint64 buffer = 0;
+  unsigned int filled = 0, n;
+  for( n = 0; n < count; ++n ) {
+    buffer |= (sqlite3_uint64)neighbors[n] << filled;
+    filled += bits;
+    while( filled >= 8 ) {
+      *target++ = (unsigned char)buffer;
+      buffer >>= 8;
+      filled -= 8;
+    }
+  }
+  if( filled > 0 ) {
+    *target = (unsigned char)buffer;
+  }
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_neighbors_unpack
+// Desc: Reads node indexes written by ndvss_neighbors_pack. Eight indexes take exactly
+//       bits bytes, so every group of eight starts on a byte. With AVX2 and up to 25 
+//       bits, a group is two 16-byte loads, a byte shuffle that puts the 4 bytes of 
+//       each index in its 32-bit lane, a shift per lane and a mask. The rest, and wider
+//       indexes, are one unaligned 64-bit load, a shift and a mask each; the load is cut
+//       short at the end of the packed bytes.
+//----------------------------------------------------------------------------------------
+static void ndvss_neighbors_unpack( unsigned int* neighbors, 
+                                    const unsigned char* source, 
+                                    size_t source_bytes,
+                                    unsigned int count, 
+                                    unsigned int bits )
+{
+  sqlite3_uint64 mask = ((sqlite3_uint64)1 << bits) - 1;
+  size_t position = 0;
+  unsigned int n = 0;
+  #ifdef __AVX2__
+  if( bits <= 25 && count >= 8 ) {
+    // Lanes 4-7 are read from the byte of index 4, so both halves stay within 16 bytes.
+    size_t half = (4 * bits) >> 3;
+    const __m256i bit = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32((int)bits));
+    const __m256i byte = _mm256_sub_epi32(_mm256_srli_epi32(bit, 3), 
+                                          _mm256_setr_epi32(0, 0, 0, 0, (int)half, (int)half, (int)half, (int)half));
+    // Bytes byte .. byte + 3 of the half in every lane.
+    const __m256i shuffle = _mm256_add_epi32(_mm256_mullo_epi32(byte, _mm256_set1_epi32(0x01010101)), 
+                                             _mm256_set1_epi32(0x03020100));
+    const __m256i shift = _mm256_and_si256(bit, _mm256_set1_epi32(7));
+    const __m256i lane_mask = _mm256_set1_epi32((int)mask);
+    const unsigned char* group = source;
+    for( ; n + 8 <= count && (size_t)(group - source) + half + 16 <= source_bytes; n += 8, group += bits ) {
+      __m256i bytes = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)group)),
+                                              _mm_loadu_si128((const __m128i*)(group + half)), 1);
+      __m256i words = _mm256_shuffle_epi8(bytes, shuffle);
+      _mm256_storeu_si256((__m256i*)(neighbors + n), 
+                          _mm256_and_si256(_mm256_srlv_epi32(words, shift), lane_mask));
+    }
+    position = (size_t)n * bits;
+  }
+  #endif
+  for( ; n < count; ++n, position += bits ) {
+    size_t byte = position >> 3;
+    sqlite3_uint64 word = 0;
+    if( byte + sizeof(word) <= source_bytes ) {
+      memcpy(&word, source + byte, sizeof(word));
+    } else {
+      memcpy(&word, source + byte, source_bytes - byte);
+    }
+    neighbors[n] = (unsigned int)((word >> (position & 7)) & mask);
+  }
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_node_compare
+// Desc: qsort comparator of node indexes, ascending.
+//----------------------------------------------------------------------------------------
+static int ndvss_node_compare( const void* a, const void* b )
+{
+  unsigned int x = *(const unsigned int*)a;
+  unsigned int y = *(const unsigned int*)b;
+  return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_diskann_builder_distance
+// Desc: Squared euclidean distance of two nodes, or of a node and a vector.
+//----------------------------------------------------------------------------------------
+static inline float ndvss_diskann_builder_distance( const ndvss_diskann_builder* builder, 
+                                                    const float* vector, 
+                                                    unsigned int node )
+{
+  return ndvss_euclidean_distance_squared_kernel_f(vector, builder->vectors + (size_t)node * builder->dimensions, 
+                                                   builder->dimensions);
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_diskann_pool_add
+// Desc: Adds a candidate neighbour to the pool of the node being pruned.
+// Returns: SQLITE_OK or SQLITE_NOMEM.
+//----------------------------------------------------------------------------------------
+static int ndvss_diskann_pool_add( ndvss_diskann_builder* builder, unsigned int node, float distance )
+{
+  if( builder->pool_count == builder->pool_capacity ) {
+    int capacity = builder->pool_capacity * 2;
+    ndvss_diskann_pool_item* pool = (ndvss_diskann_pool_item*)sqlite3_realloc64(builder->pool, 
+                                      sizeof(ndvss_diskann_pool_item) * (sqlite3_uint64)capacity);
+    if( pool == 0 ) {
+      return SQLITE_NOMEM;
+    }
+    builder->pool = pool;
+    unsigned char* pruned = (unsigned char*)sqlite3_realloc64(builder->pruned, (sqlite3_uint64)capacity);
+    if( pruned == 0 ) {
+      return SQLITE_NOMEM;
+    }
+    builder->pruned = pruned;
+    builder->pool_capacity = capacity;
+  }
+  builder->pool[builder->pool_count].distance = distance;
+  builder->pool[builder->pool_count].node = node;
+  ++builder->pool_count;
+  return SQLITE_OK;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_diskann_pool_compare
+// Desc: qsort comparator of the pool, nearest first.
+//----------------------------------------------------------------------------------------
+static int ndvss_diskann_pool_compare( const void* a, const void* b )
+{
+  const ndvss_diskann_pool_item* x = (const ndvss_diskann_pool_item*)a;
+  const ndvss_diskann_pool_item* y = (const ndvss_diskann_pool_item*)b;
+  if( x->distance != y->distance ) {
+    return x->distance < y->distance ? -1 : 1;
+  }
+  return x->node < y->node ? -1 : (x->node > y->node ? 1 : 0);
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_diskann_greedy_search
+// Desc: Searches the graph under construction from the medoid for a node. The nodes 
+//       that were expanded are left in the pool, with their distances to the node.
+// Returns: SQLITE_OK or SQLITE_NOMEM.
+//----------------------------------------------------------------------------------------
+static int ndvss_diskann_greedy_search( ndvss_diskann_builder* builder, unsigned int node, unsigned int medoid )
+{
+  const float* vector = builder->vectors + (size_t)node * builder->dimensions;
+  ndvss_diskann_list* list = &builder->list;
+  list->count = 0;
+  builder->pool_count = 0;
+  if( ++builder->generation == 0 ) {
+    memset(builder->marks, 0, sizeof(unsigned int) * builder->count);
+    builder->generation = 1;
+  }
+  builder->marks[medoid] = builder->generation;
+  ndvss_diskann_list_insert(list, medoid, ndvss_diskann_builder_distance(builder, vector, medoid));
+  for( ;; ) {
+    int i;
+    for( i = 0; i < list->count && list->expanded[i]; ++i ) {
+    }
+    if( i == list->count ) {
+      break;
+    }
+    list->expanded[i] = 1;
+    unsigned int current = list->nodes[i];
+    if( ndvss_diskann_pool_add(builder, current, list->distances[i]) != SQLITE_OK ) {
+      return SQLITE_NOMEM;
+    }
+    const unsigned int* neighbors = builder->neighbors + (size_t)current * builder->degree;
+    unsigned int j;
+    for( j = 0; j < builder->neighbor_counts[current]; ++j ) {
+      unsigned int neighbor = neighbors[j];
+      if( builder->marks[neighbor] == builder->generation ) {
+        continue;
+      }
+      builder->marks[neighbor] = builder->generation;
+      ndvss_diskann_list_insert(list, neighbor, ndvss_diskann_builder_distance(builder, vector, neighbor));
+    }
+  }//endfor expanding
+  return SQLITE_OK;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_diskann_robust_prune
+// Desc: Picks the neighbours of a node from the pool: the nearest candidate is kept 
+//       and the candidates it covers (alpha * distance to it <= distance to the node) 
+//       are dropped, until degree neighbours are chosen.
+//----------------------------------------------------------------------------------------
+static void ndvss_diskann_robust_prune( ndvss_diskann_builder* builder, unsigned int node, double alpha )
+{
+  float alpha_squared = (float)(alpha * alpha); // The distances are squared.
+  ndvss_diskann_pool_item* pool = builder->pool;
+  qsort(pool, (size_t)builder->pool_count, sizeof(ndvss_diskann_pool_item), ndvss_diskann_pool_compare);
+  memset(builder->pruned, 0, (size_t)builder->pool_count);
+  unsigned int* neighbors = builder->neighbors + (size_t)node * builder->degree;
+  unsigned int count = 0;
+  int i, j;
+  for( i = 0; i < builder->pool_count && count < (unsigned int)builder->degree; ++i ) {
+    if( builder->pruned[i] || pool[i].node == node || (i > 0 && pool[i].node == pool[i - 1].node) ) {
+      continue;
+    }
+    neighbors[count++] = pool[i].node;
+    const float* chosen = builder->vectors + (size_t)pool[i].node * builder->dimensions;
+    for( j = i + 1; j < builder->pool_count; ++j ) {
+      if( !builder->pruned[j] && 
+          alpha_squared * ndvss_diskann_builder_distance(builder, chosen, pool[j].node) <= pool[j].distance ) {
+        builder->pruned[j] = 1;
+      }
+    }
+  }
+  builder->neighbor_counts[node] = count;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_diskann_build_pass
+// Desc: Inserts every node in random order: its neighbours are pruned from the nodes a
+//       search for it visits, and it's added to their neighbours in turn.
+// Returns: SQLITE_OK, SQLITE_NOMEM or SQLITE_INTERRUPT.
+//----------------------------------------------------------------------------------------
+static int ndvss_diskann_build_pass( ndvss_diskann_builder* builder, 
+                                     const unsigned int* order, 
+                                     unsigned int medoid, 
+                                     double alpha )
+{
+  ndvss_task* task = ndvss_task_current();
+  unsigned int o;
+  for( o = 0; o < builder->count; ++o ) {
+    if( o % NDVSS_DISKANN_CHECK_NODES == 0 && ndvss_task_advance(task, o > 0 ? NDVSS_DISKANN_CHECK_NODES : 0) ) {
+      return SQLITE_INTERRUPT;
+    }
+    unsigned int node = order[o];
+    const float* vector = builder->vectors + (size_t)node * builder->dimensions;
+    if( ndvss_diskann_greedy_search(builder, node, medoid) != SQLITE_OK ) {
+      return SQLITE_NOMEM;
+    }
+    unsigned int* neighbors = builder->neighbors + (size_t)node * builder->degree;
+    unsigned int j;
+    for( j = 0; j < builder->neighbor_counts[node]; ++j ) {
+      if( ndvss_diskann_pool_add(builder, neighbors[j], ndvss_diskann_builder_distance(builder, vector, neighbors[j])) != SQLITE_OK ) {
+        return SQLITE_NOMEM;
+      }
+    }
+    ndvss_diskann_robust_prune(builder, node, alpha);
+    // Back edges.
+    for( j = 0; j < builder->neighbor_counts[node]; ++j ) {
+      unsigned int other = neighbors[j];
+      unsigned int* other_neighbors = builder->neighbors + (size_t)other * builder->degree;
+      unsigned int count = builder->neighbor_counts[other];
+      unsigned int n;
+      for( n = 0; n < count && other_neighbors[n] != node; ++n ) {
+      }
+      if( n < count ) {
+        continue;
+      }
+      if( count < (unsigned int)builder->degree ) {
+        other_neighbors[builder->neighbor_counts[other]++] = node;
+        continue;
+      }
+      const float* other_vector = builder->vectors + (size_t)other * builder->dimensions;
+      builder->pool_count = 0;
+      for( n = 0; n < count; ++n ) {
+        if( ndvss_diskann_pool_add(builder, other_neighbors[n], 
+                                   ndvss_diskann_builder_distance(builder, other_vector, other_neighbors[n])) != SQLITE_OK ) {
+          return SQLITE_NOMEM;
+        }
+      }
+      if( ndvss_diskann_pool_add(builder, node, ndvss_diskann_builder_distance(builder, other_vector, node)) != SQLITE_OK ) {
+        return SQLITE_NOMEM;
+      }
+      ndvss_diskann_robust_prune(builder, other, alpha);
+    }//endfor back edges
+  }//endfor nodes
+  return SQLITE_OK;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_diskann_build
+// Desc: Shared implementation of ndvss_diskann_build_f/_d. Reads a column, builds its 
+//       Vamana graph and PQ codes in memory and writes the index file.
+// Args: Table name TEXT ("table" or "schema.table"),
+//       Column name TEXT,
+//       Path of the file TEXT (relative to the database file),
+//       Optionally the metric TEXT: 'euclidean' (default) or 'cosine',
+//       Optionally the number of neighbours of a node INTEGER (default 32),
+//       Optionally the vectors of the nodes TEXT: 'full' (default) or 'int8'
+// Returns: Number of vectors in the index INTEGER
+//----------------------------------------------------------------------------------------
+static void ndvss_diskann_build( sqlite3_context* context,
+                                 int argc,
+                                 sqlite3_value** argv,
+                                 int element_size ) 
+{
+  if( argc < 3 || sqlite3_value_type(argv[0]) == SQLITE_NULL || 
+      sqlite3_value_type(argv[1]) == SQLITE_NULL || sqlite3_value_type(argv[2]) == SQLITE_NULL ) {
+    sqlite3_result_error(context, "The table, the column and the file path need to be given.", -1);
+    return;
+  }
+  int metric = ndvss_metric_from_name(argc > 3 && sqlite3_value_type(argv[3]) != SQLITE_NULL 
+                                      ? (const char*)sqlite3_value_text(argv[3]) : "euclidean");
+  if( metric == NDVSS_METRIC_EUCLIDEAN_SQUARED ) {
+    metric = NDVSS_METRIC_EUCLIDEAN;
+  }
+  if( metric != NDVSS_METRIC_EUCLIDEAN && metric != NDVSS_METRIC_COSINE ) {
+    sqlite3_result_error(context, "The index can be built for the euclidean or the cosine metric.", -1);
+    return;
+  }
+  int degree = argc > 4 && sqlite3_value_type(argv[4]) != SQLITE_NULL ? sqlite3_value_int(argv[4]) : NDVSS_DISKANN_DEGREE;
+  if( degree < 2 || degree > 1024 ) {
+    sqlite3_result_error(context, "The number of neighbours needs to be between 2 and 1024.", -1);
+    return;
+  }
+  const char* storage_name = argc > 5 && sqlite3_value_type(argv[5]) != SQLITE_NULL 
+                             ? (const char*)sqlite3_value_text(argv[5]) : "full";
+  int storage;
+  if( sqlite3_stricmp(storage_name, "full") == 0 ) {
+    storage = NDVSS_DISKANN_FULL;
+  } else if( sqlite3_stricmp(storage_name, "int8") == 0 ) {
+    storage = NDVSS_DISKANN_INT8;
+  } else {
+    sqlite3_result_error(context, "The vectors of the nodes can be 'full' or 'int8'.", -1);
+    return;
+  }
+  double start = ndvss_now();
+  sqlite3* db = sqlite3_context_db_handle(context);
+  const char* table = (const char*)sqlite3_value_text(argv[0]);
+  const char* column = (const char*)sqlite3_value_text(argv[1]);
+  const char* dot = strchr(table, '.');
+  const char* table_name = dot != 0 ? dot + 1 : table;
+  char* db_name = dot != 0 ? sqlite3_mprintf("%.*s", (int)(dot - table), table) : sqlite3_mprintf("main");
+  char* path = ndvss_resolve_path(db, (const char*)sqlite3_value_text(argv[2]));
+  if( db_name == 0 || path == 0 ) {
+    sqlite3_free(db_name);
+    sqlite3_free(path);
+    sqlite3_result_error_nomem(context);
+    return;
+  }
+  // The names of the column go to the first sector, after the header.
+  size_t source_bytes = strlen(db_name) + strlen(table_name) + strlen(column) + 3;
+  if( sizeof(ndvss_diskann_header) + source_bytes > NDVSS_IO_ALIGNMENT ) {
+    sqlite3_free(db_name);
+    sqlite3_free(path);
+    sqlite3_result_error(context, "The names of the table and the column are too long.", -1);
+    return;
+  }
+  sqlite3_stmt* stmt = 0;
+  char* message = 0;
+  int rc = ndvss_vector_select_prepare(db, db_name, table_name, column, &stmt, &message);
+  if( rc != SQLITE_OK ) {
+    sqlite3_free(db_name);
+    sqlite3_free(path);
+    if( message != 0 ) {
+      sqlite3_result_error(context, message, -1);
+      sqlite3_free(message);
+    } else {
+      sqlite3_result_error_nomem(context);
+    }
+    return;
+  }
+  ndvss_task task;
+  ndvss_task_begin(&task, db, "diskann_build", table);
+
+  // The column is read to memory: the vectors as stored, as floats and the rowids.
+  const char* error = 0;
+  int error_code = SQLITE_ERROR;
+  int vector_bytes = -1;
+  int dimensions = 0;
+  sqlite3_int64 count = 0, capacity = 0;
+  unsigned char* raw = 0;
+  float* vectors = 0;
+  sqlite3_int64* rowids = 0;
+  while( (rc = sqlite3_step(stmt)) == SQLITE_ROW ) {
+    int bytes = sqlite3_column_bytes(stmt, 1);
+    if( vector_bytes < 0 ) {
+      vector_bytes = bytes;
+      dimensions = bytes / element_size;
+      if( dimensions < 1 ) {
+        error = "The arrays are empty.";
+        break;
+      }
+    } else if( bytes != vector_bytes ) {
+      error = "The arrays are not the same length.";
+      break;
+    }
+    if( count == 0xFFFFFFFEu ) {
+      error = "Too many vectors for one index.";
+      break;
+    }
+    if( count == capacity ) {
+      capacity = capacity < 1024 ? 1024 : capacity * 2;
+      unsigned char* grown_raw = (unsigned char*)sqlite3_realloc64(raw, (sqlite3_uint64)capacity * (sqlite3_uint64)vector_bytes);
+      if( grown_raw != 0 ) {
+        raw = grown_raw;
+      }
+      float* grown_vectors = (float*)sqlite3_realloc64(vectors, sizeof(float) * (sqlite3_uint64)capacity * (sqlite3_uint64)dimensions);
+      if( grown_vectors != 0 ) {
+        vectors = grown_vectors;
+      }
+      sqlite3_int64* grown_rowids = (sqlite3_int64*)sqlite3_realloc64(rowids, sizeof(sqlite3_int64) * (sqlite3_uint64)capacity);
+      if( grown_rowids != 0 ) {
+        rowids = grown_rowids;
+      }
+      if( grown_raw == 0 || grown_vectors == 0 || grown_rowids == 0 ) {
+        error = "Out of memory.";
+        break;
+      }
+    }
+    const void* blob = sqlite3_column_blob(stmt, 1);
+    memcpy(raw + (size_t)count * (size_t)vector_bytes, blob, (size_t)vector_bytes);
+    float* vector = vectors + (size_t)count * (size_t)dimensions;
+    ndvss_to_float(vector, blob, dimensions, element_size);
+    if( metric == NDVSS_METRIC_COSINE ) {
+      // The euclidean distance of unit vectors orders like the cosine.
+      double norm = 0.0;
+      int j;
+      for( j = 0; j < dimensions; ++j ) {
+        norm += (double)vector[j] * vector[j];
+      }
+      norm = norm > 0.0 ? 1.0 / sqrt(norm) : 0.0;
+      for( j = 0; j < dimensions; ++j ) {
+        vector[j] = (float)(vector[j] * norm);
+      }
+    }
+    rowids[count++] = sqlite3_column_int64(stmt, 0);
+  }//endwhile reading rows
+  if( error == 0 && rc != SQLITE_DONE ) {
+    error = sqlite3_errmsg(db);
+    error_code = rc;
+  }
+  if( error == 0 && count == 0 ) {
+    error = "The column has no vectors.";
+  }
+  sqlite3_finalize(stmt);
+
+  // The graph.
+  ndvss_diskann_builder builder;
+  memset(&builder, 0, sizeof(builder));
+  unsigned int* order = 0;
+  unsigned int medoid = 0;
+  if( error == 0 ) {
+    builder.dimensions = dimensions;
+    builder.count = (unsigned int)count;
+    builder.degree = degree;
+    builder.vectors = vectors;
+    builder.neighbors = (unsigned int*)sqlite3_malloc64(sizeof(unsigned int) * (sqlite3_uint64)count * (sqlite3_uint64)degree);
+    builder.neighbor_counts = (unsigned int*)sqlite3_malloc64(sizeof(unsigned int) * (sqlite3_uint64)count);
+    builder.marks = (unsigned int*)sqlite3_malloc64(sizeof(unsigned int) * (sqlite3_uint64)count);
+    builder.pool_capacity = 4 * NDVSS_DISKANN_BUILD_LIST;
+    builder.pool = (ndvss_diskann_pool_item*)sqlite3_malloc64(sizeof(ndvss_diskann_pool_item) * (sqlite3_uint64)builder.pool_capacity);
+    builder.pruned = (unsigned char*)sqlite3_malloc(builder.pool_capacity);
+    order = (unsigned int*)sqlite3_malloc64(sizeof(unsigned int) * (sqlite3_uint64)count);
+    if( builder.neighbors == 0 || builder.neighbor_counts == 0 || builder.marks == 0 || builder.pool == 0 || 
+        builder.pruned == 0 || order == 0 || 
+        ndvss_diskann_list_init(&builder.list, degree > NDVSS_DISKANN_BUILD_LIST ? degree : NDVSS_DISKANN_BUILD_LIST) != SQLITE_OK ) {
+      error = "Out of memory.";
+    }
+  }
+  if( error == 0 ) {
+    memset(builder.marks, 0, sizeof(unsigned int) * (size_t)count);
+    // The medoid is the vector nearest to the mean.
+    float* mean = (float*)sqlite3_malloc64(sizeof(float) * (sqlite3_uint64)dimensions);
+    double* sums = (double*)sqlite3_malloc64(sizeof(double) * (sqlite3_uint64)dimensions);
+    if( mean == 0 || sums == 0 ) {
+      error = "Out of memory.";
+    } else {
+      sqlite3_int64 i;
+      int j;
+      memset(sums, 0, sizeof(double) * (size_t)dimensions);
+      for( i = 0; i < count; ++i ) {
+        for( j = 0; j < dimensions; ++j ) {
+          sums[j] += vectors[(size_t)i * dimensions + j];
+        }
+      }
+      for( j = 0; j < dimensions; ++j ) {
+        mean[j] = (float)(sums[j] / (double)count);
+      }
+      float best = 0.0f;
+      for( i = 0; i < count; ++i ) {
+        float distance = ndvss_diskann_builder_distance(&builder, mean, (unsigned int)i);
+        if( i == 0 || distance < best ) {
+          best = distance;
+          medoid = (unsigned int)i;
+        }
+      }
+    }
+    sqlite3_free(mean);
+    sqlite3_free(sums);
+  }
+  if( error == 0 ) {
+    // Start from a random graph and insert in a random order, first keeping the 
+    // nearest neighbours (alpha 1) and then adding long range ones (alpha 1.2).
+    sqlite3_uint64 random_state = 0x9E3779B97F4A7C15ULL;
+    unsigned int i, j;
+    unsigned int initial = (unsigned int)(degree / 2) < (unsigned int)count - 1 ? (unsigned int)(degree / 2) : (unsigned int)count - 1;
+    for( i = 0; i < (unsigned int)count; ++i ) {
+      builder.neighbor_counts[i] = 0;
+      for( j = 0; j < initial; ++j ) {
+        random_state = random_state * 6364136223846793005ULL + 1442695040888963407ULL;
+        unsigned int other = (unsigned int)((random_state >> 33) % (sqlite3_uint64)count);
+        if( other != i ) {
+          builder.neighbors[(size_t)i * degree + builder.neighbor_counts[i]++] = other;
+        }
+      }
+      order[i] = i;
+    }
+    for( i = (unsigned int)count - 1; i > 0; --i ) {
+      random_state = random_state * 6364136223846793005ULL + 1442695040888963407ULL;
+      j = (unsigned int)((random_state >> 33) % (sqlite3_uint64)(i + 1));
+      unsigned int swap = order[i];
+      order[i] = order[j];
+      order[j] = swap;
+    }
+    ndvss_task_phase(&task, "diskann_graph", 2 * count);
+    rc = ndvss_diskann_build_pass(&builder, order, medoid, 1.0);
+    if( rc == SQLITE_OK ) {
+      rc = ndvss_diskann_build_pass(&builder, order, medoid, NDVSS_DISKANN_ALPHA);
+    }
+    if( rc != SQLITE_OK ) {
+      error = rc == SQLITE_INTERRUPT ? sqlite3_errstr(rc) : "Out of memory.";
+      error_code = rc;
+    }
+  }
+  sqlite3_free(order);
+  sqlite3_free(builder.marks);
+  sqlite3_free(builder.pool);
+  sqlite3_free(builder.pruned);
+  ndvss_diskann_list_free(&builder.list);
+
+  // The PQ codebooks and codes.
+  int m_count = (int)NDVSS_CONFIG(NDVSS_CONFIG_PQ_SUBQUANTIZERS);
+  if( m_count == 0 ) {
+    m_count = dimensions / 2;
+  }
+  if( m_count < 1 ) {
+    m_count = 1;
+  }
+  if( m_count > dimensions ) {
+    m_count = dimensions;
+  }
+  int code_bytes = (m_count + 1) / 2;
+  int* sub_first = 0;
+  float* centroids = 0;
+  unsigned char* codes = 0;
+  if( error == 0 ) {
+    int n = count < NDVSS_PQ_TRAINING_VECTORS ? (int)count : NDVSS_PQ_TRAINING_VECTORS;
+    float* train = (float*)sqlite3_malloc64(sizeof(float) * (sqlite3_uint64)n * (sqlite3_uint64)dimensions);
+    int* assignment = (int*)sqlite3_malloc64(sizeof(int) * (sqlite3_uint64)n);
+    sub_first = (int*)sqlite3_malloc(sizeof(int) * (m_count + 1));
+    centroids = (float*)sqlite3_malloc64(sizeof(float) * NDVSS_PQ_CENTROIDS * (sqlite3_uint64)dimensions);
+    codes = (unsigned char*)sqlite3_malloc64((sqlite3_uint64)count * (sqlite3_uint64)code_bytes);
+    if( train == 0 || assignment == 0 || sub_first == 0 || centroids == 0 || codes == 0 ) {
+      error = "Out of memory.";
+    } else {
+      int m, i;
+      for( m = 0; m <= m_count; ++m ) {
+        sub_first[m] = (int)((sqlite3_int64)m * dimensions / m_count);
+      }
+      for( i = 0; i < n; ++i ) {
+        memcpy(train + (size_t)i * dimensions, vectors + (size_t)((sqlite3_int64)i * count / n) * dimensions, 
+               sizeof(float) * (size_t)dimensions);
+      }
+      ndvss_task_phase(&task, "pq_train", (sqlite3_int64)m_count * NDVSS_PQ_ITERATIONS);
+      for( m = 0; m < m_count && error == 0; ++m ) {
+        if( ndvss_pq_kmeans(train, n, dimensions, sub_first[m], sub_first[m + 1] - sub_first[m],
+                            centroids + NDVSS_PQ_CENTROIDS * sub_first[m], assignment, NDVSS_PQ_ITERATIONS, 1) != SQLITE_OK ) {
+          error = sqlite3_errstr(SQLITE_INTERRUPT);
+          error_code = SQLITE_INTERRUPT;
+        }
+      }
+      memset(codes, 0, (size_t)count * (size_t)code_bytes);
+      sqlite3_int64 v;
+      for( v = 0; v < count; ++v ) {
+        const float* vector = vectors + (size_t)v * dimensions;
+        for( m = 0; m < m_count; ++m ) {
+          int code = ndvss_pq_nearest(centroids + NDVSS_PQ_CENTROIDS * sub_first[m], vector + sub_first[m], 
+                                      sub_first[m + 1] - sub_first[m]);
+          codes[(size_t)v * code_bytes + m / 2] |= (unsigned char)(m % 2 == 0 ? code : code << 4);
+        }
+      }
+    }
+    sqlite3_free(train);
+    sqlite3_free(assignment);
+  }
+
+  // The 8-bit codes replace the stored vectors: every dimension is quantized between 
+  // its minimum and maximum over the working vectors (unit vectors for the cosine).
+  float* quantizer = 0;
+  int node_vector_bytes = vector_bytes;
+  if( error == 0 && storage == NDVSS_DISKANN_INT8 ) {
+    quantizer = (float*)sqlite3_malloc64(sizeof(float) * 2 * (sqlite3_uint64)dimensions);
+    if( quantizer == 0 ) {
+      error = "Out of memory.";
+    } else {
+      float* minimums = quantizer;
+      float* steps = quantizer + dimensions;
+      sqlite3_int64 v;
+      int j;
+      for( j = 0; j < dimensions; ++j ) {
+        float low = vectors[j], high = vectors[j];
+        for( v = 1; v < count; ++v ) {
+          float x = vectors[(size_t)v * dimensions + j];
+          low = x < low ? x : low;
+          high = x > high ? x : high;
+        }
+        minimums[j] = low;
+        steps[j] = (high - low) / 255.0f;
+      }
+      for( v = 0; v < count; ++v ) {
+        const float* vector = vectors + (size_t)v * dimensions;
+        unsigned char* code = raw + (size_t)v * (size_t)dimensions;
+        for( j = 0; j < dimensions; ++j ) {
+          float level = steps[j] > 0.0f ? (vector[j] - minimums[j]) / steps[j] + 0.5f : 0.0f;
+          code[j] = (unsigned char)(level < 0.0f ? 0 : (level > 255.0f ? 255 : (int)level));
+        }
+      }
+      node_vector_bytes = dimensions;
+    }
+  }
+  sqlite3_free(vectors);
+
+  // The file.
+  ndvss_diskann_header header;
+  memset(&header, 0, sizeof(header));
+  int ok = 1;
+  if( error == 0 ) {
+    memcpy(header.magic, NDVSS_DISKANN_MAGIC, 8);
+    header.version = NDVSS_DISKANN_VERSION;
+    header.element_size = (unsigned int)element_size;
+    header.dimensions = (unsigned int)dimensions;
+    header.metric = (unsigned int)metric;
+    header.degree = (unsigned int)degree;
+    header.neighbor_bits = ndvss_neighbor_bits(count);
+    header.storage = (unsigned int)storage;
+    header.source_bytes = (unsigned int)source_bytes;
+    // Rounded up to 8 bytes, so that the vectors of doubles stay aligned.
+    header.node_bytes = (unsigned int)((node_vector_bytes + sizeof(sqlite3_int64) + sizeof(unsigned int) + 
+                                        ((size_t)degree * header.neighbor_bits + 7) / 8 + 7) & ~(size_t)7);
+    header.nodes_per_sector = header.node_bytes <= NDVSS_IO_ALIGNMENT ? NDVSS_IO_ALIGNMENT / header.node_bytes : 0;
+    header.sectors_per_node = header.nodes_per_sector > 0 ? 1 : (header.node_bytes + NDVSS_IO_ALIGNMENT - 1) / NDVSS_IO_ALIGNMENT;
+    header.subquantizers = (unsigned int)m_count;
+    header.count = count;
+    header.medoid = medoid;
+    header.node_offset = NDVSS_IO_ALIGNMENT;
+    sqlite3_int64 sectors = header.nodes_per_sector > 0 ? (count + header.nodes_per_sector - 1) / header.nodes_per_sector
+                                                        : count * header.sectors_per_node;
+    header.pq_offset = header.node_offset + sectors * NDVSS_IO_ALIGNMENT;
+    FILE* file = fopen(path, "wb");
+    if( file == 0 ) {
+      error = "Can't open the file for writing.";
+    } else {
+      size_t sector_bytes = (size_t)header.sectors_per_node * NDVSS_IO_ALIGNMENT;
+      unsigned char* sector = (unsigned char*)sqlite3_malloc64(sector_bytes);
+      if( sector == 0 ) {
+        error = "Out of memory.";
+      } else {
+        memset(sector, 0, NDVSS_IO_ALIGNMENT);
+        memcpy(sector, &header, sizeof(header));
+        char* names = (char*)sector + sizeof(header);
+        memcpy(names, db_name, strlen(db_name) + 1);
+        names += strlen(db_name) + 1;
+        memcpy(names, table_name, strlen(table_name) + 1);
+        names += strlen(table_name) + 1;
+        memcpy(names, column, strlen(column) + 1);
+        ok = fwrite(sector, 1, NDVSS_IO_ALIGNMENT, file) == NDVSS_IO_ALIGNMENT;
+        unsigned int per_sector = header.nodes_per_sector > 0 ? header.nodes_per_sector : 1;
+        sqlite3_int64 v;
+        for( v = 0; v < count && ok; ++v ) {
+          unsigned int slot = (unsigned int)(v % per_sector);
+          if( slot == 0 ) {
+            memset(sector, 0, sector_bytes);
+          }
+          unsigned char* node = sector + (size_t)slot * header.node_bytes;
+          unsigned int neighbor_count = builder.neighbor_counts[v];
+          memcpy(node, raw + (size_t)v * (size_t)node_vector_bytes, (size_t)node_vector_bytes);
+          memcpy(node + node_vector_bytes, &rowids[v], sizeof(sqlite3_int64));
+          memcpy(node + node_vector_bytes + sizeof(sqlite3_int64), &neighbor_count, sizeof(unsigned int));
+          // Sorted, the PQ codes of the neighbours are looked up in address order.
+          unsigned int* neighbors = builder.neighbors + (size_t)v * degree;
+          qsort(neighbors, neighbor_count, sizeof(unsigned int), ndvss_node_compare);
+          ndvss_neighbors_pack(node + node_vector_bytes + sizeof(sqlite3_int64) + sizeof(unsigned int), 
+                               neighbors, neighbor_count, header.neighbor_bits);
+          if( slot == per_sector - 1 || v == count - 1 ) {
+            ok = fwrite(sector, 1, sector_bytes, file) == sector_bytes;
+          }
+        }//endfor nodes
+        sqlite3_free(sector);
+        sqlite3_int64 pq_bytes = sizeof(int) * (sqlite3_int64)(m_count + 1) + 
+                                 sizeof(float) * NDVSS_PQ_CENTROIDS * (sqlite3_int64)dimensions + 
+                                 count * code_bytes;
+        ok = ok && fwrite(sub_first, sizeof(int), (size_t)(m_count + 1), file) == (size_t)(m_count + 1);
+        ok = ok && fwrite(centroids, sizeof(float), NDVSS_PQ_CENTROIDS * (size_t)dimensions, file) == NDVSS_PQ_CENTROIDS * (size_t)dimensions;
+        ok = ok && fwrite(codes, (size_t)code_bytes, (size_t)count, file) == (size_t)count;
+        if( quantizer != 0 ) {
+          while( ok && pq_bytes % sizeof(float) != 0 ) {
+            ok = fputc(0, file) != EOF;
+            ++pq_bytes;
+          }
+          ok = ok && fwrite(quantizer, sizeof(float), 2 * (size_t)dimensions, file) == 2 * (size_t)dimensions;
+          pq_bytes += sizeof(float) * 2 * (sqlite3_int64)dimensions;
+        }
+        // Pad the end, so that every O_DIRECT read stays inside the file.
+        size_t padding = (size_t)(((pq_bytes + NDVSS_IO_ALIGNMENT - 1) & ~(sqlite3_int64)(NDVSS_IO_ALIGNMENT - 1)) - pq_bytes);
+        while( ok && padding > 0 ) {
+          ok = fputc(0, file) != EOF;
+          --padding;
+        }
+      }
+      if( fclose(file) != 0 ) {
+        ok = 0;
+      }
+    }
+  }
+  sqlite3_free(db_name);
+  sqlite3_free(path);
+  sqlite3_free(raw);
+  sqlite3_free(rowids);
+  sqlite3_free(builder.neighbors);
+  sqlite3_free(builder.neighbor_counts);
+  sqlite3_free(sub_first);
+  sqlite3_free(centroids);
+  sqlite3_free(codes);
+  sqlite3_free(quantizer);
+  if( error != 0 ) {
+    sqlite3_result_error(context, error, -1);
+    if( error_code != SQLITE_ERROR ) {
+      sqlite3_result_error_code(context, error_code);
+    }
+  } else if( !ok ) {
+    sqlite3_result_error(context, "Writing the file failed.", -1);
+  } else {
+    NDVSS_STAT_ADD(diskann_builds, 1);
+    NDVSS_STAT_ADD(diskann_build_nanoseconds, (sqlite3_int64)((ndvss_now() - start) * 1e9));
+    sqlite3_result_int64(context, count);
+  }
+  ndvss_task_end(&task);
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_diskann_build_d
+// Desc: Builds a DiskANN index of a column of double-arrays. See ndvss_diskann_build.
+//----------------------------------------------------------------------------------------
+static void ndvss_diskann_build_d( sqlite3_context* context,
+                                   int argc,
+                                   sqlite3_value** argv ) 
+{
+  ndvss_diskann_build(context, argc, argv, sizeof(double));
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_diskann_build_f
+// Desc: Builds a DiskANN index of a column of float-arrays. See ndvss_diskann_build.
+//----------------------------------------------------------------------------------------
+static void ndvss_diskann_build_f( sqlite3_context* context,
+                                   int argc,
+                                   sqlite3_value** argv ) 
+{
+  ndvss_diskann_build(context, argc, argv, sizeof(float));
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_diskann_free
+// Desc: Closes an index file and frees its codes.
+//----------------------------------------------------------------------------------------
+static void ndvss_diskann_free( ndvss_diskann* index )
+{
+  if( index == 0 ) {
+    return;
+  }
+#ifdef NDVSS_HAVE_IO_URING
+  if( index->has_ring ) {
+    ndvss_uring_close(&index->ring);
+  }
+#endif
+  if( index->fd >= 0 ) {
+#ifdef _WIN32
+    _close(index->fd);
+#else
+    close(index->fd);
+#endif
+  }
+  if( index->pq_section != 0 ) {
+    NDVSS_STAT_ADD(diskann_code_bytes, -index->pq_bytes);
+  }
+  ndvss_aligned_free(index->pq_section);
+  sqlite3_free(index->source);
+  sqlite3_free(index->path);
+  sqlite3_free(index);
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_diskann_free_list
+// Desc: Closes the index files of a connection.
+//----------------------------------------------------------------------------------------
+static void ndvss_diskann_free_list( ndvss_diskann* index )
+{
+  while( index != 0 ) {
+    ndvss_diskann* next = index->next;
+    ndvss_diskann_free(index);
+    index = next;
+  }
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_diskann_open
+// Desc: Opens an index file and reads its header and PQ section to memory.
+// Returns: SQLITE_OK or an error code, with the message in error_message.
+//----------------------------------------------------------------------------------------
+static int ndvss_diskann_open( const char* path, ndvss_diskann** result, char** error_message )
+{
+  ndvss_diskann* index = (ndvss_diskann*)sqlite3_malloc(sizeof(ndvss_diskann));
+  if( index == 0 ) {
+    return SQLITE_NOMEM;
+  }
+  memset(index, 0, sizeof(ndvss_diskann));
+  index->fd = -1;
+  index->path = sqlite3_mprintf("%s", path);
+  if( index->path == 0 ) {
+    ndvss_diskann_free(index);
+    return SQLITE_NOMEM;
+  }
+  // The reason a file can't be used is reported apart from a file that isn't an index.
+  if( !ndvss_file_identity(path, &index->file_size, &index->file_mtime) ) {
+    *error_message = sqlite3_mprintf("Can't open %s: %s.", path, strerror(errno));
+    ndvss_diskann_free(index);
+    return SQLITE_CANTOPEN;
+  }
+#if defined(__linux__) && defined(O_DIRECT)
+  // The nodes are read at random, the page cache wouldn't help much.
+  if( NDVSS_CONFIG(NDVSS_CONFIG_DIRECT_IO) ) {
+    index->fd = open(path, O_RDONLY | O_DIRECT);
+    index->direct = index->fd >= 0;
+  }
+#endif
+  if( index->fd < 0 ) {
+#ifdef _WIN32
+    index->fd = _open(path, _O_RDONLY | _O_BINARY);
+#else
+    index->fd = open(path, O_RDONLY);
+#endif
+  }
+  if( index->fd < 0 ) {
+    *error_message = sqlite3_mprintf("Can't open %s: %s.", path, strerror(errno));
+    ndvss_diskann_free(index);
+    return SQLITE_CANTOPEN;
+  }
+  unsigned char* first = (unsigned char*)ndvss_aligned_malloc(NDVSS_IO_ALIGNMENT, NDVSS_IO_ALIGNMENT);
+  if( first == 0 ) {
+    ndvss_diskann_free(index);
+    return SQLITE_NOMEM;
+  }
+  sqlite3_int64 read_bytes = ndvss_file_read_at(index->fd, first, NDVSS_IO_ALIGNMENT, 0);
+  if( read_bytes < 0 ) {
+    *error_message = sqlite3_mprintf("Can't read %s: %s.", path, strerror(errno));
+    ndvss_aligned_free(first);
+    ndvss_diskann_free(index);
+    return SQLITE_IOERR;
+  }
+  int valid = read_bytes >= (sqlite3_int64)sizeof(ndvss_diskann_header);
+  memcpy(&index->header, first, sizeof(ndvss_diskann_header));
+  const ndvss_diskann_header* header = &index->header;
+  if( header->version < 3 ) {
+    // Older files have zeros after the header.
+    index->header.storage = NDVSS_DISKANN_FULL;
+    index->header.source_bytes = 0;
+  }
+  if( valid && header->source_bytes > 0 ) {
+    // Three strings, the last one ending the names.
+    const char* names = (const char*)first + sizeof(ndvss_diskann_header);
+    size_t bytes = header->source_bytes;
+    valid = bytes <= NDVSS_IO_ALIGNMENT - sizeof(ndvss_diskann_header) && names[bytes - 1] == 0;
+    if( valid ) {
+      index->source = (char*)sqlite3_malloc((int)bytes);
+      if( index->source == 0 ) {
+        ndvss_aligned_free(first);
+        ndvss_diskann_free(index);
+        return SQLITE_NOMEM;
+      }
+      memcpy(index->source, names, bytes);
+      index->source_table = index->source + strlen(index->source) + 1;
+      valid = (size_t)(index->source_table - index->source) < bytes;
+      if( valid ) {
+        index->source_column = index->source_table + strlen(index->source_table) + 1;
+        valid = (size_t)(index->source_column - index->source) < bytes;
+      }
+    }
+  }
+  ndvss_aligned_free(first);
+  index->neighbor_bits = header->version == 1 ? 32 : (int)header->neighbor_bits;
+  index->neighbor_bytes = (int)(((sqlite3_int64)header->degree * index->neighbor_bits + 7) / 8);
+  index->node_vector_bytes = header->storage == NDVSS_DISKANN_INT8 ? (int)header->dimensions 
+                                                                   : (int)(header->element_size * header->dimensions);
+  if( !valid || memcmp(header->magic, NDVSS_DISKANN_MAGIC, 8) != 0 || 
+      header->version < 1 || header->version > NDVSS_DISKANN_VERSION ||
+      (header->storage != NDVSS_DISKANN_FULL && header->storage != NDVSS_DISKANN_INT8) ||
+      index->neighbor_bits < 1 || index->neighbor_bits > 32 || header->degree < 1 ||
+      (sqlite3_int64)index->node_vector_bytes + (sqlite3_int64)sizeof(sqlite3_int64) + 
+        (sqlite3_int64)sizeof(unsigned int) + index->neighbor_bytes > (sqlite3_int64)header->node_bytes ||
+      header->count < 1 || header->dimensions < 1 || header->subquantizers < 1 || header->subquantizers > header->dimensions ||
+      header->medoid < 0 || header->medoid >= header->count || header->sectors_per_node < 1 ) {
+    *error_message = sqlite3_mprintf("Not a DiskANN index file.");
+    ndvss_diskann_free(index);
+    return SQLITE_ERROR;
+  }
+  index->read_bytes = (int)header->sectors_per_node * NDVSS_IO_ALIGNMENT;
+  index->code_bytes = (int)(header->subquantizers + 1) / 2;
+  sqlite3_int64 centroid_bytes = sizeof(float) * NDVSS_PQ_CENTROIDS * (sqlite3_int64)header->dimensions;
+  sqlite3_int64 sub_first_bytes = sizeof(int) * (sqlite3_int64)(header->subquantizers + 1);
+  sqlite3_int64 pq_bytes = sub_first_bytes + centroid_bytes + header->count * index->code_bytes;
+  sqlite3_int64 quantizer_offset = (pq_bytes + (sqlite3_int64)sizeof(float) - 1) & ~(sqlite3_int64)(sizeof(float) - 1);
+  if( header->storage == NDVSS_DISKANN_INT8 ) {
+    pq_bytes = quantizer_offset + sizeof(float) * 2 * (sqlite3_int64)header->dimensions;
+  }
+  index->pq_bytes = (pq_bytes + NDVSS_IO_ALIGNMENT - 1) & ~(sqlite3_int64)(NDVSS_IO_ALIGNMENT - 1);
+  index->pq_section = (unsigned char*)ndvss_aligned_malloc((sqlite3_uint64)index->pq_bytes, NDVSS_IO_ALIGNMENT);
+  if( index->pq_section == 0 ) {
+    ndvss_diskann_free(index);
+    return SQLITE_NOMEM;
+  }
+  NDVSS_STAT_ADD(diskann_code_bytes, index->pq_bytes);
+  if( ndvss_file_read_at(index->fd, index->pq_section, index->pq_bytes, header->pq_offset) < pq_bytes ) {
+    *error_message = sqlite3_mprintf("The DiskANN index file is truncated.");
+    ndvss_diskann_free(index);
+    return SQLITE_IOERR;
+  }
+  index->sub_first = (const int*)index->pq_section;
+  index->centroids = (const float*)(index->pq_section + sub_first_bytes);
+  index->codes = index->pq_section + sub_first_bytes + centroid_bytes;
+  if( header->storage == NDVSS_DISKANN_INT8 ) {
+    index->minimums = (const float*)(index->pq_section + quantizer_offset);
+    index->steps = index->minimums + header->dimensions;
+  }
+  *result = index;
+  return SQLITE_OK;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_diskann_get
+// Desc: Finds the open index of a file in the connection state, or opens it. An index
+//       whose file has changed since it was opened is opened again.
+// Returns: SQLITE_OK or an error code, with the message in error_message.
+//----------------------------------------------------------------------------------------
+static int ndvss_diskann_get( ndvss_connection* connection, 
+                              const char* file_path, 
+                              ndvss_diskann** result, 
+                              char** error_message )
+{
+  char* path = ndvss_resolve_path(connection->db, file_path);
+  if( path == 0 ) {
+    return SQLITE_NOMEM;
+  }
+  sqlite3_int64 size = 0, mtime = 0;
+  int exists = ndvss_file_identity(path, &size, &mtime);
+  ndvss_diskann** link = &connection->diskann_indexes;
+  while( *link != 0 ) {
+    ndvss_diskann* index = *link;
+    if( strcmp(index->path, path) == 0 ) {
+      if( exists && index->file_size == size && index->file_mtime == mtime ) {
+        sqlite3_free(path);
+        *result = index;
+        return SQLITE_OK;
+      }
+      *link = index->next;
+      ndvss_diskann_free(index);
+      break;
+    }
+    link = &index->next;
+  }
+  int rc = ndvss_diskann_open(path, result, error_message);
+  sqlite3_free(path);
+  if( rc == SQLITE_OK ) {
+    (*result)->next = connection->diskann_indexes;
+    connection->diskann_indexes = *result;
+  }
+  return rc;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_diskann_code_distance
+// Desc: Squared euclidean distance between a float vector and the 8-bit codes of a node.
+//----------------------------------------------------------------------------------------
+static float ndvss_diskann_code_distance( const float* query, 
+                                          const unsigned char* code, 
+                                          const float* minimums, 
+                                          const float* steps, 
+                                          int dimensions )
+{
+  float sum = 0.0f;
+  int j;
+  for( j = 0; j < dimensions; ++j ) {
+    float difference = query[j] - (minimums[j] + steps[j] * (float)code[j]);
+    sum += difference * difference;
+  }
+  return sum;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_diskann_rerank
+// Desc: Reranks the candidates of a search of an index with 8-bit nodes with the vectors
+//       read from the column the index was built from. Rows that were deleted or whose
+//       vector has changed length since are skipped.
+// Args: Database, index, metric, searched vector and its size in bytes, candidates 
+//       (rowids), top-k, where an error message is stored.
+// Returns: SQLITE_OK or an error code.
+//----------------------------------------------------------------------------------------
+static int ndvss_diskann_rerank( sqlite3* db,
+                                 const ndvss_diskann* index,
+                                 int metric,
+                                 const void* searched_array,
+                                 int vector_bytes,
+                                 const ndvss_topk* candidates,
+                                 ndvss_topk* topk,
+                                 char** error_message )
+{
+  if( index->source == 0 ) {
+    *error_message = sqlite3_mprintf("The DiskANN index file doesn't name its column.");
+    return SQLITE_ERROR;
+  }
+  char* sql = sqlite3_mprintf("SELECT v.\"%w\" FROM \"%w\".\"%w\" AS v WHERE v.rowid = ?1", 
+                              index->source_column, index->source, index->source_table);
+  void* vector = ndvss_aligned_malloc((sqlite3_uint64)vector_bytes, NDVSS_ALIGNMENT);
+  if( sql == 0 || vector == 0 ) {
+    sqlite3_free(sql);
+    ndvss_aligned_free(vector);
+    return SQLITE_NOMEM;
+  }
+  sqlite3_stmt* stmt = 0;
+  int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+  sqlite3_free(sql);
+  if( rc != SQLITE_OK ) {
+    *error_message = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+    ndvss_aligned_free(vector);
+    return rc;
+  }
+  int dimensions = vector_bytes / (int)index->header.element_size;
+  int i;
+  for( i = 0; i < candidates->count && rc == SQLITE_OK; ++i ) {
+    sqlite3_bind_int64(stmt, 1, candidates->rowids[i]);
+    int step = sqlite3_step(stmt);
+    if( step == SQLITE_ROW ) {
+      double distance;
+      if( sqlite3_column_bytes(stmt, 0) == vector_bytes ) {
+        memcpy(vector, sqlite3_column_blob(stmt, 0), (size_t)vector_bytes);
+        if( ndvss_metric_distance(metric, (int)index->header.element_size, searched_array, vector, dimensions, &distance) &&
+            distance < ndvss_topk_bound(topk) ) {
+          ndvss_topk_push(topk, distance, candidates->rowids[i]);
+        }
+      }
+    } else if( step != SQLITE_DONE ) {
+      *error_message = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+      rc = step;
+    }
+    sqlite3_reset(stmt);
+  }//endfor candidates
+  sqlite3_finalize(stmt);
+  ndvss_aligned_free(vector);
+  NDVSS_STAT_ADD(diskann_reranks, candidates->count);
+  return rc;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_diskann_search
+// Desc: Beam search of an index file. Only the nodes on the path are read. The nodes of
+//       an index with 8-bit vectors give approximate distances, see ndvss_diskann_rerank.
+// Args: Database, index, metric, searched vector and its size in bytes, top-k, where an
+//       error message is stored.
+// Returns: SQLITE_OK or an error code.
+//----------------------------------------------------------------------------------------
+static int ndvss_diskann_search( sqlite3* db,
+                                 ndvss_diskann* index,
+                                 int metric,
+                                 const void* searched_array,
+                                 int vector_bytes,
+                                 ndvss_topk* topk,
+                                 char** error_message )
+{
+  const ndvss_diskann_header* header = &index->header;
+  int dimensions = (int)header->dimensions;
+  if( (int)(header->dimensions * header->element_size) != vector_bytes ) {
+    *error_message = sqlite3_mprintf("The arrays are not the same length.");
+    return SQLITE_ERROR;
+  }
+  int index_metric = metric == NDVSS_METRIC_EUCLIDEAN_SQUARED ? NDVSS_METRIC_EUCLIDEAN : metric;
+  if( index_metric != (int)header->metric ) {
+    *error_message = sqlite3_mprintf("The index was built for the %s metric.", 
+                                     header->metric == NDVSS_METRIC_COSINE ? "cosine" : "euclidean");
+    return SQLITE_ERROR;
+  }
+  double start = ndvss_now();
+  int list_size = (int)NDVSS_CONFIG(NDVSS_CONFIG_DISKANN_SEARCH_LIST);
+  if( list_size < topk->k ) {
+    list_size = topk->k;
+  }
+  int beam_width = (int)NDVSS_CONFIG(NDVSS_CONFIG_DISKANN_BEAM_WIDTH);
+  int m_count = (int)header->subquantizers;
+  int quantized = header->storage == NDVSS_DISKANN_INT8;
+  int rerank = (int)NDVSS_CONFIG(NDVSS_CONFIG_PQ_RERANK);
+  sqlite3_int64 candidate_count = rerank > 0 ? (sqlite3_int64)topk->k * rerank : topk->k;
+  if( candidate_count > header->count ) {
+    candidate_count = header->count;
+  }
+  ndvss_topk candidates;
+  memset(&candidates, 0, sizeof(candidates));
+  float* query = (float*)sqlite3_malloc64(sizeof(float) * (sqlite3_uint64)dimensions);
+  float* tables = (float*)sqlite3_malloc64(sizeof(float) * NDVSS_PQ_CENTROIDS * (sqlite3_uint64)m_count);
+  unsigned char* buffers = (unsigned char*)ndvss_aligned_malloc((sqlite3_uint64)index->read_bytes * (sqlite3_uint64)beam_width, 
+                                                                NDVSS_IO_ALIGNMENT);
+  unsigned int* neighbors = (unsigned int*)sqlite3_malloc64(sizeof(unsigned int) * (sqlite3_uint64)header->degree);
+  unsigned int beam[NDVSS_DISKANN_MAX_BEAM];
+  int results[NDVSS_DISKANN_MAX_BEAM];
+  ndvss_diskann_list list;
+  ndvss_node_set visited;
+  memset(&list, 0, sizeof(list));
+  memset(&visited, 0, sizeof(visited));
+  int rc = SQLITE_OK;
+  if( query == 0 || tables == 0 || buffers == 0 || neighbors == 0 || 
+      ndvss_diskann_list_init(&list, list_size) != SQLITE_OK ||
+      (quantized && ndvss_topk_init(&candidates, (int)candidate_count) != SQLITE_OK) ) {
+    rc = SQLITE_NOMEM;
+  }
+  if( rc == SQLITE_OK ) {
+    ndvss_to_float(query, searched_array, dimensions, (int)header->element_size);
+    int j, c;
+    if( header->metric == NDVSS_METRIC_COSINE ) {
+      double norm = 0.0;
+      for( j = 0; j < dimensions; ++j ) {
+        norm += (double)query[j] * query[j];
+      }
+      norm = norm > 0.0 ? 1.0 / sqrt(norm) : 0.0;
+      for( j = 0; j < dimensions; ++j ) {
+        query[j] = (float)(query[j] * norm);
+      }
+    }
+    for( j = 0; j < m_count; ++j ) {
+      int first = index->sub_first[j];
+      int size = index->sub_first[j + 1] - first;
+      const float* centroids = index->centroids + NDVSS_PQ_CENTROIDS * first;
+      for( c = 0; c < NDVSS_PQ_CENTROIDS; ++c ) {
+        tables[j * NDVSS_PQ_CENTROIDS + c] = ndvss_euclidean_distance_squared_kernel_f(query + first, centroids + c * size, size);
+      }
+    }
+  }
+#ifdef NDVSS_HAVE_IO_URING
+  if( rc == SQLITE_OK && !index->has_ring && NDVSS_CONFIG(NDVSS_CONFIG_IO_URING) ) {
+    index->has_ring = ndvss_uring_open(&index->ring, NDVSS_DISKANN_MAX_BEAM) == SQLITE_OK;
+  }
+  int use_ring = index->has_ring && NDVSS_CONFIG(NDVSS_CONFIG_IO_URING);
+#endif
+  sqlite3_int64 reads = 0, hops = 0;
+  unsigned int next = (unsigned int)header->medoid;
+  if( rc == SQLITE_OK && ndvss_node_set_insert(&visited, next) < 0 ) {
+    rc = SQLITE_NOMEM;
+  }
+  if( rc == SQLITE_OK ) {
+    ndvss_diskann_list_insert(&list, next, 0.0f);
+  }
+  while( rc == SQLITE_OK ) {
+    // The best candidates that haven't been read yet.
+    int beam_count = 0, i;
+    for( i = 0; i < list.count && beam_count < beam_width; ++i ) {
+      if( !list.expanded[i] ) {
+        list.expanded[i] = 1;
+        beam[beam_count++] = list.nodes[i];
+      }
+    }
+    if( beam_count == 0 ) {
+      break;
+    }
+    ++hops;
+    reads += beam_count;
+    for( i = 0; i < beam_count; ++i ) {
+      results[i] = -2;
+    }
+#ifdef NDVSS_HAVE_IO_URING
+    if( use_ring ) {
+      int inflight = beam_count;
+      for( i = 0; i < beam_count; ++i ) {
+        sqlite3_int64 sector = header->nodes_per_sector > 0 ? beam[i] / header->nodes_per_sector 
+                                                            : (sqlite3_int64)beam[i] * header->sectors_per_node;
+        ndvss_uring_prepare_read(&index->ring, index->fd, buffers + (size_t)i * index->read_bytes, (unsigned)index->read_bytes,
+                                 header->node_offset + sector * NDVSS_IO_ALIGNMENT, (sqlite3_uint64)i);
+      }
+      while( inflight > 0 ) {
+        sqlite3_uint64 user_data;
+        int result;
+        if( ndvss_uring_wait(&index->ring, &user_data, &result) != SQLITE_OK ) {
+          // Reads may still land in the buffers, so they are left allocated.
+          ndvss_uring_close(&index->ring);
+          index->has_ring = 0;
+          use_ring = 0;
+          buffers = 0;
+          rc = SQLITE_IOERR;
+          break;
+        }
+        if( user_data < (sqlite3_uint64)beam_count ) {
+          results[user_data] = result;
+        }
+        --inflight;
+      }
+      if( rc != SQLITE_OK ) {
+        *error_message = sqlite3_mprintf("Reading the DiskANN index file failed.");
+        break;
+      }
+    }
+#endif
+    for( i = 0; i < beam_count; ++i ) {
+      unsigned char* buffer = buffers + (size_t)i * index->read_bytes;
+      sqlite3_int64 sector = header->nodes_per_sector > 0 ? beam[i] / header->nodes_per_sector 
+                                                          : (sqlite3_int64)beam[i] * header->sectors_per_node;
+      if( results[i] < index->read_bytes &&
+          ndvss_file_read_at(index->fd, buffer, index->read_bytes, header->node_offset + sector * NDVSS_IO_ALIGNMENT) < index->read_bytes ) {
+        *error_message = sqlite3_mprintf("Reading the DiskANN index file failed.");
+        rc = SQLITE_IOERR;
+        break;
+      }
+      const unsigned char* node = buffer + (header->nodes_per_sector > 0 ? (size_t)(beam[i] % header->nodes_per_sector) * header->node_bytes : 0);
+      sqlite3_int64 rowid;
+      unsigned int neighbor_count;
+      memcpy(&rowid, node + index->node_vector_bytes, sizeof(sqlite3_int64));
+      memcpy(&neighbor_count, node + index->node_vector_bytes + sizeof(sqlite3_int64), sizeof(unsigned int));
+      double distance;
+      if( quantized ) {
+        // The squared distance of unit vectors is 2 - 2 cos.
+        distance = ndvss_diskann_code_distance(query, node, index->minimums, index->steps, dimensions);
+        if( header->metric == NDVSS_METRIC_COSINE ) {
+          distance = distance / 2.0 - 1.0;
+        }
+        if( distance < ndvss_topk_bound(&candidates) ) {
+          ndvss_topk_push(&candidates, distance, rowid);
+        }
+      } else if( ndvss_metric_distance(metric, (int)header->element_size, searched_array, node, dimensions, &distance) &&
+                 distance < ndvss_topk_bound(topk) ) {
+        ndvss_topk_push(topk, distance, rowid);
+      }
+      if( neighbor_count > header->degree ) {
+        neighbor_count = header->degree;
+      }
+      ndvss_neighbors_unpack(neighbors, node + index->node_vector_bytes + sizeof(sqlite3_int64) + sizeof(unsigned int), 
+                             (size_t)index->neighbor_bytes, neighbor_count, (unsigned int)index->neighbor_bits);
+      unsigned int n;
+      for( n = 0; n < neighbor_count; ++n ) {
+        unsigned int neighbor = neighbors[n];
+        if( (sqlite3_int64)neighbor >= header->count ) {
+          continue;
+        }
+        int added = ndvss_node_set_insert(&visited, neighbor);
+        if( added < 0 ) {
+          rc = SQLITE_NOMEM;
+          break;
+        }
+        if( added == 0 ) {
+          continue;
+        }
+        const unsigned char* code = index->codes + (size_t)neighbor * index->code_bytes;
+        float estimate = 0.0f;
+        int m;
+        for( m = 0; m < m_count; ++m ) {
+          estimate += tables[m * NDVSS_PQ_CENTROIDS + ((m % 2 == 0) ? (code[m / 2] & 0x0F) : (code[m / 2] >> 4))];
+        }
+        ndvss_diskann_list_insert(&list, neighbor, estimate);
+      }//endfor neighbours
+    }//endfor beam
+  }//endwhile hops
+  if( rc == SQLITE_OK && quantized ) {
+    if( rerank > 0 ) {
+      rc = ndvss_diskann_rerank(db, index, metric, searched_array, vector_bytes, &candidates, topk, error_message);
+    } else {
+      int i;
+      for( i = 0; i < candidates.count; ++i ) {
+        if( candidates.distances[i] < ndvss_topk_bound(topk) ) {
+          ndvss_topk_push(topk, candidates.distances[i], candidates.rowids[i]);
+        }
+      }
+    }
+  }
+  if( rc == SQLITE_OK ) {
+    NDVSS_STAT_ADD(diskann_searches, 1);
+    NDVSS_STAT_ADD(diskann_hops, hops);
+    NDVSS_STAT_ADD(diskann_reads, reads);
+    NDVSS_STAT_ADD(diskann_search_nanoseconds, (sqlite3_int64)((ndvss_now() - start) * 1e9));
+  }
+  ndvss_diskann_list_free(&list);
+  ndvss_topk_free(&candidates);
+  sqlite3_free(visited.slots);
+  sqlite3_free(query);
+  sqlite3_free(tables);
+  sqlite3_free(neighbors);
+  ndvss_aligned_free(buffers);
+  return rc;
+}
+
+
+//----------------------------------------------------------------------------------------
+// INDEX FILES.
+// The vector set of a column and its PQ codes can be written with ndvss_index_export_f/_d
+// to an index file that is used in place: ndvss_index_attach maps the file and the 
+// arrays of the vector set point straight into the mapping, so that nothing is parsed
+// or trained when a process starts and the pages come from the page cache as they are 
+// touched. Every section starts on a cache line, the vectors on a page, and all the 
+// positions are offsets from the start of the file, so the same bytes can be mapped 
+// anywhere (see SHARED MEMORY). The k-NN functions search an attached file given as
+// 'file:<path>' with the 'exact' and 'pq' methods. The file must not be changed while
+// it's mapped; write a new file and rename it over the old one.
+//
+// File layout (little-endian):
+//   0                 ndvss_index_header, padded to NDVSS_IO_ALIGNMENT bytes
+//   sub_first_offset  M + 1 32-bit integers
+//   centroids_offset  16 centroids per sub-quantizer (floats)
+//   rotation_offset   dimensions * dimensions floats of the OPQ rotation, if any
+//   codes_offset      the PQ codes in blocks of 32 vectors, as in memory
+//   rowids_offset     count rowids as 64-bit integers
+//   vectors_offset    count vectors of stride bytes each, aligned to NDVSS_IO_ALIGNMENT
+//----------------------------------------------------------------------------------------
+#define NDVSS_INDEX_MAGIC   "NDVSSIDX"
+#define NDVSS_INDEX_VERSION 1
+
+typedef struct ndvss_index_header {
+  char          magic[8];
+  unsigned int  version;
+  unsigned int  element_size;
+  unsigned int  dimensions;
+  unsigned int  stride;             // Bytes between vectors, a multiple of NDVSS_ALIGNMENT.
+  unsigned int  subquantizers;
+  unsigned int  reserved;
+  sqlite3_int64 count;
+  sqlite3_int64 sub_first_offset;
+  sqlite3_int64 centroids_offset;
+  sqlite3_int64 rotation_offset;    // 0 if there is no rotation.
+  sqlite3_int64 codes_offset;
+  sqlite3_int64 rowids_offset;
+  sqlite3_int64 vectors_offset;
+  sqlite3_int64 file_size;
+} ndvss_index_header;
+
+
+// Where an index is written: a file, or memory that is already zeroed.
+typedef struct ndvss_index_writer {
+  FILE*          file;
+  unsigned char* image;
+  sqlite3_int64  position;
+} ndvss_index_writer;
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_index_write_section
+// Desc: Pads the index to the given offset and writes a section there.
+// Returns: 1 on success, 0 if writing failed.
+//----------------------------------------------------------------------------------------
+static int ndvss_index_write_section( ndvss_index_writer* writer, 
+                                      sqlite3_int64 offset, 
+                                      const void* data, 
+                                      sqlite3_int64 bytes )
+{
+  if( writer->image != 0 ) {
+    if( bytes > 0 ) {
+      memcpy(writer->image + offset, data, (size_t)bytes);
+    }
+    writer->position = offset + bytes;
+    return 1;
+  }
+  static const unsigned char padding[NDVSS_IO_ALIGNMENT];
+  while( writer->position < offset ) {
+    size_t n = offset - writer->position < NDVSS_IO_ALIGNMENT ? (size_t)(offset - writer->position) : NDVSS_IO_ALIGNMENT;
+    if( fwrite(padding, 1, n, writer->file) != n ) {
+      return 0;
+    }
+    writer->position += (sqlite3_int64)n;
+  }
+  if( bytes > 0 && fwrite(data, 1, (size_t)bytes, writer->file) != (size_t)bytes ) {
+    return 0;
+  }
+  writer->position += bytes;
+  return 1;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_index_layout
+// Desc: Fills the header of the index of a vector set that has its PQ codes.
+//----------------------------------------------------------------------------------------
+static void ndvss_index_layout( const ndvss_vector_set* set, ndvss_index_header* header )
+{
+  const ndvss_pq* pq = set->pq;
+  memset(header, 0, sizeof(ndvss_index_header));
+  memcpy(header->magic, NDVSS_INDEX_MAGIC, 8);
+  header->version = NDVSS_INDEX_VERSION;
+  header->element_size = (unsigned int)set->element_size;
+  header->dimensions = (unsigned int)set->dimensions;
+  header->stride = (unsigned int)set->stride;
+  header->subquantizers = (unsigned int)pq->subquantizers;
+  header->count = set->count;
+  sqlite3_int64 sub_first_bytes = sizeof(int) * (sqlite3_int64)(pq->subquantizers + 1);
+  sqlite3_int64 centroid_bytes = sizeof(float) * NDVSS_PQ_CENTROIDS * (sqlite3_int64)set->dimensions;
+  sqlite3_int64 rotation_bytes = pq->rotation != 0 ? sizeof(float) * (sqlite3_int64)set->dimensions * set->dimensions : 0;
+  sqlite3_int64 code_bytes = pq->block_count * pq->pairs * 32;
+  sqlite3_int64 line = NDVSS_ALIGNMENT - 1, page = NDVSS_IO_ALIGNMENT - 1;
+  header->sub_first_offset = NDVSS_IO_ALIGNMENT;
+  header->centroids_offset = (header->sub_first_offset + sub_first_bytes + line) & ~line;
+  sqlite3_int64 end = (header->centroids_offset + centroid_bytes + line) & ~line;
+  if( rotation_bytes > 0 ) {
+    header->rotation_offset = end;
+    end = (header->rotation_offset + rotation_bytes + line) & ~line;
+  }
+  header->codes_offset = end;
+  header->rowids_offset = (header->codes_offset + code_bytes + line) & ~line;
+  header->vectors_offset = (header->rowids_offset + (sqlite3_int64)sizeof(sqlite3_int64) * set->count + page) & ~page;
+  header->file_size = header->vectors_offset + set->count * set->stride;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_index_write
+// Desc: Writes the index of a vector set laid out by ndvss_index_layout.
+// Returns: 1 on success, 0 if writing failed.
+//----------------------------------------------------------------------------------------
+static int ndvss_index_write( ndvss_index_writer* writer, 
+                              const ndvss_vector_set* set, 
+                              const ndvss_index_header* header )
+{
+  const ndvss_pq* pq = set->pq;
+  int ok = ndvss_index_write_section(writer, 0, header, sizeof(ndvss_index_header)) &&
+           ndvss_index_write_section(writer, header->sub_first_offset, pq->sub_first, 
+                                     sizeof(int) * (sqlite3_int64)(pq->subquantizers + 1)) &&
+           ndvss_index_write_section(writer, header->centroids_offset, pq->centroids, 
+                                     sizeof(float) * NDVSS_PQ_CENTROIDS * (sqlite3_int64)set->dimensions) &&
+           (pq->rotation == 0 || 
+            ndvss_index_write_section(writer, header->rotation_offset, pq->rotation, 
+                                      sizeof(float) * (sqlite3_int64)set->dimensions * set->dimensions)) &&
+           ndvss_index_write_section(writer, header->codes_offset, pq->codes, pq->block_count * pq->pairs * 32) &&
+           ndvss_index_write_section(writer, header->rowids_offset, set->rowids, sizeof(sqlite3_int64) * set->count);
+  // The vectors are written one at a time, so that the padding after each is zeros.
+  sqlite3_int64 i;
+  for( i = 0; ok && i < set->count; ++i ) {
+    ok = ndvss_index_write_section(writer, header->vectors_offset + i * set->stride, 
+                                   ndvss_vector_set_vector(set, i), set->vector_bytes);
+  }
+  return ok && ndvss_index_write_section(writer, header->file_size, 0, 0);
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_index_source
+// Desc: Reads the table and column arguments of the functions that write an index, and
+//       returns the cached vector set of the column with its PQ codes, pinned until
+//       ndvss_vector_set_unpin.
+// Args: Function context, arguments, element size, message for too few arguments, where
+//       the set is stored.
+// Returns: 1 on success, 0 if an error was set as the result.
+//----------------------------------------------------------------------------------------
+static int ndvss_index_source( sqlite3_context* context,
+                               int argc,
+                               sqlite3_value** argv,
+                               int element_size,
+                               const char* usage,
+                               ndvss_vector_set** result ) 
+{
+  if( argc < 3 ) {
+    sqlite3_result_error(context, usage, -1);
+    return 0;
+  }
+  if( sqlite3_value_type(argv[0]) == SQLITE_NULL ||
+      sqlite3_value_type(argv[1]) == SQLITE_NULL ||
+      sqlite3_value_type(argv[2]) == SQLITE_NULL ) {
+    sqlite3_result_error(context, "One of the given arguments is null.", -1);
+    return 0;
+  }
+  ndvss_connection* connection = (ndvss_connection*)sqlite3_user_data(context);
+  sqlite3* db = connection->db;
+  const char* table = (const char*)sqlite3_value_text(argv[0]);
+  const char* column = (const char*)sqlite3_value_text(argv[1]);
+  const char* dot = strchr(table, '.');
+  char* db_name = dot != 0 ? sqlite3_mprintf("%.*s", (int)(dot - table), table) : sqlite3_mprintf("main");
+  const char* table_name = dot != 0 ? dot + 1 : table;
+  if( db_name == 0 ) {
+    sqlite3_result_error_nomem(context);
+    return 0;
+  }
+  // The size of the first vector is the size of all of them.
+  sqlite3_stmt* stmt = 0;
+  char* message = 0;
+  int rc = ndvss_vector_select_prepare(db, db_name, table_name, column, &stmt, &message);
+  if( rc != SQLITE_OK ) {
+    sqlite3_free(db_name);
+    if( message != 0 ) {
+      sqlite3_result_error(context, message, -1);
+      sqlite3_free(message);
+    } else {
+      sqlite3_result_error_nomem(context);
+    }
+    return 0;
+  }
+  rc = sqlite3_step(stmt);
+  int vector_bytes = rc == SQLITE_ROW ? sqlite3_column_bytes(stmt, 1) : 0;
+  sqlite3_finalize(stmt);
+  if( rc != SQLITE_ROW ) {
+    sqlite3_free(db_name);
+    sqlite3_result_error(context, rc == SQLITE_DONE ? "The column has no vectors." : sqlite3_errmsg(db), -1);
+    return 0;
+  }
+  if( vector_bytes < element_size ) {
+    sqlite3_free(db_name);
+    sqlite3_result_error(context, "The arrays are empty.", -1);
+    return 0;
+  }
+  char* error_message = 0;
+  rc = ndvss_vector_set_get(connection, db_name, table_name, column, element_size, vector_bytes, result, &error_message);
+  sqlite3_free(db_name);
+  if( rc == SQLITE_OK ) {
+    ndvss_task task;
+    ndvss_task_begin(&task, db, "pq_build", table);
+    rc = ndvss_pq_ensure(db, *result);
+    ndvss_task_end(&task);
+    if( rc != SQLITE_OK ) {
+      ndvss_vector_set_unpin(*result);
+    }
+  }
+  if( rc != SQLITE_OK ) {
+    if( error_message != 0 ) {
+      sqlite3_result_error(context, error_message, -1);
+      sqlite3_free(error_message);
+    } else {
+      sqlite3_result_error_code(context, rc);
+    }
+    return 0;
+  }
+  return 1;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_index_export
+// Desc: Shared implementation of ndvss_index_export_f/_d. Writes the vector set of a 
+//       column and its PQ codes to an index file, building the codes if the set 
+//       doesn't have them yet.
+// Args: Table name TEXT ("table" or "schema.table"),
+//       Column name TEXT,
+//       Path of the file TEXT (relative to the database file)
+// Returns: Number of vectors written INTEGER
+//----------------------------------------------------------------------------------------
+static void ndvss_index_export( sqlite3_context* context,
+                                int argc,
+                                sqlite3_value** argv,
+                                int element_size ) 
+{
+  ndvss_vector_set* set = 0;
+  if( !ndvss_index_source(context, argc, argv, element_size, 
+                          "3 arguments needs to be given: table, column, file path.", &set) ) {
+    return;
+  }
+  sqlite3* db = sqlite3_context_db_handle(context);
+  char* path = ndvss_resolve_path(db, (const char*)sqlite3_value_text(argv[2]));
+  if( path == 0 ) {
+    ndvss_vector_set_unpin(set);
+    sqlite3_result_error_nomem(context);
+    return;
+  }
+  FILE* file = fopen(path, "wb");
+  if( file == 0 ) {
+    ndvss_vector_set_unpin(set);
+    char* message = sqlite3_mprintf("Can't open %s for writing.", path);
+    sqlite3_result_error(context, message ? message : "Can't open the file for writing.", -1);
+    sqlite3_free(message);
+    sqlite3_free(path);
+    return;
+  }
+  sqlite3_free(path);
+  ndvss_index_header header;
+  ndvss_index_layout(set, &header);
+  ndvss_index_writer writer = { file, 0, 0 };
+  int ok = ndvss_index_write(&writer, set, &header);
+  sqlite3_int64 count = set->count;
+  ndvss_vector_set_unpin(set);
+  if( fclose(file) != 0 ) {
+    ok = 0;
+  }
+  if( !ok ) {
+    sqlite3_result_error(context, "Writing the file failed.", -1);
+    return;
+  }
+  NDVSS_STAT_ADD(index_exports, 1);
+  sqlite3_result_int64(context, count);
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_index_export_d
+// Desc: Writes a column of double-arrays to an index file. See ndvss_index_export.
+//----------------------------------------------------------------------------------------
+static void ndvss_index_export_d( sqlite3_context* context,
+                                  int argc,
+                                  sqlite3_value** argv ) 
+{
+  ndvss_index_export(context, argc, argv, sizeof(double));
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_index_export_f
+// Desc: Writes a column of float-arrays to an index file. See ndvss_index_export.
+//----------------------------------------------------------------------------------------
+static void ndvss_index_export_f( sqlite3_context* context,
+                                  int argc,
+                                  sqlite3_value** argv ) 
+{
+  ndvss_index_export(context, argc, argv, sizeof(float));
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_index_section_valid
+// Desc: Checks that a section is aligned and inside the file.
+//----------------------------------------------------------------------------------------
+static int ndvss_index_section_valid( const ndvss_index_header* header, 
+                                      sqlite3_int64 offset, 
+                                      sqlite3_int64 bytes, 
+                                      int alignment )
+{
+  return offset >= (sqlite3_int64)sizeof(ndvss_index_header) && offset % alignment == 0 && 
+         bytes >= 0 && offset <= header->file_size && bytes <= header->file_size - offset;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_index_use_mapping
+// Desc: Makes a vector set whose arrays point into a mapped index. Only the header and 
+//       sub_first are read, to check that the index is whole. The set owns the mapping,
+//       and unmaps it on failure too.
+// Args: Mapping, its size, name of the set (its path), where the set is stored and
+//       where an error message is stored.
+// Returns: SQLITE_OK or an error code.
+//----------------------------------------------------------------------------------------
+static int ndvss_index_use_mapping( unsigned char* mapping, 
+                                    sqlite3_int64 bytes,
+                                    const char* name,
+                                    ndvss_vector_set** result, 
+                                    char** error_message )
+{
+  double start = ndvss_now();
+  const ndvss_index_header* header = (const ndvss_index_header*)mapping;
+  int valid = bytes >= NDVSS_IO_ALIGNMENT && memcmp(header->magic, NDVSS_INDEX_MAGIC, 8) == 0 && 
+              header->version == NDVSS_INDEX_VERSION && header->file_size <= bytes &&
+              (header->element_size == sizeof(float) || header->element_size == sizeof(double)) &&
+              header->dimensions >= 1 && header->dimensions <= 1000000 && header->stride % NDVSS_ALIGNMENT == 0 &&
+              header->stride >= header->dimensions * header->element_size && header->stride <= bytes &&
+              header->subquantizers >= 1 && header->subquantizers <= header->dimensions &&
+              header->count >= 0 && header->count <= bytes;
+  sqlite3_int64 pairs = (header->subquantizers + 1) / 2;
+  sqlite3_int64 block_count = (header->count + NDVSS_PQ_BLOCK_VECTORS - 1) / NDVSS_PQ_BLOCK_VECTORS;
+  valid = valid &&
+          ndvss_index_section_valid(header, header->sub_first_offset, sizeof(int) * (sqlite3_int64)(header->subquantizers + 1), 
+                                    sizeof(int)) &&
+          ndvss_index_section_valid(header, header->centroids_offset, 
+                                    sizeof(float) * NDVSS_PQ_CENTROIDS * (sqlite3_int64)header->dimensions, NDVSS_ALIGNMENT) &&
+          (header->rotation_offset == 0 ||
+           ndvss_index_section_valid(header, header->rotation_offset, 
+                                     sizeof(float) * (sqlite3_int64)header->dimensions * header->dimensions, NDVSS_ALIGNMENT)) &&
+          ndvss_index_section_valid(header, header->codes_offset, block_count * pairs * 32, NDVSS_ALIGNMENT) &&
+          ndvss_index_section_valid(header, header->rowids_offset, sizeof(sqlite3_int64) * header->count, NDVSS_ALIGNMENT) &&
+          ndvss_index_section_valid(header, header->vectors_offset, header->count * header->stride, NDVSS_ALIGNMENT);
+  if( valid ) {
+    // The sub-vector bounds index the centroids, so they have to be in order.
+    const int* sub_first = (const int*)(mapping + header->sub_first_offset);
+    unsigned int m;
+    valid = sub_first[0] == 0 && sub_first[header->subquantizers] == (int)header->dimensions;
+    for( m = 0; valid && m < header->subquantizers; ++m ) {
+      valid = sub_first[m] < sub_first[m + 1];
+    }
+  }
+  if( !valid ) {
+    ndvss_unmap_file(mapping, bytes);
+    *error_message = sqlite3_mprintf("Not an index file made with ndvss_index_export_f/_d.");
+    return SQLITE_ERROR;
+  }
+
+  ndvss_vector_set* set = (ndvss_vector_set*)sqlite3_malloc(sizeof(ndvss_vector_set));
+  if( set == 0 ) {
+    ndvss_unmap_file(mapping, bytes);
+    return SQLITE_NOMEM;
+  }
+  memset(set, 0, sizeof(ndvss_vector_set));
+  set->mapping = mapping;
+  set->mapping_bytes = bytes;
+  NDVSS_STAT_ADD(index_mapped_bytes, bytes);
+  set->db_name = sqlite3_mprintf("file");
+  set->table_name = sqlite3_mprintf("%s", name);
+  set->column_name = sqlite3_mprintf("");
+  set->element_size = (int)header->element_size;
+  set->dimensions = (int)header->dimensions;
+  set->vector_bytes = set->dimensions * set->element_size;
+  set->stride = (int)header->stride;
+  set->count = header->count;
+  set->rowids = (sqlite3_int64*)(mapping + header->rowids_offset);
+  int full_capacity = NDVSS_SEGMENT_BYTES / set->stride;
+  if( full_capacity < 1 ) {
+    full_capacity = 1;
+  }
+  set->segment_capacity = (int)((set->count + full_capacity - 1) / full_capacity);
+  set->segments = (ndvss_segment*)sqlite3_malloc64(sizeof(ndvss_segment) * (sqlite3_uint64)(set->segment_capacity + 1));
+  set->pq = (ndvss_pq*)sqlite3_malloc(sizeof(ndvss_pq));
+  if( set->db_name == 0 || set->table_name == 0 || set->column_name == 0 || set->segments == 0 || set->pq == 0 ) {
+    ndvss_vector_set_free(set);
+    return SQLITE_NOMEM;
+  }
+  sqlite3_int64 first;
+  for( first = 0; first < set->count; first += full_capacity ) {
+    ndvss_segment* segment = &set->segments[set->segment_count++];
+    memset(segment, 0, sizeof(ndvss_segment));
+    segment->vectors = mapping + header->vectors_offset + first * set->stride;
+    segment->first = first;
+    segment->count = set->count - first < full_capacity ? (int)(set->count - first) : full_capacity;
+    segment->capacity = segment->count;
+    segment->node = -1;
+    segment->arena_kind = NDVSS_ARENA_FILE;
+    segment->bytes = (size_t)segment->count * (size_t)set->stride;
+  }
+  ndvss_pq* pq = set->pq;
+  memset(pq, 0, sizeof(ndvss_pq));
+  pq->mapped = 1;
+  pq->dimensions = set->dimensions;
+  pq->subquantizers = (int)header->subquantizers;
+  pq->pairs = (int)pairs;
+  pq->sub_first = (int*)(mapping + header->sub_first_offset);
+  pq->centroids = (float*)(mapping + header->centroids_offset);
+  pq->count = set->count;
+  pq->block_count = block_count;
+  pq->codes = mapping + header->codes_offset;
+  pq->rotation = header->rotation_offset != 0 ? (float*)(mapping + header->rotation_offset) : 0;
+  NDVSS_STAT_ADD(index_attaches, 1);
+  NDVSS_STAT_ADD(index_attach_nanoseconds, (sqlite3_int64)((ndvss_now() - start) * 1e9));
+  *result = set;
+  return SQLITE_OK;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_index_map
+// Desc: Maps an index file and makes a vector set of it.
+// Returns: SQLITE_OK or an error code, with the message in error_message.
+//----------------------------------------------------------------------------------------
+static int ndvss_index_map( const char* path, ndvss_vector_set** result, char** error_message )
+{
+  sqlite3_int64 size = 0, mtime = 0;
+  sqlite3_int64 bytes = 0;
+  if( !ndvss_file_identity(path, &size, &mtime) ) {
+    *error_message = sqlite3_mprintf("Can't open %s.", path);
+    return SQLITE_CANTOPEN;
+  }
+  unsigned char* mapping = (unsigned char*)ndvss_map_file(path, &bytes);
+  if( mapping == 0 ) {
+    *error_message = sqlite3_mprintf("Can't map %s.", path);
+    return SQLITE_CANTOPEN;
+  }
+  int rc = ndvss_index_use_mapping(mapping, bytes, path, result, error_message);
+  if( rc == SQLITE_OK ) {
+    // For a file the identity of the file takes the place of the table snapshot.
+    (*result)->data_version = mtime;
+    (*result)->total_changes = size;
+  }
+  return rc;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_index_find
+// Desc: Finds an attached index file in the connection state. A file that has changed
+//       since it was mapped is dropped.
+// Args: Connection state, resolved path, whether to map the file if it isn't attached,
+//       where the set is stored (0 if not attached) and where an error message is stored.
+// Returns: SQLITE_OK or an error code.
+//----------------------------------------------------------------------------------------
+static int ndvss_index_find( ndvss_connection* connection, 
+                             const char* path, 
+                             int attach,
+                             ndvss_vector_set** result, 
+                             char** error_message )
+{
+  *result = 0;
+  ndvss_vector_set** link = &connection->index_files;
+  while( *link != 0 ) {
+    ndvss_vector_set* set = *link;
+    if( strcmp(set->table_name, path) == 0 ) {
+      sqlite3_int64 size = 0, mtime = 0;
+      if( ndvss_file_identity(path, &size, &mtime) && set->data_version == mtime && set->total_changes == size ) {
+        *result = set;
+        return SQLITE_OK;
+      }
+      *link = set->next;
+      ndvss_vector_set_free(set);
+      break;
+    }
+    link = &set->next;
+  }
+  if( !attach ) {
+    return SQLITE_OK;
+  }
+  int rc = ndvss_index_map(path, result, error_message);
+  if( rc == SQLITE_OK ) {
+    (*result)->next = connection->index_files;
+    connection->index_files = *result;
+  }
+  return rc;
+}
+
+
+static int ndvss_shm_get( ndvss_connection* connection, 
+                          const char* name, 
+                          ndvss_vector_set** result, 
+                          char** error_message );
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_index_attach
+// Desc: Maps an index file made with ndvss_index_export_f/_d, or a shared memory segment
+//       made with ndvss_shm_publish_f/_d, for the connection. An index that is already 
+//       attached is only checked.
+// Args: Path of the file TEXT (relative to the database file), or 'shm:<name>'
+// Returns: Number of vectors in the index INTEGER
+//----------------------------------------------------------------------------------------
+static void ndvss_index_attach( sqlite3_context* context,
+                                int argc,
+                                sqlite3_value** argv ) 
+{
+  if( argc < 1 || sqlite3_value_type(argv[0]) == SQLITE_NULL ) {
+    sqlite3_result_error(context, "The path of the index file needs to be given.", -1);
+    return;
+  }
+  ndvss_connection* connection = (ndvss_connection*)sqlite3_user_data(context);
+  const char* name = (const char*)sqlite3_value_text(argv[0]);
+  ndvss_vector_set* set = 0;
+  char* error_message = 0;
+  int rc;
+  if( sqlite3_strnicmp(name, "shm:", 4) == 0 ) {
+    rc = ndvss_shm_get(connection, name + 4, &set, &error_message);
+  } else {
+    char* path = ndvss_resolve_path(connection->db, name);
+    if( path == 0 ) {
+      sqlite3_result_error_nomem(context);
+      return;
+    }
+    rc = ndvss_index_find(connection, path, 1, &set, &error_message);
+    sqlite3_free(path);
+  }
+  if( rc != SQLITE_OK ) {
+    if( error_message != 0 ) {
+      sqlite3_result_error(context, error_message, -1);
+      sqlite3_free(error_message);
+    } else {
+      sqlite3_result_error_code(context, rc);
+    }
+    return;
+  }
+  sqlite3_result_int64(context, set->count);
+}
+
+
+//----------------------------------------------------------------------------------------
+// SHARED MEMORY.
+// For servers that fork worker processes, ndvss_shm_publish_f/_d writes the index of a 
+// column to a named POSIX shared memory segment, in the layout of an index file. The 
+// workers search it as 'shm:<name>': every process maps the same physical pages 
+// read-only, so there is one copy however many workers there are, and a worker can 
+// search as soon as it has made the mapping. A small control segment <name> holds the 
+// generation of the current data segment <name>.<generation>. Publishing again writes
+// the next generation and then switches the counter atomically; the old segment is 
+// unlinked at once but stays valid in the processes that have it mapped, and each 
+// connection moves to the new one on its next search.
+//----------------------------------------------------------------------------------------
+#define NDVSS_SHM_MAGIC    "NDVSSSHM"
+#define NDVSS_SHM_MAX_NAME 200
+
+typedef struct ndvss_shm_control {
+  char          magic[8];
+  sqlite3_int64 generation;        // Current data segment, 0 if none yet.
+} ndvss_shm_control;
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_shm_name_valid
+// Desc: Checks that a segment name is short and only has letters, digits, '_', '-' and
+//       '.', so that it can't point elsewhere.
+//----------------------------------------------------------------------------------------
+static int ndvss_shm_name_valid( const char* name )
+{
+  int i;
+  for( i = 0; name[i] != 0; ++i ) {
+    char c = name[i];
+    if( i >= NDVSS_SHM_MAX_NAME || 
+        !((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || 
+          c == '_' || c == '-' || (c == '.' && i > 0)) ) {
+      return 0;
+    }
+  }
+  return i > 0;
+}
+
+
+#ifndef _WIN32
+//----------------------------------------------------------------------------------------
+// Name: ndvss_shm_generation
+// Desc: Reads the current generation of a segment from its control segment.
+// Returns: SQLITE_OK, SQLITE_CANTOPEN if there is no such segment or SQLITE_ERROR.
+//----------------------------------------------------------------------------------------
+static int ndvss_shm_generation( const char* name, sqlite3_int64* generation )
+{
+  int fd = ndvss_shm_open(name, O_RDONLY, 0);
+  if( fd < 0 ) {
+    return SQLITE_CANTOPEN;
+  }
+  sqlite3_int64 bytes = 0;
+  ndvss_shm_control* control = (ndvss_shm_control*)ndvss_map_fd(fd, 0, &bytes);
+  close(fd);
+  if( control == 0 ) {
+    return SQLITE_ERROR;
+  }
+  int rc = bytes >= (sqlite3_int64)sizeof(ndvss_shm_control) && memcmp(control->magic, NDVSS_SHM_MAGIC, 8) == 0 
+           ? SQLITE_OK : SQLITE_ERROR;
+  *generation = __atomic_load_n(&control->generation, __ATOMIC_ACQUIRE);
+  ndvss_unmap_file(control, bytes);
+  return rc;
+}
+#endif
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_shm_publish
+// Desc: Shared implementation of ndvss_shm_publish_f/_d. Writes the vector set of a
+//       column and its PQ codes to the next generation of a shared memory segment, 
+//       and makes it the current one.
+// Args: Table name TEXT ("table" or "schema.table"),
+//       Column name TEXT,
+//       Name of the segment TEXT
+// Returns: Generation of the new data INTEGER
+//----------------------------------------------------------------------------------------
+static void ndvss_shm_publish( sqlite3_context* context,
+                               int argc,
+                               sqlite3_value** argv,
+                               int element_size ) 
+{
+#ifdef _WIN32
+  sqlite3_result_error(context, "Shared memory segments need POSIX shared memory.", -1);
+#else
+  ndvss_vector_set* set = 0;
+  if( !ndvss_index_source(context, argc, argv, element_size, 
+                          "3 arguments needs to be given: table, column, segment name.", &set) ) {
+    return;
+  }
+  const char* name = (const char*)sqlite3_value_text(argv[2]);
+  if( !ndvss_shm_name_valid(name) ) {
+    ndvss_vector_set_unpin(set);
+    sqlite3_result_error(context, "A segment name has letters, digits, '_', '-' and '.'.", -1);
+    return;
+  }
+  int fd = ndvss_shm_open(name, O_RDWR | O_CREAT, 0600);
+  sqlite3_int64 control_bytes = 0;
+  ndvss_shm_control* control = 0;
+  if( fd >= 0 ) {
+    struct stat st;
+    if( fstat(fd, &st) == 0 && st.st_size < (off_t)sizeof(ndvss_shm_control) ) {
+      // New, the memory is zeros.
+      if( ftruncate(fd, sizeof(ndvss_shm_control)) != 0 ) {
+        st.st_size = -1;
+      }
+    }
+    control = (ndvss_shm_control*)ndvss_map_fd(fd, 1, &control_bytes);
+    close(fd);
+  }
+  if( control == 0 ) {
+    ndvss_vector_set_unpin(set);
+    sqlite3_result_error(context, "Can't open the shared memory segment.", -1);
+    return;
+  }
+  static const char zeros[8];
+  if( memcmp(control->magic, zeros, 8) == 0 ) {
+    memcpy(control->magic, NDVSS_SHM_MAGIC, 8);
+  } else if( memcmp(control->magic, NDVSS_SHM_MAGIC, 8) != 0 ) {
+    ndvss_unmap_file(control, control_bytes);
+    ndvss_vector_set_unpin(set);
+    sqlite3_result_error(context, "The shared memory segment wasn't made by ndvss_shm_publish_f/_d.", -1);
+    return;
+  }
+  sqlite3_int64 generation = __atomic_load_n(&control->generation, __ATOMIC_ACQUIRE) + 1;
+  char data_name[NDVSS_SHM_MAX_NAME + 32];
+  snprintf(data_name, sizeof(data_name), "%s.%lld", name, generation);
+
+  ndvss_index_header header;
+  ndvss_index_layout(set, &header);
+  unsigned char* image = 0;
+  sqlite3_int64 image_bytes = 0;
+  fd = ndvss_shm_open(data_name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if( fd >= 0 ) {
+    if( ftruncate(fd, (off_t)header.file_size) == 0 ) {
+      image = (unsigned char*)ndvss_map_fd(fd, 1, &image_bytes);
+    }
+    close(fd);
+    if( image == 0 ) {
+      ndvss_shm_unlink(data_name);
+    }
+  }
+  if( image == 0 ) {
+    ndvss_unmap_file(control, control_bytes);
+    ndvss_vector_set_unpin(set);
+    sqlite3_result_error(context, fd < 0 ? "Can't create the shared memory segment, is another one being published?" 
+                                         : "Out of shared memory.", -1);
+    return;
+  }
+  ndvss_index_writer writer = { 0, image, 0 };
+  ndvss_index_write(&writer, set, &header);
+  ndvss_vector_set_unpin(set);
+  ndvss_unmap_file(image, image_bytes);
+  // The readers that see the new generation find the segment complete.
+  __atomic_store_n(&control->generation, generation, __ATOMIC_RELEASE);
+  ndvss_unmap_file(control, control_bytes);
+  if( generation > 1 ) {
+    snprintf(data_name, sizeof(data_name), "%s.%lld", name, generation - 1);
+    ndvss_shm_unlink(data_name);
+  }
+  NDVSS_STAT_ADD(shm_publishes, 1);
+  sqlite3_result_int64(context, generation);
+#endif
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_shm_publish_d
+// Desc: Publishes a column of double-arrays to shared memory. See ndvss_shm_publish.
+//----------------------------------------------------------------------------------------
+static void ndvss_shm_publish_d( sqlite3_context* context,
+                                 int argc,
+                                 sqlite3_value** argv ) 
+{
+  ndvss_shm_publish(context, argc, argv, sizeof(double));
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_shm_publish_f
+// Desc: Publishes a column of float-arrays to shared memory. See ndvss_shm_publish.
+//----------------------------------------------------------------------------------------
+static void ndvss_shm_publish_f( sqlite3_context* context,
+                                 int argc,
+                                 sqlite3_value** argv ) 
+{
+  ndvss_shm_publish(context, argc, argv, sizeof(float));
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_shm_get
+// Desc: Returns the mapping of the current generation of a shared memory segment in the
+//       connection state, mapping it if the connection doesn't have it yet.
+// Returns: SQLITE_OK or an error code, with the message in error_message.
+//----------------------------------------------------------------------------------------
+static int ndvss_shm_get( ndvss_connection* connection, 
+                          const char* name, 
+                          ndvss_vector_set** result, 
+                          char** error_message )
+{
+#ifdef _WIN32
+  *error_message = sqlite3_mprintf("Shared memory segments need POSIX shared memory.");
+  return SQLITE_ERROR;
+#else
+  if( !ndvss_shm_name_valid(name) ) {
+    *error_message = sqlite3_mprintf("A segment name has letters, digits, '_', '-' and '.'.");
+    return SQLITE_ERROR;
+  }
+  char key[NDVSS_SHM_MAX_NAME + 8];
+  snprintf(key, sizeof(key), "shm:%s", name);
+  int attempt;
+  for( attempt = 0; attempt < 8; ++attempt ) {
+    sqlite3_int64 generation = 0;
+    int rc = ndvss_shm_generation(name, &generation);
+    if( rc != SQLITE_OK || generation < 1 ) {
+      *error_message = sqlite3_mprintf(rc == SQLITE_ERROR ? "The shared memory segment %s is damaged." 
+                                                          : "No shared memory segment %s.", name);
+      return rc == SQLITE_ERROR ? SQLITE_ERROR : SQLITE_CANTOPEN;
+    }
+    ndvss_vector_set** link = &connection->index_files;
+    while( *link != 0 ) {
+      ndvss_vector_set* set = *link;
+      if( strcmp(set->table_name, key) == 0 ) {
+        if( set->data_version == generation ) {
+          *result = set;
+          return SQLITE_OK;
+        }
+        *link = set->next;
+        ndvss_vector_set_free(set);
+        break;
+      }
+      link = &set->next;
+    }
+    char data_name[NDVSS_SHM_MAX_NAME + 32];
+    snprintf(data_name, sizeof(data_name), "%s.%lld", name, generation);
+    int fd = ndvss_shm_open(data_name, O_RDONLY, 0);
+    if( fd < 0 ) {
+      // Replaced by a newer generation after the counter was read.
+      continue;
+    }
+    sqlite3_int64 bytes = 0;
+    unsigned char* mapping = (unsigned char*)ndvss_map_fd(fd, 0, &bytes);
+    close(fd);
+    if( mapping == 0 ) {
+      *error_message = sqlite3_mprintf("Can't map the shared memory segment %s.", name);
+      return SQLITE_CANTOPEN;
+    }
+    rc = ndvss_index_use_mapping(mapping, bytes, key, result, error_message);
+    if( rc == SQLITE_OK ) {
+      (*result)->data_version = generation;
+      (*result)->next = connection->index_files;
+      connection->index_files = *result;
+    }
+    return rc;
+  }
+  *error_message = sqlite3_mprintf("The shared memory segment %s keeps changing.", name);
+  return SQLITE_BUSY;
+#endif
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_shm_remove
+// Desc: Removes a shared memory segment and its current data. The processes that have 
+//       it mapped can still use it until they let it go.
+// Args: Name of the segment TEXT
+// Returns: 1 if the segment existed, 0 if not INTEGER
+//----------------------------------------------------------------------------------------
+static void ndvss_shm_remove( sqlite3_context* context,
+                              int argc,
+                              sqlite3_value** argv ) 
+{
+  if( argc < 1 || sqlite3_value_type(argv[0]) == SQLITE_NULL ) {
+    sqlite3_result_error(context, "The name of the segment needs to be given.", -1);
+    return;
+  }
+  const char* name = (const char*)sqlite3_value_text(argv[0]);
+  if( !ndvss_shm_name_valid(name) ) {
+    sqlite3_result_error(context, "A segment name has letters, digits, '_', '-' and '.'.", -1);
+    return;
+  }
+#ifdef _WIN32
+  sqlite3_result_error(context, "Shared memory segments need POSIX shared memory.", -1);
+#else
+  sqlite3_int64 generation = 0;
+  if( ndvss_shm_generation(name, &generation) == SQLITE_CANTOPEN ) {
+    sqlite3_result_int(context, 0);
+    return;
+  }
+  if( generation > 0 ) {
+    char data_name[NDVSS_SHM_MAX_NAME + 32];
+    snprintf(data_name, sizeof(data_name), "%s.%lld", name, generation);
+    ndvss_shm_unlink(data_name);
+  }
+  sqlite3_result_int(context, ndvss_shm_unlink(name) == 0);
+#endif
+}
+
+
+//----------------------------------------------------------------------------------------
+// LIVE INDEX TABLES.
+// An ndvss_index virtual table keeps its vectors in memory while rows are inserted,
+// updated and deleted, so that the searches don't reload the column after every write:
+//   CREATE VIRTUAL TABLE docs USING ndvss_index(dimensions=384, type=float);
+//   SELECT id, similarity FROM ndvss_knn_f(searched, 'docs', 'vector', 10);
+// The rows are stored in the shadow table <name>_vectors, and <name>_info holds a
+// generation that every write transaction increments. The memory copy is a vector set
+// shared by the connections of the process, with the generation it holds.
+// The searches never lock: a search reads the current snapshot of the set and scans
+// it. The one writer (SQLite lets one transaction commit at a time, and the commits of
+// the process are serialized with the writer mutex) applies a committed transaction to
+// a copy of the snapshot's segment table: new vectors go after the end of the last
+// segment, past what the published snapshots see, and a delete copies the deleted
+// bitmap of its segment. The new snapshot is then published with one atomic store.
+// The memory the old snapshots used is retired with the current epoch and freed when
+// no search that started before it is still running (epoch-based reclamation).
+// A search falls back to the table when the memory doesn't match what the connection
+// sees: in a transaction that has written to the table, in a read transaction that
+// started before the last commit, or after another process has written to it.
+// The 'pq' method searches the snapshot like an LSM tree: the vectors that have PQ 
+// codes are the main index and the ones appended after the codes were built are the 
+// delta, which is scanned exactly. A commit only appends to the delta. A merge encodes
+// the delta with the codebooks of the main index (or retrains them when the table has
+// doubled since) and publishes a snapshot with the new codes. ndvss_index_merge() 
+// merges at once, and a background thread merges when the delta of a table searched
+// with 'pq' reaches merge_threshold vectors.
+//----------------------------------------------------------------------------------------
+#define NDVSS_EPOCH_SLOTS         256
+#define NDVSS_LIVE_MAX_DIMENSIONS 65536
+#define NDVSS_LIVE_COMPACT_MIN    1024   // Deleted vectors before compaction is considered.
+
+// A running search announces the epoch it started in. 0 = free slot.
+typedef struct ndvss_epoch_slot {
+  sqlite3_uint64 epoch;
+  char           padding[64 - sizeof(sqlite3_uint64)];
+} ndvss_epoch_slot;
+
+static ndvss_epoch_slot ndvss_epoch_slots[NDVSS_EPOCH_SLOTS];
+static sqlite3_uint64   ndvss_epoch = 1;
+static unsigned         ndvss_epoch_next_slot = 0;
+
+enum {
+  NDVSS_RETIRED_MEMORY = 0,      // sqlite3_malloc'ed block.
+  NDVSS_RETIRED_SNAPSHOT,        // Snapshot header and segment table, the rest lives on.
+  NDVSS_RETIRED_SET,             // Vector set with everything it points to.
+  NDVSS_RETIRED_PQ               // PQ codes replaced by a merge.
+};
+
+typedef struct ndvss_retired ndvss_retired;
+struct ndvss_retired {
+  void*          pointer;
+  int            kind;
+  sqlite3_uint64 epoch;          // Free once no search is in this epoch or an older one.
+  ndvss_retired* next;
+};
+
+typedef struct ndvss_live_entry {
+  sqlite3_int64 rowid;
+  sqlite3_int64 position;        // -1 = empty, -2 = removed.
+} ndvss_live_entry;
+
+typedef struct ndvss_live_change {
+  sqlite3_int64 rowid;
+  void*         vector;          // 0 for a delete.
+} ndvss_live_change;
+
+typedef struct ndvss_live_index ndvss_live_index;
+struct ndvss_live_index {
+  char*             key;             // Database file, or the connection of an in-memory one.
+  char*             table_name;
+  int               element_size;
+  int               vector_bytes;
+  int               ref_count;       // Tables connected to the index, protected by the global lock.
+  int               registered;
+  ndvss_live_index* next;
+  ndvss_vector_set* current;         // Published snapshot, data_version is its generation.
+  sqlite3_int64     committing;      // Generation being committed, 0 if none.
+  ndvss_mutex       writer;
+  // Owned by the writer.
+  ndvss_live_entry* entries;         // Rowid -> position, open addressing.
+  sqlite3_int64     entry_capacity;  // A power of 2.
+  sqlite3_int64     entry_used;      // Including the removed ones.
+  sqlite3_int64     deleted;         // Deleted vectors in the current snapshot.
+  sqlite3_int64     trained_count;   // Vectors the codebooks of the current codes were trained on.
+  ndvss_retired*    retired;
+  int               uses_codes;      // Searched with 'pq' or merged, so merges are worth it.
+  int               merging;         // A background merge is running.
+  int               merger_started;  // merger must be joined.
+  ndvss_thread      merger;
+};
+
+struct ndvss_live_table {
+  sqlite3_vtab       base;
+  ndvss_connection*  connection;
+  char*              db_name;
+  char*              name;
+  ndvss_live_index*  index;
+  sqlite3_stmt*      generation_stmt;
+  ndvss_live_change* changes;        // Uncommitted changes of this connection.
+  int                change_count;
+  int                change_capacity;
+  int*               savepoints;     // change_count when each savepoint started.
+  int                savepoint_count;
+  sqlite3_int64      commit_generation;
+  int                holds_writer;   // Between xSync and xCommit/xRollback.
+  ndvss_live_table*  next;
+};
+
+typedef struct ndvss_live_cursor {
+  sqlite3_vtab_cursor base;
+  sqlite3_stmt*       stmt;
+  int                 eof;
+} ndvss_live_cursor;
+
+// Published live indexes, protected by the global lock.
+static ndvss_live_index* ndvss_live_indexes = 0;
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_epoch_enter / ndvss_epoch_leave
+// Desc: Marks the start and the end of a search. Taking a slot doesn't wait unless
+//       NDVSS_EPOCH_SLOTS searches are running at the same time.
+// Returns: The slot to give to ndvss_epoch_leave.
+//----------------------------------------------------------------------------------------
+static int ndvss_epoch_enter( void )
+{
+  unsigned start = __atomic_fetch_add(&ndvss_epoch_next_slot, 1, __ATOMIC_RELAXED);
+  for( ;; ) {
+    int i;
+    for( i = 0; i < NDVSS_EPOCH_SLOTS; ++i ) {
+      int slot = (int)((start + (unsigned)i) % NDVSS_EPOCH_SLOTS);
+      sqlite3_uint64 expected = 0;
+      if( __atomic_load_n(&ndvss_epoch_slots[slot].epoch, __ATOMIC_RELAXED) == 0 &&
+          __atomic_compare_exchange_n(&ndvss_epoch_slots[slot].epoch, &expected,
+                                      __atomic_load_n(&ndvss_epoch, __ATOMIC_SEQ_CST),
+                                      0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED) ) {
+        return slot;
+      }
+    }
+    ndvss_thread_yield();
+  }
+}
+
+static void ndvss_epoch_leave( int slot )
+{
+  __atomic_store_n(&ndvss_epoch_slots[slot].epoch, 0, __ATOMIC_RELEASE);
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_live_retire
+// Desc: Queues memory that the current snapshot uses to be freed after the next
+//       snapshot is published. If the queue can't grow, the memory is leaked, which is
+//       safer than freeing it under a search.
+//----------------------------------------------------------------------------------------
+static void ndvss_live_retire( ndvss_live_index* index, int kind, void* pointer )
+{
+  if( pointer == 0 ) {
+    return;
+  }
+  ndvss_retired* retired = (ndvss_retired*)sqlite3_malloc(sizeof(ndvss_retired));
+  if( retired == 0 ) {
+    return;
+  }
+  retired->pointer = pointer;
+  retired->kind = kind;
+  retired->epoch = 0;
+  retired->next = index->retired;
+  index->retired = retired;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_live_reclaim
+// Desc: Frees the retired memory that no running search can still see. With all set,
+//       frees everything, for when no search can be running.
+//----------------------------------------------------------------------------------------
+static void ndvss_live_reclaim( ndvss_live_index* index, int all )
+{
+  sqlite3_uint64 oldest = ~(sqlite3_uint64)0;
+  int i;
+  for( i = 0; i < NDVSS_EPOCH_SLOTS && !all; ++i ) {
+    sqlite3_uint64 epoch = __atomic_load_n(&ndvss_epoch_slots[i].epoch, __ATOMIC_SEQ_CST);
+    if( epoch != 0 && epoch < oldest ) {
+      oldest = epoch;
+    }
+  }
+  ndvss_retired** link = &index->retired;
+  while( *link != 0 ) {
+    ndvss_retired* retired = *link;
+    if( !all && (retired->epoch == 0 || retired->epoch >= oldest) ) {
+      link = &retired->next;
+      continue;
+    }
+    *link = retired->next;
+    if( retired->kind == NDVSS_RETIRED_SET ) {
+      ndvss_vector_set_free((ndvss_vector_set*)retired->pointer);
+    } else if( retired->kind == NDVSS_RETIRED_PQ ) {
+      ndvss_pq_free((ndvss_pq*)retired->pointer);
+    } else if( retired->kind == NDVSS_RETIRED_SNAPSHOT ) {
+      sqlite3_free(((ndvss_vector_set*)retired->pointer)->segments);
+      sqlite3_free(retired->pointer);
+    } else {
+      sqlite3_free(retired->pointer);
+    }
+    sqlite3_free(retired);
+  }
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_live_publish
+// Desc: Makes a snapshot the current one, retires the previous one (only its header
+//       and segment table if the new one shares the rest) and the memory queued with
+//       ndvss_live_retire, and frees what can be freed.
+//----------------------------------------------------------------------------------------
+static void ndvss_live_publish( ndvss_live_index* index, ndvss_vector_set* set, int shares_old )
+{
+  ndvss_vector_set* old = index->current;
+  __atomic_store_n(&index->current, set, __ATOMIC_SEQ_CST);
+  ndvss_live_retire(index, shares_old ? NDVSS_RETIRED_SNAPSHOT : NDVSS_RETIRED_SET, old);
+  // A search that announces a later epoch loaded the new snapshot.
+  sqlite3_uint64 epoch = __atomic_fetch_add(&ndvss_epoch, 1, __ATOMIC_SEQ_CST);
+  ndvss_retired* retired;
+  for( retired = index->retired; retired != 0 && retired->epoch == 0; retired = retired->next ) {
+    retired->epoch = epoch;
+  }
+  ndvss_live_reclaim(index, 0);
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_live_slot
+// Desc: Finds the entry of a rowid in the rowid map, or the empty entry where it goes.
+//----------------------------------------------------------------------------------------
+static ndvss_live_entry* ndvss_live_slot( ndvss_live_entry* entries, sqlite3_int64 capacity, sqlite3_int64 rowid )
+{
+  sqlite3_uint64 mask = (sqlite3_uint64)capacity - 1;
+  sqlite3_uint64 i = ((sqlite3_uint64)rowid * 0x9E3779B97F4A7C15ULL) >> 17;
+  ndvss_live_entry* removed = 0;
+  for( ;; i = i + 1 ) {
+    ndvss_live_entry* entry = &entries[i & mask];
+    if( entry->position == -1 ) {
+      return removed != 0 ? removed : entry;
+    }
+    if( entry->position == -2 ) {
+      if( removed == 0 ) {
+        removed = entry;
+      }
+    } else if( entry->rowid == rowid ) {
+      return entry;
+    }
+  }
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_live_map_reserve
+// Desc: Makes room for one more rowid in the map, rebuilding it without the removed
+//       entries when it's too full.
+// Returns: SQLITE_OK or SQLITE_NOMEM.
+//----------------------------------------------------------------------------------------
+static int ndvss_live_map_reserve( ndvss_live_index* index, sqlite3_int64 count )
+{
+  if( (index->entry_used + 1) * 4 <= index->entry_capacity * 3 ) {
+    return SQLITE_OK;
+  }
+  sqlite3_int64 capacity = 1024;
+  while( capacity < (count + 1) * 2 ) {
+    capacity *= 2;
+  }
+  ndvss_live_entry* entries = (ndvss_live_entry*)sqlite3_malloc64(sizeof(ndvss_live_entry) * (sqlite3_uint64)capacity);
+  if( entries == 0 ) {
+    return SQLITE_NOMEM;
+  }
+  sqlite3_int64 i;
+  for( i = 0; i < capacity; ++i ) {
+    entries[i].position = -1;
+  }
+  sqlite3_int64 used = 0;
+  for( i = 0; i < index->entry_capacity; ++i ) {
+    if( index->entries[i].position >= 0 ) {
+      *ndvss_live_slot(entries, capacity, index->entries[i].rowid) = index->entries[i];
+      ++used;
+    }
+  }
+  sqlite3_free(index->entries);
+  index->entries = entries;
+  index->entry_capacity = capacity;
+  index->entry_used = used;
+  return SQLITE_OK;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_live_map_build
+// Desc: Rebuilds the rowid map from the vectors of a set that aren't deleted.
+// Returns: SQLITE_OK or SQLITE_NOMEM.
+//----------------------------------------------------------------------------------------
+static int ndvss_live_map_build( ndvss_live_index* index, const ndvss_vector_set* set )
+{
+  sqlite3_free(index->entries);
+  index->entries = 0;
+  index->entry_capacity = 0;
+  index->entry_used = 0;
+  int rc = ndvss_live_map_reserve(index, set->count);
+  int s, i;
+  for( s = 0; s < set->segment_count && rc == SQLITE_OK; ++s ) {
+    const ndvss_segment* segment = &set->segments[s];
+    for( i = 0; i < segment->count; ++i ) {
+      if( segment->deleted == 0 || !(segment->deleted[i >> 3] & (1 << (i & 7))) ) {
+        ndvss_live_entry* entry = ndvss_live_slot(index->entries, index->entry_capacity, set->rowids[segment->first + i]);
+        entry->rowid = set->rowids[segment->first + i];
+        entry->position = segment->first + i;
+        ++index->entry_used;
+      }
+    }
+  }
+  return rc;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_live_delete
+// Desc: Marks a vector of a new snapshot deleted. The bitmap of its segment is copied
+//       if the published snapshot uses it.
+// Returns: SQLITE_OK or SQLITE_NOMEM.
+//----------------------------------------------------------------------------------------
+static int ndvss_live_delete( ndvss_live_index* index,
+                              const ndvss_vector_set* old,
+                              ndvss_vector_set* set,
+                              sqlite3_int64 position )
+{
+  int low = ndvss_vector_set_segment(set, position);
+  ndvss_segment* segment = &set->segments[low];
+  int shared = old != 0 && low < old->segment_count && segment->deleted == old->segments[low].deleted;
+  if( segment->deleted == 0 || shared ) {
+    size_t bytes = (size_t)(segment->capacity + 7) / 8;
+    unsigned char* deleted = (unsigned char*)sqlite3_malloc64(bytes);
+    if( deleted == 0 ) {
+      return SQLITE_NOMEM;
+    }
+    if( segment->deleted != 0 ) {
+      memcpy(deleted, segment->deleted, bytes);
+      ndvss_live_retire(index, NDVSS_RETIRED_MEMORY, segment->deleted);
+    } else {
+      memset(deleted, 0, bytes);
+    }
+    segment->deleted = deleted;
+  }
+  int i = (int)(position - segment->first);
+  segment->deleted[i >> 3] |= (unsigned char)(1 << (i & 7));
+  ++index->deleted;
+  return SQLITE_OK;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_live_compact
+// Desc: Copies the vectors of a set that aren't deleted to a new set.
+// Returns: SQLITE_OK or SQLITE_NOMEM.
+//----------------------------------------------------------------------------------------
+static int ndvss_live_compact( const ndvss_vector_set* set, ndvss_vector_set** result )
+{
+  ndvss_vector_set* compact = (ndvss_vector_set*)sqlite3_malloc(sizeof(ndvss_vector_set));
+  if( compact == 0 ) {
+    return SQLITE_NOMEM;
+  }
+  memset(compact, 0, sizeof(ndvss_vector_set));
+  compact->element_size = set->element_size;
+  compact->dimensions = set->dimensions;
+  compact->vector_bytes = set->vector_bytes;
+  compact->stride = set->stride;
+  compact->db_name = sqlite3_mprintf("%s", set->db_name);
+  compact->table_name = sqlite3_mprintf("%s", set->table_name);
+  compact->column_name = sqlite3_mprintf("%s", set->column_name);
+  int rc = compact->db_name != 0 && compact->table_name != 0 && compact->column_name != 0 ? SQLITE_OK : SQLITE_NOMEM;
+  int s, i;
+  for( s = 0; s < set->segment_count && rc == SQLITE_OK; ++s ) {
+    const ndvss_segment* segment = &set->segments[s];
+    for( i = 0; i < segment->count && rc == SQLITE_OK; ++i ) {
+      if( segment->deleted == 0 || !(segment->deleted[i >> 3] & (1 << (i & 7))) ) {
+        rc = ndvss_vector_set_append(compact, set->rowids[segment->first + i],
+                                     segment->vectors + (size_t)set->stride * (size_t)i);
+      }
+    }
+  }
+  if( rc != SQLITE_OK ) {
+    ndvss_vector_set_free(compact);
+    return rc;
+  }
+  *result = compact;
+  return SQLITE_OK;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_live_merge
+// Desc: Gives the vectors of the current snapshot that have no PQ codes yet codes and
+//       publishes the snapshot with them. The codebooks are retrained if asked to, if
+//       there are none yet or if the table has doubled since they were trained.
+//       Called by the writer.
+// Args: Index, OPQ rotation for retraining (taken over, 0 = the one of the current
+//       codes), its sub-quantizers, 1 to retrain, where the number of vectors that 
+//       were merged is stored.
+// Returns: SQLITE_OK, SQLITE_NOMEM or SQLITE_INTERRUPT.
+//----------------------------------------------------------------------------------------
+static int ndvss_live_merge( ndvss_live_index* index, 
+                             float* rotation, 
+                             int rotation_subquantizers, 
+                             int retrain,
+                             sqlite3_int64* merged )
+{
+  ndvss_vector_set* old = index->current;
+  *merged = 0;
+  if( old == 0 || (!retrain && old->pq != 0 && old->pq->count == old->count) ) {
+    sqlite3_free(rotation);
+    return SQLITE_OK;
+  }
+  sqlite3_int64 live_count = old->count - index->deleted;
+  int train = retrain || old->pq == 0 || live_count > index->trained_count * 2;
+  if( !train ) {
+    sqlite3_free(rotation);
+    rotation = 0;
+  } else if( rotation == 0 && old->pq != 0 && old->pq->rotation != 0 ) {
+    size_t bytes = sizeof(float) * (size_t)old->dimensions * (size_t)old->dimensions;
+    rotation = (float*)sqlite3_malloc64(bytes);
+    if( rotation == 0 ) {
+      return SQLITE_NOMEM;
+    }
+    memcpy(rotation, old->pq->rotation, bytes);
+    rotation_subquantizers = old->pq->subquantizers;
+  }
+  ndvss_vector_set* set = (ndvss_vector_set*)sqlite3_malloc(sizeof(ndvss_vector_set));
+  ndvss_segment* segments = (ndvss_segment*)sqlite3_malloc64(sizeof(ndvss_segment) * (sqlite3_uint64)(old->segment_capacity > 0 ? old->segment_capacity : 1));
+  ndvss_pq* pq = 0;
+  int rc = set == 0 || segments == 0 ? SQLITE_NOMEM : SQLITE_OK;
+  if( rc != SQLITE_OK ) {
+    sqlite3_free(rotation);
+  } else if( train ) {
+    rc = ndvss_pq_train(old, rotation, rotation_subquantizers, &pq);
+  } else {
+    rc = ndvss_pq_extend(old->pq, old, &pq);
+  }
+  if( rc != SQLITE_OK ) {
+    sqlite3_free(set);
+    sqlite3_free(segments);
+    return rc;
+  }
+  *merged = old->count - (old->pq != 0 ? old->pq->count : 0);
+  if( train ) {
+    index->trained_count = live_count;
+  }
+  // The same vectors with the new codes.
+  *set = *old;
+  memcpy(segments, old->segments, sizeof(ndvss_segment) * (size_t)old->segment_count);
+  set->segments = segments;
+  set->pq = pq;
+  ndvss_live_retire(index, NDVSS_RETIRED_PQ, old->pq);
+  ndvss_live_publish(index, set, 1);
+  NDVSS_STAT_ADD(live_merges, 1);
+  NDVSS_STAT_ADD(live_merged_vectors, *merged);
+  return SQLITE_OK;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_live_merge_run
+// Desc: Thread function of a background merge.
+//----------------------------------------------------------------------------------------
+static NDVSS_THREAD_PROC ndvss_live_merge_run( void* arg )
+{
+  ndvss_live_index* index = (ndvss_live_index*)arg;
+  sqlite3_int64 merged;
+  ndvss_mutex_lock(&index->writer);
+  ndvss_live_merge(index, 0, 0, 0, &merged);
+  __atomic_store_n(&index->merging, 0, __ATOMIC_RELEASE);
+  ndvss_mutex_unlock(&index->writer);
+  return 0;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_live_merge_start
+// Desc: Starts a background merge if the delta of the current snapshot has reached 
+//       merge_threshold and no merge is running. Called by the writer.
+//----------------------------------------------------------------------------------------
+static void ndvss_live_merge_start( ndvss_live_index* index )
+{
+  sqlite3_int64 threshold = (sqlite3_int64)NDVSS_CONFIG(NDVSS_CONFIG_MERGE_THRESHOLD);
+  const ndvss_vector_set* set = index->current;
+  if( threshold == 0 || set == 0 || !__atomic_load_n(&index->uses_codes, __ATOMIC_RELAXED) || 
+      __atomic_load_n(&index->merging, __ATOMIC_RELAXED) ||
+      set->count - (set->pq != 0 ? set->pq->count : 0) < threshold ) {
+    return;
+  }
+  if( index->merger_started ) {
+    ndvss_thread_join(index->merger);
+    index->merger_started = 0;
+  }
+  __atomic_store_n(&index->merging, 1, __ATOMIC_RELAXED);
+  if( ndvss_thread_start(&index->merger, ndvss_live_merge_run, index) == SQLITE_OK ) {
+    index->merger_started = 1;
+  } else {
+    __atomic_store_n(&index->merging, 0, __ATOMIC_RELAXED);
+  }
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_live_apply
+// Desc: Applies the changes of a committed transaction to a new snapshot and publishes
+//       it. Called by the writer. If memory runs out half way, what was applied is
+//       published with an invalid generation so that the next search reloads the table.
+//----------------------------------------------------------------------------------------
+static void ndvss_live_apply( ndvss_live_index* index,
+                              const ndvss_live_change* changes,
+                              int change_count,
+                              sqlite3_int64 generation )
+{
+  ndvss_vector_set* old = index->current;
+  ndvss_vector_set* set = (ndvss_vector_set*)sqlite3_malloc(sizeof(ndvss_vector_set));
+  ndvss_segment* segments = (ndvss_segment*)sqlite3_malloc64(sizeof(ndvss_segment) * (sqlite3_uint64)(old->segment_capacity > 0 ? old->segment_capacity : 1));
+  if( set == 0 || segments == 0 ) {
+    sqlite3_free(set);
+    sqlite3_free(segments);
+    __atomic_store_n(&old->data_version, -1, __ATOMIC_RELAXED);
+    return;
+  }
+  // The new snapshot takes over everything but the segment table.
+  *set = *old;
+  memcpy(segments, old->segments, sizeof(ndvss_segment) * (size_t)old->segment_count);
+  set->segments = segments;
+  int rc = SQLITE_OK;
+  int i;
+  for( i = 0; i < change_count && rc == SQLITE_OK; ++i ) {
+    ndvss_live_entry* entry = ndvss_live_slot(index->entries, index->entry_capacity, changes[i].rowid);
+    if( entry->position >= 0 ) {
+      rc = ndvss_live_delete(index, old, set, entry->position);
+      if( rc != SQLITE_OK ) {
+        break;
+      }
+      entry->position = -2;
+    }
+    if( changes[i].vector == 0 ) {
+      continue;
+    }
+    rc = ndvss_live_map_reserve(index, set->count - index->deleted);
+    if( rc == SQLITE_OK && set->count == set->rowid_capacity ) {
+      // The published snapshot reads the old array, so it isn't reallocated in place.
+      sqlite3_int64 capacity = set->rowid_capacity < 1024 ? 1024 : set->rowid_capacity * 2;
+      sqlite3_int64* rowids = (sqlite3_int64*)sqlite3_malloc64(sizeof(sqlite3_int64) * (sqlite3_uint64)capacity);
+      if( rowids == 0 ) {
+        rc = SQLITE_NOMEM;
+        break;
+      }
+      if( set->count > 0 ) {
+        memcpy(rowids, set->rowids, sizeof(sqlite3_int64) * (size_t)set->count);
+      }
+      if( set->rowids == old->rowids ) {
+        ndvss_live_retire(index, NDVSS_RETIRED_MEMORY, set->rowids);
+      } else {
+        sqlite3_free(set->rowids);
+      }
+      set->rowids = rowids;
+      set->rowid_capacity = capacity;
+    }
+    if( rc == SQLITE_OK ) {
+      rc = ndvss_vector_set_append(set, changes[i].rowid, changes[i].vector);
+    }
+    if( rc == SQLITE_OK ) {
+      entry = ndvss_live_slot(index->entries, index->entry_capacity, changes[i].rowid);
+      if( entry->position == -1 ) {
+        ++index->entry_used;
+      }
+      entry->rowid = changes[i].rowid;
+      entry->position = set->count - 1;
+    }
+  }//endfor changes
+  set->data_version = rc == SQLITE_OK ? generation : -1;
+  if( rc == SQLITE_OK && index->deleted >= NDVSS_LIVE_COMPACT_MIN && index->deleted * 2 > set->count ) {
+    ndvss_vector_set* compact = 0;
+    if( ndvss_live_compact(set, &compact) == SQLITE_OK && ndvss_live_map_build(index, compact) == SQLITE_OK ) {
+      // The old snapshot's vectors go with the set they were compacted from.
+      compact->data_version = generation;
+      ndvss_live_retire(index, NDVSS_RETIRED_SET, set);
+      set = compact;
+      index->deleted = 0;
+      NDVSS_STAT_ADD(live_compactions, 1);
+    } else if( compact != 0 ) {
+      ndvss_vector_set_free(compact);
+      set->data_version = -1;
+    }
+  }
+  ndvss_live_publish(index, set, 1);
+  NDVSS_STAT_ADD(live_commits, 1);
+  ndvss_live_merge_start(index);
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_live_generation
+// Desc: Reads the generation of the table as this connection sees it.
+// Returns: SQLITE_OK or an error code.
+//----------------------------------------------------------------------------------------
+static int ndvss_live_generation( ndvss_live_table* table, sqlite3_int64* generation )
+{
+  sqlite3* db = table->connection->db;
+  if( table->generation_stmt == 0 ) {
+    char* sql = sqlite3_mprintf("SELECT generation FROM \"%w\".\"%w_info\"", table->db_name, table->name);
+    if( sql == 0 ) {
+      return SQLITE_NOMEM;
+    }
+    int rc = sqlite3_prepare_v3(db, sql, -1, SQLITE_PREPARE_PERSISTENT, &table->generation_stmt, 0);
+    sqlite3_free(sql);
+    if( rc != SQLITE_OK ) {
+      return rc;
+    }
+  }
+  *generation = 0;
+  if( sqlite3_step(table->generation_stmt) == SQLITE_ROW ) {
+    *generation = sqlite3_column_int64(table->generation_stmt, 0);
+  }
+  return sqlite3_reset(table->generation_stmt);
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_live_reload
+// Desc: Loads the memory copy of a table from its shadow table, unless the writer is
+//       busy, in which case the search reads the table itself.
+// Returns: SQLITE_OK, SQLITE_BUSY or an error code.
+//----------------------------------------------------------------------------------------
+static int ndvss_live_reload( ndvss_live_table* table, sqlite3_int64 generation, char** error_message )
+{
+  ndvss_live_index* index = table->index;
+  if( !ndvss_mutex_trylock(&index->writer) ) {
+    return SQLITE_BUSY;
+  }
+  int rc = SQLITE_OK;
+  if( index->current == 0 || index->current->data_version < generation ) {
+    char* shadow_name = sqlite3_mprintf("%s_vectors", table->name);
+    ndvss_vector_set* set = 0;
+    rc = shadow_name == 0 ? SQLITE_NOMEM
+                          : ndvss_vector_set_load(table->connection->db, table->db_name, shadow_name, "vector",
+                                                  index->element_size, index->vector_bytes, &set, error_message);
+    sqlite3_free(shadow_name);
+    if( rc == SQLITE_OK ) {
+      rc = ndvss_live_map_build(index, set);
+    }
+    if( rc == SQLITE_OK ) {
+      set->data_version = generation;
+      index->deleted = 0;
+      index->trained_count = 0;
+      ndvss_live_publish(index, set, 0);
+      NDVSS_STAT_ADD(live_reloads, 1);
+      ndvss_live_merge_start(index);
+    } else {
+      ndvss_vector_set_free(set);
+    }
+  }
+  ndvss_mutex_unlock(&index->writer);
+  return rc;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_live_table_find
+// Desc: Returns the connected ndvss_index table of the given name, connecting it first
+//       if the connection hasn't used it yet. A table that the vector cache already
+//       holds is a normal table and isn't looked up again.
+//----------------------------------------------------------------------------------------
+static ndvss_live_table* ndvss_live_table_find( ndvss_connection* connection,
+                                                const char* db_name,
+                                                const char* table_name )
+{
+  int probe;
+  for( probe = 0; probe < 2; ++probe ) {
+    ndvss_live_table* table;
+    for( table = connection->live_tables; table != 0; table = table->next ) {
+      if( sqlite3_stricmp(table->db_name, db_name) == 0 && sqlite3_stricmp(table->name, table_name) == 0 ) {
+        return table;
+      }
+    }
+    ndvss_set_ref* ref;
+    for( ref = connection->vector_sets; ref != 0; ref = ref->next ) {
+      if( sqlite3_stricmp(ref->db_name, db_name) == 0 && sqlite3_stricmp(ref->set->table_name, table_name) == 0 ) {
+        return 0;
+      }
+    }
+    if( probe == 0 ) {
+      // Preparing a statement on a virtual table connects it.
+      char* sql = sqlite3_mprintf("SELECT 1 FROM \"%w\".\"%w\"", db_name, table_name);
+      sqlite3_stmt* stmt = 0;
+      if( sql == 0 || sqlite3_prepare_v2(connection->db, sql, -1, &stmt, 0) != SQLITE_OK ) {
+        probe = 1;
+      }
+      sqlite3_finalize(stmt);
+      sqlite3_free(sql);
+    }
+  }
+  return 0;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_live_search
+// Desc: Finds the k best vectors of an ndvss_index table for the k-NN functions, with
+//       the exact method, or with the PQ codes of the main index and an exact scan of
+//       the delta. The first search with the codes lets the table merge in the 
+//       background.
+// Returns: SQLITE_OK or an error code, with the message in error_message.
+//----------------------------------------------------------------------------------------
+static int ndvss_live_search( ndvss_live_table* table,
+                              const char* column,
+                              int element_size,
+                              int metric,
+                              const void* searched_array,
+                              int vector_bytes,
+                              int use_codes,
+                              ndvss_topk* topk,
+                              char** error_message )
+{
+  ndvss_live_index* index = table->index;
+  if( sqlite3_stricmp(column, "vector") != 0 ) {
+    *error_message = sqlite3_mprintf("The column of an ndvss_index table is vector.");
+    return SQLITE_ERROR;
+  }
+  if( index->element_size != element_size ) {
+    *error_message = sqlite3_mprintf("The table contains %s.", index->element_size == sizeof(double) ? "doubles" : "floats");
+    return SQLITE_ERROR;
+  }
+  if( index->vector_bytes != vector_bytes ) {
+    *error_message = sqlite3_mprintf("The arrays are not the same length.");
+    return SQLITE_ERROR;
+  }
+  int rc = SQLITE_OK;
+  if( table->change_count == 0 ) {
+    sqlite3_int64 generation = 0;
+    rc = ndvss_live_generation(table, &generation);
+    if( rc != SQLITE_OK ) {
+      *error_message = sqlite3_mprintf("%s", sqlite3_errmsg(table->connection->db));
+      return rc;
+    }
+    int attempt;
+    for( attempt = 0; attempt < 2; ++attempt ) {
+      int slot = ndvss_epoch_enter();
+      const ndvss_vector_set* set = __atomic_load_n(&index->current, __ATOMIC_SEQ_CST);
+      sqlite3_int64 version = set != 0 ? __atomic_load_n(&set->data_version, __ATOMIC_RELAXED) : 0;
+      // A commit that is being applied is linearized after this search.
+      if( set != 0 && (version == generation ||
+                       (version == generation - 1 && __atomic_load_n(&index->committing, __ATOMIC_ACQUIRE) == generation)) ) {
+        rc = use_codes && set->pq != 0 ? ndvss_pq_scan(set, metric, searched_array, topk)
+                                       : ndvss_scan(set, metric, searched_array, topk);
+        sqlite3_int64 delta = set->count - (set->pq != 0 ? set->pq->count : 0);
+        ndvss_epoch_leave(slot);
+        double threshold = NDVSS_CONFIG(NDVSS_CONFIG_MERGE_THRESHOLD);
+        if( use_codes && (!__atomic_load_n(&index->uses_codes, __ATOMIC_RELAXED) || 
+                          (threshold > 0 && delta >= threshold && !__atomic_load_n(&index->merging, __ATOMIC_RELAXED))) ) {
+          __atomic_store_n(&index->uses_codes, 1, __ATOMIC_RELAXED);
+          // No waiting: the next commit starts the merge if the writer is busy.
+          if( ndvss_mutex_trylock(&index->writer) ) {
+            ndvss_live_merge_start(index);
+            ndvss_mutex_unlock(&index->writer);
+          }
+        }
+        return rc;
+      }
+      ndvss_epoch_leave(slot);
+      if( attempt > 0 || (set != 0 && version > generation) ) {
+        break;
+      }
+      rc = ndvss_live_reload(table, generation, error_message);
+      if( rc == SQLITE_BUSY ) {
+        rc = SQLITE_OK;
+        break;
+      }
+      if( rc != SQLITE_OK ) {
+        return rc;
+      }
+    }
+  }
+  // The memory doesn't match what this connection sees.
+  NDVSS_STAT_ADD(live_fallbacks, 1);
+  char* shadow_name = sqlite3_mprintf("%s_vectors", table->name);
+  if( shadow_name == 0 ) {
+    return SQLITE_NOMEM;
+  }
+  ndvss_vector_set* set = 0;
+  rc = ndvss_vector_set_get(table->connection, table->db_name, shadow_name, "vector", element_size, vector_bytes,
+                            &set, error_message);
+  sqlite3_free(shadow_name);
+  if( rc == SQLITE_OK ) {
+    rc = ndvss_scan(set, metric, searched_array, topk);
+    ndvss_vector_set_unpin(set);
+  }
+  return rc;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_live_index_get
+// Desc: Returns the live index of a table with a new reference, creating it if no
+//       connection of the process has it yet. Tables of in-memory and temporary
+//       databases get their own.
+// Returns: The index, or 0 if out of memory.
+//----------------------------------------------------------------------------------------
+static ndvss_live_index* ndvss_live_index_get( sqlite3* db,
+                                               const char* db_name,
+                                               const char* table_name,
+                                               int element_size,
+                                               int vector_bytes )
+{
+  const char* file_name = sqlite3_db_filename(db, db_name);
+  char* key = (file_name != 0 && file_name[0] != 0) ? sqlite3_mprintf("%s", file_name)
+                                                     : sqlite3_mprintf("%p/%s", (void*)db, db_name);
+  if( key == 0 ) {
+    return 0;
+  }
+  ndvss_global_lock();
+  ndvss_live_index* index;
+  for( index = ndvss_live_indexes; index != 0; index = index->next ) {
+    if( strcmp(index->key, key) == 0 && sqlite3_stricmp(index->table_name, table_name) == 0 &&
+        index->element_size == element_size && index->vector_bytes == vector_bytes ) {
+      ++index->ref_count;
+      break;
+    }
+  }
+  if( index == 0 ) {
+    index = (ndvss_live_index*)sqlite3_malloc(sizeof(ndvss_live_index));
+    char* name = sqlite3_mprintf("%s", table_name);
+    if( index == 0 || name == 0 ) {
+      sqlite3_free(index);
+      sqlite3_free(name);
+      index = 0;
+    } else {
+      ndvss_mutex unlocked = NDVSS_MUTEX_INITIALIZER;
+      memset(index, 0, sizeof(ndvss_live_index));
+      index->key = key;
+      index->table_name = name;
+      index->element_size = element_size;
+      index->vector_bytes = vector_bytes;
+      index->ref_count = 1;
+      index->registered = 1;
+      index->writer = unlocked;
+      index->next = ndvss_live_indexes;
+      ndvss_live_indexes = index;
+      key = 0;
+    }
+  }
+  ndvss_global_unlock();
+  sqlite3_free(key);
+  return index;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_live_index_unregister
+// Desc: Stops other tables from finding an index, when its table is dropped.
+//----------------------------------------------------------------------------------------
+static void ndvss_live_index_unregister( ndvss_live_index* index )
+{
+  ndvss_global_lock();
+  if( index->registered ) {
+    ndvss_live_index** link = &ndvss_live_indexes;
+    while( *link != index ) {
+      link = &(*link)->next;
+    }
+    *link = index->next;
+    index->registered = 0;
+  }
+  ndvss_global_unlock();
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_live_index_release
+// Desc: Drops a table's reference to a live index, freeing it with the last one.
+//----------------------------------------------------------------------------------------
+static void ndvss_live_index_release( ndvss_live_index* index )
+{
+  if( index == 0 ) {
+    return;
+  }
+  ndvss_global_lock();
+  int last = --index->ref_count == 0;
+  if( last && index->registered ) {
+    ndvss_live_index** link = &ndvss_live_indexes;
+    while( *link != index ) {
+      link = &(*link)->next;
+    }
+    *link = index->next;
+  }
+  ndvss_global_unlock();
+  if( !last ) {
+    return;
+  }
+  if( index->merger_started ) {
+    ndvss_thread_join(index->merger);
+  }
+  ndvss_live_reclaim(index, 1);
+  ndvss_vector_set_free(index->current);
+  sqlite3_free(index->entries);
+  sqlite3_free(index->key);
+  sqlite3_free(index->table_name);
+  sqlite3_free(index);
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_live_changes_clear
+// Desc: Forgets the uncommitted changes of a table from the given one on.
+//----------------------------------------------------------------------------------------
+static void ndvss_live_changes_clear( ndvss_live_table* table, int first )
+{
+  int i;
+  for( i = first; i < table->change_count; ++i ) {
+    sqlite3_free(table->changes[i].vector);
+  }
+  if( first < table->change_count ) {
+    table->change_count = first;
+  }
+  if( first == 0 ) {
+    table->savepoint_count = 0;
+  }
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_live_connect
+// Desc: xConnect/xCreate of ndvss_index tables. xCreate also creates the shadow tables.
+// Args: dimensions=<n> (required), type=float|double (default float).
+//----------------------------------------------------------------------------------------
+static int ndvss_live_connect_or_create( sqlite3* db,
+                                         void* pAux,
+                                         int argc,
+                                         const char* const* argv,
+                                         sqlite3_vtab** ppVtab,
+                                         char** pzErr,
+                                         int create )
+{
+  int dimensions = 0;
+  int element_size = sizeof(float);
+  int i;
+  for( i = 3; i < argc; ++i ) {
+    const char* argument = argv[i];
+    while( *argument == ' ' ) {
+      ++argument;
+    }
+    if( sqlite3_strnicmp(argument, "dimensions", 10) == 0 && strchr(argument, '=') != 0 ) {
+      dimensions = atoi(strchr(argument, '=') + 1);
+    } else if( sqlite3_strnicmp(argument, "type", 4) == 0 && strchr(argument, '=') != 0 ) {
+      const char* type = strchr(argument, '=') + 1;
+      while( *type == ' ' ) {
+        ++type;
+      }
+      if( sqlite3_strnicmp(type, "double", 6) == 0 ) {
+        element_size = sizeof(double);
+      } else if( sqlite3_strnicmp(type, "float", 5) != 0 ) {
+        *pzErr = sqlite3_mprintf("The type of an ndvss_index table is float or double.");
+        return SQLITE_ERROR;
+      }
+    } else {
+      *pzErr = sqlite3_mprintf("Unknown argument %s. Use dimensions=<n> and type=float|double.", argument);
+      return SQLITE_ERROR;
+    }
+  }
+  if( dimensions < 1 || dimensions > NDVSS_LIVE_MAX_DIMENSIONS ) {
+    *pzErr = sqlite3_mprintf("An ndvss_index table needs dimensions=<n> between 1 and %d.", NDVSS_LIVE_MAX_DIMENSIONS);
+    return SQLITE_ERROR;
+  }
+  int rc;
+  if( create ) {
+    char* sql = sqlite3_mprintf("CREATE TABLE \"%w\".\"%w_vectors\"(rowid INTEGER PRIMARY KEY, vector BLOB NOT NULL);"
+                                "CREATE TABLE \"%w\".\"%w_info\"(generation INTEGER NOT NULL);"
+                                // A random start keeps a dropped and recreated table from matching old memory.
+                                "INSERT INTO \"%w\".\"%w_info\" VALUES(random() & 4611686018427387903);",
+                                argv[1], argv[2], argv[1], argv[2], argv[1], argv[2]);
+    if( sql == 0 ) {
+      return SQLITE_NOMEM;
+    }
+    rc = sqlite3_exec(db, sql, 0, 0, pzErr);
+    sqlite3_free(sql);
+    if( rc != SQLITE_OK ) {
+      return rc;
+    }
+  }
+  rc = sqlite3_declare_vtab(db, "CREATE TABLE x(vector BLOB)");
+  if( rc != SQLITE_OK ) {
+    return rc;
+  }
+  // INSERT OR REPLACE replaces the row in the shadow table.
+  sqlite3_vtab_config(db, SQLITE_VTAB_CONSTRAINT_SUPPORT, 1);
+  ndvss_live_table* table = (ndvss_live_table*)sqlite3_malloc(sizeof(ndvss_live_table));
+  if( table == 0 ) {
+    return SQLITE_NOMEM;
+  }
+  memset(table, 0, sizeof(ndvss_live_table));
+  table->connection = (ndvss_connection*)pAux;
+  table->db_name = sqlite3_mprintf("%s", argv[1]);
+  table->name = sqlite3_mprintf("%s", argv[2]);
+  table->index = ndvss_live_index_get(db, argv[1], argv[2], element_size, dimensions * element_size);
+  if( table->db_name == 0 || table->name == 0 || table->index == 0 ) {
+    ndvss_live_index_release(table->index);
+    sqlite3_free(table->db_name);
+    sqlite3_free(table->name);
+    sqlite3_free(table);
+    return SQLITE_NOMEM;
+  }
+  ++table->connection->ref_count;
+  table->next = table->connection->live_tables;
+  table->connection->live_tables = table;
+  *ppVtab = &table->base;
+  return SQLITE_OK;
+}
+
+static int ndvss_live_create( sqlite3* db, void* pAux, int argc, const char* const* argv,
+                              sqlite3_vtab** ppVtab, char** pzErr )
+{
+  return ndvss_live_connect_or_create(db, pAux, argc, argv, ppVtab, pzErr, 1);
+}
+
+static int ndvss_live_connect( sqlite3* db, void* pAux, int argc, const char* const* argv,
+                               sqlite3_vtab** ppVtab, char** pzErr )
+{
+  return ndvss_live_connect_or_create(db, pAux, argc, argv, ppVtab, pzErr, 0);
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_live_disconnect
+//----------------------------------------------------------------------------------------
+static int ndvss_live_disconnect( sqlite3_vtab* pVtab )
+{
+  ndvss_live_table* table = (ndvss_live_table*)pVtab;
+  ndvss_connection* connection = table->connection;
+  ndvss_live_table** link = &connection->live_tables;
+  while( *link != table ) {
+    link = &(*link)->next;
+  }
+  *link = table->next;
+  if( table->holds_writer ) {
+    __atomic_store_n(&table->index->committing, 0, __ATOMIC_RELEASE);
+    ndvss_mutex_unlock(&table->index->writer);
+  }
+  ndvss_live_changes_clear(table, 0);
+  sqlite3_free(table->changes);
+  sqlite3_free(table->savepoints);
+  sqlite3_finalize(table->generation_stmt);
+  ndvss_live_index_release(table->index);
+  sqlite3_free(table->db_name);
+  sqlite3_free(table->name);
+  sqlite3_free(table);
+  ndvss_connection_release(connection);
+  return SQLITE_OK;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_live_destroy
+// Desc: xDestroy: drops the shadow tables.
+//----------------------------------------------------------------------------------------
+static int ndvss_live_destroy( sqlite3_vtab* pVtab )
+{
+  ndvss_live_table* table = (ndvss_live_table*)pVtab;
+  char* sql = sqlite3_mprintf("DROP TABLE IF EXISTS \"%w\".\"%w_vectors\";"
+                              "DROP TABLE IF EXISTS \"%w\".\"%w_info\";",
+                              table->db_name, table->name, table->db_name, table->name);
+  if( sql == 0 ) {
+    return SQLITE_NOMEM;
+  }
+  int rc = sqlite3_exec(table->connection->db, sql, 0, 0, 0);
+  sqlite3_free(sql);
+  if( rc != SQLITE_OK ) {
+    return rc;
+  }
+  ndvss_live_index_unregister(table->index);
+  return ndvss_live_disconnect(pVtab);
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_live_best_index
+// Desc: A rowid is looked up, anything else scans the shadow table.
+//----------------------------------------------------------------------------------------
+static int ndvss_live_best_index( sqlite3_vtab* pVtab, sqlite3_index_info* pIdxInfo )
+{
+  (void)pVtab;
+  int i;
+  pIdxInfo->idxNum = 0;
+  pIdxInfo->estimatedCost = 1000000.0;
+  for( i = 0; i < pIdxInfo->nConstraint; ++i ) {
+    const struct sqlite3_index_constraint* constraint = &pIdxInfo->aConstraint[i];
+    if( constraint->usable && constraint->iColumn == -1 && constraint->op == SQLITE_INDEX_CONSTRAINT_EQ ) {
+      pIdxInfo->idxNum = 1;
+      pIdxInfo->aConstraintUsage[i].argvIndex = 1;
+      pIdxInfo->aConstraintUsage[i].omit = 1;
+      pIdxInfo->estimatedCost = 1.0;
+      pIdxInfo->estimatedRows = 1;
+      pIdxInfo->idxFlags = SQLITE_INDEX_SCAN_UNIQUE;
+      break;
+    }
+  }
+  return SQLITE_OK;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_live_open / ndvss_live_close
+//----------------------------------------------------------------------------------------
+static int ndvss_live_open( sqlite3_vtab* pVtab, sqlite3_vtab_cursor** ppCursor )
+{
+  (void)pVtab;
+  ndvss_live_cursor* cursor = (ndvss_live_cursor*)sqlite3_malloc(sizeof(ndvss_live_cursor));
+  if( cursor == 0 ) {
+    return SQLITE_NOMEM;
+  }
+  memset(cursor, 0, sizeof(ndvss_live_cursor));
+  *ppCursor = &cursor->base;
+  return SQLITE_OK;
+}
+
+static int ndvss_live_close( sqlite3_vtab_cursor* pCursor )
+{
+  ndvss_live_cursor* cursor = (ndvss_live_cursor*)pCursor;
+  sqlite3_finalize(cursor->stmt);
+  sqlite3_free(cursor);
+  return SQLITE_OK;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_live_next
+//----------------------------------------------------------------------------------------
+static int ndvss_live_next( sqlite3_vtab_cursor* pCursor )
+{
+  ndvss_live_cursor* cursor = (ndvss_live_cursor*)pCursor;
+  int rc = sqlite3_step(cursor->stmt);
+  cursor->eof = rc != SQLITE_ROW;
+  if( rc != SQLITE_ROW && rc != SQLITE_DONE ) {
+    pCursor->pVtab->zErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(sqlite3_db_handle(cursor->stmt)));
+    return rc;
+  }
+  return SQLITE_OK;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_live_filter
+// Desc: Reads the rows from the shadow table.
+//----------------------------------------------------------------------------------------
+static int ndvss_live_filter( sqlite3_vtab_cursor* pCursor,
+                              int idxNum,
+                              const char* idxStr,
+                              int argc,
+                              sqlite3_value** argv )
+{
+  (void)idxStr;
+  (void)argc;
+  ndvss_live_cursor* cursor = (ndvss_live_cursor*)pCursor;
+  ndvss_live_table* table = (ndvss_live_table*)pCursor->pVtab;
+  sqlite3_finalize(cursor->stmt);
+  cursor->stmt = 0;
+  char* sql = sqlite3_mprintf("SELECT rowid, vector FROM \"%w\".\"%w_vectors\"%s", table->db_name, table->name,
+                              idxNum == 1 ? " WHERE rowid = ?" : "");
+  if( sql == 0 ) {
+    return SQLITE_NOMEM;
+  }
+  int rc = sqlite3_prepare_v2(table->connection->db, sql, -1, &cursor->stmt, 0);
+  sqlite3_free(sql);
+  if( rc != SQLITE_OK ) {
+    return rc;
+  }
+  if( idxNum == 1 ) {
+    sqlite3_bind_value(cursor->stmt, 1, argv[0]);
+  }
+  return ndvss_live_next(pCursor);
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_live_eof / ndvss_live_column / ndvss_live_rowid
+//----------------------------------------------------------------------------------------
+static int ndvss_live_eof( sqlite3_vtab_cursor* pCursor )
+{
+  return ((ndvss_live_cursor*)pCursor)->eof;
+}
+
+static int ndvss_live_column( sqlite3_vtab_cursor* pCursor, sqlite3_context* context, int column )
+{
+  (void)column;
+  sqlite3_result_value(context, sqlite3_column_value(((ndvss_live_cursor*)pCursor)->stmt, 1));
+  return SQLITE_OK;
+}
+
+static int ndvss_live_rowid( sqlite3_vtab_cursor* pCursor, sqlite3_int64* pRowid )
+{
+  *pRowid = sqlite3_column_int64(((ndvss_live_cursor*)pCursor)->stmt, 0);
+  return SQLITE_OK;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_live_change_add
+// Desc: Remembers a change until the transaction commits.
+// Returns: SQLITE_OK or SQLITE_NOMEM.
+//----------------------------------------------------------------------------------------
+static int ndvss_live_change_add( ndvss_live_table* table, sqlite3_int64 rowid, const void* vector )
+{
+  if( table->change_count == table->change_capacity ) {
+    int capacity = table->change_capacity < 64 ? 64 : table->change_capacity * 2;
+    ndvss_live_change* changes = (ndvss_live_change*)sqlite3_realloc64(table->changes, sizeof(ndvss_live_change) * (sqlite3_uint64)capacity);
+    if( changes == 0 ) {
+      return SQLITE_NOMEM;
+    }
+    table->changes = changes;
+    table->change_capacity = capacity;
+  }
+  void* copy = 0;
+  if( vector != 0 ) {
+    copy = sqlite3_malloc(table->index->vector_bytes);
+    if( copy == 0 ) {
+      return SQLITE_NOMEM;
+    }
+    memcpy(copy, vector, (size_t)table->index->vector_bytes);
+  }
+  table->changes[table->change_count].rowid = rowid;
+  table->changes[table->change_count].vector = copy;
+  ++table->change_count;
+  return SQLITE_OK;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_live_update
+// Desc: xUpdate: writes the change to the shadow table and remembers it for the memory
+//       copy.
+//----------------------------------------------------------------------------------------
+static int ndvss_live_update( sqlite3_vtab* pVtab, int argc, sqlite3_value** argv, sqlite3_int64* pRowid )
+{
+  ndvss_live_table* table = (ndvss_live_table*)pVtab;
+  sqlite3* db = table->connection->db;
+  int is_delete = argc == 1;
+  int is_insert = sqlite3_value_type(argv[0]) == SQLITE_NULL;
+  if( !is_delete && (sqlite3_value_type(argv[2]) != SQLITE_BLOB || sqlite3_value_bytes(argv[2]) != table->index->vector_bytes) ) {
+    pVtab->zErrMsg = sqlite3_mprintf("The vector needs to be a BLOB of %d bytes.", table->index->vector_bytes);
+    return SQLITE_ERROR;
+  }
+  char* sql;
+  if( is_delete ) {
+    sql = sqlite3_mprintf("DELETE FROM \"%w\".\"%w_vectors\" WHERE rowid = ?1", table->db_name, table->name);
+  } else if( is_insert ) {
+    sql = sqlite3_mprintf("INSERT OR %s INTO \"%w\".\"%w_vectors\"(rowid, vector) VALUES(?2, ?3)",
+                          sqlite3_vtab_on_conflict(db) == SQLITE_REPLACE ? "REPLACE" : "ABORT",
+                          table->db_name, table->name);
+  } else {
+    sql = sqlite3_mprintf("UPDATE OR %s \"%w\".\"%w_vectors\" SET rowid = ?2, vector = ?3 WHERE rowid = ?1",
+                          sqlite3_vtab_on_conflict(db) == SQLITE_REPLACE ? "REPLACE" : "ABORT",
+                          table->db_name, table->name);
+  }
+  if( sql == 0 ) {
+    return SQLITE_NOMEM;
+  }
+  sqlite3_stmt* stmt = 0;
+  int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+  sqlite3_free(sql);
+  if( rc == SQLITE_OK ) {
+    if( !is_insert ) {
+      sqlite3_bind_value(stmt, 1, argv[0]);
+    }
+    if( !is_delete ) {
+      sqlite3_bind_value(stmt, 2, argv[1]);
+      sqlite3_bind_value(stmt, 3, argv[2]);
+    }
+    sqlite3_step(stmt);
+    rc = sqlite3_finalize(stmt);
+  }
+  if( rc != SQLITE_OK ) {
+    pVtab->zErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+    return rc;
+  }
+  sqlite3_int64 rowid = is_delete ? 0 : (sqlite3_value_type(argv[1]) == SQLITE_NULL ? sqlite3_last_insert_rowid(db)
+                                                                                   : sqlite3_value_int64(argv[1]));
+  if( is_insert ) {
+    *pRowid = rowid;
+  } else {
+    rc = ndvss_live_change_add(table, sqlite3_value_int64(argv[0]), 0);
+  }
+  if( rc == SQLITE_OK && !is_delete ) {
+    rc = ndvss_live_change_add(table, rowid, sqlite3_value_blob(argv[2]));
+  }
+  return rc;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_live_sync
+// Desc: xSync: increments the generation in the transaction and takes the writer mutex
+//       until the changes are applied in xCommit, so that the commits of the process
+//       are applied in order.
+//----------------------------------------------------------------------------------------
+static int ndvss_live_sync( sqlite3_vtab* pVtab )
+{
+  ndvss_live_table* table = (ndvss_live_table*)pVtab;
+  if( table->change_count == 0 ) {
+    return SQLITE_OK;
+  }
+  char* sql = sqlite3_mprintf("UPDATE \"%w\".\"%w_info\" SET generation = generation + 1", table->db_name, table->name);
+  if( sql == 0 ) {
+    return SQLITE_NOMEM;
+  }
+  int rc = sqlite3_exec(table->connection->db, sql, 0, 0, 0);
+  sqlite3_free(sql);
+  if( rc == SQLITE_OK ) {
+    rc = ndvss_live_generation(table, &table->commit_generation);
+  }
+  if( rc != SQLITE_OK ) {
+    return rc;
+  }
+  if( !table->holds_writer ) {
+    ndvss_mutex_lock(&table->index->writer);
+    table->holds_writer = 1;
+  }
+  __atomic_store_n(&table->index->committing, table->commit_generation, __ATOMIC_RELEASE);
+  return SQLITE_OK;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_live_commit
+// Desc: xCommit: applies the committed changes to the memory copy, if it holds the
+//       generation before them. Otherwise the next search reloads it.
+//----------------------------------------------------------------------------------------
+static int ndvss_live_commit( sqlite3_vtab* pVtab )
+{
+  ndvss_live_table* table = (ndvss_live_table*)pVtab;
+  ndvss_live_index* index = table->index;
+  if( table->holds_writer ) {
+    if( index->current != 0 && index->entries != 0 && index->current->data_version == table->commit_generation - 1 ) {
+      ndvss_live_apply(index, table->changes, table->change_count, table->commit_generation);
+    }
+    __atomic_store_n(&index->committing, 0, __ATOMIC_RELEASE);
+    table->holds_writer = 0;
+    ndvss_mutex_unlock(&index->writer);
+  }
+  ndvss_live_changes_clear(table, 0);
+  return SQLITE_OK;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_live_rollback
+//----------------------------------------------------------------------------------------
+static int ndvss_live_rollback( sqlite3_vtab* pVtab )
+{
+  ndvss_live_table* table = (ndvss_live_table*)pVtab;
+  if( table->holds_writer ) {
+    __atomic_store_n(&table->index->committing, 0, __ATOMIC_RELEASE);
+    table->holds_writer = 0;
+    ndvss_mutex_unlock(&table->index->writer);
+  }
+  ndvss_live_changes_clear(table, 0);
+  return SQLITE_OK;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_live_begin / ndvss_live_savepoint / ndvss_live_release /
+//       ndvss_live_rollback_to
+// Desc: Track the changes made since each savepoint. A savepoint that started before
+//       the table was written to has no changes to keep.
+//----------------------------------------------------------------------------------------
+static int ndvss_live_begin( sqlite3_vtab* pVtab )
+{
+  ndvss_live_changes_clear((ndvss_live_table*)pVtab, 0);
+  return SQLITE_OK;
+}
+
+static int ndvss_live_savepoint( sqlite3_vtab* pVtab, int savepoint )
+{
+  ndvss_live_table* table = (ndvss_live_table*)pVtab;
+  if( savepoint >= table->savepoint_count ) {
+    int* savepoints = (int*)sqlite3_realloc64(table->savepoints, sizeof(int) * (sqlite3_uint64)(savepoint + 1));
+    if( savepoints == 0 ) {
+      return SQLITE_NOMEM;
+    }
+    memset(savepoints + table->savepoint_count, 0, sizeof(int) * (size_t)(savepoint + 1 - table->savepoint_count));
+    table->savepoints = savepoints;
+    table->savepoint_count = savepoint + 1;
+  }
+  table->savepoints[savepoint] = table->change_count;
+  return SQLITE_OK;
+}
+
+static int ndvss_live_release( sqlite3_vtab* pVtab, int savepoint )
+{
+  ndvss_live_table* table = (ndvss_live_table*)pVtab;
+  if( savepoint < table->savepoint_count ) {
+    table->savepoint_count = savepoint;
+  }
+  return SQLITE_OK;
+}
+
+static int ndvss_live_rollback_to( sqlite3_vtab* pVtab, int savepoint )
+{
+  ndvss_live_table* table = (ndvss_live_table*)pVtab;
+  if( savepoint < table->savepoint_count ) {
+    ndvss_live_changes_clear(table, table->savepoints[savepoint]);
+    table->savepoint_count = savepoint + 1;
+  }
+  return SQLITE_OK;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_live_shadow_name
+// Desc: Marks <name>_vectors and <name>_info read-only in defensive mode.
+//----------------------------------------------------------------------------------------
+static int ndvss_live_shadow_name( const char* suffix )
+{
+  return sqlite3_stricmp(suffix, "vectors") == 0 || sqlite3_stricmp(suffix, "info") == 0;
+}
+
+
+static sqlite3_module ndvss_live_module = {
+  3,                        // iVersion
+  ndvss_live_create,        // xCreate
+  ndvss_live_connect,       // xConnect
+  ndvss_live_best_index,    // xBestIndex
+  ndvss_live_disconnect,    // xDisconnect
+  ndvss_live_destroy,       // xDestroy
+  ndvss_live_open,          // xOpen
+  ndvss_live_close,         // xClose
+  ndvss_live_filter,        // xFilter
+  ndvss_live_next,          // xNext
+  ndvss_live_eof,           // xEof
+  ndvss_live_column,        // xColumn
+  ndvss_live_rowid,         // xRowid
+  ndvss_live_update,        // xUpdate
+  ndvss_live_begin,         // xBegin
+  ndvss_live_sync,          // xSync
+  ndvss_live_commit,        // xCommit
+  ndvss_live_rollback,      // xRollback
+  0,                        // xFindFunction
+  0,                        // xRename
+  ndvss_live_savepoint,     // xSavepoint
+  ndvss_live_release,       // xRelease
+  ndvss_live_rollback_to,   // xRollbackTo
+  ndvss_live_shadow_name    // xShadowName
+};
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_index_merge
+// Desc: Merges the delta of an ndvss_index table in to its main index at once: the
+//       codebooks are retrained on the current vectors, with the OPQ rotation of the
+//       shadow table if ndvss_opq_train_f/_d has made one, and every vector is encoded.
+// Args: Table name TEXT ("table" or "schema.table")
+// Returns: Number of vectors that were in the delta INTEGER
+//----------------------------------------------------------------------------------------
+static void ndvss_index_merge( sqlite3_context* context,
+                               int argc,
+                               sqlite3_value** argv ) 
+{
+  if( argc < 1 || sqlite3_value_type(argv[0]) == SQLITE_NULL ) {
+    sqlite3_result_error(context, "The table name is null.", -1);
+    return;
+  }
+  ndvss_connection* connection = (ndvss_connection*)sqlite3_user_data(context);
+  const char* table = (const char*)sqlite3_value_text(argv[0]);
+  const char* dot = strchr(table, '.');
+  char* db_name = dot != 0 ? sqlite3_mprintf("%.*s", (int)(dot - table), table) : sqlite3_mprintf("main");
+  if( db_name == 0 ) {
+    sqlite3_result_error_nomem(context);
+    return;
+  }
+  ndvss_live_table* live = ndvss_live_table_find(connection, db_name, dot != 0 ? dot + 1 : table);
+  sqlite3_free(db_name);
+  if( live == 0 ) {
+    sqlite3_result_error(context, "Not an ndvss_index table.", -1);
+    return;
+  }
+  ndvss_live_index* index = live->index;
+  sqlite3_int64 generation = 0;
+  char* error_message = 0;
+  int rc = ndvss_live_generation(live, &generation);
+  if( rc != SQLITE_OK ) {
+    sqlite3_result_error(context, sqlite3_errmsg(connection->db), -1);
+    return;
+  }
+  rc = ndvss_live_reload(live, generation, &error_message);
+  if( rc != SQLITE_OK && rc != SQLITE_BUSY ) {
+    sqlite3_result_error(context, error_message != 0 ? error_message : sqlite3_errstr(rc), -1);
+    sqlite3_free(error_message);
+    return;
+  }
+  __atomic_store_n(&index->uses_codes, 1, __ATOMIC_RELAXED);
+  sqlite3_int64 merged = 0;
+  ndvss_task task;
+  ndvss_task_begin(&task, connection->db, "index_merge", table);
+  ndvss_mutex_lock(&index->writer);
+  float* rotation = 0;
+  int rotation_subquantizers = 0;
+  rc = index->current == 0 ? SQLITE_OK : ndvss_opq_load(connection->db, index->current, &rotation, &rotation_subquantizers);
+  if( rc == SQLITE_OK ) {
+    rc = ndvss_live_merge(index, rotation, rotation_subquantizers, 1, &merged);
+  }
+  ndvss_mutex_unlock(&index->writer);
+  ndvss_task_end(&task);
+  if( rc != SQLITE_OK ) {
+    sqlite3_result_error_code(context, rc);
+    return;
+  }
+  sqlite3_result_int64(context, merged);
+}
+
+
+//----------------------------------------------------------------------------------------
+// STREAMING PIPELINE.
+// With vector_cache set to 0 the k-NN functions don't copy the column to memory, but
+// stream it from the table. The calling thread steps the statement and copies the 
+// vectors in to batches while scan_threads workers score the previous batches, so the
+// cost of the cursor and record decoding is hidden behind the scoring.
+// The batches go through a bounded single-producer/multi-consumer ring. Every slot has
+// a sequence number: the slot at position p is free for the producer when its sequence
+// is p and full when it is p + 1. Consumers claim full slots with a compare-and-swap on
+// the read position and free them by setting the sequence to p + slot count.
+//----------------------------------------------------------------------------------------
+#define NDVSS_PIPELINE_BATCH_BYTES      (256 * 1024) // Approximate size of one batch.
+#define NDVSS_PIPELINE_SLOTS_PER_WORKER 2
+
+typedef struct ndvss_pipeline_slot {
+  sqlite3_uint64  sequence;
+  int             count;
+  sqlite3_int64*  rowids;
+  unsigned char*  vectors;        // count vectors, stride bytes apart.
+} ndvss_pipeline_slot;
+
+typedef struct ndvss_pipeline {
+  ndvss_pipeline_slot* slots;
+  int                  slot_count;
+  int                  batch_vectors;
+  int                  stride;
+  int                  element_size;
+  int                  dimensions;
+  int                  metric;
+  const void*          searched_array;
+  sqlite3_uint64       read_position;   // Next slot to be claimed by a consumer.
+  int                  done;            // Set by the producer after the last batch.
+} ndvss_pipeline;
+
+typedef struct ndvss_pipeline_worker {
+  ndvss_pipeline* pipeline;
+  ndvss_topk      topk;
+  ndvss_thread    thread;
+  int             started;
+} ndvss_pipeline_worker;
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_pipeline_consume
+// Desc: Claims one full batch from the ring and scores it.
+// Returns: 1 if a batch was scored, 0 if the ring was empty.
+//----------------------------------------------------------------------------------------
+static int ndvss_pipeline_consume( ndvss_pipeline* pipeline, ndvss_topk* topk )
+{
+  sqlite3_uint64 position = __atomic_load_n(&pipeline->read_position, __ATOMIC_RELAXED);
+  for( ;; ) {
+    ndvss_pipeline_slot* slot = &pipeline->slots[position % (sqlite3_uint64)pipeline->slot_count];
+    sqlite3_uint64 sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+    if( sequence != position + 1 ) {
+      if( sequence < position + 1 ) {
+        return 0;
+      }
+      // Another consumer took it, try the next one.
+      position = __atomic_load_n(&pipeline->read_position, __ATOMIC_RELAXED);
+      continue;
+    }
+    if( !__atomic_compare_exchange_n(&pipeline->read_position, &position, position + 1, 0, 
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED) ) {
+      continue;
+    }
+    const unsigned char* vector = slot->vectors;
+    int i;
+    for( i = 0; i < slot->count; ++i, vector += pipeline->stride ) {
+      double distance;
+      if( ndvss_metric_distance(pipeline->metric, pipeline->element_size, pipeline->searched_array, vector, 
+                                pipeline->dimensions, &distance) &&
+          distance < ndvss_topk_bound(topk) ) {
+        ndvss_topk_push(topk, distance, slot->rowids[i]);
+      }
+    }
+    __atomic_store_n(&slot->sequence, position + (sqlite3_uint64)pipeline->slot_count, __ATOMIC_RELEASE);
+    return 1;
+  }
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_pipeline_worker_run
+// Desc: Thread function of a pipeline worker: scores batches until the producer is done
+//       and the ring is empty.
+//----------------------------------------------------------------------------------------
+static NDVSS_THREAD_PROC ndvss_pipeline_worker_run( void* arg )
+{
+  ndvss_pipeline_worker* worker = (ndvss_pipeline_worker*)arg;
+  ndvss_pipeline* pipeline = worker->pipeline;
+  for( ;; ) {
+    if( ndvss_pipeline_consume(pipeline, &worker->topk) ) {
+      continue;
+    }
+    if( __atomic_load_n(&pipeline->done, __ATOMIC_ACQUIRE) ) {
+      // The last batch was published before done, so one more look finds it.
+      while( ndvss_pipeline_consume(pipeline, &worker->topk) ) {
+      }
+      break;
+    }
+    NDVSS_STAT_ADD(pipeline_consumer_waits, 1);
+    ndvss_thread_yield();
+  }
+  return 0;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_pipeline_scan
+// Desc: Finds the k best vectors of a column by streaming the table through the ring.
+//       If the ring is full, the producer scores a batch itself instead of waiting, so
+//       the scan finishes even if no thread could be started.
+// Args: Database, schema, table and column names, element size, size of a vector in
+//       bytes, metric, searched vector, top-k, where an error message is stored.
+// Returns: SQLITE_OK or an error code.
+//----------------------------------------------------------------------------------------
+static int ndvss_pipeline_scan( sqlite3* db,
+                                const char* db_name,
+                                const char* table_name,
+                                const char* column_name,
+                                int element_size,
+                                int vector_bytes,
+                                int metric,
+                                const void* searched_array,
+                                ndvss_topk* topk,
+                                char** error_message )
+{
+  double start = ndvss_now();
+  sqlite3_stmt* stmt = 0;
+  int rc = ndvss_vector_select_prepare(db, db_name, table_name, column_name, &stmt, error_message);
+  if( rc != SQLITE_OK ) {
+    return rc;
+  }
+
+  int worker_count = (int)NDVSS_CONFIG(NDVSS_CONFIG_SCAN_THREADS);
+  if( worker_count == 0 ) {
+    worker_count = ndvss_cpu_count();
+  }
+  ndvss_pipeline pipeline;
+  memset(&pipeline, 0, sizeof(pipeline));
+  pipeline.stride = (vector_bytes + NDVSS_ALIGNMENT - 1) & ~(NDVSS_ALIGNMENT - 1);
+  pipeline.batch_vectors = NDVSS_PIPELINE_BATCH_BYTES / pipeline.stride;
+  if( pipeline.batch_vectors < 1 ) {
+    pipeline.batch_vectors = 1;
+  }
+  pipeline.element_size = element_size;
+  pipeline.dimensions = vector_bytes / element_size;
+  pipeline.metric = metric;
+  pipeline.searched_array = searched_array;
+  pipeline.slot_count = worker_count * NDVSS_PIPELINE_SLOTS_PER_WORKER + 1;
+  pipeline.slots = (ndvss_pipeline_slot*)sqlite3_malloc64(sizeof(ndvss_pipeline_slot) * (sqlite3_uint64)pipeline.slot_count);
+  ndvss_pipeline_worker* workers = (ndvss_pipeline_worker*)sqlite3_malloc64(sizeof(ndvss_pipeline_worker) * (sqlite3_uint64)worker_count);
+  int i;
+  if( pipeline.slots == 0 || workers == 0 ) {
+    rc = SQLITE_NOMEM;
+  } else {
+    memset(pipeline.slots, 0, sizeof(ndvss_pipeline_slot) * (size_t)pipeline.slot_count);
+    memset(workers, 0, sizeof(ndvss_pipeline_worker) * (size_t)worker_count);
+    for( i = 0; i < pipeline.slot_count && rc == SQLITE_OK; ++i ) {
+      pipeline.slots[i].sequence = (sqlite3_uint64)i;
+      pipeline.slots[i].rowids = (sqlite3_int64*)sqlite3_malloc64(sizeof(sqlite3_int64) * (sqlite3_uint64)pipeline.batch_vectors);
+      pipeline.slots[i].vectors = (unsigned char*)ndvss_aligned_malloc((sqlite3_uint64)pipeline.stride * (sqlite3_uint64)pipeline.batch_vectors, 
+                                                                       NDVSS_ALIGNMENT);
+      if( pipeline.slots[i].rowids == 0 || pipeline.slots[i].vectors == 0 ) {
+        rc = SQLITE_NOMEM;
+      }
+    }
+    for( i = 0; i < worker_count && rc == SQLITE_OK; ++i ) {
+      workers[i].pipeline = &pipeline;
+      rc = ndvss_topk_init(&workers[i].topk, topk->k);
+    }
+    for( i = 0; i < worker_count && rc == SQLITE_OK; ++i ) {
+      workers[i].started = ndvss_thread_start(&workers[i].thread, ndvss_pipeline_worker_run, &workers[i]) == SQLITE_OK;
+    }
+  }
+
+  // Produce: fill the free slot at the write position, then publish it. The budget is
+  // checked as the batches are published.
+  double budget_ms = NDVSS_CONFIG(NDVSS_CONFIG_SEARCH_BUDGET_MS);
+  double deadline = budget_ms > 0 ? start + budget_ms * 1e-3 : 0.0;
+  sqlite3_int64 row_budget = (sqlite3_int64)NDVSS_CONFIG(NDVSS_CONFIG_SEARCH_BUDGET_ROWS);
+  int expired = 0;
+  int stopped = 0;
+  sqlite3_int64 rows = 0;
+  sqlite3_uint64 write_position = 0;
+  ndvss_pipeline_slot* slot = 0;
+  ndvss_task* task = ndvss_task_current();
+  ndvss_task_phase(task, "pipeline_scan", 0);
+  while( rc == SQLITE_OK && (rc = sqlite3_step(stmt)) == SQLITE_ROW ) {
+    if( expired || (row_budget > 0 && rows >= row_budget) ) {
+      stopped = 1;
+      rc = SQLITE_OK;
+      break;
+    }
+    if( sqlite3_column_bytes(stmt, 1) != vector_bytes ) {
+      *error_message = sqlite3_mprintf("The arrays are not the same length (rowid %lld).", 
+                                       sqlite3_column_int64(stmt, 0));
+      rc = SQLITE_ERROR;
+      break;
+    }
+    if( slot == 0 ) {
+      slot = &pipeline.slots[write_position % (sqlite3_uint64)pipeline.slot_count];
+      while( __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != write_position ) {
+        NDVSS_STAT_ADD(pipeline_producer_waits, 1);
+        if( !ndvss_pipeline_consume(&pipeline, topk) ) {
+          ndvss_thread_yield();
+        }
+      }
+      slot->count = 0;
+    }
+    slot->rowids[slot->count] = sqlite3_column_int64(stmt, 0);
+    memcpy(slot->vectors + (size_t)pipeline.stride * (size_t)slot->count, sqlite3_column_blob(stmt, 1), (size_t)vector_bytes);
+    ++rows;
+    rc = SQLITE_OK;
+    if( ++slot->count == pipeline.batch_vectors ) {
+      __atomic_store_n(&slot->sequence, write_position + 1, __ATOMIC_RELEASE);
+      ++write_position;
+      slot = 0;
+      expired = deadline > 0.0 && ndvss_now() >= deadline;
+      if( ndvss_task_advance(task, pipeline.batch_vectors) ) {
+        rc = SQLITE_INTERRUPT;
+      }
+    }
+  }//endwhile reading rows
+  if( rc == SQLITE_DONE ) {
+    rc = SQLITE_OK;
+  } else if( rc != SQLITE_OK && *error_message == 0 && rc != SQLITE_NOMEM && rc != SQLITE_INTERRUPT ) {
+    *error_message = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+  }
+  if( slot != 0 ) {
+    if( rc != SQLITE_OK ) {
+      slot->count = 0;
+    }
+    __atomic_store_n(&slot->sequence, write_position + 1, __ATOMIC_RELEASE);
+  }
+  __atomic_store_n(&pipeline.done, 1, __ATOMIC_RELEASE);
+  sqlite3_finalize(stmt);
+
+  // The producer helps with the last batches, then the results are merged.
+  if( pipeline.slots != 0 ) {
+    while( ndvss_pipeline_consume(&pipeline, topk) ) {
+    }
+  }
+  int thread_count = 0;
+  if( workers != 0 ) {
+    for( i = 0; i < worker_count; ++i ) {
+      if( workers[i].started ) {
+        ndvss_thread_join(workers[i].thread);
+        ++thread_count;
+      }
+      int j;
+      for( j = 0; j < workers[i].topk.count; ++j ) {
+        ndvss_topk_push(topk, workers[i].topk.distances[j], workers[i].topk.rowids[j]);
+      }
+      ndvss_topk_free(&workers[i].topk);
+    }
+    sqlite3_free(workers);
+  }
+  if( pipeline.slots != 0 ) {
+    for( i = 0; i < pipeline.slot_count; ++i ) {
+      sqlite3_free(pipeline.slots[i].rowids);
+      ndvss_aligned_free(pipeline.slots[i].vectors);
+    }
+    sqlite3_free(pipeline.slots);
+  }
+
+  if( rc == SQLITE_OK && stopped ) {
+    topk->partial = 1;
+    NDVSS_STAT_ADD(partial_searches, 1);
+  }
+  if( rc == SQLITE_OK ) {
+    sqlite3_int64 nanoseconds = (sqlite3_int64)((ndvss_now() - start) * 1e9);
+    NDVSS_STAT_ADD(pipeline_scans, 1);
+    NDVSS_STAT_ADD(pipeline_rows, rows);
+    NDVSS_STAT_ADD(pipeline_nanoseconds, nanoseconds);
+    NDVSS_STAT_SET(last_pipeline_threads, thread_count);
+  }
+  return rc;
+}
+
+
+//----------------------------------------------------------------------------------------
+// K-NN TABLE-VALUED FUNCTIONS.
+// ndvss_knn_f and ndvss_knn_d return the k most similar rows of a table:
+//   SELECT id, similarity FROM ndvss_knn_f(searched, 'table', 'column', k, 'metric');
+// A flat vector file is searched by giving 'file:<path>' as the table and no column.
+// The optional method picks how the cached vectors are searched: 'exact' (default)
+// scans them all, 'pq' scans their 4-bit product quantization codes.
+// The rows are returned from the most similar to the least similar. The hidden column
+// partial is 1 when a search budget stopped the exact scan before it saw every row.
+//----------------------------------------------------------------------------------------
+#define NDVSS_KNN_COLUMN_ID          0
+#define NDVSS_KNN_COLUMN_SIMILARITY  1
+#define NDVSS_KNN_COLUMN_QUERY       2
+#define NDVSS_KNN_COLUMN_TABLE       3
+#define NDVSS_KNN_COLUMN_COLUMN      4
+#define NDVSS_KNN_COLUMN_K           5
+#define NDVSS_KNN_COLUMN_METRIC      6
+#define NDVSS_KNN_COLUMN_METHOD      7
+#define NDVSS_KNN_COLUMN_PARTIAL     8
+#define NDVSS_KNN_FIRST_ARGUMENT     NDVSS_KNN_COLUMN_QUERY
+#define NDVSS_KNN_ARGUMENT_COUNT     6
+#define NDVSS_KNN_DEFAULT_K          10
+#define NDVSS_KNN_MAX_K              1000000 // The top-k of a search is allocated up front.
+
+enum {
+  NDVSS_KNN_METHOD_EXACT = 0,
+  NDVSS_KNN_METHOD_PQ,
+  NDVSS_KNN_METHOD_DISKANN
+};
+
+typedef struct ndvss_knn_vtab {
+  sqlite3_vtab      base;
+  ndvss_connection* connection;
+  int               element_size;
+} ndvss_knn_vtab;
+
+typedef struct ndvss_knn_cursor {
+  sqlite3_vtab_cursor base;
+  ndvss_topk          results;
+  int                 metric;
+  int                 position;
+} ndvss_knn_cursor;
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_knn_connect
+// Desc: xConnect/xCreate of the k-NN functions. The element type is picked from the
+//       name of the module.
+//----------------------------------------------------------------------------------------
+static int ndvss_knn_connect( sqlite3* db,
+                              void* pAux,
+                              int argc, 
+                              const char* const* argv,
+                              sqlite3_vtab** ppVtab,
+                              char** pzErr )
+{
+  int rc = sqlite3_declare_vtab(db, "CREATE TABLE x(id INTEGER, similarity REAL, "
+                                    "query HIDDEN, table_name HIDDEN, column_name HIDDEN, "
+                                    "k HIDDEN, metric HIDDEN, method HIDDEN, partial HIDDEN)");
+  if( rc != SQLITE_OK ) {
+    return rc;
+  }
+  ndvss_knn_vtab* vtab = (ndvss_knn_vtab*)sqlite3_malloc(sizeof(ndvss_knn_vtab));
+  if( vtab == 0 ) {
+    return SQLITE_NOMEM;
+  }
+  memset(vtab, 0, sizeof(ndvss_knn_vtab));
+  vtab->connection = (ndvss_connection*)pAux;
+  size_t name_length = strlen(argv[0]);
+  vtab->element_size = (name_length > 0 && argv[0][name_length - 1] == 'd') ? sizeof(double) : sizeof(float);
+  sqlite3_vtab_config(db, SQLITE_VTAB_DIRECTONLY);
+  *ppVtab = &vtab->base;
+  return SQLITE_OK;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_knn_disconnect
+//----------------------------------------------------------------------------------------
+static int ndvss_knn_disconnect( sqlite3_vtab* pVtab )
+{
+  sqlite3_free(pVtab);
+  return SQLITE_OK;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_knn_estimate_rows
+// Desc: Lowers the estimated rows of a k-NN plan when a similarity constraint lets only
+//       a few of them through, e.g. WHERE similarity >= 0.8, using the sample of the 
+//       column if ndvss_estimate_count_f/_d has taken one. The values of the arguments
+//       are only known here when they are literals (SQLite 3.38 and later); without 
+//       the searched vector the estimate is for a typical vector of the column.
+// Args: The vtab, the index info and the constraint of each argument, -1 if not given.
+//----------------------------------------------------------------------------------------
+static void ndvss_knn_estimate_rows( ndvss_knn_vtab* vtab, 
+                                     sqlite3_index_info* pIdxInfo, 
+                                     const int* argument_constraint )
+{
+  if( sqlite3_libversion_number() < 3038000 || argument_constraint[1] < 0 || argument_constraint[2] < 0 ) {
+    return;
+  }
+  int similarity_constraint = -1;
+  int i;
+  for( i = 0; i < pIdxInfo->nConstraint; ++i ) {
+    const struct sqlite3_index_constraint* constraint = &pIdxInfo->aConstraint[i];
+    if( constraint->usable && constraint->iColumn == NDVSS_KNN_COLUMN_SIMILARITY &&
+        (constraint->op == SQLITE_INDEX_CONSTRAINT_GT || constraint->op == SQLITE_INDEX_CONSTRAINT_GE ||
+         constraint->op == SQLITE_INDEX_CONSTRAINT_LT || constraint->op == SQLITE_INDEX_CONSTRAINT_LE) ) {
+      similarity_constraint = i;
+      break;
+    }
+  }
+  sqlite3_value* threshold = 0;
+  sqlite3_value* table = 0;
+  sqlite3_value* column = 0;
+  if( similarity_constraint < 0 ||
+      sqlite3_vtab_rhs_value(pIdxInfo, similarity_constraint, &threshold) != SQLITE_OK ||
+      sqlite3_vtab_rhs_value(pIdxInfo, argument_constraint[1], &table) != SQLITE_OK ||
+      sqlite3_vtab_rhs_value(pIdxInfo, argument_constraint[2], &column) != SQLITE_OK ||
+      sqlite3_value_type(table) != SQLITE_TEXT || sqlite3_value_type(column) != SQLITE_TEXT ) {
+    return;
+  }
+  sqlite3_value* value = 0;
+  const char* metric_name = 0;
+  if( argument_constraint[4] >= 0 ) {
+    if( sqlite3_vtab_rhs_value(pIdxInfo, argument_constraint[4], &value) != SQLITE_OK ) {
+      return;
+    }
+    metric_name = (const char*)sqlite3_value_text(value);
+  }
+  int metric = ndvss_metric_from_name(metric_name);
+  unsigned char op = pIdxInfo->aConstraint[similarity_constraint].op;
+  int at_least = op == SQLITE_INDEX_CONSTRAINT_GT || op == SQLITE_INDEX_CONSTRAINT_GE;
+  if( metric < 0 || at_least != (metric == NDVSS_METRIC_COSINE || metric == NDVSS_METRIC_DOT_PRODUCT) ) {
+    return;
+  }
+  sqlite3_int64 k = NDVSS_KNN_DEFAULT_K;
+  if( argument_constraint[3] >= 0 ) {
+    if( sqlite3_vtab_rhs_value(pIdxInfo, argument_constraint[3], &value) != SQLITE_OK ) {
+      return;
+    }
+    k = sqlite3_value_int64(value);
+  }
+  const char* table_text = (const char*)sqlite3_value_text(table);
+  const char* dot = strchr(table_text, '.');
+  char* db_name = dot != 0 ? sqlite3_mprintf("%.*s", (int)(dot - table_text), table_text) : sqlite3_mprintf("main");
+  if( db_name == 0 ) {
+    return;
+  }
+  ndvss_score_sample* sample = ndvss_score_sample_find(vtab->connection, db_name, dot != 0 ? dot + 1 : table_text,
+                                                       (const char*)sqlite3_value_text(column), vtab->element_size);
+  sqlite3_free(db_name);
+  if( sample == 0 ) {
+    return;
+  }
+  void* searched_array = 0;
+  if( argument_constraint[0] >= 0 && sqlite3_vtab_rhs_value(pIdxInfo, argument_constraint[0], &value) == SQLITE_OK &&
+      sqlite3_value_type(value) == SQLITE_BLOB && sqlite3_value_bytes(value) == sample->vector_bytes ) {
+    searched_array = ndvss_aligned_malloc((sqlite3_uint64)sample->vector_bytes, NDVSS_ALIGNMENT);
+    if( searched_array == 0 ) {
+      return;
+    }
+    memcpy(searched_array, sqlite3_value_blob(value), (size_t)sample->vector_bytes);
+  }
+  double estimate = ndvss_score_sample_estimate(sample, metric, searched_array, sqlite3_value_double(threshold));
+  ndvss_aligned_free(searched_array);
+  if( estimate < 0.0 ) {
+    return;
+  }
+  pIdxInfo->estimatedRows = estimate < (double)k ? (sqlite3_int64)estimate + 1 : k;
+  NDVSS_STAT_ADD(planner_estimates, 1);
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_knn_best_index
+// Desc: The searched vector and table are required. idxNum has a bit set for
+//       each of the arguments that are given, in the order of the hidden columns.
+//----------------------------------------------------------------------------------------
+static int ndvss_knn_best_index( sqlite3_vtab* pVtab, sqlite3_index_info* pIdxInfo )
+{
+  int argument_constraint[NDVSS_KNN_ARGUMENT_COUNT];
+  int i;
+  for( i = 0; i < NDVSS_KNN_ARGUMENT_COUNT; ++i ) {
+    argument_constraint[i] = -1;
+  }
+  for( i = 0; i < pIdxInfo->nConstraint; ++i ) {
+    const struct sqlite3_index_constraint* constraint = &pIdxInfo->aConstraint[i];
+    int argument = constraint->iColumn - NDVSS_KNN_FIRST_ARGUMENT;
+    if( argument < 0 || argument >= NDVSS_KNN_ARGUMENT_COUNT ) {
+      continue;
+    }
+    if( constraint->op != SQLITE_INDEX_CONSTRAINT_EQ ) {
+      continue;
+    }
+    if( !constraint->usable ) {
+      // A required argument that can't be used yet makes the plan unusable.
+      return SQLITE_CONSTRAINT;
+    }
+    argument_constraint[argument] = i;
+  }
+  int idx_num = 0;
+  int argv_index = 0;
+  for( i = 0; i < NDVSS_KNN_ARGUMENT_COUNT; ++i ) {
+    if( argument_constraint[i] < 0 ) {
+      continue;
+    }
+    idx_num |= (1 << i);
+    pIdxInfo->aConstraintUsage[argument_constraint[i]].argvIndex = ++argv_index;
+    pIdxInfo->aConstraintUsage[argument_constraint[i]].omit = 1;
+  }
+  if( (idx_num & 3) != 3 ) {
+    sqlite3_free(pVtab->zErrMsg);
+    pVtab->zErrMsg = sqlite3_mprintf("The searched array and table need to be given.");
+    return SQLITE_ERROR;
+  }
+  pIdxInfo->idxNum = idx_num;
+  pIdxInfo->estimatedCost = 1000000.0;
+  pIdxInfo->estimatedRows = NDVSS_KNN_DEFAULT_K;
+  ndvss_knn_estimate_rows((ndvss_knn_vtab*)pVtab, pIdxInfo, argument_constraint);
+  return SQLITE_OK;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_knn_open
+//----------------------------------------------------------------------------------------
+static int ndvss_knn_open( sqlite3_vtab* pVtab, sqlite3_vtab_cursor** ppCursor )
+{
+  ndvss_knn_cursor* cursor = (ndvss_knn_cursor*)sqlite3_malloc(sizeof(ndvss_knn_cursor));
+  if( cursor == 0 ) {
+    return SQLITE_NOMEM;
+  }
+  memset(cursor, 0, sizeof(ndvss_knn_cursor));
+  *ppCursor = &cursor->base;
+  return SQLITE_OK;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_knn_close
+//----------------------------------------------------------------------------------------
+static int ndvss_knn_close( sqlite3_vtab_cursor* pCursor )
+{
+  ndvss_knn_cursor* cursor = (ndvss_knn_cursor*)pCursor;
+  ndvss_topk_free(&cursor->results);
+  sqlite3_free(cursor);
+  return SQLITE_OK;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_knn_table_search
+// Desc: Searches a column of a table: through its live index if it has one, through 
+//       the cached vectors or by streaming the table when the vector cache is off.
+// Args: Connection, database and table name, column, element size, metric, method,
+//       the aligned searched vector and its size, the initialized top-k that gets the
+//       sorted results and a pointer for an error message.
+// Returns: SQLite result code.
+//----------------------------------------------------------------------------------------
+static int ndvss_knn_table_search( ndvss_connection* connection,
+                                   const char* db_name,
+                                   const char* table_name,
+                                   const char* column,
+                                   int element_size,
+                                   int metric,
+                                   int method,
+                                   const void* searched_array,
+                                   int vector_bytes,
+                                   ndvss_topk* topk,
+                                   char** error_message )
+{
+  int rc;
+  ndvss_live_table* live = ndvss_live_table_find(connection, db_name, table_name);
+  if( live != 0 ) {
+    rc = ndvss_live_search(live, column, element_size, metric, searched_array, vector_bytes,
+                           method == NDVSS_KNN_METHOD_PQ, topk, error_message);
+  } else if( !NDVSS_CONFIG(NDVSS_CONFIG_VECTOR_CACHE) ) {
+    rc = ndvss_pipeline_scan(connection->db, db_name, table_name, column, element_size, vector_bytes,
+                             metric, searched_array, topk, error_message);
+  } else {
+    ndvss_vector_set* set = 0;
+    rc = ndvss_vector_set_get(connection, db_name, table_name, column, 
+                              element_size, vector_bytes, &set, error_message);
+    if( rc == SQLITE_OK && set->count > 0 && set->vector_bytes != vector_bytes ) {
+      *error_message = sqlite3_mprintf("The arrays are not the same length.");
+      rc = SQLITE_ERROR;
+    }
+    if( rc == SQLITE_OK ) {
+      rc = ndvss_topk_fit(topk, set->count);
+    }
+    if( rc == SQLITE_OK && method == NDVSS_KNN_METHOD_PQ ) {
+      rc = ndvss_pq_search(connection->db, set, metric, searched_array, topk);
+    } else if( rc == SQLITE_OK ) {
+      rc = ndvss_ivf_ensure(set);
+      if( rc == SQLITE_OK ) {
+        rc = ndvss_scan(set, metric, searched_array, topk);
+      }
+    }
+    ndvss_vector_set_unpin(set);
+  }
+  ndvss_topk_sort(topk);
+  return rc;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_filter_table
+// Desc: Finds the table argument (the second hidden column) of the k-NN style functions
+//       in the arguments of xFilter, to name their task.
+// Returns: The table, 0 if it wasn't given.
+//----------------------------------------------------------------------------------------
+static const char* ndvss_filter_table( int idxNum, sqlite3_value** argv )
+{
+  return (idxNum & 2) ? (const char*)sqlite3_value_text(argv[idxNum & 1]) : 0;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_knn_run
+// Desc: Runs the search. All the results are computed here, the rest of the cursor
+//       only walks through them.
+//----------------------------------------------------------------------------------------
+static int ndvss_knn_run( sqlite3_vtab_cursor* pCursor,
+                          int idxNum, 
+                          const char* idxStr,
+                          int argc, 
+                          sqlite3_value** argv )
+{
+  ndvss_knn_cursor* cursor = (ndvss_knn_cursor*)pCursor;
+  ndvss_knn_vtab* vtab = (ndvss_knn_vtab*)pCursor->pVtab;
+  sqlite3_value* arguments[NDVSS_KNN_ARGUMENT_COUNT];
+  int i, j = 0;
+  for( i = 0; i < NDVSS_KNN_ARGUMENT_COUNT; ++i ) {
+    arguments[i] = (idxNum & (1 << i)) ? argv[j++] : 0;
+  }
+  ndvss_topk_free(&cursor->results);
+  cursor->position = 0;
+
+  sqlite3_value* query = arguments[0];
+  const char* table = (const char*)sqlite3_value_text(arguments[1]);
+  // A shared memory segment is searched like an index file.
+  int is_shm = table != 0 && sqlite3_strnicmp(table, "shm:", 4) == 0;
+  int is_file = is_shm || (table != 0 && sqlite3_strnicmp(table, "file:", 5) == 0);
+  if( sqlite3_value_type(query) == SQLITE_NULL || table == 0 ||
+      (!is_file && (arguments[2] == 0 || sqlite3_value_type(arguments[2]) == SQLITE_NULL)) ) {
+    vtab->base.zErrMsg = sqlite3_mprintf("One of the required arguments is null.");
+    return SQLITE_ERROR;
+  }
+  sqlite3_int64 k_value = NDVSS_KNN_DEFAULT_K;
+  if( arguments[3] != 0 && sqlite3_value_type(arguments[3]) != SQLITE_NULL ) {
+    k_value = sqlite3_value_int64(arguments[3]);
+  }
+  if( k_value < 1 || k_value > NDVSS_KNN_MAX_K ) {
+    vtab->base.zErrMsg = sqlite3_mprintf("k needs to be between 1 and %d.", NDVSS_KNN_MAX_K);
+    return SQLITE_ERROR;
+  }
+  int k = (int)k_value;
+  const char* metric_name = arguments[4] != 0 ? (const char*)sqlite3_value_text(arguments[4]) : 0;
+  cursor->metric = ndvss_metric_from_name(metric_name);
+  if( cursor->metric < 0 ) {
+    vtab->base.zErrMsg = sqlite3_mprintf("Unknown metric. Use cosine, euclidean, euclidean_squared or dot_product.");
+    return SQLITE_ERROR;
+  }
+  const char* method_name = arguments[5] != 0 ? (const char*)sqlite3_value_text(arguments[5]) : 0;
+  int method = NDVSS_KNN_METHOD_EXACT;
+  if( method_name != 0 && sqlite3_stricmp(method_name, "pq") == 0 ) {
+    method = NDVSS_KNN_METHOD_PQ;
+  } else if( method_name != 0 && sqlite3_stricmp(method_name, "diskann") == 0 ) {
+    method = NDVSS_KNN_METHOD_DISKANN;
+  } else if( method_name != 0 && sqlite3_stricmp(method_name, "exact") != 0 ) {
+    vtab->base.zErrMsg = sqlite3_mprintf("Unknown method. Use exact, pq or diskann.");
+    return SQLITE_ERROR;
+  }
+  if( method == NDVSS_KNN_METHOD_PQ && !is_file && !NDVSS_CONFIG(NDVSS_CONFIG_VECTOR_CACHE) ) {
+    vtab->base.zErrMsg = sqlite3_mprintf("The %s method needs the vector cache of a table or an index file.", method_name);
+    return SQLITE_ERROR;
+  }
+  if( method == NDVSS_KNN_METHOD_DISKANN && (!is_file || is_shm) ) {
+    vtab->base.zErrMsg = sqlite3_mprintf("The diskann method searches a 'file:' made with ndvss_diskann_build_f/_d.");
+    return SQLITE_ERROR;
+  }
+  int vector_bytes = sqlite3_value_bytes(query);
+  if( vector_bytes < vtab->element_size ) {
+    vtab->base.zErrMsg = sqlite3_mprintf("The searched array is empty.");
+    return SQLITE_ERROR;
+  }
+  // The searched vector is copied so that it's aligned the same way as the stored ones.
+  void* searched_array = ndvss_aligned_malloc((sqlite3_uint64)vector_bytes, NDVSS_ALIGNMENT);
+  if( searched_array == 0 ) {
+    return SQLITE_NOMEM;
+  }
+  memcpy(searched_array, sqlite3_value_blob(query), (size_t)vector_bytes);
+
+  if( is_file ) {
+    char* error_message = 0;
+    int rc = ndvss_topk_init(&cursor->results, k);
+    ndvss_vector_set* index_file = 0;
+    if( rc == SQLITE_OK && is_shm ) {
+      rc = ndvss_shm_get(vtab->connection, table + 4, &index_file, &error_message);
+    } else if( rc == SQLITE_OK && method != NDVSS_KNN_METHOD_DISKANN ) {
+      // An attached index file is searched in place, the pq method attaches it on first use.
+      char* path = ndvss_resolve_path(vtab->connection->db, table + 5);
+      rc = path == 0 ? SQLITE_NOMEM : ndvss_index_find(vtab->connection, path, method == NDVSS_KNN_METHOD_PQ, 
+                                                       &index_file, &error_message);
+      sqlite3_free(path);
+    }
+    if( rc == SQLITE_OK && method == NDVSS_KNN_METHOD_DISKANN ) {
+      ndvss_diskann* index = 0;
+      rc = ndvss_diskann_get(vtab->connection, table + 5, &index, &error_message);
+      if( rc == SQLITE_OK && (int)index->header.element_size != vtab->element_size ) {
+        error_message = sqlite3_mprintf("The file contains %s.", index->header.element_size == sizeof(double) ? "doubles" : "floats");
+        rc = SQLITE_ERROR;
+      }
+      if( rc == SQLITE_OK ) {
+        rc = ndvss_diskann_search(vtab->connection->db, index, cursor->metric, searched_array, vector_bytes, &cursor->results, &error_message);
+      }
+      ndvss_topk_sort(&cursor->results);
+    } else if( rc == SQLITE_OK && index_file != 0 ) {
+      if( index_file->element_size != vtab->element_size ) {
+        error_message = sqlite3_mprintf("The file contains %s.", index_file->element_size == sizeof(double) ? "doubles" : "floats");
+        rc = SQLITE_ERROR;
+      } else if( index_file->count > 0 && index_file->vector_bytes != vector_bytes ) {
+        error_message = sqlite3_mprintf("The arrays are not the same length.");
+        rc = SQLITE_ERROR;
+      } else {
+        rc = ndvss_topk_fit(&cursor->results, index_file->count);
+        if( rc == SQLITE_OK && method == NDVSS_KNN_METHOD_PQ ) {
+          rc = ndvss_pq_search(vtab->connection->db, index_file, cursor->metric, searched_array, &cursor->results);
+        } else if( rc == SQLITE_OK ) {
+          rc = ndvss_ivf_ensure(index_file);
+          if( rc == SQLITE_OK ) {
+            rc = ndvss_scan(index_file, cursor->metric, searched_array, &cursor->results);
+          }
+        }
+      }
+      ndvss_topk_sort(&cursor->results);
+    } else if( rc == SQLITE_OK ) {
+      rc = ndvss_flat_scan(vtab->connection->db, table + 5, vtab->element_size,
+                           cursor->metric, searched_array, vector_bytes, &cursor->results, &error_message);
+      ndvss_topk_sort(&cursor->results);
+    }
+    ndvss_aligned_free(searched_array);
+    if( error_message != 0 ) {
+      vtab->base.zErrMsg = error_message;
+    }
+    return rc;
+  }
+  const char* column = (const char*)sqlite3_value_text(arguments[2]);
+  const char* dot = strchr(table, '.');
+  char* db_name = dot != 0 ? sqlite3_mprintf("%.*s", (int)(dot - table), table) : sqlite3_mprintf("main");
+  const char* table_name = dot != 0 ? dot + 1 : table;
+  if( db_name == 0 ) {
+    ndvss_aligned_free(searched_array);
+    return SQLITE_NOMEM;
+  }
+  ndvss_connection* connection = vtab->connection;
+  char* error_message = 0;
+  int rc = SQLITE_OK;
+  int use_result_cache = NDVSS_CONFIG(NDVSS_CONFIG_RESULT_CACHE_ENTRIES) > 0;
+  sqlite3_uint64 hash = 0;
+  sqlite3_uint64 settings = ndvss_result_cache_settings();
+  sqlite3_int64 data_version = 0, total_changes = 0;
+  int autocommit = sqlite3_get_autocommit(connection->db);
+  if( use_result_cache ) {
+    hash = ndvss_result_cache_hash(table, column, vtab->element_size, cursor->metric, method, settings,
+                                   searched_array, vector_bytes);
+    rc = ndvss_table_snapshot(connection->db, db_name, &data_version, &total_changes);
+    if( rc != SQLITE_OK ) {
+      error_message = sqlite3_mprintf("%s", sqlite3_errmsg(connection->db));
+    } else {
+      rc = ndvss_result_cache_get(connection, hash, table, column, vtab->element_size, cursor->metric, method,
+                                  settings, searched_array, vector_bytes, k, data_version, total_changes, autocommit, 
+                                  &cursor->results);
+      if( rc == SQLITE_OK ) {
+        sqlite3_free(db_name);
+        ndvss_aligned_free(searched_array);
+        return SQLITE_OK;
+      }
+      if( rc == SQLITE_NOTFOUND && NDVSS_CONFIG(NDVSS_CONFIG_SEMANTIC_CACHE_EPSILON) > 0 ) {
+        // Approximate results aren't stored, so that they don't drift further.
+        rc = ndvss_semantic_cache_get(connection, db_name, table_name, table, column, vtab->element_size, 
+                                      cursor->metric, method, settings, searched_array, vector_bytes, k, data_version, 
+                                      total_changes, autocommit, &cursor->results);
+        if( rc == SQLITE_OK ) {
+          sqlite3_free(db_name);
+          ndvss_aligned_free(searched_array);
+          return SQLITE_OK;
+        }
+      }
+      if( rc == SQLITE_NOTFOUND ) {
+        rc = SQLITE_OK;
+      }
+    }
+  }
+  if( rc == SQLITE_OK ) {
+    rc = ndvss_topk_init(&cursor->results, k);
+  }
+  if( rc == SQLITE_OK ) {
+    rc = ndvss_knn_table_search(connection, db_name, table_name, column, vtab->element_size, cursor->metric,
+                                method, searched_array, vector_bytes, &cursor->results, &error_message);
+  }
+  if( rc == SQLITE_OK && use_result_cache && !cursor->results.partial ) {
+    // A result that can't be cached is still a result.
+    ndvss_result_cache_put(connection, hash, table, column, vtab->element_size, cursor->metric, method,
+                           settings, searched_array, vector_bytes, data_version, total_changes, autocommit, &cursor->results);
+  }
+  sqlite3_free(db_name);
+  ndvss_aligned_free(searched_array);
+  if( error_message != 0 ) {
+    vtab->base.zErrMsg = error_message;
+  }
+  return rc;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_knn_filter
+// Desc: Runs the search as a task of the connection, see ndvss_progress().
+//----------------------------------------------------------------------------------------
+static int ndvss_knn_filter( sqlite3_vtab_cursor* pCursor,
+                             int idxNum, 
+                             const char* idxStr,
+                             int argc, 
+                             sqlite3_value** argv )
+{
+  ndvss_knn_vtab* vtab = (ndvss_knn_vtab*)pCursor->pVtab;
+  ndvss_task task;
+  ndvss_task_begin(&task, vtab->connection->db, "knn", ndvss_filter_table(idxNum, argv));
+  int rc = ndvss_knn_run(pCursor, idxNum, idxStr, argc, argv);
+  ndvss_task_end(&task);
+  if( rc == SQLITE_NOMEM && vtab->base.zErrMsg == 0 ) {
+    // SQLite reports the error of a virtual table with the table's message only.
+    vtab->base.zErrMsg = sqlite3_mprintf("Out of memory.");
+  }
+  return rc;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_knn_next
+//----------------------------------------------------------------------------------------
+static int ndvss_knn_next( sqlite3_vtab_cursor* pCursor )
+{
+  ++((ndvss_knn_cursor*)pCursor)->position;
+  return SQLITE_OK;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_knn_eof
+//----------------------------------------------------------------------------------------
+static int ndvss_knn_eof( sqlite3_vtab_cursor* pCursor )
+{
+  ndvss_knn_cursor* cursor = (ndvss_knn_cursor*)pCursor;
+  return cursor->position >= cursor->results.count;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_knn_column
+//----------------------------------------------------------------------------------------
+static int ndvss_knn_column( sqlite3_vtab_cursor* pCursor, sqlite3_context* context, int column )
+{
+  ndvss_knn_cursor* cursor = (ndvss_knn_cursor*)pCursor;
+  switch( column ) {
+    case NDVSS_KNN_COLUMN_ID:
+      sqlite3_result_int64(context, cursor->results.rowids[cursor->position]);
+      break;
+    case NDVSS_KNN_COLUMN_SIMILARITY:
+      sqlite3_result_double(context, ndvss_metric_similarity(cursor->metric, cursor->results.distances[cursor->position]));
+      break;
+    case NDVSS_KNN_COLUMN_PARTIAL:
+      sqlite3_result_int(context, cursor->results.partial);
+      break;
+    default:
+      sqlite3_result_null(context);
+      break;
+  }
+  return SQLITE_OK;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_knn_rowid
+//----------------------------------------------------------------------------------------
+static int ndvss_knn_rowid( sqlite3_vtab_cursor* pCursor, sqlite3_int64* pRowid )
+{
+  ndvss_knn_cursor* cursor = (ndvss_knn_cursor*)pCursor;
+  *pRowid = cursor->position + 1;
+  return SQLITE_OK;
+}
+
+
+static sqlite3_module ndvss_knn_module = {
+  0,                        // iVersion
+  0,                        // xCreate: eponymous only
+  ndvss_knn_connect,        // xConnect
+  ndvss_knn_best_index,     // xBestIndex
+  ndvss_knn_disconnect,     // xDisconnect
+  0,                        // xDestroy
+  ndvss_knn_open,           // xOpen
+  ndvss_knn_close,          // xClose
+  ndvss_knn_filter,         // xFilter
+  ndvss_knn_next,           // xNext
+  ndvss_knn_eof,            // xEof
+  ndvss_knn_column,         // xColumn
+  ndvss_knn_rowid,          // xRowid
+  0,                        // xUpdate
+  0,                        // xBegin
+  0,                        // xSync
+  0,                        // xCommit
+  0,                        // xRollback
+  0,                        // xFindFunction
+  0,                        // xRename
+  0,                        // xSavepoint
+  0,                        // xRelease
+  0,                        // xRollbackTo
+  0                         // xShadowName
+};
+
+
+//----------------------------------------------------------------------------------------
+// GROUPED TOP-K.
+// ndvss_topk_per_group_f and ndvss_topk_per_group_d return the k best groups of rows 
+// and up to per_group rows of each, e.g. the 10 documents with the best chunks:
+//   SELECT id, group_id, similarity 
+//   FROM ndvss_topk_per_group_f(searched, 'chunks', 'embedding', 'document_id', 10, 3);
+// A group is ranked by its best row. The rows are scored in one pass over the cached
+// vectors: a hash of the groups keeps the best rows of each group and a max-heap holds
+// the k groups with the best scores, its root is the group that drops out next. The 
+// group keys are read from the table once per cached copy of the column.
+//----------------------------------------------------------------------------------------
+#define NDVSS_GROUP_NONE              ((sqlite3_int64)(((sqlite3_uint64)1) << 63))
+#define NDVSS_GROUP_COLUMN_ID         0
+#define NDVSS_GROUP_COLUMN_GROUP_ID   1
+#define NDVSS_GROUP_COLUMN_SIMILARITY 2
+#define NDVSS_GROUP_FIRST_ARGUMENT    3
+#define NDVSS_GROUP_ARGUMENT_COUNT    7
+#define NDVSS_GROUP_MAX_PER_GROUP     1000
+
+typedef struct ndvss_group_entry {
+  sqlite3_int64 group;
+  double        best;
+  int           count;           // Rows kept, up to per_group.
+  int           heap_position;   // Position in the heap of the best groups, -1 if not in it.
+} ndvss_group_entry;
+
+typedef struct ndvss_group_topk {
+  int                k;
+  int                per_group;
+  ndvss_group_entry* entries;
+  int                entry_count;
+  int                entry_capacity;
+  int*               slots;       // Entry of each hash slot, -1 = empty.
+  int                slot_capacity; // A power of 2.
+  double*            distances;   // per_group rows of each entry.
+  sqlite3_int64*     rowids;
+  int*               heap;        // Entries of the k best groups, the worst at the root.
+  int                heap_count;
+} ndvss_group_topk;
+
+typedef struct ndvss_group_cursor {
+  sqlite3_vtab_cursor base;
+  int                 metric;
+  int                 count;
+  int                 position;
+  sqlite3_int64*      rowids;
+  sqlite3_int64*      groups;
+  double*             distances;
+} ndvss_group_cursor;
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_group_topk_init
+// Returns: SQLITE_OK or SQLITE_NOMEM.
+//----------------------------------------------------------------------------------------
+static int ndvss_group_topk_init( ndvss_group_topk* topk, int k, int per_group )
+{
+  memset(topk, 0, sizeof(ndvss_group_topk));
+  topk->k = k;
+  topk->per_group = per_group;
+  topk->heap = (int*)sqlite3_malloc64(sizeof(int) * (sqlite3_uint64)k);
+  return topk->heap != 0 ? SQLITE_OK : SQLITE_NOMEM;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_group_topk_free
+//----------------------------------------------------------------------------------------
+static void ndvss_group_topk_free( ndvss_group_topk* topk )
+{
+  sqlite3_free(topk->entries);
+  sqlite3_free(topk->slots);
+  sqlite3_free(topk->distances);
+  sqlite3_free(topk->rowids);
+  sqlite3_free(topk->heap);
+  memset(topk, 0, sizeof(ndvss_group_topk));
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_group_topk_slot
+// Desc: Finds the hash slot of a group, or the empty slot where it goes.
+//----------------------------------------------------------------------------------------
+static int* ndvss_group_topk_slot( const ndvss_group_topk* topk, sqlite3_int64 group )
+{
+  sqlite3_uint64 mask = (sqlite3_uint64)topk->slot_capacity - 1;
+  sqlite3_uint64 i = ((sqlite3_uint64)group * 0x9E3779B97F4A7C15ULL) >> 17;
+  for( ;; ++i ) {
+    int* slot = &topk->slots[i & mask];
+    if( *slot < 0 || topk->entries[*slot].group == group ) {
+      return slot;
+    }
+  }
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_group_topk_heap_move
+// Desc: Restores the max-heap of the best groups after the score of the entry at a 
+//       position has changed.
+//----------------------------------------------------------------------------------------
+static void ndvss_group_topk_heap_move( ndvss_group_topk* topk, int position )
+{
+  int* heap = topk->heap;
+  ndvss_group_entry* entries = topk->entries;
+  int entry = heap[position];
+  while( position > 0 && entries[heap[(position - 1) / 2]].best < entries[entry].best ) {
+    heap[position] = heap[(position - 1) / 2];
+    entries[heap[position]].heap_position = position;
+    position = (position - 1) / 2;
+  }
+  for( ;; ) {
+    int child = position * 2 + 1;
+    if( child >= topk->heap_count ) {
+      break;
+    }
+    if( child + 1 < topk->heap_count && entries[heap[child + 1]].best > entries[heap[child]].best ) {
+      ++child;
+    }
+    if( entries[heap[child]].best <= entries[entry].best ) {
+      break;
+    }
+    heap[position] = heap[child];
+    entries[heap[position]].heap_position = position;
+    position = child;
+  }
+  heap[position] = entry;
+  entries[entry].heap_position = position;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_group_topk_add
+// Desc: Adds a scored row of a group.
+// Returns: SQLITE_OK or SQLITE_NOMEM.
+//----------------------------------------------------------------------------------------
+static int ndvss_group_topk_add( ndvss_group_topk* topk, double distance, sqlite3_int64 rowid, sqlite3_int64 group )
+{
+  if( (topk->entry_count + 1) * 2 > topk->slot_capacity ) {
+    int capacity = topk->slot_capacity < 1024 ? 1024 : topk->slot_capacity * 2;
+    int* slots = (int*)sqlite3_malloc64(sizeof(int) * (sqlite3_uint64)capacity);
+    if( slots == 0 ) {
+      return SQLITE_NOMEM;
+    }
+    sqlite3_free(topk->slots);
+    topk->slots = slots;
+    topk->slot_capacity = capacity;
+    memset(slots, 0xFF, sizeof(int) * (size_t)capacity);
+    int e;
+    for( e = 0; e < topk->entry_count; ++e ) {
+      *ndvss_group_topk_slot(topk, topk->entries[e].group) = e;
+    }
+  }
+  int* slot = ndvss_group_topk_slot(topk, group);
+  int per_group = topk->per_group;
+  if( *slot < 0 ) {
+    if( topk->entry_count == topk->entry_capacity ) {
+      int capacity = topk->entry_capacity < 256 ? 256 : topk->entry_capacity * 2;
+      ndvss_group_entry* entries = (ndvss_group_entry*)sqlite3_realloc64(topk->entries, sizeof(ndvss_group_entry) * (sqlite3_uint64)capacity);
+      if( entries == 0 ) {
+        return SQLITE_NOMEM;
+      }
+      topk->entries = entries;
+      double* distances = (double*)sqlite3_realloc64(topk->distances, sizeof(double) * (sqlite3_uint64)capacity * per_group);
+      if( distances == 0 ) {
+        return SQLITE_NOMEM;
+      }
+      topk->distances = distances;
+      sqlite3_int64* rowids = (sqlite3_int64*)sqlite3_realloc64(topk->rowids, sizeof(sqlite3_int64) * (sqlite3_uint64)capacity * per_group);
+      if( rowids == 0 ) {
+        return SQLITE_NOMEM;
+      }
+      topk->rowids = rowids;
+      topk->entry_capacity = capacity;
+    }
+    ndvss_group_entry* entry = &topk->entries[topk->entry_count];
+    entry->group = group;
+    entry->best = distance;
+    entry->count = 0;
+    entry->heap_position = -1;
+    *slot = topk->entry_count++;
+  }
+  int e = *slot;
+  ndvss_group_entry* entry = &topk->entries[e];
+  double* distances = topk->distances + (size_t)e * per_group;
+  sqlite3_int64* rowids = topk->rowids + (size_t)e * per_group;
+  if( entry->count < per_group ) {
+    distances[entry->count] = distance;
+    rowids[entry->count] = rowid;
+    ++entry->count;
+  } else {
+    int worst = 0, i;
+    for( i = 1; i < per_group; ++i ) {
+      if( distances[i] > distances[worst] ) {
+        worst = i;
+      }
+    }
+    if( distance >= distances[worst] ) {
+      return SQLITE_OK;
+    }
+    distances[worst] = distance;
+    rowids[worst] = rowid;
+  }
+  if( distance > entry->best || (distance == entry->best && entry->count > 1) ) {
+    return SQLITE_OK;
+  }
+  entry->best = distance;
+  if( entry->heap_position >= 0 ) {
+    ndvss_group_topk_heap_move(topk, entry->heap_position);
+  } else if( topk->heap_count < topk->k ) {
+    topk->heap[topk->heap_count++] = e;
+    ndvss_group_topk_heap_move(topk, topk->heap_count - 1);
+  } else if( distance < topk->entries[topk->heap[0]].best ) {
+    topk->entries[topk->heap[0]].heap_position = -1;
+    topk->heap[0] = e;
+    ndvss_group_topk_heap_move(topk, 0);
+  }
+  return SQLITE_OK;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_group_topk_results
+// Desc: Moves the rows of the best groups to a cursor, the groups from the best to the 
+//       worst and the rows of a group from the best to the worst.
+// Returns: SQLITE_OK or SQLITE_NOMEM.
+//----------------------------------------------------------------------------------------
+static int ndvss_group_topk_results( ndvss_group_topk* topk, ndvss_group_cursor* cursor )
+{
+  int total = 0, i, j, n;
+  for( i = 0; i < topk->heap_count; ++i ) {
+    total += topk->entries[topk->heap[i]].count;
+  }
+  cursor->rowids = (sqlite3_int64*)sqlite3_malloc64(sizeof(sqlite3_int64) * (sqlite3_uint64)(total > 0 ? total : 1));
+  cursor->groups = (sqlite3_int64*)sqlite3_malloc64(sizeof(sqlite3_int64) * (sqlite3_uint64)(total > 0 ? total : 1));
+  cursor->distances = (double*)sqlite3_malloc64(sizeof(double) * (sqlite3_uint64)(total > 0 ? total : 1));
+  if( cursor->rowids == 0 || cursor->groups == 0 || cursor->distances == 0 ) {
+    return SQLITE_NOMEM;
+  }
+  // Taking the worst group off the heap until it's empty orders them from the end.
+  int group_count = topk->heap_count;
+  int* order = topk->heap;
+  for( n = topk->heap_count; n > 1; --n ) {
+    int worst = order[0];
+    order[0] = order[n - 1];
+    topk->heap_count = n - 1;
+    ndvss_group_topk_heap_move(topk, 0);
+    order[n - 1] = worst;
+  }
+  n = 0;
+  for( i = 0; i < group_count; ++i ) {
+    int e = order[i];
+    const ndvss_group_entry* entry = &topk->entries[e];
+    double* distances = topk->distances + (size_t)e * topk->per_group;
+    sqlite3_int64* rowids = topk->rowids + (size_t)e * topk->per_group;
+    int first = n;
+    for( j = 0; j < entry->count; ++j, ++n ) {
+      // Insertion sort, per_group is small.
+      int p = n;
+      while( p > first && cursor->distances[p - 1] > distances[j] ) {
+        cursor->distances[p] = cursor->distances[p - 1];
+        cursor->rowids[p] = cursor->rowids[p - 1];
+        --p;
+      }
+      cursor->distances[p] = distances[j];
+      cursor->rowids[p] = rowids[j];
+      cursor->groups[n] = entry->group;
+    }
+  }
+  cursor->count = n;
+  return SQLITE_OK;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_group_keys_get
+// Desc: Returns the group keys of the vectors of a cached set, reading them from the 
+//       table the first time. A shared set can be used by several connections at once,
+//       so only one of them reads.
+// Returns: SQLITE_OK or an error code, with the message in error_message.
+//----------------------------------------------------------------------------------------
+static int ndvss_group_keys_get( sqlite3* db,
+                                   ndvss_vector_set* set,
+                                   const char* db_name,
+                                   const char* table_name,
+                                   const char* group_column,
+                                   const sqlite3_int64** result,
+                                   char** error_message )
+{
+  int locked;
+  for( locked = 0; locked < 2; ++locked ) {
+    const ndvss_group_keys* node;
+    for( node = __atomic_load_n(&set->group_keys, __ATOMIC_ACQUIRE); node != 0; node = node->next ) {
+      if( sqlite3_stricmp(node->column_name, group_column) == 0 ) {
+        *result = node->groups;
+        if( locked ) {
+          ndvss_mutex_unlock(&ndvss_build_mutex);
+        }
+        return SQLITE_OK;
+      }
+    }
+    if( !locked ) {
+      ndvss_mutex_lock(&ndvss_build_mutex);
+    }
+  }
+  int rc = ndvss_column_check(db, db_name, table_name, group_column, error_message);
+  if( rc != SQLITE_OK ) {
+    ndvss_mutex_unlock(&ndvss_build_mutex);
+    return rc;
+  }
+  // Rowid -> position of the set, open addressing.
+  sqlite3_int64 capacity = 1024;
+  while( capacity < set->count * 2 ) {
+    capacity *= 2;
+  }
+  sqlite3_int64* positions = (sqlite3_int64*)sqlite3_malloc64(sizeof(sqlite3_int64) * (sqlite3_uint64)capacity);
+  ndvss_group_keys* node = (ndvss_group_keys*)sqlite3_malloc(sizeof(ndvss_group_keys));
+  char* sql = sqlite3_mprintf("SELECT rowid, \"%w\" FROM \"%w\".\"%w\"", group_column, db_name, table_name);
+  rc = positions != 0 && node != 0 && sql != 0 ? SQLITE_OK : SQLITE_NOMEM;
+  if( node != 0 ) {
+    node->column_name = sqlite3_mprintf("%s", group_column);
+    node->groups = (sqlite3_int64*)sqlite3_malloc64(sizeof(sqlite3_int64) * (sqlite3_uint64)(set->count > 0 ? set->count : 1));
+    if( node->column_name == 0 || node->groups == 0 ) {
+      rc = SQLITE_NOMEM;
+    }
+  }
+  sqlite3_uint64 mask = (sqlite3_uint64)capacity - 1;
+  sqlite3_int64 i;
+  if( rc == SQLITE_OK ) {
+    memset(positions, 0xFF, sizeof(sqlite3_int64) * (size_t)capacity);
+    for( i = 0; i < set->count; ++i ) {
+      sqlite3_uint64 h = ((sqlite3_uint64)set->rowids[i] * 0x9E3779B97F4A7C15ULL) >> 17;
+      while( positions[h & mask] >= 0 ) {
+        ++h;
+      }
+      positions[h & mask] = i;
+      node->groups[i] = NDVSS_GROUP_NONE;
+    }
+  }
+  sqlite3_stmt* stmt = 0;
+  if( rc == SQLITE_OK ) {
+    rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+    if( rc != SQLITE_OK ) {
+      *error_message = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+    }
+  }
+  while( rc == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW ) {
+    sqlite3_int64 rowid = sqlite3_column_int64(stmt, 0);
+    sqlite3_uint64 h = ((sqlite3_uint64)rowid * 0x9E3779B97F4A7C15ULL) >> 17;
+    while( positions[h & mask] >= 0 && set->rowids[positions[h & mask]] != rowid ) {
+      ++h;
+    }
+    if( positions[h & mask] < 0 ) {
+      continue; // No vector.
+    }
+    int type = sqlite3_column_type(stmt, 1);
+    if( type == SQLITE_INTEGER ) {
+      node->groups[positions[h & mask]] = sqlite3_column_int64(stmt, 1);
+    } else if( type != SQLITE_NULL ) {
+      *error_message = sqlite3_mprintf("The group column needs to hold integers.");
+      rc = SQLITE_ERROR;
+    }
+  }
+  if( stmt != 0 && sqlite3_finalize(stmt) != SQLITE_OK && rc == SQLITE_OK ) {
+    *error_message = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+    rc = SQLITE_ERROR;
+  }
+  sqlite3_free(sql);
+  sqlite3_free(positions);
+  if( rc == SQLITE_OK ) {
+    node->next = set->group_keys;
+    __atomic_store_n(&set->group_keys, node, __ATOMIC_RELEASE);
+    *result = node->groups;
+  } else if( node != 0 ) {
+    sqlite3_free(node->column_name);
+    sqlite3_free(node->groups);
+    sqlite3_free(node);
+  }
+  ndvss_mutex_unlock(&ndvss_build_mutex);
+  return rc;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_group_scan
+// Desc: Scores the vectors of a cached set and adds them to the groups.
+// Returns: SQLITE_OK, SQLITE_NOMEM or SQLITE_INTERRUPT.
+//----------------------------------------------------------------------------------------
+static int ndvss_group_scan( const ndvss_vector_set* set,
+                             const sqlite3_int64* groups,
+                             int metric,
+                             const void* searched_array,
+                             ndvss_group_topk* topk )
+{
+  double start = ndvss_now();
+  const int prefetch_distance = (int)NDVSS_CONFIG(NDVSS_CONFIG_PREFETCH_DISTANCE);
+  const int nontemporal = (int)NDVSS_CONFIG(NDVSS_CONFIG_SCAN_NONTEMPORAL);
+  int rc = SQLITE_OK;
+  ndvss_task* task = ndvss_task_current();
+  ndvss_task_phase(task, "scan", set->count);
+  int s, i;
+  for( s = 0; s < set->segment_count && rc == SQLITE_OK; ++s ) {
+    const ndvss_segment* segment = &set->segments[s];
+    const unsigned char* vector = segment->vectors;
+    if( ndvss_task_interrupted(task) ) {
+      rc = SQLITE_INTERRUPT;
+      break;
+    }
+    for( i = 0; i < segment->count && rc == SQLITE_OK; ++i, vector += set->stride ) {
+      if( prefetch_distance > 0 && i + prefetch_distance < segment->count ) {
+        ndvss_prefetch_vector(vector + (size_t)set->stride * (size_t)prefetch_distance, set->vector_bytes, nontemporal);
+      }
+      sqlite3_int64 group = groups[segment->first + i];
+      double distance;
+      if( group != NDVSS_GROUP_NONE && 
+          ndvss_metric_distance(metric, set->element_size, searched_array, vector, set->dimensions, &distance) ) {
+        rc = ndvss_group_topk_add(topk, distance, set->rowids[segment->first + i], group);
+      }
+    }
+    ndvss_task_advance(task, segment->count);
+  }
+  NDVSS_STAT_ADD(scans, 1);
+  NDVSS_STAT_ADD(scan_rows, set->count);
+  NDVSS_STAT_ADD(scan_bytes, set->count * (sqlite3_int64)set->vector_bytes);
+  NDVSS_STAT_ADD(scan_nanoseconds, (sqlite3_int64)((ndvss_now() - start) * 1e9));
+  return rc;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_group_stream
+// Desc: Scores the rows of a table read with a statement, for when the vector cache
+//       is off, and adds them to the groups.
+// Returns: SQLITE_OK or an error code, with the message in error_message.
+//----------------------------------------------------------------------------------------
+static int ndvss_group_stream( sqlite3* db,
+                               const char* db_name,
+                               const char* table_name,
+                               const char* column,
+                               const char* group_column,
+                               int element_size,
+                               int vector_bytes,
+                               int metric,
+                               const void* searched_array,
+                               ndvss_group_topk* topk,
+                               char** error_message )
+{
+  int rc = ndvss_column_check(db, db_name, table_name, column, error_message);
+  if( rc == SQLITE_OK ) {
+    rc = ndvss_column_check(db, db_name, table_name, group_column, error_message);
+  }
+  if( rc != SQLITE_OK ) {
+    return rc;
+  }
+  char* sql = sqlite3_mprintf("SELECT rowid, v.\"%w\", v.\"%w\" FROM \"%w\".\"%w\" AS v WHERE v.\"%w\" IS NOT NULL", 
+                              column, group_column, db_name, table_name, column);
+  if( sql == 0 ) {
+    return SQLITE_NOMEM;
+  }
+  sqlite3_stmt* stmt = 0;
+  rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+  sqlite3_free(sql);
+  if( rc != SQLITE_OK ) {
+    *error_message = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+    return rc;
+  }
+  while( rc == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW ) {
+    int type = sqlite3_column_type(stmt, 2);
+    if( type == SQLITE_NULL ) {
+      continue;
+    }
+    if( type != SQLITE_INTEGER ) {
+      *error_message = sqlite3_mprintf("The group column needs to hold integers.");
+      rc = SQLITE_ERROR;
+      break;
+    }
+    const void* vector = sqlite3_column_blob(stmt, 1);
+    if( sqlite3_column_bytes(stmt, 1) != vector_bytes ) {
+      *error_message = sqlite3_mprintf("The arrays are not the same length.");
+      rc = SQLITE_ERROR;
+      break;
+    }
+    double distance;
+    if( ndvss_metric_distance(metric, element_size, searched_array, vector, vector_bytes / element_size, &distance) ) {
+      rc = ndvss_group_topk_add(topk, distance, sqlite3_column_int64(stmt, 0), sqlite3_column_int64(stmt, 2));
+    }
+  }
+  if( sqlite3_finalize(stmt) != SQLITE_OK && rc == SQLITE_OK ) {
+    *error_message = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+    rc = SQLITE_ERROR;
+  }
+  return rc;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_group_connect
+// Desc: xConnect/xCreate of the grouped top-k functions. The element type is picked 
+//       from the name of the module.
+//----------------------------------------------------------------------------------------
+static int ndvss_group_connect( sqlite3* db,
+                                void* pAux,
+                                int argc, 
+                                const char* const* argv,
+                                sqlite3_vtab** ppVtab,
+                                char** pzErr )
+{
+  int rc = sqlite3_declare_vtab(db, "CREATE TABLE x(id INTEGER, group_id INTEGER, similarity REAL, "
+                                    "query HIDDEN, table_name HIDDEN, column_name HIDDEN, "
+                                    "group_column HIDDEN, k HIDDEN, per_group HIDDEN, metric HIDDEN)");
+  if( rc != SQLITE_OK ) {
+    return rc;
+  }
+  ndvss_knn_vtab* vtab = (ndvss_knn_vtab*)sqlite3_malloc(sizeof(ndvss_knn_vtab));
+  if( vtab == 0 ) {
+    return SQLITE_NOMEM;
+  }
+  memset(vtab, 0, sizeof(ndvss_knn_vtab));
+  vtab->connection = (ndvss_connection*)pAux;
+  size_t name_length = strlen(argv[0]);
+  vtab->element_size = (name_length > 0 && argv[0][name_length - 1] == 'd') ? sizeof(double) : sizeof(float);
+  sqlite3_vtab_config(db, SQLITE_VTAB_DIRECTONLY);
+  *ppVtab = &vtab->base;
+  return SQLITE_OK;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_group_best_index
+// Desc: The searched vector, table, column and group column are required. idxNum has 
+//       a bit set for each of the arguments that are given, in the order of the hidden
+//       columns.
+//----------------------------------------------------------------------------------------
+static int ndvss_group_best_index( sqlite3_vtab* pVtab, sqlite3_index_info* pIdxInfo )
+{
+  int argument_constraint[NDVSS_GROUP_ARGUMENT_COUNT];
+  int i;
+  for( i = 0; i < NDVSS_GROUP_ARGUMENT_COUNT; ++i ) {
+    argument_constraint[i] = -1;
+  }
+  for( i = 0; i < pIdxInfo->nConstraint; ++i ) {
+    const struct sqlite3_index_constraint* constraint = &pIdxInfo->aConstraint[i];
+    int argument = constraint->iColumn - NDVSS_GROUP_FIRST_ARGUMENT;
+    if( argument < 0 || argument >= NDVSS_GROUP_ARGUMENT_COUNT || constraint->op != SQLITE_INDEX_CONSTRAINT_EQ ) {
+      continue;
+    }
+    if( !constraint->usable ) {
+      return SQLITE_CONSTRAINT;
+    }
+    argument_constraint[argument] = i;
+  }
+  int idx_num = 0;
+  int argv_index = 0;
+  for( i = 0; i < NDVSS_GROUP_ARGUMENT_COUNT; ++i ) {
+    if( argument_constraint[i] < 0 ) {
+      continue;
+    }
+    idx_num |= (1 << i);
+    pIdxInfo->aConstraintUsage[argument_constraint[i]].argvIndex = ++argv_index;
+    pIdxInfo->aConstraintUsage[argument_constraint[i]].omit = 1;
+  }
+  if( (idx_num & 15) != 15 ) {
+    sqlite3_free(pVtab->zErrMsg);
+    pVtab->zErrMsg = sqlite3_mprintf("The searched array, table, column and group column need to be given.");
+    return SQLITE_ERROR;
+  }
+  pIdxInfo->idxNum = idx_num;
+  pIdxInfo->estimatedCost = 1000000.0;
+  pIdxInfo->estimatedRows = NDVSS_KNN_DEFAULT_K;
+  return SQLITE_OK;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_group_open
+//----------------------------------------------------------------------------------------
+static int ndvss_group_open( sqlite3_vtab* pVtab, sqlite3_vtab_cursor** ppCursor )
+{
+  ndvss_group_cursor* cursor = (ndvss_group_cursor*)sqlite3_malloc(sizeof(ndvss_group_cursor));
+  if( cursor == 0 ) {
+    return SQLITE_NOMEM;
+  }
+  memset(cursor, 0, sizeof(ndvss_group_cursor));
+  *ppCursor = &cursor->base;
+  return SQLITE_OK;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_group_cursor_clear
+//----------------------------------------------------------------------------------------
+static void ndvss_group_cursor_clear( ndvss_group_cursor* cursor )
+{
+  sqlite3_free(cursor->rowids);
+  sqlite3_free(cursor->groups);
+  sqlite3_free(cursor->distances);
+  cursor->rowids = 0;
+  cursor->groups = 0;
+  cursor->distances = 0;
+  cursor->count = 0;
+  cursor->position = 0;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_group_close
+//----------------------------------------------------------------------------------------
+static int ndvss_group_close( sqlite3_vtab_cursor* pCursor )
+{
+  ndvss_group_cursor_clear((ndvss_group_cursor*)pCursor);
+  sqlite3_free(pCursor);
+  return SQLITE_OK;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_group_run
+// Desc: Runs the search. All the results are computed here, the rest of the cursor
+//       only walks through them.
+//----------------------------------------------------------------------------------------
+static int ndvss_group_run( sqlite3_vtab_cursor* pCursor,
+                            int idxNum, 
+                            const char* idxStr,
+                            int argc, 
+                            sqlite3_value** argv )
+{
+  ndvss_group_cursor* cursor = (ndvss_group_cursor*)pCursor;
+  ndvss_knn_vtab* vtab = (ndvss_knn_vtab*)pCursor->pVtab;
+  sqlite3_value* arguments[NDVSS_GROUP_ARGUMENT_COUNT];
+  int i, j = 0;
+  for( i = 0; i < NDVSS_GROUP_ARGUMENT_COUNT; ++i ) {
+    arguments[i] = (idxNum & (1 << i)) ? argv[j++] : 0;
+  }
+  ndvss_group_cursor_clear(cursor);
+
+  sqlite3_value* query = arguments[0];
+  const char* table = (const char*)sqlite3_value_text(arguments[1]);
+  const char* column = (const char*)sqlite3_value_text(arguments[2]);
+  const char* group_column = (const char*)sqlite3_value_text(arguments[3]);
+  if( sqlite3_value_type(query) == SQLITE_NULL || table == 0 || column == 0 || group_column == 0 ) {
+    vtab->base.zErrMsg = sqlite3_mprintf("One of the required arguments is null.");
+    return SQLITE_ERROR;
+  }
+  int k = NDVSS_KNN_DEFAULT_K;
+  if( arguments[4] != 0 && sqlite3_value_type(arguments[4]) != SQLITE_NULL ) {
+    k = sqlite3_value_int(arguments[4]);
+  }
+  int per_group = 1;
+  if( arguments[5] != 0 && sqlite3_value_type(arguments[5]) != SQLITE_NULL ) {
+    per_group = sqlite3_value_int(arguments[5]);
+  }
+  if( k < 1 || per_group < 1 || per_group > NDVSS_GROUP_MAX_PER_GROUP ) {
+    vtab->base.zErrMsg = sqlite3_mprintf("k needs to be at least 1 and per_group between 1 and %d.", NDVSS_GROUP_MAX_PER_GROUP);
+    return SQLITE_ERROR;
+  }
+  const char* metric_name = arguments[6] != 0 ? (const char*)sqlite3_value_text(arguments[6]) : 0;
+  cursor->metric = ndvss_metric_from_name(metric_name);
+  if( cursor->metric < 0 ) {
+    vtab->base.zErrMsg = sqlite3_mprintf("Unknown metric. Use cosine, euclidean, euclidean_squared or dot_product.");
+    return SQLITE_ERROR;
+  }
+  int vector_bytes = sqlite3_value_bytes(query);
+  if( vector_bytes < vtab->element_size ) {
+    vtab->base.zErrMsg = sqlite3_mprintf("The searched array is empty.");
+    return SQLITE_ERROR;
+  }
+  void* searched_array = ndvss_aligned_malloc((sqlite3_uint64)vector_bytes, NDVSS_ALIGNMENT);
+  const char* dot = strchr(table, '.');
+  char* db_name = dot != 0 ? sqlite3_mprintf("%.*s", (int)(dot - table), table) : sqlite3_mprintf("main");
+  const char* table_name = dot != 0 ? dot + 1 : table;
+  ndvss_group_topk topk;
+  if( searched_array == 0 || db_name == 0 || ndvss_group_topk_init(&topk, k, per_group) != SQLITE_OK ) {
+    ndvss_aligned_free(searched_array);
+    sqlite3_free(db_name);
+    ndvss_group_topk_free(&topk);
+    return SQLITE_NOMEM;
+  }
+  memcpy(searched_array, sqlite3_value_blob(query), (size_t)vector_bytes);
+  ndvss_connection* connection = vtab->connection;
+  char* error_message = 0;
+  int rc;
+  if( !NDVSS_CONFIG(NDVSS_CONFIG_VECTOR_CACHE) ) {
+    rc = ndvss_group_stream(connection->db, db_name, table_name, column, group_column, vtab->element_size,
+                            vector_bytes, cursor->metric, searched_array, &topk, &error_message);
+  } else {
+    ndvss_vector_set* set = 0;
+    const sqlite3_int64* groups = 0;
+    rc = ndvss_vector_set_get(connection, db_name, table_name, column, 
+                              vtab->element_size, vector_bytes, &set, &error_message);
+    if( rc == SQLITE_OK && set->count > 0 && set->vector_bytes != vector_bytes ) {
+      error_message = sqlite3_mprintf("The arrays are not the same length.");
+      rc = SQLITE_ERROR;
+    }
+    if( rc == SQLITE_OK ) {
+      rc = ndvss_group_keys_get(connection->db, set, db_name, table_name, group_column, &groups, &error_message);
+    }
+    if( rc == SQLITE_OK ) {
+      rc = ndvss_group_scan(set, groups, cursor->metric, searched_array, &topk);
+    }
+    ndvss_vector_set_unpin(set);
+  }
+  if( rc == SQLITE_OK ) {
+    rc = ndvss_group_topk_results(&topk, cursor);
+  }
+  ndvss_group_topk_free(&topk);
+  sqlite3_free(db_name);
+  ndvss_aligned_free(searched_array);
+  if( error_message != 0 ) {
+    vtab->base.zErrMsg = error_message;
+  }
+  return rc;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_group_filter
+// Desc: Runs the search as a task of the connection, see ndvss_progress().
+//----------------------------------------------------------------------------------------
+static int ndvss_group_filter( sqlite3_vtab_cursor* pCursor,
+                               int idxNum, 
+                               const char* idxStr,
+                               int argc, 
+                               sqlite3_value** argv )
+{
+  ndvss_knn_vtab* vtab = (ndvss_knn_vtab*)pCursor->pVtab;
+  ndvss_task task;
+  ndvss_task_begin(&task, vtab->connection->db, "topk_per_group", ndvss_filter_table(idxNum, argv));
+  int rc = ndvss_group_run(pCursor, idxNum, idxStr, argc, argv);
+  ndvss_task_end(&task);
+  return rc;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_group_next
+//----------------------------------------------------------------------------------------
+static int ndvss_group_next( sqlite3_vtab_cursor* pCursor )
+{
+  ++((ndvss_group_cursor*)pCursor)->position;
+  return SQLITE_OK;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_group_eof
+//----------------------------------------------------------------------------------------
+static int ndvss_group_eof( sqlite3_vtab_cursor* pCursor )
+{
+  ndvss_group_cursor* cursor = (ndvss_group_cursor*)pCursor;
+  return cursor->position >= cursor->count;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_group_column
+//----------------------------------------------------------------------------------------
+static int ndvss_group_column( sqlite3_vtab_cursor* pCursor, sqlite3_context* context, int column )
+{
+  ndvss_group_cursor* cursor = (ndvss_group_cursor*)pCursor;
+  switch( column ) {
+    case NDVSS_GROUP_COLUMN_ID:
+      sqlite3_result_int64(context, cursor->rowids[cursor->position]);
+      break;
+    case NDVSS_GROUP_COLUMN_GROUP_ID:
+      sqlite3_result_int64(context, cursor->groups[cursor->position]);
+      break;
+    case NDVSS_GROUP_COLUMN_SIMILARITY:
+      sqlite3_result_double(context, ndvss_metric_similarity(cursor->metric, cursor->distances[cursor->position]));
+      break;
+    default:
+      sqlite3_result_null(context);
+      break;
+  }
+  return SQLITE_OK;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_group_rowid
+//----------------------------------------------------------------------------------------
+static int ndvss_group_rowid( sqlite3_vtab_cursor* pCursor, sqlite3_int64* pRowid )
+{
+  *pRowid = ((ndvss_group_cursor*)pCursor)->position + 1;
+  return SQLITE_OK;
+}
+
+
+static sqlite3_module ndvss_group_module = {
+  0,                        // iVersion
+  0,                        // xCreate: eponymous only
+  ndvss_group_connect,      // xConnect
+  ndvss_group_best_index,   // xBestIndex
+  ndvss_knn_disconnect,     // xDisconnect
+  0,                        // xDestroy
+  ndvss_group_open,         // xOpen
+  ndvss_group_close,        // xClose
+  ndvss_group_filter,       // xFilter
+  ndvss_group_next,         // xNext
+  ndvss_group_eof,          // xEof
+  ndvss_group_column,       // xColumn
+  ndvss_group_rowid,        // xRowid
+  0,                        // xUpdate
+  0,                        // xBegin
+  0,                        // xSync
+  0,                        // xCommit
+  0,                        // xRollback
+  0,                        // xFindFunction
+  0,                        // xRename
+  0,                        // xSavepoint
+  0,                        // xRelease
+  0,                        // xRollbackTo
+  0                         // xShadowName
+};
+
+
+//----------------------------------------------------------------------------------------
+// MAXIMAL MARGINAL RELEVANCE.
+// ndvss_mmr_f and ndvss_mmr_d pick k rows that are similar to the searched vector but
+// not to each other, from the candidates of a search:
+//   SELECT id, similarity FROM ndvss_mmr_f(searched, 'chunks', 'embedding', 5, 0.7, 100);
+// The candidates are either the given number of most similar rows or a JSON array of 
+// rowids, e.g. from json_group_array(id) over another query. Each step picks the
+// candidate with the best lambda * relevance - (1 - lambda) * redundancy, where the
+// redundancy is its highest similarity to the rows picked so far. Only the rows of the
+// candidate-candidate similarity matrix of the picked candidates are computed: each 
+// pick scores itself against the candidates left, with the same kernels as the scans.
+// Distances are mixed as they are, so for the euclidean metrics lambda weights squared 
+// distances and for cosine and dot product it weights the similarities.
+//----------------------------------------------------------------------------------------
+#define NDVSS_MMR_COLUMN_ID            0
+#define NDVSS_MMR_COLUMN_SIMILARITY    1
+#define NDVSS_MMR_COLUMN_SCORE         2
+#define NDVSS_MMR_FIRST_ARGUMENT       3
+#define NDVSS_MMR_ARGUMENT_COUNT       7
+#define NDVSS_MMR_DEFAULT_K            10
+#define NDVSS_MMR_DEFAULT_LAMBDA       0.5
+#define NDVSS_MMR_DEFAULT_CANDIDATES   100
+#define NDVSS_MMR_MAX_CANDIDATES       100000
+
+typedef struct ndvss_mmr_cursor {
+  sqlite3_vtab_cursor base;
+  int                 metric;
+  int                 count;
+  int                 position;
+  sqlite3_int64*      rowids;
+  double*             distances;      // To the searched vector.
+  double*             scores;         // MMR score when the row was picked.
+} ndvss_mmr_cursor;
+
+typedef struct ndvss_mmr_candidates {
+  int             count;
+  int             capacity;
+  int             stride;             // Bytes between vectors, a multiple of NDVSS_ALIGNMENT.
+  sqlite3_int64*  rowids;
+  unsigned char*  vectors;
+} ndvss_mmr_candidates;
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_mmr_candidates_load
+// Desc: Reads the vectors of the candidate rowids from the table. Rowids without a 
+//       vector are left out.
+// Args: Database, database and table name, column, rowids and their count, size of the
+//       vectors, the candidates to fill and a pointer for an error message.
+// Returns: SQLite result code.
+//----------------------------------------------------------------------------------------
+static int ndvss_mmr_candidates_load( sqlite3* db,
+                                      const char* db_name,
+                                      const char* table_name,
+                                      const char* column,
+                                      const sqlite3_int64* rowids,
+                                      int rowid_count,
+                                      int vector_bytes,
+                                      ndvss_mmr_candidates* candidates,
+                                      char** error_message )
+{
+  candidates->count = 0;
+  candidates->capacity = rowid_count;
+  candidates->stride = (vector_bytes + NDVSS_ALIGNMENT - 1) & ~(NDVSS_ALIGNMENT - 1);
+  candidates->rowids = (sqlite3_int64*)sqlite3_malloc64(sizeof(sqlite3_int64) * (sqlite3_uint64)(rowid_count > 0 ? rowid_count : 1));
+  candidates->vectors = (unsigned char*)ndvss_aligned_malloc((sqlite3_uint64)candidates->stride * (sqlite3_uint64)(rowid_count > 0 ? rowid_count : 1), 
+                                                             NDVSS_ALIGNMENT);
+  char* sql = sqlite3_mprintf("SELECT \"%w\" FROM \"%w\".\"%w\" WHERE rowid = ?", column, db_name, table_name);
+  if( candidates->rowids == 0 || candidates->vectors == 0 || sql == 0 ) {
+    sqlite3_free(sql);
+    return SQLITE_NOMEM;
+  }
+  sqlite3_stmt* stmt = 0;
+  int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+  sqlite3_free(sql);
+  if( rc != SQLITE_OK ) {
+    *error_message = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+    return rc;
+  }
+  int i;
+  for( i = 0; i < rowid_count && rc == SQLITE_OK; ++i ) {
+    sqlite3_bind_int64(stmt, 1, rowids[i]);
+    int step = sqlite3_step(stmt);
+    if( step == SQLITE_ROW && sqlite3_column_type(stmt, 0) != SQLITE_NULL ) {
+      const void* blob = sqlite3_column_blob(stmt, 0);
+      if( sqlite3_column_bytes(stmt, 0) != vector_bytes ) {
+        *error_message = sqlite3_mprintf("The arrays are not the same length.");
+        rc = SQLITE_ERROR;
+      } else {
+        memcpy(candidates->vectors + (size_t)candidates->stride * (size_t)candidates->count, blob, (size_t)vector_bytes);
+        candidates->rowids[candidates->count++] = rowids[i];
+      }
+    } else if( step != SQLITE_ROW && step != SQLITE_DONE ) {
+      *error_message = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+      rc = SQLITE_ERROR;
+    }
+    sqlite3_reset(stmt);
+  }
+  sqlite3_finalize(stmt);
+  return rc;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_mmr_select
+// Desc: Greedy MMR selection of up to k candidates.
+// Args: Candidates, element size, metric, searched vector, number of dimensions, k,
+//       lambda and the cursor that gets the picked rows in the order they were picked.
+// Returns: SQLITE_OK, SQLITE_NOMEM or SQLITE_INTERRUPT.
+//----------------------------------------------------------------------------------------
+static int ndvss_mmr_select( const ndvss_mmr_candidates* candidates,
+                             int element_size,
+                             int metric,
+                             const void* searched_array,
+                             int dimensions,
+                             int k,
+                             double lambda,
+                             ndvss_mmr_cursor* cursor )
+{
+  int n = candidates->count;
+  int size = n > 0 ? n : 1;
+  double* relevance = (double*)sqlite3_malloc64(sizeof(double) * (sqlite3_uint64)size);
+  double* redundancy = (double*)sqlite3_malloc64(sizeof(double) * (sqlite3_uint64)size);
+  int* left = (int*)sqlite3_malloc64(sizeof(int) * (sqlite3_uint64)size);
+  int capacity = k < n ? k : n;
+  cursor->rowids = (sqlite3_int64*)sqlite3_malloc64(sizeof(sqlite3_int64) * (sqlite3_uint64)(capacity > 0 ? capacity : 1));
+  cursor->distances = (double*)sqlite3_malloc64(sizeof(double) * (sqlite3_uint64)(capacity > 0 ? capacity : 1));
+  cursor->scores = (double*)sqlite3_malloc64(sizeof(double) * (sqlite3_uint64)(capacity > 0 ? capacity : 1));
+  if( relevance == 0 || redundancy == 0 || left == 0 || 
+      cursor->rowids == 0 || cursor->distances == 0 || cursor->scores == 0 ) {
+    sqlite3_free(relevance);
+    sqlite3_free(redundancy);
+    sqlite3_free(left);
+    return SQLITE_NOMEM;
+  }
+  // Relevance and redundancy are kept as negated distances so that higher is better.
+  int left_count = 0;
+  int i;
+  for( i = 0; i < n; ++i ) {
+    double distance;
+    if( !ndvss_metric_distance(metric, element_size, searched_array, 
+                               candidates->vectors + (size_t)candidates->stride * (size_t)i, dimensions, &distance) ) {
+      continue;
+    }
+    relevance[i] = -distance;
+    redundancy[i] = 0.0;
+    left[left_count++] = i;
+  }
+  ndvss_task* task = ndvss_task_current();
+  ndvss_task_phase(task, "mmr_select", capacity);
+  int rc = SQLITE_OK;
+  while( cursor->count < k && left_count > 0 && rc == SQLITE_OK ) {
+    int best = 0;
+    double best_score = 0.0;
+    for( i = 0; i < left_count; ++i ) {
+      double score = lambda * relevance[left[i]] - (cursor->count > 0 ? (1.0 - lambda) * redundancy[left[i]] : 0.0);
+      // Ties, e.g. every first pick with lambda 0, go to the more relevant candidate.
+      if( i == 0 || score > best_score || (score == best_score && relevance[left[i]] > relevance[left[best]]) ) {
+        best = i;
+        best_score = score;
+      }
+    }
+    int picked = left[best];
+    left[best] = left[--left_count];
+    cursor->rowids[cursor->count] = candidates->rowids[picked];
+    cursor->distances[cursor->count] = -relevance[picked];
+    cursor->scores[cursor->count] = best_score;
+    ++cursor->count;
+    // One row of the similarity matrix: the picked vector stays in cache while the 
+    // candidates left stream past it.
+    const unsigned char* picked_vector = candidates->vectors + (size_t)candidates->stride * (size_t)picked;
+    for( i = 0; i < left_count; ++i ) {
+      const unsigned char* vector = candidates->vectors + (size_t)candidates->stride * (size_t)left[i];
+      if( i + 2 < left_count ) {
+        ndvss_prefetch_vector(candidates->vectors + (size_t)candidates->stride * (size_t)left[i + 2], 
+                              dimensions * element_size, 0);
+      }
+      double distance;
+      if( ndvss_metric_distance(metric, element_size, picked_vector, vector, dimensions, &distance) &&
+          (cursor->count == 1 || -distance > redundancy[left[i]]) ) {
+        redundancy[left[i]] = -distance;
+      }
+    }
+    if( ndvss_task_advance(task, 1) ) {
+      rc = SQLITE_INTERRUPT;
+    }
+  }
+  sqlite3_free(relevance);
+  sqlite3_free(redundancy);
+  sqlite3_free(left);
+  return rc;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_mmr_connect
+// Desc: xConnect/xCreate of the MMR functions. The element type is picked from the 
+//       name of the module.
+//----------------------------------------------------------------------------------------
+static int ndvss_mmr_connect( sqlite3* db,
+                              void* pAux,
+                              int argc, 
+                              const char* const* argv,
+                              sqlite3_vtab** ppVtab,
+                              char** pzErr )
+{
+  int rc = sqlite3_declare_vtab(db, "CREATE TABLE x(id INTEGER, similarity REAL, score REAL, "
+                                    "query HIDDEN, table_name HIDDEN, column_name HIDDEN, "
+                                    "k HIDDEN, lambda HIDDEN, candidates HIDDEN, metric HIDDEN)");
+  if( rc != SQLITE_OK ) {
+    return rc;
+  }
+  ndvss_knn_vtab* vtab = (ndvss_knn_vtab*)sqlite3_malloc(sizeof(ndvss_knn_vtab));
+  if( vtab == 0 ) {
+    return SQLITE_NOMEM;
+  }
+  memset(vtab, 0, sizeof(ndvss_knn_vtab));
+  vtab->connection = (ndvss_connection*)pAux;
+  size_t name_length = strlen(argv[0]);
+  vtab->element_size = (name_length > 0 && argv[0][name_length - 1] == 'd') ? sizeof(double) : sizeof(float);
+  sqlite3_vtab_config(db, SQLITE_VTAB_DIRECTONLY);
+  *ppVtab = &vtab->base;
+  return SQLITE_OK;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_mmr_best_index
+// Desc: The searched vector, table and column are required. idxNum has a bit set for 
+//       each of the arguments that are given, in the order of the hidden columns.
+//----------------------------------------------------------------------------------------
+static int ndvss_mmr_best_index( sqlite3_vtab* pVtab, sqlite3_index_info* pIdxInfo )
+{
+  int argument_constraint[NDVSS_MMR_ARGUMENT_COUNT];
+  int i;
+  for( i = 0; i < NDVSS_MMR_ARGUMENT_COUNT; ++i ) {
+    argument_constraint[i] = -1;
+  }
+  for( i = 0; i < pIdxInfo->nConstraint; ++i ) {
+    const struct sqlite3_index_constraint* constraint = &pIdxInfo->aConstraint[i];
+    int argument = constraint->iColumn - NDVSS_MMR_FIRST_ARGUMENT;
+    if( argument < 0 || argument >= NDVSS_MMR_ARGUMENT_COUNT || constraint->op != SQLITE_INDEX_CONSTRAINT_EQ ) {
+      continue;
+    }
+    if( !constraint->usable ) {
+      return SQLITE_CONSTRAINT;
+    }
+    argument_constraint[argument] = i;
+  }
+  int idx_num = 0;
+  int argv_index = 0;
+  for( i = 0; i < NDVSS_MMR_ARGUMENT_COUNT; ++i ) {
+    if( argument_constraint[i] < 0 ) {
+      continue;
+    }
+    idx_num |= (1 << i);
+    pIdxInfo->aConstraintUsage[argument_constraint[i]].argvIndex = ++argv_index;
+    pIdxInfo->aConstraintUsage[argument_constraint[i]].omit = 1;
+  }
+  if( (idx_num & 7) != 7 ) {
+    sqlite3_free(pVtab->zErrMsg);
+    pVtab->zErrMsg = sqlite3_mprintf("The searched array, table and column need to be given.");
+    return SQLITE_ERROR;
+  }
+  pIdxInfo->idxNum = idx_num;
+  pIdxInfo->estimatedCost = 1000000.0;
+  pIdxInfo->estimatedRows = NDVSS_MMR_DEFAULT_K;
+  return SQLITE_OK;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_mmr_open
+//----------------------------------------------------------------------------------------
+static int ndvss_mmr_open( sqlite3_vtab* pVtab, sqlite3_vtab_cursor** ppCursor )
+{
+  ndvss_mmr_cursor* cursor = (ndvss_mmr_cursor*)sqlite3_malloc(sizeof(ndvss_mmr_cursor));
+  if( cursor == 0 ) {
+    return SQLITE_NOMEM;
+  }
+  memset(cursor, 0, sizeof(ndvss_mmr_cursor));
+  *ppCursor = &cursor->base;
+  return SQLITE_OK;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_mmr_cursor_clear
+//----------------------------------------------------------------------------------------
+static void ndvss_mmr_cursor_clear( ndvss_mmr_cursor* cursor )
+{
+  sqlite3_free(cursor->rowids);
+  sqlite3_free(cursor->distances);
+  sqlite3_free(cursor->scores);
+  cursor->rowids = 0;
+  cursor->distances = 0;
+  cursor->scores = 0;
+  cursor->count = 0;
+  cursor->position = 0;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_mmr_close
+//----------------------------------------------------------------------------------------
+static int ndvss_mmr_close( sqlite3_vtab_cursor* pCursor )
+{
+  ndvss_mmr_cursor_clear((ndvss_mmr_cursor*)pCursor);
+  sqlite3_free(pCursor);
+  return SQLITE_OK;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_rowid_compare
+// Desc: qsort comparator of rowids, ascending.
+//----------------------------------------------------------------------------------------
+static int ndvss_rowid_compare( const void* a, const void* b )
+{
+  sqlite3_int64 x = *(const sqlite3_int64*)a;
+  sqlite3_int64 y = *(const sqlite3_int64*)b;
+  return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_mmr_rowids
+// Desc: Reads the candidate rowids from a JSON array, sorted and without repeats, so 
+//       that a row can't be picked twice.
+// Args: Database, the JSON text, pointers for the rowids and their count and a pointer
+//       for an error message.
+// Returns: SQLite result code.
+//----------------------------------------------------------------------------------------
+static int ndvss_mmr_rowids( sqlite3* db,
+                             const char* json,
+                             sqlite3_int64** rowids,
+                             int* count,
+                             char** error_message )
+{
+  sqlite3_stmt* stmt = 0;
+  int rc = sqlite3_prepare_v2(db, "SELECT value, type FROM json_each(?)", -1, &stmt, 0);
+  if( rc != SQLITE_OK ) {
+    *error_message = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+    return rc;
+  }
+  sqlite3_bind_text(stmt, 1, json, -1, SQLITE_STATIC);
+  int capacity = 0;
+  int step;
+  *count = 0;
+  while( (step = sqlite3_step(stmt)) == SQLITE_ROW ) {
+    const char* type = (const char*)sqlite3_column_text(stmt, 1);
+    if( type == 0 || strcmp(type, "integer") != 0 ) {
+      *error_message = sqlite3_mprintf("The candidates need to be a number or a JSON array of rowids.");
+      rc = SQLITE_ERROR;
+      break;
+    }
+    if( *count >= NDVSS_MMR_MAX_CANDIDATES ) {
+      *error_message = sqlite3_mprintf("There can be at most %d candidates.", NDVSS_MMR_MAX_CANDIDATES);
+      rc = SQLITE_ERROR;
+      break;
+    }
+    if( *count == capacity ) {
+      capacity = capacity > 0 ? capacity * 2 : 128;
+      sqlite3_int64* grown = (sqlite3_int64*)sqlite3_realloc64(*rowids, sizeof(sqlite3_int64) * (sqlite3_uint64)capacity);
+      if( grown == 0 ) {
+        rc = SQLITE_NOMEM;
+        break;
+      }
+      *rowids = grown;
+    }
+    (*rowids)[(*count)++] = sqlite3_column_int64(stmt, 0);
+  }
+  if( rc == SQLITE_OK && step != SQLITE_DONE ) {
+    *error_message = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+    rc = SQLITE_ERROR;
+  }
+  sqlite3_finalize(stmt);
+  if( rc == SQLITE_OK && *count > 1 ) {
+    qsort(*rowids, (size_t)*count, sizeof(sqlite3_int64), ndvss_rowid_compare);
+    int unique = 1, i;
+    for( i = 1; i < *count; ++i ) {
+      if( (*rowids)[i] != (*rowids)[unique - 1] ) {
+        (*rowids)[unique++] = (*rowids)[i];
+      }
+    }
+    *count = unique;
+  }
+  return rc;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_mmr_run
+// Desc: Finds the candidates and picks the rows. All the results are computed here, the 
+//       rest of the cursor only walks through them.
+//----------------------------------------------------------------------------------------
+static int ndvss_mmr_run( sqlite3_vtab_cursor* pCursor,
+                          int idxNum, 
+                          const char* idxStr,
+                          int argc, 
+                          sqlite3_value** argv )
+{
+  ndvss_mmr_cursor* cursor = (ndvss_mmr_cursor*)pCursor;
+  ndvss_knn_vtab* vtab = (ndvss_knn_vtab*)pCursor->pVtab;
+  sqlite3_value* arguments[NDVSS_MMR_ARGUMENT_COUNT];
+  int i, j = 0;
+  for( i = 0; i < NDVSS_MMR_ARGUMENT_COUNT; ++i ) {
+    arguments[i] = (idxNum & (1 << i)) ? argv[j++] : 0;
+  }
+  ndvss_mmr_cursor_clear(cursor);
+
+  sqlite3_value* query = arguments[0];
+  const char* table = (const char*)sqlite3_value_text(arguments[1]);
+  const char* column = (const char*)sqlite3_value_text(arguments[2]);
+  if( sqlite3_value_type(query) == SQLITE_NULL || table == 0 || column == 0 ) {
+    vtab->base.zErrMsg = sqlite3_mprintf("One of the required arguments is null.");
+    return SQLITE_ERROR;
+  }
+  int k = NDVSS_MMR_DEFAULT_K;
+  if( arguments[3] != 0 && sqlite3_value_type(arguments[3]) != SQLITE_NULL ) {
+    k = sqlite3_value_int(arguments[3]);
+  }
+  double lambda = NDVSS_MMR_DEFAULT_LAMBDA;
+  if( arguments[4] != 0 && sqlite3_value_type(arguments[4]) != SQLITE_NULL ) {
+    lambda = sqlite3_value_double(arguments[4]);
+  }
+  if( k < 1 || !(lambda >= 0.0 && lambda <= 1.0) ) {
+    vtab->base.zErrMsg = sqlite3_mprintf("k needs to be at least 1 and lambda between 0 and 1.");
+    return SQLITE_ERROR;
+  }
+  sqlite3_value* candidates_value = arguments[5];
+  int candidate_count = NDVSS_MMR_DEFAULT_CANDIDATES;
+  const char* candidate_json = 0;
+  if( candidates_value != 0 && sqlite3_value_type(candidates_value) == SQLITE_TEXT ) {
+    candidate_json = (const char*)sqlite3_value_text(candidates_value);
+  } else if( candidates_value != 0 && sqlite3_value_type(candidates_value) != SQLITE_NULL ) {
+    candidate_count = sqlite3_value_int(candidates_value);
+    if( candidate_count < 1 || candidate_count > NDVSS_MMR_MAX_CANDIDATES ) {
+      vtab->base.zErrMsg = sqlite3_mprintf("The number of candidates needs to be between 1 and %d.", NDVSS_MMR_MAX_CANDIDATES);
+      return SQLITE_ERROR;
+    }
+  }
+  const char* metric_name = arguments[6] != 0 ? (const char*)sqlite3_value_text(arguments[6]) : 0;
+  cursor->metric = ndvss_metric_from_name(metric_name);
+  if( cursor->metric < 0 ) {
+    vtab->base.zErrMsg = sqlite3_mprintf("Unknown metric. Use cosine, euclidean, euclidean_squared or dot_product.");
+    return SQLITE_ERROR;
+  }
+  int vector_bytes = sqlite3_value_bytes(query);
+  if( vector_bytes < vtab->element_size ) {
+    vtab->base.zErrMsg = sqlite3_mprintf("The searched array is empty.");
+    return SQLITE_ERROR;
+  }
+  void* searched_array = ndvss_aligned_malloc((sqlite3_uint64)vector_bytes, NDVSS_ALIGNMENT);
+  const char* dot = strchr(table, '.');
+  char* db_name = dot != 0 ? sqlite3_mprintf("%.*s", (int)(dot - table), table) : sqlite3_mprintf("main");
+  const char* table_name = dot != 0 ? dot + 1 : table;
+  if( searched_array == 0 || db_name == 0 ) {
+    ndvss_aligned_free(searched_array);
+    sqlite3_free(db_name);
+    return SQLITE_NOMEM;
+  }
+  memcpy(searched_array, sqlite3_value_blob(query), (size_t)vector_bytes);
+  ndvss_connection* connection = vtab->connection;
+  char* error_message = 0;
+  sqlite3_int64* rowids = 0;
+  int rowid_count = 0;
+  int rc;
+  if( candidate_json != 0 ) {
+    rc = ndvss_mmr_rowids(connection->db, candidate_json, &rowids, &rowid_count, &error_message);
+  } else {
+    ndvss_topk topk;
+    rc = ndvss_topk_init(&topk, candidate_count);
+    if( rc == SQLITE_OK ) {
+      rc = ndvss_knn_table_search(connection, db_name, table_name, column, vtab->element_size, cursor->metric,
+                                  NDVSS_KNN_METHOD_EXACT, searched_array, vector_bytes, &topk, &error_message);
+    }
+    if( rc == SQLITE_OK ) {
+      rowids = (sqlite3_int64*)sqlite3_malloc64(sizeof(sqlite3_int64) * (sqlite3_uint64)(topk.count > 0 ? topk.count : 1));
+      if( rowids == 0 ) {
+        rc = SQLITE_NOMEM;
+      } else {
+        rowid_count = topk.count;
+        memcpy(rowids, topk.rowids, sizeof(sqlite3_int64) * (size_t)rowid_count);
+      }
+    }
+    ndvss_topk_free(&topk);
+  }
+  ndvss_mmr_candidates candidates;
+  memset(&candidates, 0, sizeof(candidates));
+  if( rc == SQLITE_OK ) {
+    rc = ndvss_mmr_candidates_load(connection->db, db_name, table_name, column, rowids, rowid_count,
+                                   vector_bytes, &candidates, &error_message);
+  }
+  if( rc == SQLITE_OK ) {
+    rc = ndvss_mmr_select(&candidates, vtab->element_size, cursor->metric, searched_array,
+                          vector_bytes / vtab->element_size, k, lambda, cursor);
+  }
+  sqlite3_free(candidates.rowids);
+  ndvss_aligned_free(candidates.vectors);
+  sqlite3_free(rowids);
+  sqlite3_free(db_name);
+  ndvss_aligned_free(searched_array);
+  if( error_message != 0 ) {
+    vtab->base.zErrMsg = error_message;
+  }
+  return rc;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_mmr_filter
+// Desc: Runs the search as a task of the connection, see ndvss_progress().
+//----------------------------------------------------------------------------------------
+static int ndvss_mmr_filter( sqlite3_vtab_cursor* pCursor,
+                             int idxNum, 
+                             const char* idxStr,
+                             int argc, 
+                             sqlite3_value** argv )
+{
+  ndvss_knn_vtab* vtab = (ndvss_knn_vtab*)pCursor->pVtab;
+  ndvss_task task;
+  ndvss_task_begin(&task, vtab->connection->db, "mmr", ndvss_filter_table(idxNum, argv));
+  int rc = ndvss_mmr_run(pCursor, idxNum, idxStr, argc, argv);
+  ndvss_task_end(&task);
+  return rc;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_mmr_next
+//----------------------------------------------------------------------------------------
+static int ndvss_mmr_next( sqlite3_vtab_cursor* pCursor )
+{
+  ++((ndvss_mmr_cursor*)pCursor)->position;
+  return SQLITE_OK;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_mmr_eof
+//----------------------------------------------------------------------------------------
+static int ndvss_mmr_eof( sqlite3_vtab_cursor* pCursor )
+{
+  ndvss_mmr_cursor* cursor = (ndvss_mmr_cursor*)pCursor;
+  return cursor->position >= cursor->count;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_mmr_column
+//----------------------------------------------------------------------------------------
+static int ndvss_mmr_column( sqlite3_vtab_cursor* pCursor, sqlite3_context* context, int column )
+{
+  ndvss_mmr_cursor* cursor = (ndvss_mmr_cursor*)pCursor;
+  switch( column ) {
+    case NDVSS_MMR_COLUMN_ID:
+      sqlite3_result_int64(context, cursor->rowids[cursor->position]);
+      break;
+    case NDVSS_MMR_COLUMN_SIMILARITY:
+      sqlite3_result_double(context, ndvss_metric_similarity(cursor->metric, cursor->distances[cursor->position]));
+      break;
+    case NDVSS_MMR_COLUMN_SCORE:
+      sqlite3_result_double(context, cursor->scores[cursor->position]);
+      break;
+    default:
+      sqlite3_result_null(context);
+      break;
+  }
+  return SQLITE_OK;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_mmr_rowid
+//----------------------------------------------------------------------------------------
+static int ndvss_mmr_rowid( sqlite3_vtab_cursor* pCursor, sqlite3_int64* pRowid )
+{
+  *pRowid = ((ndvss_mmr_cursor*)pCursor)->position + 1;
+  return SQLITE_OK;
+}
+
+
+static sqlite3_module ndvss_mmr_module = {
+  0,                        // iVersion
+  0,                        // xCreate: eponymous only
+  ndvss_mmr_connect,        // xConnect
+  ndvss_mmr_best_index,     // xBestIndex
+  ndvss_knn_disconnect,     // xDisconnect
+  0,                        // xDestroy
+  ndvss_mmr_open,           // xOpen
+  ndvss_mmr_close,          // xClose
+  ndvss_mmr_filter,         // xFilter
+  ndvss_mmr_next,           // xNext
+  ndvss_mmr_eof,            // xEof
+  ndvss_mmr_column,         // xColumn
+  ndvss_mmr_rowid,          // xRowid
+  0,                        // xUpdate
+  0,                        // xBegin
+  0,                        // xSync
+  0,                        // xCommit
+  0,                        // xRollback
+  0,                        // xFindFunction
+  0,                        // xRename
+  0,                        // xSavepoint
+  0,                        // xRelease
+  0,                        // xRollbackTo
+  0                         // xShadowName
+};
+
+
+//----------------------------------------------------------------------------------------
+// K-NN ACROSS SHARDS.
+// ndvss_knn_multi_f and ndvss_knn_multi_d search the same kind of column in several 
+// tables, e.g. one per attached database, and return the k best rows of them all:
+//   SELECT id, shard, similarity 
+//   FROM ndvss_knn_multi_f(searched, 10, 'main.emb.embedding', 'jan.emb.embedding');
+// A shard is 'schema.table.column' or 'table.column'. The metric and the method 
+// ('exact' or 'pq') are given as WHERE metric = ... AND method = ..., after the shards.
+// The columns are loaded (or found cached) one after the other, as they are read 
+// through the one connection, and then scanned at the same time, each on its own 
+// thread with its share of scan_threads, so that a search takes about as long as its
+// largest shard. A shard with a live index, or any shard when vector_cache is off, is
+// searched on the calling thread. The results carry the shard they came from, as the
+// rowids of different tables can be the same.
+//
+// The top-k of separate processes can be merged with the ndvss_topk_merge aggregate.
+// A serialized top-k is a BLOB of (id, similarity) pairs, a 64-bit integer and a double
+// each, the best first. ndvss_topk_entry(id, similarity) makes a top-k of one row, so 
+// that a search serializes with 
+//   SELECT ndvss_topk_merge(ndvss_topk_entry(id, similarity), 10, 'cosine') FROM ...
+// and the BLOBs of the processes merge the same way. ndvss_topk_json turns one in to a
+// JSON array for json_each.
+//----------------------------------------------------------------------------------------
+#define NDVSS_MULTI_COLUMN_ID         0
+#define NDVSS_MULTI_COLUMN_SIMILARITY 1
+#define NDVSS_MULTI_COLUMN_SHARD      2
+#define NDVSS_MULTI_COLUMN_PARTIAL    (NDVSS_MULTI_FIRST_ARGUMENT + NDVSS_MULTI_ARGUMENT_COUNT)
+#define NDVSS_MULTI_FIRST_ARGUMENT    3
+#define NDVSS_MULTI_MAX_SHARDS        16
+#define NDVSS_MULTI_ARGUMENT_COUNT    (NDVSS_MULTI_MAX_SHARDS + 4) // query, k, the shards, metric, method
+#define NDVSS_TOPK_ENTRY_BYTES        16
+
+// The search of one shard.
+typedef struct ndvss_multi_shard {
+  const char*       name;          // As given.
+  char*             names;         // The schema (unless main), table and column.
+  const char*       db_name;
+  const char*       table_name;
+  const char*       column;
+  ndvss_vector_set* set;           // Pinned, 0 if the shard is searched on the calling thread.
+  int               method;
+  int               metric;
+  const void*       searched_array;
+  ndvss_task*       task;
+  ndvss_topk        topk;
+  int               rc;
+  ndvss_thread      thread;
+  int               started;
+} ndvss_multi_shard;
+
+typedef struct ndvss_multi_cursor {
+  sqlite3_vtab_cursor base;
+  int                 metric;
+  int                 count;
+  int                 position;
+  int                 partial;
+  sqlite3_int64*      rowids;
+  double*             distances;
+  int*                shards;
+  char*               shard_names[NDVSS_MULTI_MAX_SHARDS];
+  sqlite3_value*      arguments[NDVSS_MULTI_ARGUMENT_COUNT]; // Copies, see ndvss_multi_column.
+} ndvss_multi_cursor;
+
+// The state of the ndvss_topk_merge aggregate.
+typedef struct ndvss_topk_merger {
+  int        initialized;
+  int        failed;
+  int        higher_better;   // 1 for the cosine and the dot product.
+  ndvss_topk topk;
+} ndvss_topk_merger;
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_multi_connect
+// Desc: xConnect/xCreate of ndvss_knn_multi_f/_d.
+//----------------------------------------------------------------------------------------
+static int ndvss_multi_connect( sqlite3* db,
+                                void* pAux,
+                                int argc, 
+                                const char* const* argv,
+                                sqlite3_vtab** ppVtab,
+                                char** pzErr )
+{
+  int rc = sqlite3_declare_vtab(db, "CREATE TABLE x(id INTEGER, similarity REAL, shard TEXT, "
+                                    "query HIDDEN, k HIDDEN, shard_1 HIDDEN, shard_2 HIDDEN, "
+                                    "shard_3 HIDDEN, shard_4 HIDDEN, shard_5 HIDDEN, shard_6 HIDDEN, "
+                                    "shard_7 HIDDEN, shard_8 HIDDEN, shard_9 HIDDEN, shard_10 HIDDEN, "
+                                    "shard_11 HIDDEN, shard_12 HIDDEN, shard_13 HIDDEN, shard_14 HIDDEN, "
+                                    "shard_15 HIDDEN, shard_16 HIDDEN, metric HIDDEN, method HIDDEN, "
+                                    "partial HIDDEN)");
+  if( rc != SQLITE_OK ) {
+    return rc;
+  }
+  ndvss_knn_vtab* vtab = (ndvss_knn_vtab*)sqlite3_malloc(sizeof(ndvss_knn_vtab));
+  if( vtab == 0 ) {
+    return SQLITE_NOMEM;
+  }
+  memset(vtab, 0, sizeof(ndvss_knn_vtab));
+  vtab->connection = (ndvss_connection*)pAux;
+  size_t name_length = strlen(argv[0]);
+  vtab->element_size = (name_length > 0 && argv[0][name_length - 1] == 'd') ? sizeof(double) : sizeof(float);
+  sqlite3_vtab_config(db, SQLITE_VTAB_DIRECTONLY);
+  *ppVtab = &vtab->base;
+  return SQLITE_OK;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_multi_best_index
+// Desc: The searched vector and one shard are required. idxNum has a bit set for each 
+//       of the arguments that are given, in the order of the hidden columns.
+//----------------------------------------------------------------------------------------
+static int ndvss_multi_best_index( sqlite3_vtab* pVtab, sqlite3_index_info* pIdxInfo )
+{
+  int argument_constraint[NDVSS_MULTI_ARGUMENT_COUNT];
+  int i;
+  for( i = 0; i < NDVSS_MULTI_ARGUMENT_COUNT; ++i ) {
+    argument_constraint[i] = -1;
+  }
+  for( i = 0; i < pIdxInfo->nConstraint; ++i ) {
+    const struct sqlite3_index_constraint* constraint = &pIdxInfo->aConstraint[i];
+    int argument = constraint->iColumn - NDVSS_MULTI_FIRST_ARGUMENT;
+#if SQLITE_VERSION_NUMBER >= 3038000
+    // The 19th shard of a call lands on the hidden column partial, which is an INT.
+    sqlite3_value* value = 0;
+    if( constraint->iColumn == NDVSS_MULTI_COLUMN_PARTIAL && constraint->op == SQLITE_INDEX_CONSTRAINT_EQ && 
+        sqlite3_vtab_rhs_value(pIdxInfo, i, &value) == SQLITE_OK && sqlite3_value_type(value) == SQLITE_TEXT ) {
+      sqlite3_free(pVtab->zErrMsg);
+      pVtab->zErrMsg = sqlite3_mprintf("At most %d shards can be given.", NDVSS_MULTI_MAX_SHARDS);
+      return SQLITE_ERROR;
+    }
+#endif
+    if( argument < 0 || argument >= NDVSS_MULTI_ARGUMENT_COUNT || constraint->op != SQLITE_INDEX_CONSTRAINT_EQ ) {
+      continue;
+    }
+    if( !constraint->usable ) {
+      return SQLITE_CONSTRAINT;
+    }
+    argument_constraint[argument] = i;
+  }
+  int idx_num = 0;
+  int argv_index = 0;
+  for( i = 0; i < NDVSS_MULTI_ARGUMENT_COUNT; ++i ) {
+    if( argument_constraint[i] < 0 ) {
+      continue;
+    }
+    idx_num |= (1 << i);
+    pIdxInfo->aConstraintUsage[argument_constraint[i]].argvIndex = ++argv_index;
+    pIdxInfo->aConstraintUsage[argument_constraint[i]].omit = 1;
+  }
+  if( (idx_num & 1) == 0 || (idx_num & (((1 << NDVSS_MULTI_MAX_SHARDS) - 1) << 2)) == 0 ) {
+    sqlite3_free(pVtab->zErrMsg);
+    pVtab->zErrMsg = sqlite3_mprintf("The searched array and a shard need to be given.");
+    return SQLITE_ERROR;
+  }
+  pIdxInfo->idxNum = idx_num;
+  pIdxInfo->estimatedCost = 1000000.0;
+  pIdxInfo->estimatedRows = NDVSS_KNN_DEFAULT_K;
+  return SQLITE_OK;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_multi_open
+//----------------------------------------------------------------------------------------
+static int ndvss_multi_open( sqlite3_vtab* pVtab, sqlite3_vtab_cursor** ppCursor )
+{
+  ndvss_multi_cursor* cursor = (ndvss_multi_cursor*)sqlite3_malloc(sizeof(ndvss_multi_cursor));
+  if( cursor == 0 ) {
+    return SQLITE_NOMEM;
+  }
+  memset(cursor, 0, sizeof(ndvss_multi_cursor));
+  *ppCursor = &cursor->base;
+  return SQLITE_OK;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_multi_cursor_clear
+//----------------------------------------------------------------------------------------
+static void ndvss_multi_cursor_clear( ndvss_multi_cursor* cursor )
+{
+  int s;
+  sqlite3_free(cursor->rowids);
+  sqlite3_free(cursor->distances);
+  sqlite3_free(cursor->shards);
+  for( s = 0; s < NDVSS_MULTI_MAX_SHARDS; ++s ) {
+    sqlite3_free(cursor->shard_names[s]);
+    cursor->shard_names[s] = 0;
+  }
+  for( s = 0; s < NDVSS_MULTI_ARGUMENT_COUNT; ++s ) {
+    sqlite3_value_free(cursor->arguments[s]);
+    cursor->arguments[s] = 0;
+  }
+  cursor->rowids = 0;
+  cursor->distances = 0;
+  cursor->shards = 0;
+  cursor->count = 0;
+  cursor->position = 0;
+  cursor->partial = 0;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_multi_close
+//----------------------------------------------------------------------------------------
+static int ndvss_multi_close( sqlite3_vtab_cursor* pCursor )
+{
+  ndvss_multi_cursor_clear((ndvss_multi_cursor*)pCursor);
+  sqlite3_free(pCursor);
+  return SQLITE_OK;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_multi_shard_parse
+// Desc: Splits the name of a shard, 'schema.table.column' or 'table.column'.
+// Returns: SQLITE_OK, SQLITE_NOMEM or SQLITE_ERROR if the name has no column.
+//----------------------------------------------------------------------------------------
+static int ndvss_multi_shard_parse( ndvss_multi_shard* shard )
+{
+  shard->names = sqlite3_mprintf("%s", shard->name);
+  if( shard->names == 0 ) {
+    return SQLITE_NOMEM;
+  }
+  char* dot = strrchr(shard->names, '.');
+  if( dot == 0 || dot == shard->names || dot[1] == 0 ) {
+    return SQLITE_ERROR;
+  }
+  *dot = 0;
+  shard->column = dot + 1;
+  dot = strchr(shard->names, '.');
+  if( dot != 0 ) {
+    *dot = 0;
+    shard->db_name = shard->names;
+    shard->table_name = dot + 1;
+  } else {
+    shard->db_name = "main";
+    shard->table_name = shard->names;
+  }
+  return shard->table_name[0] != 0 ? SQLITE_OK : SQLITE_ERROR;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_multi_shard_run
+// Desc: Scans the cached column of a shard, on a thread of its own or on the calling 
+//       one.
+//----------------------------------------------------------------------------------------
+static NDVSS_THREAD_PROC ndvss_multi_shard_run( void* arg )
+{
+  ndvss_multi_shard* shard = (ndvss_multi_shard*)arg;
+  // The scans find the task of the statement, for the interrupts, through the thread.
+  ndvss_task_of_thread = shard->task;
+  if( shard->method == NDVSS_KNN_METHOD_PQ ) {
+    shard->rc = ndvss_pq_scan(shard->set, shard->metric, shard->searched_array, &shard->topk);
+  } else {
+    shard->rc = ndvss_scan(shard->set, shard->metric, shard->searched_array, &shard->topk);
+  }
+  return 0;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_multi_search
+// Desc: Searches the shards: the columns are prepared on the calling thread and the
+//       cached ones scanned in parallel. 
+// Args: Connection, shards (names parsed, top-k initialized), their count, element 
+//       size, metric, method, the aligned searched vector and its size, where an error
+//       message is stored.
+// Returns: SQLite result code.
+//----------------------------------------------------------------------------------------
+static int ndvss_multi_search( ndvss_connection* connection,
+                               ndvss_multi_shard* shards,
+                               int shard_count,
+                               int element_size,
+                               int metric,
+                               int method,
+                               const void* searched_array,
+                               int vector_bytes,
+                               char** error_message )
+{
+  ndvss_task* task = ndvss_task_current();
+  int rc = SQLITE_OK;
+  int parallel = 0;
+  int s;
+  for( s = 0; s < shard_count && rc == SQLITE_OK; ++s ) {
+    ndvss_multi_shard* shard = &shards[s];
+    if( ndvss_live_table_find(connection, shard->db_name, shard->table_name) != 0 || 
+        !NDVSS_CONFIG(NDVSS_CONFIG_VECTOR_CACHE) ) {
+      rc = ndvss_knn_table_search(connection, shard->db_name, shard->table_name, shard->column, element_size, 
+                                  metric, method, searched_array, vector_bytes, &shard->topk, error_message);
+      continue;
+    }
+    rc = ndvss_vector_set_get(connection, shard->db_name, shard->table_name, shard->column, 
+                              element_size, vector_bytes, &shard->set, error_message);
+    if( rc == SQLITE_OK && shard->set->count > 0 && shard->set->vector_bytes != vector_bytes ) {
+      *error_message = sqlite3_mprintf("The arrays of %s are not the same length.", shard->name);
+      rc = SQLITE_ERROR;
+    }
+    if( rc == SQLITE_OK ) {
+      rc = method == NDVSS_KNN_METHOD_PQ ? ndvss_pq_ensure(connection->db, shard->set) : ndvss_ivf_ensure(shard->set);
+    }
+    shard->method = method;
+    shard->metric = metric;
+    shard->searched_array = searched_array;
+    shard->task = task;
+    parallel += rc == SQLITE_OK;
+  }//endfor preparing the shards
+
+  if( rc == SQLITE_OK && parallel > 0 ) {
+    // Each shard gets a thread, the last one the calling thread, and the scans share
+    // scan_threads.
+    int threads = (int)NDVSS_CONFIG(NDVSS_CONFIG_SCAN_THREADS);
+    if( threads == 0 ) {
+      threads = ndvss_cpu_count();
+    }
+    if( task != 0 ) {
+      task->scan_threads = threads > parallel ? threads / parallel : 1;
+    }
+    ndvss_multi_shard* last = 0;
+    for( s = 0; s < shard_count; ++s ) {
+      if( shards[s].set == 0 ) {
+        continue;
+      }
+      if( last != 0 ) {
+        last->started = ndvss_thread_start(&last->thread, ndvss_multi_shard_run, last) == SQLITE_OK;
+        if( !last->started ) {
+          ndvss_multi_shard_run(last);
+        }
+      }
+      last = &shards[s];
+    }
+    ndvss_multi_shard_run(last);
+    for( s = 0; s < shard_count; ++s ) {
+      if( shards[s].started ) {
+        ndvss_thread_join(shards[s].thread);
+      }
+      if( shards[s].set != 0 && rc == SQLITE_OK ) {
+        rc = shards[s].rc;
+      }
+    }
+    if( task != 0 ) {
+      task->scan_threads = 0;
+    }
+  }
+  for( s = 0; s < shard_count; ++s ) {
+    ndvss_vector_set_unpin(shards[s].set);
+    shards[s].set = 0;
+  }
+  if( rc == SQLITE_OK ) {
+    NDVSS_STAT_ADD(multi_searches, 1);
+    NDVSS_STAT_ADD(multi_shards, shard_count);
+  }
+  return rc;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_multi_results
+// Desc: Merges the top-k of the shards in to the results of the cursor.
+// Returns: SQLITE_OK or SQLITE_NOMEM.
+//----------------------------------------------------------------------------------------
+static int ndvss_multi_results( ndvss_multi_cursor* cursor, const ndvss_multi_shard* shards, int shard_count, int k )
+{
+  // The merged top-k holds positions in the concatenated results.
+  ndvss_topk merged;
+  if( ndvss_topk_init(&merged, k) != SQLITE_OK ) {
+    return SQLITE_NOMEM;
+  }
+  int s, i, offset = 0;
+  for( s = 0; s < shard_count; ++s ) {
+    for( i = 0; i < shards[s].topk.count; ++i ) {
+      if( shards[s].topk.distances[i] < ndvss_topk_bound(&merged) ) {
+        ndvss_topk_push(&merged, shards[s].topk.distances[i], offset + i);
+      }
+    }
+    offset += shards[s].topk.count;
+    cursor->partial |= shards[s].topk.partial;
+  }
+  ndvss_topk_sort(&merged);
+  cursor->rowids = (sqlite3_int64*)sqlite3_malloc64(sizeof(sqlite3_int64) * (sqlite3_uint64)(merged.count + 1));
+  cursor->distances = (double*)sqlite3_malloc64(sizeof(double) * (sqlite3_uint64)(merged.count + 1));
+  cursor->shards = (int*)sqlite3_malloc64(sizeof(int) * (sqlite3_uint64)(merged.count + 1));
+  if( cursor->rowids == 0 || cursor->distances == 0 || cursor->shards == 0 ) {
+    ndvss_topk_free(&merged);
+    return SQLITE_NOMEM;
+  }
+  for( i = 0; i < merged.count; ++i ) {
+    int position = (int)merged.rowids[i];
+    for( s = 0; position >= shards[s].topk.count; ++s ) {
+      position -= shards[s].topk.count;
+    }
+    cursor->rowids[i] = shards[s].topk.rowids[position];
+    cursor->distances[i] = shards[s].topk.distances[position];
+    cursor->shards[i] = s;
+  }
+  cursor->count = merged.count;
+  ndvss_topk_free(&merged);
+  return SQLITE_OK;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_multi_run
+// Desc: Runs the search. All the results are computed here, the rest of the cursor
+//       only walks through them.
+//----------------------------------------------------------------------------------------
+static int ndvss_multi_run( sqlite3_vtab_cursor* pCursor,
+                            int idxNum, 
+                            const char* idxStr,
+                            int argc, 
+                            sqlite3_value** argv )
+{
+  ndvss_multi_cursor* cursor = (ndvss_multi_cursor*)pCursor;
+  ndvss_knn_vtab* vtab = (ndvss_knn_vtab*)pCursor->pVtab;
+  sqlite3_value* arguments[NDVSS_MULTI_ARGUMENT_COUNT];
+  int i, j = 0;
+  for( i = 0; i < NDVSS_MULTI_ARGUMENT_COUNT; ++i ) {
+    arguments[i] = (idxNum & (1 << i)) ? argv[j++] : 0;
+  }
+  ndvss_multi_cursor_clear(cursor);
+  for( i = 0; i < NDVSS_MULTI_ARGUMENT_COUNT; ++i ) {
+    if( arguments[i] != 0 && (cursor->arguments[i] = sqlite3_value_dup(arguments[i])) == 0 ) {
+      return SQLITE_NOMEM;
+    }
+  }
+
+  sqlite3_value* query = arguments[0];
+  if( sqlite3_value_type(query) == SQLITE_NULL ) {
+    vtab->base.zErrMsg = sqlite3_mprintf("One of the required arguments is null.");
+    return SQLITE_ERROR;
+  }
+  int k = NDVSS_KNN_DEFAULT_K;
+  if( arguments[1] != 0 && sqlite3_value_type(arguments[1]) != SQLITE_NULL ) {
+    k = sqlite3_value_int(arguments[1]);
+  }
+  if( k < 1 ) {
+    vtab->base.zErrMsg = sqlite3_mprintf("k needs to be at least 1.");
+    return SQLITE_ERROR;
+  }
+  sqlite3_value* metric_value = arguments[NDVSS_MULTI_MAX_SHARDS + 2];
+  const char* metric_name = metric_value != 0 ? (const char*)sqlite3_value_text(metric_value) : 0;
+  sqlite3_value* method_value = arguments[NDVSS_MULTI_MAX_SHARDS + 3];
+  const char* method_name = method_value != 0 ? (const char*)sqlite3_value_text(method_value) : 0;
+  // More shards than there are shard arguments continue in to the metric and the 
+  // method, whose names have no dots.
+  if( (metric_name != 0 && strchr(metric_name, '.') != 0) || (method_name != 0 && strchr(method_name, '.') != 0) ) {
+    vtab->base.zErrMsg = sqlite3_mprintf("At most %d shards can be given.", NDVSS_MULTI_MAX_SHARDS);
+    return SQLITE_ERROR;
+  }
+  cursor->metric = ndvss_metric_from_name(metric_name);
+  if( cursor->metric < 0 ) {
+    vtab->base.zErrMsg = sqlite3_mprintf("Unknown metric. Use cosine, euclidean, euclidean_squared or dot_product.");
+    return SQLITE_ERROR;
+  }
+  int method = NDVSS_KNN_METHOD_EXACT;
+  if( method_name != 0 && sqlite3_stricmp(method_name, "pq") == 0 ) {
+    method = NDVSS_KNN_METHOD_PQ;
+  } else if( method_name != 0 && sqlite3_stricmp(method_name, "exact") != 0 ) {
+    vtab->base.zErrMsg = sqlite3_mprintf("Unknown method. Use exact or pq.");
+    return SQLITE_ERROR;
+  }
+  if( method == NDVSS_KNN_METHOD_PQ && !NDVSS_CONFIG(NDVSS_CONFIG_VECTOR_CACHE) ) {
+    vtab->base.zErrMsg = sqlite3_mprintf("The %s method needs the vector cache.", method_name);
+    return SQLITE_ERROR;
+  }
+  int vector_bytes = sqlite3_value_bytes(query);
+  if( vector_bytes < vtab->element_size ) {
+    vtab->base.zErrMsg = sqlite3_mprintf("The searched array is empty.");
+    return SQLITE_ERROR;
+  }
+
+  ndvss_multi_shard shards[NDVSS_MULTI_MAX_SHARDS];
+  memset(shards, 0, sizeof(shards));
+  int shard_count = 0;
+  int rc = SQLITE_OK;
+  for( i = 0; i < NDVSS_MULTI_MAX_SHARDS && rc == SQLITE_OK; ++i ) {
+    sqlite3_value* value = arguments[2 + i];
+    if( value == 0 || sqlite3_value_type(value) == SQLITE_NULL ) {
+      continue;
+    }
+    ndvss_multi_shard* shard = &shards[shard_count];
+    shard->name = (const char*)sqlite3_value_text(value);
+    cursor->shard_names[shard_count] = sqlite3_mprintf("%s", shard->name);
+    rc = shard->name == 0 || cursor->shard_names[shard_count] == 0 ? SQLITE_NOMEM : ndvss_multi_shard_parse(shard);
+    if( rc == SQLITE_ERROR ) {
+      vtab->base.zErrMsg = sqlite3_mprintf("A shard is 'schema.table.column' or 'table.column', not '%s'.", shard->name);
+    }
+    if( rc == SQLITE_OK ) {
+      rc = ndvss_topk_init(&shard->topk, k);
+    }
+    ++shard_count;
+  }
+  if( rc == SQLITE_OK && shard_count == 0 ) {
+    vtab->base.zErrMsg = sqlite3_mprintf("One of the required arguments is null.");
+    rc = SQLITE_ERROR;
+  }
+  // The searched vector is copied so that it's aligned the same way as the stored ones.
+  void* searched_array = rc == SQLITE_OK ? ndvss_aligned_malloc((sqlite3_uint64)vector_bytes, NDVSS_ALIGNMENT) : 0;
+  if( rc == SQLITE_OK && searched_array == 0 ) {
+    rc = SQLITE_NOMEM;
+  }
+  char* error_message = 0;
+  if( rc == SQLITE_OK ) {
+    memcpy(searched_array, sqlite3_value_blob(query), (size_t)vector_bytes);
+    rc = ndvss_multi_search(vtab->connection, shards, shard_count, vtab->element_size, cursor->metric, method,
+                            searched_array, vector_bytes, &error_message);
+  }
+  if( rc == SQLITE_OK ) {
+    rc = ndvss_multi_results(cursor, shards, shard_count, k);
+  }
+  for( i = 0; i < shard_count; ++i ) {
+    ndvss_topk_free(&shards[i].topk);
+    sqlite3_free(shards[i].names);
+  }
+  ndvss_aligned_free(searched_array);
+  if( error_message != 0 ) {
+    vtab->base.zErrMsg = error_message;
+  }
+  return rc;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_multi_filter
+// Desc: Runs the search as a task of the connection, see ndvss_progress().
+//----------------------------------------------------------------------------------------
+static int ndvss_multi_filter( sqlite3_vtab_cursor* pCursor,
+                              int idxNum, 
+                              const char* idxStr,
+                              int argc, 
+                              sqlite3_value** argv )
+{
+  ndvss_knn_vtab* vtab = (ndvss_knn_vtab*)pCursor->pVtab;
+  // The first shard names the task.
+  const char* target = 0;
+  int i, j = 0;
+  for( i = 0; i < NDVSS_MULTI_ARGUMENT_COUNT && target == 0; ++i ) {
+    if( idxNum & (1 << i) ) {
+      if( i >= 2 && i < NDVSS_MULTI_MAX_SHARDS + 2 ) {
+        target = (const char*)sqlite3_value_text(argv[j]);
+      }
+      ++j;
+    }
+  }
+  ndvss_task task;
+  ndvss_task_begin(&task, vtab->connection->db, "knn_multi", target);
+  int rc = ndvss_multi_run(pCursor, idxNum, idxStr, argc, argv);
+  ndvss_task_end(&task);
+  return rc;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_multi_next
+//----------------------------------------------------------------------------------------
+static int ndvss_multi_next( sqlite3_vtab_cursor* pCursor )
+{
+  ++((ndvss_multi_cursor*)pCursor)->position;
+  return SQLITE_OK;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_multi_eof
+//----------------------------------------------------------------------------------------
+static int ndvss_multi_eof( sqlite3_vtab_cursor* pCursor )
+{
+  ndvss_multi_cursor* cursor = (ndvss_multi_cursor*)pCursor;
+  return cursor->position >= cursor->count;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_multi_column
+//----------------------------------------------------------------------------------------
+static int ndvss_multi_column( sqlite3_vtab_cursor* pCursor, sqlite3_context* context, int column )
+{
+  ndvss_multi_cursor* cursor = (ndvss_multi_cursor*)pCursor;
+  switch( column ) {
+    case NDVSS_MULTI_COLUMN_ID:
+      sqlite3_result_int64(context, cursor->rowids[cursor->position]);
+      break;
+    case NDVSS_MULTI_COLUMN_SIMILARITY:
+      sqlite3_result_double(context, ndvss_metric_similarity(cursor->metric, cursor->distances[cursor->position]));
+      break;
+    case NDVSS_MULTI_COLUMN_SHARD:
+      sqlite3_result_text(context, cursor->shard_names[cursor->shards[cursor->position]], -1, SQLITE_TRANSIENT);
+      break;
+    case NDVSS_MULTI_COLUMN_PARTIAL:
+      sqlite3_result_int(context, cursor->partial);
+      break;
+    default:
+      // SQLite leaves only 16 constraints to the table and checks the others against
+      // the rows, so the arguments after the 14th shard have to read back as given.
+      if( column >= NDVSS_MULTI_FIRST_ARGUMENT && column < NDVSS_MULTI_FIRST_ARGUMENT + NDVSS_MULTI_ARGUMENT_COUNT &&
+          cursor->arguments[column - NDVSS_MULTI_FIRST_ARGUMENT] != 0 ) {
+        sqlite3_result_value(context, cursor->arguments[column - NDVSS_MULTI_FIRST_ARGUMENT]);
+      } else {
+        sqlite3_result_null(context);
+      }
+      break;
+  }
+  return SQLITE_OK;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_multi_rowid
+//----------------------------------------------------------------------------------------
+static int ndvss_multi_rowid( sqlite3_vtab_cursor* pCursor, sqlite3_int64* pRowid )
+{
+  *pRowid = ((ndvss_multi_cursor*)pCursor)->position + 1;
+  return SQLITE_OK;
+}
+
+
+static sqlite3_module ndvss_multi_module = {
+  0,                        // iVersion
+  0,                        // xCreate: eponymous only
+  ndvss_multi_connect,      // xConnect
+  ndvss_multi_best_index,   // xBestIndex
+  ndvss_knn_disconnect,     // xDisconnect
+  0,                        // xDestroy
+  ndvss_multi_open,         // xOpen
+  ndvss_multi_close,        // xClose
+  ndvss_multi_filter,       // xFilter
+  ndvss_multi_next,         // xNext
+  ndvss_multi_eof,          // xEof
+  ndvss_multi_column,       // xColumn
+  ndvss_multi_rowid,        // xRowid
+  0,                        // xUpdate
+  0,                        // xBegin
+  0,                        // xSync
+  0,                        // xCommit
+  0,                        // xRollback
+  0,                        // xFindFunction
+  0,                        // xRename
+  0,                        // xSavepoint
+  0,                        // xRelease
+  0,                        // xRollbackTo
+  0                         // xShadowName
+};
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_topk_entry
+// Desc: Serializes one row as a top-k, see ndvss_topk_merge.
+// Args: Id INTEGER, similarity REAL
+// Returns: The top-k of the row BLOB
+//----------------------------------------------------------------------------------------
+static void ndvss_topk_entry( sqlite3_context* context,
+                              int argc,
+                              sqlite3_value** argv )
+{
+  if( sqlite3_value_type(argv[0]) == SQLITE_NULL || sqlite3_value_type(argv[1]) == SQLITE_NULL ) {
+    sqlite3_result_null(context);
+    return;
+  }
+  unsigned char entry[NDVSS_TOPK_ENTRY_BYTES];
+  sqlite3_int64 id = sqlite3_value_int64(argv[0]);
+  double similarity = sqlite3_value_double(argv[1]);
+  memcpy(entry, &id, sizeof(id));
+  memcpy(entry + sizeof(id), &similarity, sizeof(similarity));
+  sqlite3_result_blob(context, entry, NDVSS_TOPK_ENTRY_BYTES, SQLITE_TRANSIENT);
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_topk_merge_step
+// Desc: xStep of ndvss_topk_merge: adds the rows of a serialized top-k.
+// Args: Serialized top-k BLOB, 
+//       Optionally the number of rows kept k INTEGER (default 10),
+//       Optionally the metric of the similarities TEXT (default 'cosine'), for which 
+//       way is better
+//----------------------------------------------------------------------------------------
+static void ndvss_topk_merge_step( sqlite3_context* context,
+                                   int argc,
+                                   sqlite3_value** argv )
+{
+  ndvss_topk_merger* merger = (ndvss_topk_merger*)sqlite3_aggregate_context(context, sizeof(ndvss_topk_merger));
+  if( merger == 0 ) {
+    sqlite3_result_error_nomem(context);
+    return;
+  }
+  if( merger->failed ) {
+    return;
+  }
+  if( !merger->initialized ) {
+    merger->initialized = 1;
+    int k = argc > 1 && sqlite3_value_type(argv[1]) != SQLITE_NULL ? sqlite3_value_int(argv[1]) : NDVSS_KNN_DEFAULT_K;
+    int metric = ndvss_metric_from_name(argc > 2 ? (const char*)sqlite3_value_text(argv[2]) : 0);
+    if( k < 1 || metric < 0 ) {
+      merger->failed = 1;
+      sqlite3_result_error(context, k < 1 ? "k needs to be at least 1." 
+                                          : "Unknown metric. Use cosine, euclidean, euclidean_squared or dot_product.", -1);
+      return;
+    }
+    merger->higher_better = metric == NDVSS_METRIC_COSINE || metric == NDVSS_METRIC_DOT_PRODUCT;
+    if( ndvss_topk_init(&merger->topk, k) != SQLITE_OK ) {
+      merger->failed = 1;
+      sqlite3_result_error_nomem(context);
+      return;
+    }
+  }
+  if( sqlite3_value_type(argv[0]) == SQLITE_NULL ) {
+    return;
+  }
+  int bytes = sqlite3_value_bytes(argv[0]);
+  const unsigned char* entries = (const unsigned char*)sqlite3_value_blob(argv[0]);
+  if( sqlite3_value_type(argv[0]) != SQLITE_BLOB || bytes % NDVSS_TOPK_ENTRY_BYTES != 0 ) {
+    merger->failed = 1;
+    sqlite3_result_error(context, "Not a serialized top-k.", -1);
+    return;
+  }
+  int i;
+  for( i = 0; i < bytes / NDVSS_TOPK_ENTRY_BYTES; ++i ) {
+    sqlite3_int64 id;
+    double similarity;
+    memcpy(&id, entries + (size_t)i * NDVSS_TOPK_ENTRY_BYTES, sizeof(id));
+    memcpy(&similarity, entries + (size_t)i * NDVSS_TOPK_ENTRY_BYTES + sizeof(id), sizeof(similarity));
+    double distance = merger->higher_better ? -similarity : similarity;
+    if( distance < ndvss_topk_bound(&merger->topk) ) {
+      ndvss_topk_push(&merger->topk, distance, id);
+    }
+  }
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_topk_merge_final
+// Desc: xFinal of ndvss_topk_merge. Also frees the state after an error.
+// Returns: The merged top-k BLOB, NULL if there were no rows
+//----------------------------------------------------------------------------------------
+static void ndvss_topk_merge_final( sqlite3_context* context )
+{
+  ndvss_topk_merger* merger = (ndvss_topk_merger*)sqlite3_aggregate_context(context, 0);
+  if( merger == 0 ) {
+    sqlite3_result_null(context);
+    return;
+  }
+  if( !merger->failed ) {
+    ndvss_topk_sort(&merger->topk);
+    unsigned char* entries = (unsigned char*)sqlite3_malloc64((sqlite3_uint64)(merger->topk.count + 1) * NDVSS_TOPK_ENTRY_BYTES);
+    if( entries == 0 ) {
+      sqlite3_result_error_nomem(context);
+    } else {
+      int i;
+      for( i = 0; i < merger->topk.count; ++i ) {
+        double similarity = merger->higher_better ? -merger->topk.distances[i] : merger->topk.distances[i];
+        memcpy(entries + (size_t)i * NDVSS_TOPK_ENTRY_BYTES, &merger->topk.rowids[i], sizeof(sqlite3_int64));
+        memcpy(entries + (size_t)i * NDVSS_TOPK_ENTRY_BYTES + sizeof(sqlite3_int64), &similarity, sizeof(double));
+      }
+      sqlite3_result_blob(context, entries, merger->topk.count * NDVSS_TOPK_ENTRY_BYTES, sqlite3_free);
+    }
+  }
+  ndvss_topk_free(&merger->topk);
+}
+
+
+//----------------------------------------------------------------------------------------
+// Name: ndvss_topk_json
+// Desc: Lists the rows of a serialized top-k.
+// Args: Serialized top-k BLOB
+// Returns: JSON array of {"id": ..., "similarity": ...}, the best first TEXT
+//----------------------------------------------------------------------------------------
+static void ndvss_topk_json( sqlite3_context* context,
+                             int argc,
+                             sqlite3_value** argv )
+{
+  if( sqlite3_value_type(argv[0]) == SQLITE_NULL ) {
+    sqlite3_result_null(context);
+    return;
+  }
+  int bytes = sqlite3_value_bytes(argv[0]);
+  const unsigned char* entries = (const unsigned char*)sqlite3_value_blob(argv[0]);
+  if( sqlite3_value_type(argv[0]) != SQLITE_BLOB || bytes % NDVSS_TOPK_ENTRY_BYTES != 0 ) {
+    sqlite3_result_error(context, "Not a serialized top-k.", -1);
+    return;
+  }
+  char* json = sqlite3_mprintf("[");
+  int i;
+  for( i = 0; i < bytes / NDVSS_TOPK_ENTRY_BYTES && json != 0; ++i ) {
+    sqlite3_int64 id;
+    double similarity;
+    memcpy(&id, entries + (size_t)i * NDVSS_TOPK_ENTRY_BYTES, sizeof(id));
+    memcpy(&similarity, entries + (size_t)i * NDVSS_TOPK_ENTRY_BYTES + sizeof(id), sizeof(similarity));
+    json = sqlite3_mprintf("%z%s{\"id\":%lld,\"similarity\":%!.17g}", json, i == 0 ? "" : ",", id, similarity);
+  }
+  json = json != 0 ? sqlite3_mprintf("%z]", json) : 0;
+  if( json == 0 ) {
+    sqlite3_result_error_nomem(context);
+    return;
+  }
+  sqlite3_result_text(context, json, -1, sqlite3_free);
+}
+
+
 //-----------------------------------------------------------------------------------
 // ENTRYPOINT.
 //-----------------------------------------------------------------------------------
@@ -1031,6 +14668,8 @@ int sqlite3_ndvss_init( sqlite3 *db,
   int rc = SQLITE_OK;
   SQLITE_EXTENSION_INIT2(pApi);
   (void)pzErrMsg;  /* Unused parameter */
+  // The routine table of an older library doesn't reach sqlite3_is_interrupted.
+  ndvss_interrupt_check = sqlite3_libversion_number() >= 3041000;
   rc = sqlite3_create_function( db, 
                                 "ndvss_version", // Function name 
                                 0, // Number of arguments
@@ -1192,6 +14831,456 @@ int sqlite3_ndvss_init( sqlite3 *db,
       return rc;
   }
 
+  rc = sqlite3_create_function( db, 
+                                "ndvss_euclidean_distance_similarity_blob_d", // Function name 
+                                -1, // Number of arguments
+                                SQLITE_UTF8|SQLITE_DIRECTONLY,
+                                0, // *pApp?
+                                ndvss_euclidean_distance_similarity_blob_d, // xFunc -> Function pointer 
+                                0, // xStep?
+                                0  // xFinal?
+                                );
+  if (rc != SQLITE_OK) {
+      *pzErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+      return rc;
+  }
+
+  rc = sqlite3_create_function( db, 
+                                "ndvss_euclidean_distance_similarity_blob_f", // Function name 
+                                -1, // Number of arguments
+                                SQLITE_UTF8|SQLITE_DIRECTONLY,
+                                0, // *pApp?
+                                ndvss_euclidean_distance_similarity_blob_f, // xFunc -> Function pointer 
+                                0, // xStep?
+                                0  // xFinal?
+                                );
+  if (rc != SQLITE_OK) {
+      *pzErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+      return rc;
+  }
+
+  rc = sqlite3_create_function( db, 
+                                "ndvss_config", // Function name 
+                                -1, // Number of arguments
+                                SQLITE_UTF8|SQLITE_DIRECTONLY,
+                                0, // *pApp?
+                                ndvss_config, // xFunc -> Function pointer 
+                                0, // xStep?
+                                0  // xFinal?
+                                );
+  if (rc != SQLITE_OK) {
+      *pzErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+      return rc;
+  }
+
+  rc = sqlite3_create_function( db, 
+                                "ndvss_stats", // Function name 
+                                0, // Number of arguments
+                                SQLITE_UTF8|SQLITE_INNOCUOUS,
+                                0, // *pApp?
+                                ndvss_stats, // xFunc -> Function pointer 
+                                0, // xStep?
+                                0  // xFinal?
+                                );
+  if (rc != SQLITE_OK) {
+      *pzErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+      return rc;
+  }
+
+  rc = sqlite3_create_function( db, 
+                                "ndvss_progress", // Function name 
+                                0, // Number of arguments
+                                SQLITE_UTF8|SQLITE_DIRECTONLY,
+                                0, // *pApp?
+                                ndvss_progress, // xFunc -> Function pointer 
+                                0, // xStep?
+                                0  // xFinal?
+                                );
+  if (rc != SQLITE_OK) {
+      *pzErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+      return rc;
+  }
+
+  rc = sqlite3_create_function( db, 
+                                "ndvss_cancel", // Function name 
+                                1, // Number of arguments
+                                SQLITE_UTF8|SQLITE_DIRECTONLY,
+                                0, // *pApp?
+                                ndvss_cancel, // xFunc -> Function pointer 
+                                0, // xStep?
+                                0  // xFinal?
+                                );
+  if (rc != SQLITE_OK) {
+      *pzErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+      return rc;
+  }
+
+  rc = sqlite3_create_function( db, 
+                                "ndvss_memory", // Function name 
+                                -1, // Number of arguments
+                                SQLITE_UTF8|SQLITE_DIRECTONLY,
+                                0, // *pApp?
+                                ndvss_memory, // xFunc -> Function pointer 
+                                0, // xStep?
+                                0  // xFinal?
+                                );
+  if (rc != SQLITE_OK) {
+      *pzErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+      return rc;
+  }
+  rc = sqlite3_create_function( db, 
+                                "ndvss_topk_entry", // Function name 
+                                2, // Number of arguments
+                                SQLITE_UTF8|SQLITE_INNOCUOUS|SQLITE_DETERMINISTIC,
+                                0, // *pApp?
+                                ndvss_topk_entry, // xFunc -> Function pointer 
+                                0, // xStep?
+                                0  // xFinal?
+                                );
+  if (rc != SQLITE_OK) {
+      *pzErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+      return rc;
+  }
+  rc = sqlite3_create_function( db, 
+                                "ndvss_topk_merge", // Function name 
+                                -1, // Number of arguments
+                                SQLITE_UTF8|SQLITE_INNOCUOUS|SQLITE_DETERMINISTIC,
+                                0, // *pApp?
+                                0, // xFunc -> Function pointer 
+                                ndvss_topk_merge_step, // xStep?
+                                ndvss_topk_merge_final  // xFinal?
+                                );
+  if (rc != SQLITE_OK) {
+      *pzErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+      return rc;
+  }
+  rc = sqlite3_create_function( db, 
+                                "ndvss_topk_json", // Function name 
+                                1, // Number of arguments
+                                SQLITE_UTF8|SQLITE_INNOCUOUS|SQLITE_DETERMINISTIC,
+                                0, // *pApp?
+                                ndvss_topk_json, // xFunc -> Function pointer 
+                                0, // xStep?
+                                0  // xFinal?
+                                );
+  if (rc != SQLITE_OK) {
+      *pzErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+      return rc;
+  }
+
+  // The k-NN functions share the connection state, which is freed with the last one.
+  ndvss_connection* connection = (ndvss_connection*)sqlite3_malloc(sizeof(ndvss_connection));
+  if( connection == 0 ) {
+    return SQLITE_NOMEM;
+  }
+  memset(connection, 0, sizeof(ndvss_connection));
+  connection->db = db;
+  connection->ref_count = 2;
+  rc = sqlite3_create_module_v2(db, "ndvss_knn_f", &ndvss_knn_module, connection, ndvss_connection_release);
+  if (rc != SQLITE_OK) {
+      ndvss_connection_release(connection);
+      *pzErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+      return rc;
+  }
+  rc = sqlite3_create_module_v2(db, "ndvss_knn_d", &ndvss_knn_module, connection, ndvss_connection_release);
+  if (rc != SQLITE_OK) {
+      *pzErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+      return rc;
+  }
+  ++connection->ref_count;
+  rc = sqlite3_create_module_v2(db, "ndvss_index", &ndvss_live_module, connection, ndvss_connection_release);
+  if (rc != SQLITE_OK) {
+      *pzErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+      return rc;
+  }
+
+  rc = sqlite3_create_function( db, 
+                                "ndvss_flat_export_f", // Function name 
+                                3, // Number of arguments
+                                SQLITE_UTF8|SQLITE_DIRECTONLY,
+                                0, // *pApp?
+                                ndvss_flat_export_f, // xFunc -> Function pointer 
+                                0, // xStep?
+                                0  // xFinal?
+                                );
+  if (rc != SQLITE_OK) {
+    *pzErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+    return rc;
+  }
+
+  rc = sqlite3_create_function( db, 
+                                "ndvss_flat_export_d", // Function name 
+                                3, // Number of arguments
+                                SQLITE_UTF8|SQLITE_DIRECTONLY,
+                                0, // *pApp?
+                                ndvss_flat_export_d, // xFunc -> Function pointer 
+                                0, // xStep?
+                                0  // xFinal?
+                                );
+  if (rc != SQLITE_OK) {
+    *pzErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+    return rc;
+  }
+
+  rc = sqlite3_create_function( db, 
+                                "ndvss_opq_train_f", // Function name 
+                                -1, // Number of arguments
+                                SQLITE_UTF8|SQLITE_DIRECTONLY,
+                                0, // *pApp?
+                                ndvss_opq_train_f, // xFunc -> Function pointer 
+                                0, // xStep?
+                                0  // xFinal?
+                                );
+  if (rc != SQLITE_OK) {
+    *pzErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+    return rc;
+  }
+
+  rc = sqlite3_create_function( db, 
+                                "ndvss_opq_train_d", // Function name 
+                                -1, // Number of arguments
+                                SQLITE_UTF8|SQLITE_DIRECTONLY,
+                                0, // *pApp?
+                                ndvss_opq_train_d, // xFunc -> Function pointer 
+                                0, // xStep?
+                                0  // xFinal?
+                                );
+  if (rc != SQLITE_OK) {
+    *pzErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+    return rc;
+  }
+
+  rc = sqlite3_create_function( db, 
+                                "ndvss_reorder_f", // Function name 
+                                -1, // Number of arguments
+                                SQLITE_UTF8|SQLITE_DIRECTONLY,
+                                0, // *pApp?
+                                ndvss_reorder_f, // xFunc -> Function pointer 
+                                0, // xStep?
+                                0  // xFinal?
+                                );
+  if (rc != SQLITE_OK) {
+    *pzErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+    return rc;
+  }
+
+  rc = sqlite3_create_function( db, 
+                                "ndvss_reorder_d", // Function name 
+                                -1, // Number of arguments
+                                SQLITE_UTF8|SQLITE_DIRECTONLY,
+                                0, // *pApp?
+                                ndvss_reorder_d, // xFunc -> Function pointer 
+                                0, // xStep?
+                                0  // xFinal?
+                                );
+  if (rc != SQLITE_OK) {
+    *pzErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+    return rc;
+  }
+
+  rc = sqlite3_create_function( db, 
+                                "ndvss_diskann_build_f", // Function name 
+                                -1, // Number of arguments
+                                SQLITE_UTF8|SQLITE_DIRECTONLY,
+                                0, // *pApp?
+                                ndvss_diskann_build_f, // xFunc -> Function pointer 
+                                0, // xStep?
+                                0  // xFinal?
+                                );
+  if (rc != SQLITE_OK) {
+    *pzErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+    return rc;
+  }
+
+  rc = sqlite3_create_function( db, 
+                                "ndvss_diskann_build_d", // Function name 
+                                -1, // Number of arguments
+                                SQLITE_UTF8|SQLITE_DIRECTONLY,
+                                0, // *pApp?
+                                ndvss_diskann_build_d, // xFunc -> Function pointer 
+                                0, // xStep?
+                                0  // xFinal?
+                                );
+  if (rc != SQLITE_OK) {
+    *pzErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+    return rc;
+  }
+
+  // These share the connection state with the k-NN functions.
+  ++connection->ref_count;
+  rc = sqlite3_create_function_v2( db, 
+                                   "ndvss_index_export_f", // Function name 
+                                   3, // Number of arguments
+                                   SQLITE_UTF8|SQLITE_DIRECTONLY,
+                                   connection, // *pApp?
+                                   ndvss_index_export_f, // xFunc -> Function pointer 
+                                   0, // xStep?
+                                   0, // xFinal?
+                                   ndvss_connection_release // xDestroy
+                                   );
+  if (rc != SQLITE_OK) {
+    *pzErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+    return rc;
+  }
+
+  ++connection->ref_count;
+  rc = sqlite3_create_function_v2( db, 
+                                   "ndvss_index_export_d", // Function name 
+                                   3, // Number of arguments
+                                   SQLITE_UTF8|SQLITE_DIRECTONLY,
+                                   connection, // *pApp?
+                                   ndvss_index_export_d, // xFunc -> Function pointer 
+                                   0, // xStep?
+                                   0, // xFinal?
+                                   ndvss_connection_release // xDestroy
+                                   );
+  if (rc != SQLITE_OK) {
+    *pzErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+    return rc;
+  }
+
+  ++connection->ref_count;
+  rc = sqlite3_create_function_v2( db, 
+                                   "ndvss_index_attach", // Function name 
+                                   1, // Number of arguments
+                                   SQLITE_UTF8|SQLITE_DIRECTONLY,
+                                   connection, // *pApp?
+                                   ndvss_index_attach, // xFunc -> Function pointer 
+                                   0, // xStep?
+                                   0, // xFinal?
+                                   ndvss_connection_release // xDestroy
+                                   );
+  if (rc != SQLITE_OK) {
+    *pzErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+    return rc;
+  }
+
+  ++connection->ref_count;
+  rc = sqlite3_create_function_v2( db, 
+                                   "ndvss_shm_publish_f", // Function name 
+                                   3, // Number of arguments
+                                   SQLITE_UTF8|SQLITE_DIRECTONLY,
+                                   connection, // *pApp?
+                                   ndvss_shm_publish_f, // xFunc -> Function pointer 
+                                   0, // xStep?
+                                   0, // xFinal?
+                                   ndvss_connection_release // xDestroy
+                                   );
+  if (rc != SQLITE_OK) {
+    *pzErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+    return rc;
+  }
+
+  ++connection->ref_count;
+  rc = sqlite3_create_function_v2( db, 
+                                   "ndvss_shm_publish_d", // Function name 
+                                   3, // Number of arguments
+                                   SQLITE_UTF8|SQLITE_DIRECTONLY,
+                                   connection, // *pApp?
+                                   ndvss_shm_publish_d, // xFunc -> Function pointer 
+                                   0, // xStep?
+                                   0, // xFinal?
+                                   ndvss_connection_release // xDestroy
+                                   );
+  if (rc != SQLITE_OK) {
+    *pzErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+    return rc;
+  }
+
+  rc = sqlite3_create_function( db, 
+                                "ndvss_shm_remove", // Function name 
+                                1, // Number of arguments
+                                SQLITE_UTF8|SQLITE_DIRECTONLY,
+                                0, // *pApp?
+                                ndvss_shm_remove, // xFunc -> Function pointer 
+                                0, // xStep?
+                                0  // xFinal?
+                                );
+  if (rc != SQLITE_OK) {
+    *pzErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+    return rc;
+  }
+  ++connection->ref_count;
+  rc = sqlite3_create_function_v2( db, 
+                                   "ndvss_index_merge", // Function name 
+                                   1, // Number of arguments
+                                   SQLITE_UTF8|SQLITE_DIRECTONLY,
+                                   connection, // *pApp?
+                                   ndvss_index_merge, // xFunc -> Function pointer 
+                                   0, // xStep?
+                                   0, // xFinal?
+                                   ndvss_connection_release // xDestroy
+                                   );
+  if (rc != SQLITE_OK) {
+    *pzErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+    return rc;
+  }
+  ++connection->ref_count;
+  rc = sqlite3_create_function_v2( db, 
+                                   "ndvss_estimate_count_f", // Function name 
+                                   -1, // Number of arguments
+                                   SQLITE_UTF8|SQLITE_DIRECTONLY,
+                                   connection, // *pApp?
+                                   ndvss_estimate_count_f, // xFunc -> Function pointer 
+                                   0, // xStep?
+                                   0, // xFinal?
+                                   ndvss_connection_release // xDestroy
+                                   );
+  if (rc != SQLITE_OK) {
+    *pzErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+    return rc;
+  }
+  ++connection->ref_count;
+  rc = sqlite3_create_function_v2( db, 
+                                   "ndvss_estimate_count_d", // Function name 
+                                   -1, // Number of arguments
+                                   SQLITE_UTF8|SQLITE_DIRECTONLY,
+                                   connection, // *pApp?
+                                   ndvss_estimate_count_d, // xFunc -> Function pointer 
+                                   0, // xStep?
+                                   0, // xFinal?
+                                   ndvss_connection_release // xDestroy
+                                   );
+  if (rc != SQLITE_OK) {
+    *pzErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+    return rc;
+  }
+  ++connection->ref_count;
+  rc = sqlite3_create_module_v2(db, "ndvss_topk_per_group_f", &ndvss_group_module, connection, ndvss_connection_release);
+  if (rc != SQLITE_OK) {
+      *pzErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+      return rc;
+  }
+  ++connection->ref_count;
+  rc = sqlite3_create_module_v2(db, "ndvss_topk_per_group_d", &ndvss_group_module, connection, ndvss_connection_release);
+  if (rc != SQLITE_OK) {
+      *pzErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+      return rc;
+  }
+  ++connection->ref_count;
+  rc = sqlite3_create_module_v2(db, "ndvss_mmr_f", &ndvss_mmr_module, connection, ndvss_connection_release);
+  if (rc != SQLITE_OK) {
+      *pzErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+      return rc;
+  }
+  ++connection->ref_count;
+  rc = sqlite3_create_module_v2(db, "ndvss_mmr_d", &ndvss_mmr_module, connection, ndvss_connection_release);
+  if (rc != SQLITE_OK) {
+      *pzErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+      return rc;
+  }
+  ++connection->ref_count;
+  rc = sqlite3_create_module_v2(db, "ndvss_knn_multi_f", &ndvss_multi_module, connection, ndvss_connection_release);
+  if (rc != SQLITE_OK) {
+      *pzErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+      return rc;
+  }
+  ++connection->ref_count;
+  rc = sqlite3_create_module_v2(db, "ndvss_knn_multi_d", &ndvss_multi_module, connection, ndvss_connection_release);
+  if (rc != SQLITE_OK) {
+      *pzErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+      return rc;
+  }
   return rc;
 }
 